@@ -1,4 +1,7 @@
 #include "ast.hpp"
+#include <sstream>
+#include "exceptions.hpp"
+#include "parser.hpp"
 
 void AST::accept(ASTVisitorStrategy *s, ASTVisitor *v) const {
     s->dispatch(v, this);
@@ -28,6 +31,24 @@ void FuncCallExpr::accept(ASTVisitorStrategy *s, ASTVisitor *v) const {
         (*it)->accept(s, v);
     }
 }
+void ArrayExpr::accept(ASTVisitorStrategy *s, ASTVisitor *v) const {
+    s->dispatch(v, this);
+    for (std::vector<const Expression*>::const_iterator it = elements_.begin(), end = elements_.end(); it != end; ++it) {
+        (*it)->accept(s, v);
+    }
+}
+void IndexExpr::accept(ASTVisitorStrategy *s, ASTVisitor *v) const {
+    s->dispatch(v, this);
+    container_->accept(s, v);
+    index_->accept(s, v);
+}
+void MapExpr::accept(ASTVisitorStrategy *s, ASTVisitor *v) const {
+    s->dispatch(v, this);
+    for (std::vector<const Expression*>::size_type i = 0; i < keys_.size(); ++i) {
+        keys_[i]->accept(s, v);
+        values_[i]->accept(s, v);
+    }
+}
 void ExpressionStatement::accept(ASTVisitorStrategy *s, ASTVisitor *v) const {
     s->dispatch(v, this);
     expr_->accept(s, v);
@@ -50,5 +71,30 @@ void ReturnStatement::accept(ASTVisitorStrategy *s, ASTVisitor *v) const {
 }
 void DefStatement::accept(ASTVisitorStrategy *s, ASTVisitor *v) const {
     s->dispatch(v, this);
-    block_->accept(s, v);
+    block()->accept(s, v);
+}
+void ImportStatement::accept(ASTVisitorStrategy *s, ASTVisitor *v) const {
+    s->dispatch(v, this);
+}
+
+const AST *DefStatement::parse_body() const {
+    std::lock_guard<std::mutex> lock(parse_mutex_);
+    const AST *block = block_.load(std::memory_order_relaxed);
+    if (block)
+        return block;
+
+    std::istringstream input(body_);
+    LexerContext lexer(input, filename_, body_line_);
+
+    try {
+        ParserContext parser(lexer);
+        block = parser.parse_body();
+    } catch (SyntaxError &error) {
+        std::ostringstream ss;
+        ss << lexer.filename() << ":" << lexer.line() << ": " << error.message();
+        throw SyntaxError(ss.str());
+    }
+
+    block_.store(block, std::memory_order_release);
+    return block;
 }
@@ -1,6 +1,9 @@
 #ifndef _AST_HPP
 #define _AST_HPP
 
+#include <atomic>
+#include <mutex>
+#include <set>
 #include <vector>
 #include <string>
 #include "toy.hpp"
@@ -13,6 +16,9 @@ typedef enum {
     toy_string,
     toy_binary_op,
     toy_variable,
+    toy_array,
+    toy_index,
+    toy_map,
 
     toy_expression_statement,
     toy_if,
@@ -21,6 +27,7 @@ typedef enum {
     toy_def,
     toy_assign,
     toy_function_call,
+    toy_import,
 
     toy_ast
 } NodeType;
@@ -28,12 +35,18 @@ typedef enum {
 /* Building blocks */
 class ASTNode {
   public:
-    ASTNode() {};
+    ASTNode() : line_(0) {};
+    virtual ~ASTNode() {}
     NodeType type() const { return type_; }
     virtual void accept(ASTVisitorStrategy*, ASTVisitor*) const = 0;
+
+    /* Source line the node starts on, for error messages and profiles */
+    inline unsigned int line() const { return line_; }
+    inline void set_line(unsigned int line) { line_ = line; }
   protected:
-    explicit ASTNode(NodeType type) : type_(type) {}
+    explicit ASTNode(NodeType type) : type_(type), line_(0) {}
     NodeType type_;
+    unsigned int line_;
   private:
     DISALLOW_COPY_AND_ASSIGN(ASTNode);
 };
@@ -58,7 +71,7 @@ class AST : public ASTNode {
         : ASTNode(toy_ast),
           nodes_(nodes) {}
     void accept(ASTVisitorStrategy*, ASTVisitor *v) const;
-    inline const std::vector<const Statement*> nodes() const { return nodes_; }
+    inline const std::vector<const Statement*> &nodes() const { return nodes_; }
   private:
     const std::vector<const Statement*> nodes_;
     DISALLOW_COPY_AND_ASSIGN(AST);
@@ -111,7 +124,7 @@ class VariableExpr : public Expression {
         : ASTNode(toy_variable),
           varname_(varname) {}
     void accept(ASTVisitorStrategy*, ASTVisitor *v) const;
-    inline const std::string varname() const { return varname_; }
+    inline const std::string &varname() const { return varname_; }
   private:
     const std::string varname_;
     DISALLOW_COPY_AND_ASSIGN(VariableExpr);
@@ -124,7 +137,7 @@ class AssignExpr : public Expression {
           lvalue_(lvalue),
           rvalue_(rvalue) {}
     void accept(ASTVisitorStrategy*, ASTVisitor *v) const;
-    inline const std::string lvalue() const { return lvalue_; }
+    inline const std::string &lvalue() const { return lvalue_; }
     inline const Expression *rvalue() const { return rvalue_; }
   private:
     const std::string lvalue_;
@@ -139,14 +152,56 @@ class FuncCallExpr : public Expression {
           funcname_(funcname),
           args_(args) {}
     void accept(ASTVisitorStrategy*, ASTVisitor *v) const;
-    inline const std::string funcname() const { return funcname_; }
-    inline const std::vector<const Expression*> args() const { return args_; }
+    inline const std::string &funcname() const { return funcname_; }
+    inline const std::vector<const Expression*> &args() const { return args_; }
   private:
     const std::string funcname_;
     const std::vector<const Expression*> args_;
     DISALLOW_COPY_AND_ASSIGN(FuncCallExpr);
 };
 
+class ArrayExpr : public Expression {
+  public:
+    explicit ArrayExpr(const std::vector<const Expression*> &elements)
+        : ASTNode(toy_array),
+          elements_(elements) {}
+    void accept(ASTVisitorStrategy*, ASTVisitor *v) const;
+    inline const std::vector<const Expression*> &elements() const { return elements_; }
+  private:
+    const std::vector<const Expression*> elements_;
+    DISALLOW_COPY_AND_ASSIGN(ArrayExpr);
+};
+
+class IndexExpr : public Expression {
+  public:
+    IndexExpr(const Expression *container, const Expression *index)
+        : ASTNode(toy_index),
+          container_(container),
+          index_(index) {}
+    void accept(ASTVisitorStrategy*, ASTVisitor *v) const;
+    inline const Expression *container() const { return container_; }
+    inline const Expression *index() const { return index_; }
+  private:
+    const Expression *container_;
+    const Expression *index_;
+    DISALLOW_COPY_AND_ASSIGN(IndexExpr);
+};
+
+class MapExpr : public Expression {
+  public:
+    MapExpr(const std::vector<const Expression*> &keys, const std::vector<const Expression*> &values)
+        : ASTNode(toy_map),
+          keys_(keys),
+          values_(values) {}
+    void accept(ASTVisitorStrategy*, ASTVisitor *v) const;
+    inline const std::vector<const Expression*> &keys() const { return keys_; }
+    inline const std::vector<const Expression*> &values() const { return values_; }
+  private:
+    const std::vector<const Expression*> keys_;
+    const std::vector<const Expression*> values_;
+    DISALLOW_COPY_AND_ASSIGN(MapExpr);
+};
+
 /* Statements */
 class ExpressionStatement : public Statement {
   public:
@@ -209,22 +264,68 @@ class ReturnStatement : public Statement {
     DISALLOW_COPY_AND_ASSIGN(ReturnStatement);
 };
 
+/* The body of a function is either parsed up front, or kept as source text
+ * and parsed the first time block() is called. That may happen on any
+ * thread; the parse runs once. */
 class DefStatement : public Statement {
   public:
     DefStatement(const std::string &name, const std::vector<std::string> &params, const AST *block)
         : ASTNode(toy_def),
           name_(name),
           params_(params),
-          block_(block) {}
+          block_(block),
+          body_line_(0) {}
+    DefStatement(const std::string &name, const std::vector<std::string> &params, const std::string &body,
+                 const std::string &filename, unsigned int body_line, const std::set<std::string> &callees)
+        : ASTNode(toy_def),
+          name_(name),
+          params_(params),
+          block_(0),
+          body_(body),
+          filename_(filename),
+          body_line_(body_line),
+          callees_(callees) {}
     void accept(ASTVisitorStrategy*, ASTVisitor *v) const;
-    inline const std::string name() const { return name_; }
-    inline const std::vector<std::string> params() const { return params_; }
-    inline const AST *block() const { return block_; }
+    inline const std::string &name() const { return name_; }
+    inline const std::vector<std::string> &params() const { return params_; }
+
+    /* Throws SyntaxError if a lazy body doesn't parse */
+    inline const AST *block() const {
+        const AST *block = block_.load(std::memory_order_acquire);
+        return block ? block : parse_body();
+    }
+    inline bool parsed() const { return block_.load(std::memory_order_acquire) != 0; }
+
+    /* Unparsed bodies only: the source, starting at '{', and the names of
+     * everything it calls. */
+    inline const std::string &body() const { return body_; }
+    inline const std::string &filename() const { return filename_; }
+    inline unsigned int body_line() const { return body_line_; }
+    inline const std::set<std::string> &callees() const { return callees_; }
   private:
+    const AST *parse_body() const;
+
     const std::string name_;
     const std::vector<std::string> params_;
-    const AST *block_;
+    mutable std::atomic<const AST*> block_;
+    mutable std::mutex parse_mutex_;
+    const std::string body_;
+    const std::string filename_;
+    const unsigned int body_line_;
+    const std::set<std::string> callees_;
     DISALLOW_COPY_AND_ASSIGN(DefStatement);
 };
 
+class ImportStatement : public Statement {
+  public:
+    explicit ImportStatement(const std::string &module)
+        : ASTNode(toy_import),
+          module_(module) {}
+    void accept(ASTVisitorStrategy*, ASTVisitor *v) const;
+    inline const std::string &module() const { return module_; }
+  private:
+    const std::string module_;
+    DISALLOW_COPY_AND_ASSIGN(ImportStatement);
+};
+
 #endif
@@ -41,6 +41,18 @@ class ASTVisitorDepthFirst : public ASTVisitorStrategy {
         }
     }
 
+    inline void dispatch(ASTVisitor *v, const ArrayExpr *node) {
+        v->visit(node);
+    }
+
+    inline void dispatch(ASTVisitor *v, const IndexExpr *node) {
+        v->visit(node);
+    }
+
+    inline void dispatch(ASTVisitor *v, const MapExpr *node) {
+        v->visit(node);
+    }
+
     inline void dispatch(ASTVisitor *v, const ExpressionStatement *node) {
         v->visit(node);
         //v->visit(node->expr());
@@ -49,9 +61,8 @@ class ASTVisitorDepthFirst : public ASTVisitorStrategy {
     inline void dispatch(ASTVisitor *v, const IfStatement *node) {
         v->visit(node);
         //v->visit(node->cond());
-        v->visit(node->true_block());
-        if (node->false_block())
-            v->visit(node->false_block());
+        //v->visit(node->true_block());
+        //v->visit(node->false_block());
     }
 
     inline void dispatch(ASTVisitor *v, const WhileStatement *node) {
@@ -67,7 +78,11 @@ class ASTVisitorDepthFirst : public ASTVisitorStrategy {
 
     inline void dispatch(ASTVisitor *v, const DefStatement *node) {
         v->visit(node);
-        v->visit(node->block());
+        //v->visit(node->block());
+    }
+
+    inline void dispatch(ASTVisitor *v, const ImportStatement *node) {
+        v->visit(node);
     }
 };
 
@@ -7,11 +7,15 @@ class BinaryOpExpr;
 class VariableExpr;
 class AssignExpr;
 class FuncCallExpr;
+class ArrayExpr;
+class IndexExpr;
+class MapExpr;
 class ExpressionStatement;
 class IfStatement;
 class WhileStatement;
 class ReturnStatement;
 class DefStatement;
+class ImportStatement;
 
 class ASTVisitor {
   public:
@@ -21,11 +25,15 @@ class ASTVisitor {
     virtual void visit(const VariableExpr*) = 0;
     virtual void visit(const AssignExpr*) = 0;
     virtual void visit(const FuncCallExpr*) = 0;
+    virtual void visit(const ArrayExpr*) = 0;
+    virtual void visit(const IndexExpr*) = 0;
+    virtual void visit(const MapExpr*) = 0;
     virtual void visit(const ExpressionStatement*) = 0;
     virtual void visit(const IfStatement*) = 0;
     virtual void visit(const WhileStatement*) = 0;
     virtual void visit(const ReturnStatement*) = 0;
     virtual void visit(const DefStatement*) = 0;
+    virtual void visit(const ImportStatement*) = 0;
 };
 
 #endif
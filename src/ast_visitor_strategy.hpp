@@ -11,11 +11,15 @@ class ASTVisitorStrategy {
     virtual void dispatch(ASTVisitor*, const VariableExpr*) = 0;
     virtual void dispatch(ASTVisitor*, const AssignExpr*) = 0;
     virtual void dispatch(ASTVisitor*, const FuncCallExpr*) = 0;
+    virtual void dispatch(ASTVisitor*, const ArrayExpr*) = 0;
+    virtual void dispatch(ASTVisitor*, const IndexExpr*) = 0;
+    virtual void dispatch(ASTVisitor*, const MapExpr*) = 0;
     virtual void dispatch(ASTVisitor*, const ExpressionStatement*) = 0;
     virtual void dispatch(ASTVisitor*, const IfStatement*) = 0;
     virtual void dispatch(ASTVisitor*, const WhileStatement*) = 0;
     virtual void dispatch(ASTVisitor*, const ReturnStatement*) = 0;
     virtual void dispatch(ASTVisitor*, const DefStatement*) = 0;
+    virtual void dispatch(ASTVisitor*, const ImportStatement*) = 0;
 };
 
 #endif
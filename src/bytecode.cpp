@@ -0,0 +1,720 @@
+#include "bytecode.hpp"
+#include <algorithm>
+#include <chrono>
+#include <set>
+#include "ast_depth_first.hpp"
+#include "purity_analysis.hpp"
+#include "ssa.hpp"
+#include "ssa_passes.hpp"
+
+/* Turns an optimized SsaFunction back into stack code. Phis and values
+ * used more than once or in another block get a temporary slot; the rest
+ * are left on the operand stack for their single user, as long as the
+ * order of evaluation lets them. Parameters and constants are loaded
+ * wherever they are used.
+ *
+ * Each edge into a block with phis ends with a parallel copy: every
+ * incoming value is pushed, then they are stored in reverse. No edge leaves
+ * a branch for a block with phis, so those copies always have a place.
+ */
+class CompiledCode::Lowering {
+  public:
+    Lowering(CompiledCode *code, const SsaFunction &function)
+        : code_(code),
+          function_(function),
+          order_(function.reverse_postorder()),
+          kinds_(function),
+          unchecked_(0) {}
+
+    void lower();
+    /* Operators lowered to op_number_binary */
+    inline unsigned int unchecked() const { return unchecked_; }
+  private:
+    typedef std::vector<const SsaValue*> Values;
+
+    void count_uses();
+    bool settle(const SsaBlock*);
+    void users(const SsaBlock*, std::vector<std::pair<Values, const SsaValue*> >&) const;
+    Values inputs(const SsaValue*) const;
+    Values incoming(const SsaBlock*) const;
+    unsigned int new_slot();
+
+    void lower(const SsaBlock*, const SsaBlock*);
+    void push(const Values&, unsigned int);
+    void load(const SsaValue*, unsigned int);
+
+    CompiledCode *code_;
+    const SsaFunction &function_;
+    const std::vector<SsaBlock*> order_;
+    const SsaKinds kinds_;
+    unsigned int unchecked_;
+    /* Uses, and the block of the last one */
+    std::map<const SsaValue*, unsigned int> uses_;
+    std::map<const SsaValue*, const SsaBlock*> used_in_;
+    std::set<const SsaValue*> stacked_;
+    std::map<const SsaValue*, unsigned int> slots_;
+    std::map<const SsaValue*, unsigned int> constants_;
+    std::map<const SsaBlock*, unsigned int> starts_;
+    /* Jumps and the block they go to */
+    std::vector<std::pair<unsigned int, const SsaBlock*> > jumps_;
+    DISALLOW_COPY_AND_ASSIGN(Lowering);
+};
+
+CompiledCode::Lowering::Values CompiledCode::Lowering::inputs(const SsaValue *value) const {
+    /* A read that wasn't folded goes by name, to throw if unassigned */
+    if (value->op == ssa_local)
+        return Values();
+    return Values(value->operands.begin(), value->operands.end());
+}
+
+/* What a jump from the block must copy into the phis of its target */
+CompiledCode::Lowering::Values CompiledCode::Lowering::incoming(const SsaBlock *block) const {
+    Values ret;
+    if (block->terminator != term_jump && block->terminator != term_loop)
+        return ret;
+
+    const SsaBlock *target = block->targets[0];
+    const std::vector<SsaBlock*> &preds = target->preds;
+    std::vector<SsaBlock*>::size_type edge = std::find(preds.begin(), preds.end(), block) - preds.begin();
+    for (std::vector<SsaValue*>::const_iterator it = target->phis.begin(), end = target->phis.end(); it != end; ++it)
+        ret.push_back((*it)->operands[edge]);
+    return ret;
+}
+
+/* The values of the block with their inputs, in order, then the inputs of
+ * its terminator */
+void CompiledCode::Lowering::users(const SsaBlock *block, std::vector<std::pair<Values, const SsaValue*> > &out) const {
+    for (std::vector<SsaValue*>::const_iterator it = block->values.begin(), end = block->values.end(); it != end; ++it)
+        out.push_back(std::make_pair(inputs(*it), *it));
+
+    Values terminator = incoming(block);
+    if (block->result)
+        terminator.push_back(block->result);
+    out.push_back(std::make_pair(terminator, static_cast<const SsaValue*>(0)));
+}
+
+void CompiledCode::Lowering::count_uses() {
+    for (std::vector<SsaBlock*>::const_iterator it = order_.begin(), end = order_.end(); it != end; ++it) {
+        std::vector<std::pair<Values, const SsaValue*> > block_users;
+        users(*it, block_users);
+        for (std::vector<std::pair<Values, const SsaValue*> >::const_iterator user = block_users.begin(); user != block_users.end(); ++user) {
+            for (Values::const_iterator input = user->first.begin(); input != user->first.end(); ++input) {
+                ++uses_[*input];
+                used_in_[*input] = *it;
+            }
+        }
+    }
+}
+
+/* Plays the block's stack, and takes off it whatever would be in the way
+ * of an operand below it. Returns whether the block was left as it was. */
+bool CompiledCode::Lowering::settle(const SsaBlock *block) {
+    std::vector<std::pair<Values, const SsaValue*> > block_users;
+    users(block, block_users);
+
+    Values stack;
+    for (std::vector<std::pair<Values, const SsaValue*> >::const_iterator user = block_users.begin(); user != block_users.end(); ++user) {
+        const Values &inputs = user->first;
+
+        /* Stacked operands must come before loaded ones */
+        Values::size_type stacked = 0;
+        while (stacked < inputs.size() && stacked_.count(inputs[stacked]))
+            ++stacked;
+        bool settled = true;
+        for (Values::size_type i = stacked; i < inputs.size(); ++i) {
+            if (stacked_.erase(inputs[i]))
+                settled = false;
+        }
+        if (!settled)
+            return false;
+
+        if (stack.size() < stacked || !std::equal(inputs.begin(), inputs.begin() + stacked, stack.end() - stacked)) {
+            for (Values::size_type i = 0; i < stacked; ++i)
+                stacked_.erase(inputs[i]);
+            return false;
+        }
+        stack.resize(stack.size() - stacked);
+        if (user->second && stacked_.count(user->second))
+            stack.push_back(user->second);
+    }
+    return true;
+}
+
+unsigned int CompiledCode::Lowering::new_slot() {
+    return code_->layout_->size() + code_->temps_++;
+}
+
+void CompiledCode::Lowering::lower() {
+    count_uses();
+
+    for (std::vector<SsaBlock*>::const_iterator it = order_.begin(), end = order_.end(); it != end; ++it) {
+        for (std::vector<SsaValue*>::const_iterator value = (*it)->values.begin(); value != (*it)->values.end(); ++value) {
+            if (uses_[*value] == 1 && used_in_[*value] == *it)
+                stacked_.insert(*value);
+        }
+    }
+    for (std::vector<SsaBlock*>::const_iterator it = order_.begin(), end = order_.end(); it != end; ++it) {
+        while (!settle(*it)) {}
+    }
+
+    for (std::vector<SsaBlock*>::const_iterator it = order_.begin(), end = order_.end(); it != end; ++it) {
+        for (std::vector<SsaValue*>::const_iterator phi = (*it)->phis.begin(); phi != (*it)->phis.end(); ++phi)
+            slots_[*phi] = new_slot();
+        for (std::vector<SsaValue*>::const_iterator value = (*it)->values.begin(); value != (*it)->values.end(); ++value) {
+            if (uses_[*value] > 0 && !stacked_.count(*value))
+                slots_[*value] = new_slot();
+        }
+    }
+
+    for (std::vector<SsaBlock*>::size_type i = 0; i < order_.size(); ++i)
+        lower(order_[i], i + 1 < order_.size() ? order_[i + 1] : 0);
+
+    for (std::vector<std::pair<unsigned int, const SsaBlock*> >::const_iterator it = jumps_.begin(); it != jumps_.end(); ++it)
+        code_->code_[it->first].arg = starts_[it->second];
+}
+
+void CompiledCode::Lowering::load(const SsaValue *value, unsigned int line) {
+    switch (value->op) {
+        case ssa_constant: {
+            std::map<const SsaValue*, unsigned int>::const_iterator it = constants_.find(value);
+            unsigned int id = it != constants_.end() ? it->second : (constants_[value] = code_->constant(value->constant));
+            code_->emit(op_constant, id, 0, line);
+            break;
+        }
+        case ssa_param:
+            code_->emit(op_load_slot, value->arg, 0, line);
+            break;
+        case ssa_undef:
+            code_->emit(op_load_name, code_->name(value->name), 0, line);
+            break;
+        default:
+            code_->emit(op_load_slot, slots_[value], 0, line);
+            break;
+    }
+}
+
+/* Loads the inputs that aren't already on the stack */
+void CompiledCode::Lowering::push(const Values &inputs, unsigned int line) {
+    for (Values::const_iterator it = inputs.begin(), end = inputs.end(); it != end; ++it) {
+        if (!stacked_.count(*it))
+            load(*it, line);
+    }
+}
+
+void CompiledCode::Lowering::lower(const SsaBlock *block, const SsaBlock *next) {
+    starts_[block] = code_->code_.size();
+
+    for (std::vector<SsaValue*>::const_iterator it = block->values.begin(), end = block->values.end(); it != end; ++it) {
+        const SsaValue *value = *it;
+        push(inputs(value), value->line);
+        switch (value->op) {
+            case ssa_local:
+            case ssa_global:
+                code_->emit(op_load_name, code_->name(value->name), 0, value->line);
+                break;
+            case ssa_binary:
+                if (kinds_.of(value->operands[0]) == kind_number && kinds_.of(value->operands[1]) == kind_number) {
+                    code_->emit(op_number_binary, value->arg, 0, value->line);
+                    ++unchecked_;
+                } else {
+                    code_->emit(op_binary, value->arg, 0, value->line);
+                }
+                break;
+            case ssa_index:
+                code_->emit(op_index, 0, 0, value->line);
+                break;
+            case ssa_array:
+                code_->emit(op_array, value->operands.size(), 0, value->line);
+                break;
+            case ssa_map:
+                code_->emit(op_map, value->operands.size(), 0, value->line);
+                break;
+            case ssa_call:
+                code_->emit(op_call, code_->function(value->function), value->operands.size(), value->line);
+                break;
+            case ssa_builtin:
+                code_->emit(op_builtin, code_->name(value->name), value->operands.size(), value->line);
+                break;
+            default:
+                /* Parameters, constants and phis never sit in a block's values */
+                break;
+        }
+
+        if (stacked_.count(value))
+            continue;
+        std::map<const SsaValue*, unsigned int>::const_iterator slot = slots_.find(value);
+        if (slot != slots_.end())
+            code_->emit(op_store_slot, slot->second, 0, value->line);
+        code_->emit(op_pop, 0, 0, value->line);
+    }
+
+    switch (block->terminator) {
+        case term_jump:
+        case term_loop: {
+            const SsaBlock *target = block->targets[0];
+            Values copies = incoming(block);
+            push(copies, block->line);
+            for (std::vector<SsaValue*>::const_reverse_iterator it = target->phis.rbegin(); it != target->phis.rend(); ++it) {
+                code_->emit(op_store_slot, slots_[*it], 0, block->line);
+                code_->emit(op_pop, 0, 0, block->line);
+            }
+            if (block->terminator == term_loop)
+                jumps_.push_back(std::make_pair(code_->emit(op_loop, 0, 0, block->line), target));
+            else if (target != next)
+                jumps_.push_back(std::make_pair(code_->emit(op_jump, 0, 0, block->line), target));
+            break;
+        }
+        case term_branch:
+            push(Values(1, block->result), block->line);
+            jumps_.push_back(std::make_pair(code_->emit(op_jump_if_false, 0, 0, block->line), block->targets[1]));
+            if (block->targets[0] != next)
+                jumps_.push_back(std::make_pair(code_->emit(op_jump, 0, 0, block->line), block->targets[0]));
+            break;
+        case term_return:
+            push(Values(1, block->result), block->line);
+            code_->emit(op_return, 0, 0, block->line);
+            break;
+        default:
+            code_->emit(op_end, 0, 0, block->line);
+            break;
+    }
+}
+
+/* The function as if the parameters flagged in numbers were numbers,
+ * behind a guard on each that jumps to what comes after it. Leaves nothing
+ * if that makes no operator unchecked. */
+void CompiledCode::specialize(const DefStatement *def, const FrameLayout &layout, const SsaPassManager &passes, const std::vector<bool> &numbers) {
+    SsaFunction *function = SsaFunction::build(def, layout, program_);
+    for (unsigned int i = 0; i < numbers.size() && i < layout.params(); ++i) {
+        if (numbers[i])
+            function->assume_number(i);
+    }
+    passes.run(*function);
+    if (!function->assumes_numbers() || !function->undefined_phis().empty()) {
+        delete function;
+        return;
+    }
+
+    const std::vector<Instruction>::size_type start = code_.size();
+    const unsigned int temps = temps_;
+    std::vector<unsigned int> guards;
+    for (unsigned int i = 0; i < numbers.size() && i < layout.params(); ++i) {
+        if (numbers[i])
+            guards.push_back(emit(op_guard_number, i, 0, def->line()));
+    }
+
+    Lowering lowering(this, *function);
+    lowering.lower();
+    delete function;
+
+    if (lowering.unchecked() == 0) {
+        code_.erase(code_.begin() + start, code_.end());
+        temps_ = temps;
+        return;
+    }
+    for (std::vector<unsigned int>::const_iterator it = guards.begin(), end = guards.end(); it != end; ++it)
+        code_[*it].arg2 = code_.size();
+}
+
+CompiledCode *CompiledCode::compile(const DefStatement *def, const FrameLayout &layout, const Program &program, const std::vector<bool> &numbers) {
+    std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+    CompiledCode *ret = new CompiledCode(program, &layout);
+
+    EffectsVisitor effects;
+    ASTVisitorDepthFirst strategy;
+    def->block()->accept(&strategy, &effects);
+    ret->writes_.assign(effects.writes().begin(), effects.writes().end());
+
+    SsaFunction *function = SsaFunction::build(def, layout, program);
+    SsaPassManager passes;
+    passes.add_defaults();
+    passes.run(*function);
+
+    /* A local that is only assigned on some paths into a join needs the
+     * frame's own slots to tell */
+    if (function->undefined_phis().empty()) {
+        ret->specialize(def, layout, passes, numbers);
+        Lowering lowering(ret, *function);
+        lowering.lower();
+    } else {
+        ret->params_.insert(layout.names().begin(), layout.names().begin() + layout.params());
+        ret->emit(op_reserve, 0, 0, def->line());
+        ret->compile(def->block());
+        ret->emit(op_end, 0, 0, def->line());
+        ret->code_[0].arg = ret->caches_;
+    }
+    delete function;
+    ret->fuse();
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - started;
+    ret->compile_seconds_ = elapsed.count();
+    return ret;
+}
+
+CompiledCode *CompiledCode::compile(const WhileStatement *loop, const FrameLayout *layout, const Program &program) {
+    std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+    CompiledCode *ret = new CompiledCode(program, layout);
+
+    if (layout) {
+        EffectsVisitor effects;
+        ASTVisitorDepthFirst strategy;
+        loop->accept(&strategy, &effects);
+        ret->writes_.assign(effects.writes().begin(), effects.writes().end());
+        ret->params_.insert(layout->names().begin(), layout->names().begin() + layout->params());
+    }
+
+    ret->emit(op_reserve, 0, 0, loop->line());
+    ret->compile_while(loop);
+    ret->emit(op_end, 0, 0, loop->line());
+    ret->code_[0].arg = ret->caches_;
+    ret->fuse();
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - started;
+    ret->compile_seconds_ = elapsed.count();
+    return ret;
+}
+
+/* Turns the first instruction of each of the sequences tools/opcode_pairs.sh
+ * found most often into a superinstruction, longest sequences first. The
+ * rest of the sequence stays as it was, for jumps into the middle of it. */
+void CompiledCode::fuse() {
+#ifndef TOY_NO_SUPERINSTRUCTIONS
+    std::vector<Instruction>::size_type i = 0;
+    while (i + 1 < code_.size()) {
+        Instruction &first = code_[i];
+        const Opcode second = code_[i + 1].op;
+        const bool binary_third = i + 2 < code_.size() && (code_[i + 2].op == op_binary || code_[i + 2].op == op_number_binary);
+        if (first.op == op_load_slot && second == op_constant && binary_third) {
+            first.op = op_slot_constant_binary;
+            i += 3;
+        } else if (first.op == op_load_slot && second == op_load_slot && binary_third) {
+            first.op = op_slot_slot_binary;
+            i += 3;
+        } else if (first.op == op_store_slot && second == op_pop) {
+            first.op = op_store_pop;
+            i += 2;
+        } else if (first.op == op_binary && second == op_jump_if_false) {
+            first.op = op_binary_jump_if_false;
+            i += 2;
+        } else if (first.op == op_number_binary && second == op_jump_if_false) {
+            first.op = op_number_binary_jump_if_false;
+            i += 2;
+        } else {
+            ++i;
+        }
+    }
+#endif
+}
+
+unsigned int CompiledCode::emit(Opcode op, unsigned int arg, unsigned int arg2, unsigned int line) {
+    code_.push_back(Instruction(op, arg, arg2, line));
+    return code_.size() - 1;
+}
+
+unsigned int CompiledCode::name(const std::string &name) {
+    std::map<std::string, unsigned int>::const_iterator it = name_ids_.find(name);
+    if (it != name_ids_.end())
+        return it->second;
+
+    name_ids_[name] = names_.size();
+    names_.push_back(name);
+    return names_.size() - 1;
+}
+
+unsigned int CompiledCode::constant(const Value &value) {
+    constants_.push_back(value);
+    return constants_.size() - 1;
+}
+
+unsigned int CompiledCode::function(const DefStatement *def) {
+    std::map<const DefStatement*, unsigned int>::const_iterator it = function_ids_.find(def);
+    if (it != function_ids_.end())
+        return it->second;
+
+    function_ids_[def] = functions_.size();
+    functions_.push_back(def);
+    return functions_.size() - 1;
+}
+
+void CompiledCode::load(const std::string &varname, unsigned int line) {
+    unsigned int slot = layout_ ? layout_->slot(varname) : FrameLayout::no_slot;
+    if (slot != FrameLayout::no_slot)
+        emit(op_load_slot, slot, 0, line);
+    else
+        emit(op_load_name, name(varname), 0, line);
+}
+
+void CompiledCode::store(const std::string &varname, unsigned int line) {
+    unsigned int slot = layout_ ? layout_->slot(varname) : FrameLayout::no_slot;
+    if (slot != FrameLayout::no_slot)
+        emit(op_store_slot, slot, 0, line);
+    else
+        emit(op_store_name, name(varname), 0, line);
+}
+
+/* Statements */
+
+void CompiledCode::compile(const AST *block) {
+    const std::vector<const Statement*> &nodes = block->nodes();
+    for (std::vector<const Statement*>::const_iterator it = nodes.begin(), end = nodes.end(); it != end; ++it)
+        compile(*it);
+}
+
+void CompiledCode::compile(const Statement *statement) {
+    switch (statement->type()) {
+        case toy_expression_statement:
+            compile(static_cast<const ExpressionStatement*>(statement)->expr());
+            emit(op_pop, 0, 0, statement->line());
+            break;
+        case toy_if: {
+            const IfStatement *node = static_cast<const IfStatement*>(statement);
+            compile(node->cond());
+            unsigned int skip_true = emit(op_jump_if_false, 0, 0, node->line());
+            compile(node->true_block());
+
+            if (node->false_block()) {
+                unsigned int skip_false = emit(op_jump, 0, 0, node->line());
+                code_[skip_true].arg = code_.size();
+                compile(node->false_block());
+                code_[skip_false].arg = code_.size();
+            } else {
+                code_[skip_true].arg = code_.size();
+            }
+            break;
+        }
+        case toy_while:
+            compile_while(static_cast<const WhileStatement*>(statement));
+            break;
+        case toy_return:
+            compile(static_cast<const ReturnStatement*>(statement)->ret());
+            emit(op_return, 0, 0, statement->line());
+            break;
+        default:
+            /* Nested definitions are never bound, and imports are resolved
+             * when loading */
+            break;
+    }
+}
+
+static bool is_variable(const Expression *expr, const std::string &name) {
+    return expr->type() == toy_variable && static_cast<const VariableExpr*>(expr)->varname() == name;
+}
+
+/* The update of the induction variable the condition compares, if it is
+ * the last statement of the body and steps by a number literal */
+static const AssignExpr *final_update(const WhileStatement *node, const LoopInfo &info) {
+    const BinaryOpExpr *cond = info.exit_compare();
+    const std::vector<const Statement*> &nodes = node->block()->nodes();
+    if (!cond || nodes.empty() || nodes.back()->type() != toy_expression_statement)
+        return 0;
+
+    const Expression *expr = static_cast<const ExpressionStatement*>(nodes.back())->expr();
+    if (expr->type() != toy_assign)
+        return 0;
+    const AssignExpr *assign = static_cast<const AssignExpr*>(expr);
+    const InductionVariable *var = info.induction_var(assign->lvalue());
+    if (!var || var->step()->type() != toy_number || assign->rvalue()->type() != toy_binary_op)
+        return 0;
+
+    /* The one assignment the analysis found, to what the loop compares */
+    const BinaryOpExpr *update = static_cast<const BinaryOpExpr*>(assign->rvalue());
+    if (update->left() != var->step() && update->right() != var->step())
+        return 0;
+    if (!is_variable(cond->left(), var->name()) && !is_variable(cond->right(), var->name()))
+        return 0;
+    return assign;
+}
+
+void CompiledCode::compile_while(const WhileStatement *node) {
+    LoopInfo info(node);
+    LoopAnalysis::analyze(&info, layout_ ? &params_ : 0);
+
+    /* Enclosing loops keep the entries they made */
+    const unsigned int first = caches_;
+    for (std::vector<const BinaryOpExpr*>::const_iterator it = info.invariants().begin(), end = info.invariants().end(); it != end; ++it) {
+        if (!cache_ids_.count(*it))
+            cache_ids_[*it] = new_cache();
+    }
+
+    const AssignExpr *update = final_update(node, info);
+    const unsigned int slot = update && layout_ ? layout_->slot(update->lvalue()) : FrameLayout::no_slot;
+    LoopStep step;
+    if (slot != FrameLayout::no_slot) {
+        const BinaryOpExpr *binop = static_cast<const BinaryOpExpr*>(update->rvalue());
+        const InductionVariable *var = info.induction_var(update->lvalue());
+        step.slot = slot;
+        step.op = var->op();
+        step.step = static_cast<const ValueExpr*>(var->step())->number();
+        step.step_left = binop->left() == var->step();
+        step.update_line = binop->line();
+        step.compare = info.exit_compare()->op_type();
+        step.limit = new_cache();
+        step.limit_left = !is_variable(info.exit_compare()->left(), var->name());
+        step.compare_line = info.exit_compare()->line();
+
+        const std::vector<const BinaryOpExpr*> &products = info.products();
+        for (std::vector<const BinaryOpExpr*>::const_iterator it = products.begin(), end = products.end(); it != end; ++it) {
+            const bool var_left = is_variable((*it)->left(), var->name());
+            if (!var_left && !is_variable((*it)->right(), var->name()))
+                continue;
+            const ValueExpr *factor = static_cast<const ValueExpr*>(var_left ? (*it)->right() : (*it)->left());
+            cache_ids_[*it] = new_cache();
+            step.products.push_back(std::make_pair(cache_ids_[*it], factor->number()));
+        }
+    }
+
+    if (caches_ > first)
+        emit(op_clear, first, caches_ - first, node->line());
+
+    if (slot == FrameLayout::no_slot) {
+        unsigned int start = code_.size();
+        compile(node->cond());
+        unsigned int exit = emit(op_jump_if_false, 0, 0, node->line());
+        compile(node->block());
+        emit(op_loop, start, 0, node->line());
+        code_[exit].arg = code_.size();
+        return;
+    }
+
+    /* The condition only runs here once; op_increment_loop repeats it with
+     * the limit this leaves in its entry */
+    const BinaryOpExpr *cond = info.exit_compare();
+    compile(cond->left());
+    if (step.limit_left)
+        emit(op_store_cached, step.limit, 0, cond->line());
+    compile(cond->right());
+    if (!step.limit_left)
+        emit(op_store_cached, step.limit, 0, cond->line());
+    emit(op_binary, cond->op_type(), 0, cond->line());
+    unsigned int exit = emit(op_jump_if_false, 0, 0, node->line());
+
+    step.target = code_.size();
+    const std::vector<const Statement*> &nodes = node->block()->nodes();
+    for (std::vector<const Statement*>::const_iterator it = nodes.begin(), end = nodes.end() - 1; it != end; ++it)
+        compile(*it);
+    steps_.push_back(step);
+    emit(op_increment_loop, steps_.size() - 1, 0, node->line());
+    code_[exit].arg = code_.size();
+}
+
+/* Expressions */
+
+void CompiledCode::compile(const Expression *expr) {
+    switch (expr->type()) {
+        case toy_number:
+            emit(op_constant, constant(Value(static_cast<const ValueExpr*>(expr)->number())), 0, expr->line());
+            break;
+        case toy_string:
+            emit(op_constant, constant(Value(static_cast<const ValueExpr*>(expr)->string())), 0, expr->line());
+            break;
+        case toy_variable:
+            load(static_cast<const VariableExpr*>(expr)->varname(), expr->line());
+            break;
+        case toy_binary_op: {
+            const BinaryOpExpr *node = static_cast<const BinaryOpExpr*>(expr);
+            std::map<const Expression*, unsigned int>::const_iterator cached = cache_ids_.find(node);
+            unsigned int check = cached != cache_ids_.end() ? emit(op_load_cached, cached->second, 0, node->line()) : 0;
+            compile(node->left());
+            compile(node->right());
+            emit(op_binary, node->op_type(), 0, node->line());
+            if (cached != cache_ids_.end()) {
+                emit(op_store_cached, cached->second, 0, node->line());
+                code_[check].arg2 = code_.size();
+            }
+            break;
+        }
+        case toy_assign: {
+            const AssignExpr *node = static_cast<const AssignExpr*>(expr);
+            compile(node->rvalue());
+            store(node->lvalue(), node->line());
+            break;
+        }
+        case toy_function_call: {
+            const FuncCallExpr *node = static_cast<const FuncCallExpr*>(expr);
+            const std::vector<const Expression*> &args = node->args();
+            for (std::vector<const Expression*>::const_iterator it = args.begin(), end = args.end(); it != end; ++it)
+                compile(*it);
+
+            const DefStatement *def = program_.function(node->funcname());
+            if (def)
+                emit(op_call, function(def), args.size(), node->line());
+            else
+                emit(op_builtin, name(node->funcname()), args.size(), node->line());
+            break;
+        }
+        case toy_array: {
+            const std::vector<const Expression*> &elements = static_cast<const ArrayExpr*>(expr)->elements();
+            for (std::vector<const Expression*>::const_iterator it = elements.begin(), end = elements.end(); it != end; ++it)
+                compile(*it);
+            emit(op_array, elements.size(), 0, expr->line());
+            break;
+        }
+        case toy_index: {
+            const IndexExpr *node = static_cast<const IndexExpr*>(expr);
+            compile(node->container());
+            compile(node->index());
+            emit(op_index, 0, 0, node->line());
+            break;
+        }
+        case toy_map: {
+            const MapExpr *node = static_cast<const MapExpr*>(expr);
+            for (std::vector<const Expression*>::size_type i = 0; i < node->keys().size(); ++i) {
+                compile(node->keys()[i]);
+                compile(node->values()[i]);
+            }
+            emit(op_map, node->keys().size() * 2, 0, node->line());
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+const char *opcode_name(Opcode op) {
+    switch (op) {
+        case op_constant: return "constant";
+        case op_pop: return "pop";
+        case op_load_slot: return "load_slot";
+        case op_store_slot: return "store_slot";
+        case op_load_name: return "load_name";
+        case op_store_name: return "store_name";
+        case op_binary: return "binary";
+        case op_index: return "index";
+        case op_array: return "array";
+        case op_map: return "map";
+        case op_call: return "call";
+        case op_builtin: return "builtin";
+        case op_jump: return "jump";
+        case op_jump_if_false: return "jump_if_false";
+        case op_loop: return "loop";
+        case op_return: return "return";
+        case op_end: return "end";
+        case op_reserve: return "reserve";
+        case op_clear: return "clear";
+        case op_load_cached: return "load_cached";
+        case op_store_cached: return "store_cached";
+        case op_increment_loop: return "increment_loop";
+        case op_number_binary: return "number_binary";
+        case op_guard_number: return "guard_number";
+        case op_store_pop: return "store_pop";
+        case op_slot_constant_binary: return "slot_constant_binary";
+        case op_slot_slot_binary: return "slot_slot_binary";
+        case op_binary_jump_if_false: return "binary_jump_if_false";
+        case op_number_binary_jump_if_false: return "number_binary_jump_if_false";
+    }
+    return "?";
+}
+
+#ifdef TOY_PROFILE_OPCODES
+std::atomic<unsigned long> OpcodeProfile::pairs_[opcode_count][opcode_count];
+
+void OpcodeProfile::write(std::ostream &out) {
+    for (unsigned int first = 0; first < opcode_count; ++first) {
+        for (unsigned int second = 0; second < opcode_count; ++second) {
+            unsigned long count = pairs_[first][second].load(std::memory_order_relaxed);
+            if (count > 0)
+                out << opcode_name((Opcode)first) << " " << opcode_name((Opcode)second) << " " << count << std::endl;
+        }
+    }
+}
+#endif
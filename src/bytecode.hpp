@@ -0,0 +1,210 @@
+#ifndef _BYTECODE_HPP
+#define _BYTECODE_HPP
+
+#include <atomic>
+#include <iostream>
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+#include "ast.hpp"
+#include "frame_layout.hpp"
+#include "lexer.hpp"
+#include "loop_analysis.hpp"
+#include "program.hpp"
+#include "toy.hpp"
+#include "toyobj.hpp"
+
+class SsaPassManager;
+
+/* Instructions of a stack machine. Expressions leave their value on the
+ * operand stack; statements leave it as they found it. */
+typedef enum {
+    op_constant,        /* push constants[arg] */
+    op_pop,
+    op_load_slot,       /* push frame slot arg, or the global if unassigned */
+    op_store_slot,      /* frame slot arg = top, which stays on the stack */
+    op_load_name,       /* like op_load_slot, by names[arg] */
+    op_store_name,
+    op_binary,          /* arg is the operator's TokenType */
+    op_index,
+    op_array,           /* from the top arg values */
+    op_map,             /* from the top arg keys and values */
+    op_call,            /* functions[arg] with the top arg2 values */
+    op_builtin,         /* names[arg] with the top arg2 values */
+    op_jump,            /* to code[arg] */
+    op_jump_if_false,   /* pops the condition */
+    op_loop,            /* a back-edge: a safepoint, then a jump */
+    op_return,          /* pops the return value */
+    op_end,             /* return nothing, or leave the loop */
+    op_reserve,         /* push arg empty cache entries */
+    op_clear,           /* empty cache entries arg to arg + arg2 */
+    op_load_cached,     /* if cache entry arg is set, push it and jump to code[arg2] */
+    op_store_cached,    /* cache entry arg = top, which stays on the stack */
+    op_increment_loop,  /* steps()[arg]: update, safepoint, condition and back edge */
+    op_number_binary,   /* op_binary on operands known to be numbers, unchecked */
+    op_guard_number,    /* unless frame slot arg holds a number, jump to code[arg2] */
+
+    /* Superinstructions, see CompiledCode::fuse(). Each replaces the first
+     * instruction of a sequence, and skips the others after doing their
+     * work with their arguments. A binary among them may be an
+     * op_number_binary. */
+    op_store_pop,               /* store_slot, pop */
+    op_slot_constant_binary,    /* load_slot, constant, binary */
+    op_slot_slot_binary,        /* load_slot, load_slot, binary */
+    op_binary_jump_if_false,    /* binary, jump_if_false */
+    op_number_binary_jump_if_false
+} Opcode;
+
+static const unsigned int opcode_count = op_number_binary_jump_if_false + 1;
+
+const char *opcode_name(Opcode);
+
+struct Instruction {
+    Instruction(Opcode op, unsigned int arg, unsigned int arg2, unsigned int line)
+        : op(op),
+          arg(arg),
+          arg2(arg2),
+          line(line) {}
+    Opcode op;
+    unsigned int arg, arg2;
+    unsigned int line;
+};
+
+/* The last statement of a loop body, `i = i + step` with a number literal
+ * as the step, fused with the back edge and the loop's condition, which
+ * compares i with a loop invariant limit. i is a frame slot. */
+struct LoopStep {
+    unsigned int slot;
+    TokenType op;
+    double step;
+    /* `i = step + i` */
+    bool step_left;
+    unsigned int update_line;
+
+    TokenType compare;
+    /* The cache entry the limit is kept in */
+    unsigned int limit;
+    /* `while (limit > i)` */
+    bool limit_left;
+    unsigned int compare_line;
+
+    /* Where the body starts */
+    unsigned int target;
+    /* Cache entries holding i times a number, with the number */
+    std::vector<std::pair<unsigned int, double> > products;
+};
+
+/* The Interpreter's faster tier: a function or a loop compiled to bytecode.
+ *
+ * Locals are addressed by their slot in the function's FrameLayout, and
+ * calls are resolved at compile time. A function goes through SSA first
+ * (see SsaPassManager); its values then live in temporary slots after the
+ * layout's, or on the operand stack. That is only right as long as none
+ * of the assigned names is a global, which the Interpreter checks before
+ * running the code. A loop works on the frame of the function it is in, so
+ * the Interpreter can switch to it in the middle of a run; at top level it
+ * reads and writes globals by name.
+ *
+ * A function whose every call site passes numbers to some parameters, as
+ * far as TypeInference can tell, is compiled twice: first assuming those
+ * are numbers, so that operators on values that must then be numbers are
+ * op_number_binary, then as it is. The first version starts with an
+ * op_guard_number per parameter, which jumps to the second if the call
+ * passed anything else.
+ *
+ * Loops compiled from the AST go through LoopAnalysis. Their invariant
+ * expressions are kept in cache entries, empty Values at the bottom of the
+ * code's operand stack: computed at their first use after the loop is
+ * entered, where they would throw, and loaded from then on. When the body
+ * ends with the update of an induction variable that the condition
+ * compares, the update, the back edge and the condition are one
+ * op_increment_loop, which also keeps the variable's products with
+ * numbers up to date in their cache entries.
+ */
+class CompiledCode {
+  public:
+    /* Both can throw SyntaxError from a lazily parsed body. A top-level
+     * loop has no layout. The layout must outlive the code. numbers has a
+     * flag per parameter, set for those to specialize the code for; may
+     * be empty. */
+    static CompiledCode *compile(const DefStatement*, const FrameLayout&, const Program&,
+                                 const std::vector<bool> &numbers = std::vector<bool>());
+    static CompiledCode *compile(const WhileStatement*, const FrameLayout*, const Program&);
+
+    inline const std::vector<Instruction> &code() const { return code_; }
+    inline const std::vector<Value> &constants() const { return constants_; }
+    inline const std::vector<std::string> &names() const { return names_; }
+    inline const std::vector<const DefStatement*> &functions() const { return functions_; }
+    inline const std::vector<LoopStep> &steps() const { return steps_; }
+    inline const FrameLayout *layout() const { return layout_; }
+    /* Slots the code needs past the layout's */
+    inline unsigned int temps() const { return temps_; }
+
+    /* Names that must not be globals for the slots to be right */
+    inline const std::vector<std::string> &writes() const { return writes_; }
+
+    inline double compile_seconds() const { return compile_seconds_; }
+  private:
+    class Lowering;
+
+    CompiledCode(const Program &program, const FrameLayout *layout)
+        : program_(program),
+          layout_(layout),
+          temps_(0),
+          caches_(0),
+          compile_seconds_(0) {}
+
+    void compile(const AST*);
+    void compile(const Statement*);
+    void compile(const Expression*);
+    void compile_while(const WhileStatement*);
+    void specialize(const DefStatement*, const FrameLayout&, const SsaPassManager&, const std::vector<bool>&);
+    void fuse();
+    inline unsigned int new_cache() { return caches_++; }
+
+    unsigned int emit(Opcode, unsigned int, unsigned int, unsigned int);
+    unsigned int name(const std::string&);
+    unsigned int constant(const Value&);
+    unsigned int function(const DefStatement*);
+    void load(const std::string&, unsigned int);
+    void store(const std::string&, unsigned int);
+
+    const Program &program_;
+    const FrameLayout *layout_;
+    unsigned int temps_;
+    std::vector<Instruction> code_;
+    std::vector<Value> constants_;
+    std::vector<std::string> names_;
+    std::vector<const DefStatement*> functions_;
+    std::vector<std::string> writes_;
+    std::vector<LoopStep> steps_;
+    /* Parameters, which calls in a loop can't change */
+    std::set<std::string> params_;
+    unsigned int caches_;
+    std::map<const Expression*, unsigned int> cache_ids_;
+    std::map<std::string, unsigned int> name_ids_;
+    std::map<const DefStatement*, unsigned int> function_ids_;
+    double compile_seconds_;
+    DISALLOW_COPY_AND_ASSIGN(CompiledCode);
+};
+
+#ifdef TOY_PROFILE_OPCODES
+/* Built with PROFILE_OPCODES=1: how often each opcode ran right after
+ * another, on any thread. tools/opcode_pairs.sh sums it up over a corpus
+ * of scripts. */
+class OpcodeProfile {
+  public:
+    static inline void count(unsigned int first, Opcode second) {
+        if (first < opcode_count)
+            pairs_[first][second].fetch_add(1, std::memory_order_relaxed);
+    }
+    /* A line "first second count" per pair that ran */
+    static void write(std::ostream&);
+  private:
+    static std::atomic<unsigned long> pairs_[opcode_count][opcode_count];
+};
+#endif
+
+#endif
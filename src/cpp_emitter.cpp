@@ -0,0 +1,729 @@
+#include "cpp_emitter.hpp"
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <sstream>
+#include "ast_depth_first.hpp"
+#include "lexer.hpp"
+#include "purity_analysis.hpp"
+#include "runtime.hpp"
+
+static const char *prelude =
+    "#include <array>\n"
+    "#include <cmath>\n"
+    "#include <exception>\n"
+    "#include <iostream>\n"
+    "#include <map>\n"
+    "#include <sstream>\n"
+    "#include <string>\n"
+    "#include <vector>\n"
+    "#include \"exceptions.hpp\"\n"
+    "#include \"runtime.hpp\"\n"
+    "#include \"toyobj.hpp\"\n"
+    "\n"
+    "static std::ostream *toy_out = &std::cout;\n"
+    "\n"
+    "/* A variable, and whether it has been assigned yet */\n"
+    "struct ToyVar {\n"
+    "    ToyVar() : assigned(false) {}\n"
+    "    explicit ToyVar(const Value &value) : value(value), assigned(true) {}\n"
+    "    Value value;\n"
+    "    bool assigned;\n"
+    "};\n"
+    "\n"
+    "static double toy_undefined(const char *name, unsigned int line) {\n"
+    "    throw RuntimeError(std::string(\"Undefined variable '\") + name + \"'\", line);\n"
+    "}\n"
+    "\n"
+    "static inline const Value &toy_read(const ToyVar &global, const char *name, unsigned int line) {\n"
+    "    if (!global.assigned)\n"
+    "        toy_undefined(name, line);\n"
+    "    return global.value;\n"
+    "}\n"
+    "\n"
+    "/* A local that isn't assigned yet reads the global */\n"
+    "static inline const Value &toy_read(const ToyVar &local, const ToyVar &global, const char *name, unsigned int line) {\n"
+    "    return local.assigned ? local.value : toy_read(global, name, line);\n"
+    "}\n"
+    "\n"
+    "static inline const Value &toy_assign(ToyVar &var, const Value &value) {\n"
+    "    var.value = value;\n"
+    "    var.assigned = true;\n"
+    "    return var.value;\n"
+    "}\n"
+    "\n"
+    "/* Inside a function, a name that is a global by now assigns the global */\n"
+    "static inline const Value &toy_assign(ToyVar &local, ToyVar &global, const Value &value) {\n"
+    "    return toy_assign(global.assigned ? global : local, value);\n"
+    "}\n"
+    "\n"
+    "/* Operands with side effects are gathered in a braced list, which C++\n"
+    " * evaluates left to right like the interpreter does. */\n"
+    "static inline Value toy_binary_op(TokenType op, const std::array<Value, 2> &operands, unsigned int line) {\n"
+    "    return Runtime::binary_op(op, operands[0], operands[1], line);\n"
+    "}\n"
+    "\n"
+    "static inline Value toy_index(const std::array<Value, 2> &operands, unsigned int line) {\n"
+    "    return Runtime::index(operands[0], operands[1], line);\n"
+    "}\n"
+    "\n"
+    "static inline Value toy_wrong_arity(const std::vector<Value> &args, const char *funcname, size_t params, unsigned int line) {\n"
+    "    std::ostringstream ss;\n"
+    "    ss << funcname << \"() takes \" << params << \" arguments but got \" << args.size();\n"
+    "    throw RuntimeError(ss.str(), line);\n"
+    "}\n"
+    "\n"
+    "extern \"C\" bool toy_call(const char*, const std::vector<Value>&, std::ostream&, Value&);\n"
+    "static std::vector<ToyVar> toy_save_globals();\n"
+    "static void toy_restore_globals(const std::vector<ToyVar>&);\n"
+    "\n"
+    "/* pmap() and spawn() run their calls one after the other, each starting\n"
+    " * from the globals as they were, like the interpreter's workers */\n"
+    "static Value toy_call_isolated(const std::string &funcname, const std::vector<Value> &args) {\n"
+    "    const std::vector<ToyVar> globals = toy_save_globals();\n"
+    "    std::ostream *out = toy_out;\n"
+    "    Value ret;\n"
+    "    try {\n"
+    "        if (!toy_call(funcname.c_str(), args, *out, ret))\n"
+    "            ret = Runtime::builtin(funcname, args, *out, 0);\n"
+    "    } catch (...) {\n"
+    "        toy_out = out;\n"
+    "        toy_restore_globals(globals);\n"
+    "        throw;\n"
+    "    }\n"
+    "    toy_out = out;\n"
+    "    toy_restore_globals(globals);\n"
+    "    return ret;\n"
+    "}\n"
+    "\n"
+    "static Value toy_pmap(const std::vector<Value> &args, unsigned int line) {\n"
+    "    if (args.size() != 2 || !args[0].is_string() || !args[1].is_array())\n"
+    "        throw RuntimeError(\"pmap() takes a function name and an array\", line);\n"
+    "    Value::Array ret;\n"
+    "    const Value::Array &in = args[1].array();\n"
+    "    for (Value::Array::const_iterator it = in.begin(), end = in.end(); it != end; ++it)\n"
+    "        ret.push_back(toy_call_isolated(args[0].string(), std::vector<Value>(1, *it)));\n"
+    "    return Value::new_array(ret);\n"
+    "}\n"
+    "\n"
+    "/* map() makes its calls right here, on the same globals */\n"
+    "static Value toy_map_call(const std::string &funcname, const Value &arg, unsigned int line) {\n"
+    "    const std::vector<Value> args(1, arg);\n"
+    "    std::ostream *out = toy_out;\n"
+    "    Value ret;\n"
+    "    try {\n"
+    "        if (!toy_call(funcname.c_str(), args, *out, ret))\n"
+    "            ret = Runtime::builtin(funcname, args, *out, line);\n"
+    "    } catch (...) {\n"
+    "        toy_out = out;\n"
+    "        throw;\n"
+    "    }\n"
+    "    toy_out = out;\n"
+    "    return ret;\n"
+    "}\n"
+    "\n"
+    "static Value toy_map(const std::vector<Value> &args, unsigned int line) {\n"
+    "    if (args.size() != 2 || !args[0].is_string() || (!args[1].is_array() && !args[1].is_numbers()))\n"
+    "        throw RuntimeError(\"map() takes a function name and an array or numbers\", line);\n"
+    "    const std::string &funcname = args[0].string();\n"
+    "    if (args[1].is_array()) {\n"
+    "        Value::Array ret;\n"
+    "        const Value::Array &in = args[1].array();\n"
+    "        for (Value::Array::const_iterator it = in.begin(), end = in.end(); it != end; ++it)\n"
+    "            ret.push_back(toy_map_call(funcname, *it, line));\n"
+    "        return Value::new_array(ret);\n"
+    "    }\n"
+    "    Value::Numbers ret;\n"
+    "    const Value::Numbers &in = args[1].numbers();\n"
+    "    for (Value::Numbers::const_iterator it = in.begin(), end = in.end(); it != end; ++it) {\n"
+    "        Value result = toy_map_call(funcname, Value(*it), line);\n"
+    "        if (!result.is_number())\n"
+    "            throw RuntimeError(\"map() over numbers got a \" + Value::value_type_name(result.type()) + \" from \" + funcname + \"()\", line);\n"
+    "        ret.push_back(result.number());\n"
+    "    }\n"
+    "    return Value::new_numbers(ret);\n"
+    "}\n"
+    "\n"
+    "/* A spawned call, with what it printed */\n"
+    "struct ToyTask {\n"
+    "    Value result;\n"
+    "    std::string out;\n"
+    "    std::exception_ptr error;\n"
+    "};\n"
+    "static std::map<unsigned long, ToyTask> toy_tasks;\n"
+    "static unsigned long toy_next_task = 0;\n"
+    "\n"
+    "static Value toy_spawn(const std::vector<Value> &args, unsigned int line) {\n"
+    "    if (args.empty() || !args[0].is_string())\n"
+    "        throw RuntimeError(\"spawn() takes a function name and its arguments\", line);\n"
+    "    ToyTask &task = toy_tasks[++toy_next_task];\n"
+    "    std::ostream *out = toy_out;\n"
+    "    std::ostringstream captured;\n"
+    "    toy_out = &captured;\n"
+    "    try {\n"
+    "        task.result = toy_call_isolated(args[0].string(), std::vector<Value>(args.begin() + 1, args.end()));\n"
+    "    } catch (...) {\n"
+    "        task.error = std::current_exception();\n"
+    "    }\n"
+    "    toy_out = out;\n"
+    "    task.out = captured.str();\n"
+    "    return Value((double)toy_next_task);\n"
+    "}\n"
+    "\n"
+    "static Value toy_join(const std::vector<Value> &args, unsigned int line) {\n"
+    "    std::map<unsigned long, ToyTask>::iterator it = toy_tasks.end();\n"
+    "    if (args.size() == 1 && args[0].is_number() && args[0].number() >= 1)\n"
+    "        it = toy_tasks.find((unsigned long)args[0].number());\n"
+    "    if (it == toy_tasks.end())\n"
+    "        throw RuntimeError(\"join() takes a task from spawn(), once\", line);\n"
+    "    const ToyTask task = it->second;\n"
+    "    toy_tasks.erase(it);\n"
+    "    *toy_out << task.out;\n"
+    "    if (task.error)\n"
+    "        std::rethrow_exception(task.error);\n"
+    "    return task.result;\n"
+    "}\n";
+
+static const std::string indent(const std::string &code) {
+    std::string ret;
+    bool line_start = true;
+    for (std::string::const_iterator it = code.begin(), end = code.end(); it != end; ++it) {
+        if (line_start && *it != '\n')
+            ret += "    ";
+        ret += *it;
+        line_start = *it == '\n';
+    }
+    return ret;
+}
+
+static const std::string number_literal(double number) {
+    if (std::isinf(number))
+        return "HUGE_VAL";
+
+    std::ostringstream ss;
+    ss << std::setprecision(17) << number;
+    std::string ret = ss.str();
+    if (ret.find_first_of(".e") == std::string::npos)
+        ret += ".0";
+    return ret;
+}
+
+static const std::string string_literal(const std::string &string) {
+    std::ostringstream ss;
+    ss << "std::string(\"";
+    for (std::string::const_iterator it = string.begin(), end = string.end(); it != end; ++it) {
+        const unsigned char c = *it;
+        if (c == '"' || c == '\\')
+            ss << '\\' << c;
+        else if (c < 32 || c >= 127)
+            ss << '\\' << std::oct << std::setw(3) << std::setfill('0') << (unsigned int)c << std::dec;
+        else
+            ss << c;
+    }
+    ss << "\", " << string.size() << ")";
+    return ss.str();
+}
+
+static const std::string join(const std::vector<std::string> &parts) {
+    std::string ret;
+    for (std::vector<std::string>::const_iterator it = parts.begin(), end = parts.end(); it != end; ++it) {
+        if (it != parts.begin())
+            ret += ", ";
+        ret += *it;
+    }
+    return ret;
+}
+
+CppEmitterVisitor::CppEmitterVisitor(const AST *ast, const TypeInference &types)
+    : ast_(ast),
+      types_(types),
+      def_(0),
+      def_types_(0) {
+    const std::vector<const Statement*> &nodes = ast_->nodes();
+    for (std::vector<const Statement*>::const_iterator it = nodes.begin(), end = nodes.end(); it != end; ++it) {
+        if ((*it)->type() == toy_def) {
+            /* Like Program, the last definition of a name wins */
+            const DefStatement *def = static_cast<const DefStatement*>(*it);
+            functions_[def->name()] = def;
+        } else {
+            EffectsVisitor effects;
+            ASTVisitorDepthFirst strategy;
+            (*it)->accept(&strategy, &effects);
+            toplevel_writes_.insert(effects.writes().begin(), effects.writes().end());
+        }
+    }
+}
+
+const std::string CppEmitterVisitor::buffer() const {
+    std::ostringstream ss;
+    ss << prelude << "\n";
+
+    for (std::vector<std::string>::size_type i = 0; i < constants_.size(); ++i)
+        ss << "static const Value k_" << i << "(" << constants_[i] << ");\n";
+    for (std::set<std::string>::const_iterator it = globals_.begin(), end = globals_.end(); it != end; ++it)
+        ss << "static ToyVar g_" << *it << ";\n";
+
+    std::vector<std::string> saved;
+    ss << "\nstatic std::vector<ToyVar> toy_save_globals() {\n";
+    for (std::set<std::string>::const_iterator it = globals_.begin(), end = globals_.end(); it != end; ++it)
+        saved.push_back("g_" + *it);
+    ss << "    return std::vector<ToyVar>{" << join(saved) << "};\n"
+       << "}\n\n"
+       << "static void toy_restore_globals(const std::vector<ToyVar> &saved) {\n";
+    for (std::vector<std::string>::size_type i = 0; i < saved.size(); ++i)
+        ss << "    " << saved[i] << " = saved[" << i << "];\n";
+    if (saved.empty())
+        ss << "    (void)saved;\n";
+    ss << "}\n";
+
+    ss << "\n" << prototypes_ << "\n" << definitions_;
+
+    ss << "extern \"C\" void toy_main(std::ostream &out) {\n"
+       << "    toy_out = &out;\n"
+       << indent(main_)
+       << "}\n\n";
+
+    ss << "extern \"C\" bool toy_call(const char *funcname, const std::vector<Value> &args, std::ostream &out, Value &ret) {\n"
+       << "    const std::string name(funcname);\n"
+       << "    toy_out = &out;\n";
+    for (std::map<std::string, const DefStatement*>::const_iterator it = functions_.begin(), end = functions_.end(); it != end; ++it) {
+        const std::vector<std::string>::size_type params = it->second->params().size();
+        std::vector<std::string> args;
+        for (std::vector<std::string>::size_type i = 0; i < params; ++i) {
+            std::ostringstream arg;
+            arg << "args[" << i << "]";
+            args.push_back(arg.str());
+        }
+
+        ss << "    if (name == \"" << it->first << "\") {\n"
+           << "        ret = args.size() == " << params
+           << " ? f_" << it->first << "(std::array<Value, " << params << ">{{" << join(args) << "}})"
+           << " : toy_wrong_arity(args, \"" << it->first << "\", " << params << ", " << it->second->line() << ");\n"
+           << "        return true;\n"
+           << "    }\n";
+    }
+    ss << "    return false;\n"
+       << "}\n";
+
+    return ss.str();
+}
+
+/* Variables */
+
+bool CppEmitterVisitor::is_local(const std::string &name) const {
+    return def_ && locals_.find(name) != locals_.end();
+}
+
+/* Whether the name can be a global at all: only top-level code creates
+ * globals */
+bool CppEmitterVisitor::is_global(const std::string &name) const {
+    return toplevel_writes_.find(name) != toplevel_writes_.end();
+}
+
+/* Locals that can be globals too have to stay Values to go either way */
+bool CppEmitterVisitor::is_double(const std::string &name) const {
+    return def_types_ && is_local(name) && !is_global(name) && def_types_->var(name) == type_number;
+}
+
+const std::string CppEmitterVisitor::global(const std::string &name) {
+    globals_.insert(name);
+    return "g_" + name;
+}
+
+/* A Value expression reading the variable. `pure` is set when it can't
+ * throw, i.e. it is known to be assigned. */
+const std::string CppEmitterVisitor::read(const std::string &name, const std::string &line, bool &pure) {
+    const bool assigned = assigned_.find(name) != assigned_.end();
+    const std::string quoted = "\"" + name + "\"";
+
+    if (is_local(name)) {
+        pure = assigned;
+        if (assigned && !is_global(name))
+            return "l_" + name + ".value";
+        return "toy_read(l_" + name + ", " + global(name) + ", " + quoted + ", " + line + ")";
+    }
+
+    pure = assigned && !def_;
+    if (pure)
+        return global(name) + ".value";
+    return "toy_read(" + global(name) + ", " + quoted + ", " + line + ")";
+}
+
+const std::string CppEmitterVisitor::assign(const std::string &name, const std::string &value) {
+    if (!is_local(name))
+        return "toy_assign(" + global(name) + ", " + value + ")";
+    if (is_global(name))
+        return "toy_assign(l_" + name + ", " + global(name) + ", " + value + ")";
+    return "toy_assign(l_" + name + ", " + value + ")";
+}
+
+const std::string CppEmitterVisitor::constant(const std::string &initializer) {
+    std::map<std::string, unsigned int>::const_iterator it = constant_ids_.find(initializer);
+    unsigned int id;
+    if (it == constant_ids_.end()) {
+        id = constants_.size();
+        constant_ids_[initializer] = id;
+        constants_.push_back(initializer);
+    } else {
+        id = it->second;
+    }
+
+    std::ostringstream ss;
+    ss << "k_" << id;
+    return ss.str();
+}
+
+/* Nodes arrive in pre-order; each is rendered once its last child is */
+
+void CppEmitterVisitor::open(const ASTNode *node, unsigned int children) {
+    /* The blocks of ifs and loops, and function bodies, may not run */
+    const NodeType parent = pending_.empty() ? toy_ast : pending_.back().node->type();
+    pending_.push_back(Pending(node, children));
+    if (node->type() == toy_def || (node->type() == toy_ast && (parent == toy_if || parent == toy_while))) {
+        pending_.back().scoped = true;
+        scopes_.push_back(assigned_);
+    }
+
+    while (!pending_.empty() && pending_.back().parts.size() == pending_.back().children) {
+        Fragment fragment = render(pending_.back());
+        if (pending_.back().scoped) {
+            assigned_ = scopes_.back();
+            scopes_.pop_back();
+        }
+        pending_.pop_back();
+
+        if (pending_.empty())
+            main_ = fragment.code;
+        else
+            pending_.back().parts.push_back(fragment);
+    }
+}
+
+void CppEmitterVisitor::visit(const AST *node) {
+    open(node, node->nodes().size());
+}
+
+void CppEmitterVisitor::visit(const ValueExpr *node) {
+    open(node, 0);
+}
+
+void CppEmitterVisitor::visit(const BinaryOpExpr *node) {
+    open(node, 2);
+}
+
+void CppEmitterVisitor::visit(const VariableExpr *node) {
+    open(node, 0);
+}
+
+void CppEmitterVisitor::visit(const AssignExpr *node) {
+    open(node, 1);
+}
+
+void CppEmitterVisitor::visit(const FuncCallExpr *node) {
+    open(node, node->args().size());
+}
+
+void CppEmitterVisitor::visit(const ArrayExpr *node) {
+    open(node, node->elements().size());
+}
+
+void CppEmitterVisitor::visit(const IndexExpr *node) {
+    open(node, 2);
+}
+
+void CppEmitterVisitor::visit(const MapExpr *node) {
+    open(node, node->keys().size() * 2);
+}
+
+void CppEmitterVisitor::visit(const ExpressionStatement *node) {
+    open(node, 1);
+}
+
+void CppEmitterVisitor::visit(const IfStatement *node) {
+    open(node, node->false_block() ? 3 : 2);
+}
+
+void CppEmitterVisitor::visit(const WhileStatement *node) {
+    open(node, 2);
+}
+
+void CppEmitterVisitor::visit(const ReturnStatement *node) {
+    open(node, 1);
+}
+
+void CppEmitterVisitor::visit(const DefStatement *node) {
+    /* Nested definitions are never bound, so only top-level ones are
+     * emitted */
+    std::map<std::string, const DefStatement*>::const_iterator it = functions_.find(node->name());
+    if (pending_.size() == 1 && pending_.back().node == ast_ && it->second == node) {
+        EffectsVisitor effects;
+        ASTVisitorDepthFirst strategy;
+        node->block()->accept(&strategy, &effects);
+
+        /* Like FrameLayout: the parameters and every name assigned */
+        def_ = node;
+        locals_.clear();
+        locals_.insert(node->params().begin(), node->params().end());
+        locals_.insert(effects.writes().begin(), effects.writes().end());
+
+        const FunctionTypes *fn = types_.function(node->name());
+        def_types_ = fn && fn->def() == node && fn->numeric_params() ? fn : 0;
+
+        open(node, 1);
+        assigned_.clear();
+        assigned_.insert(node->params().begin(), node->params().end());
+        return;
+    }
+
+    open(node, 1);
+}
+
+void CppEmitterVisitor::visit(const ImportStatement *node) {
+    open(node, 0);
+}
+
+/* Rendering */
+
+CppEmitterVisitor::Fragment CppEmitterVisitor::render(const Pending &pending) {
+    const std::vector<Fragment> &parts = pending.parts;
+    Fragment ret;
+
+    switch (pending.node->type()) {
+        case toy_ast:
+            for (std::vector<Fragment>::const_iterator it = parts.begin(), end = parts.end(); it != end; ++it) {
+                ret.code += it->code;
+                ret.typed += it->typed;
+            }
+            return ret;
+        case toy_expression_statement:
+            ret.code = parts[0].code + ";\n";
+            ret.typed = (parts[0].num.empty() ? parts[0].typed : parts[0].num) + ";\n";
+            return ret;
+        case toy_if:
+        case toy_while: {
+            /* The condition as a C++ bool */
+            const Fragment &cond = parts[0];
+            const std::string keyword = pending.node->type() == toy_if ? "if" : "while";
+            const std::string typed_cond = !cond.cond.empty() ? cond.cond
+                                         : !cond.num.empty() ? "(" + cond.num + " != 0)"
+                                         : "(" + cond.typed + ").truthy()";
+
+            ret.code = keyword + " ((" + cond.code + ").truthy()) {\n" + indent(parts[1].code) + "}";
+            ret.typed = keyword + " (" + typed_cond + ") {\n" + indent(parts[1].typed) + "}";
+            if (parts.size() > 2) {
+                ret.code += " else {\n" + indent(parts[2].code) + "}";
+                ret.typed += " else {\n" + indent(parts[2].typed) + "}";
+            }
+            ret.code += "\n";
+            ret.typed += "\n";
+            return ret;
+        }
+        case toy_return:
+            if (def_) {
+                ret.code = "return " + parts[0].code + ";\n";
+                ret.typed = "return " + parts[0].typed + ";\n";
+            } else {
+                /* Stops the top-level code */
+                ret.code = ret.typed = parts[0].code + ";\nreturn;\n";
+            }
+            return ret;
+        case toy_def:
+            if (pending.node == def_) {
+                render_function(def_, parts[0]);
+                def_ = 0;
+                def_types_ = 0;
+                locals_.clear();
+            }
+            return ret;
+        case toy_import:
+            return ret;
+        default:
+            return render_expression(dynamic_cast<const Expression*>(pending.node), parts);
+    }
+}
+
+CppEmitterVisitor::Fragment CppEmitterVisitor::render_expression(const Expression *expr, const std::vector<Fragment> &parts) {
+    std::ostringstream line;
+    line << expr->line();
+    Fragment ret;
+
+    std::vector<std::string> code, typed;
+    for (std::vector<Fragment>::const_iterator it = parts.begin(), end = parts.end(); it != end; ++it) {
+        code.push_back(it->code);
+        typed.push_back(it->typed);
+    }
+
+    switch (expr->type()) {
+        case toy_number: {
+            const double number = static_cast<const ValueExpr*>(expr)->number();
+            ret.code = ret.typed = constant(number_literal(number));
+            ret.num = number_literal(number);
+            ret.pure = true;
+            break;
+        }
+        case toy_string:
+            ret.code = ret.typed = constant(string_literal(static_cast<const ValueExpr*>(expr)->string()));
+            ret.pure = true;
+            break;
+        case toy_variable: {
+            const std::string &name = static_cast<const VariableExpr*>(expr)->varname();
+            ret.code = ret.typed = read(name, line.str(), ret.pure);
+            if (is_double(name)) {
+                ret.num = ret.pure ? "d_" + name : "(a_" + name + " ? d_" + name + " : toy_undefined(\"" + name + "\", " + line.str() + "))";
+                ret.typed = "Value(" + ret.num + ")";
+            }
+            break;
+        }
+        case toy_binary_op: {
+            const TokenType op = static_cast<const BinaryOpExpr*>(expr)->op_type();
+            const std::string token = "tok_" + Token::token_type_name(op);
+            const Fragment &left = parts[0], &right = parts[1];
+
+            ret.pure = left.pure && right.pure;
+            if (ret.pure) {
+                ret.code = "Runtime::binary_op(" + token + ", " + left.code + ", " + right.code + ", " + line.str() + ")";
+                ret.typed = "Runtime::binary_op(" + token + ", " + left.typed + ", " + right.typed + ", " + line.str() + ")";
+            } else {
+                ret.code = "toy_binary_op(" + token + ", {{" + left.code + ", " + right.code + "}}, " + line.str() + ")";
+                ret.typed = "toy_binary_op(" + token + ", {{" + left.typed + ", " + right.typed + "}}, " + line.str() + ")";
+            }
+
+            /* The operands of a C++ operator are unsequenced, so one of
+             * them has to be pure */
+            if (left.num.empty() || right.num.empty() || !(left.pure || right.pure))
+                break;
+
+            switch (op) {
+                case tok_add: ret.num = "(" + left.num + " + " + right.num + ")"; break;
+                case tok_sub: ret.num = "(" + left.num + " - " + right.num + ")"; break;
+                case tok_mul: ret.num = "(" + left.num + " * " + right.num + ")"; break;
+                case tok_div: ret.num = "(" + left.num + " / " + right.num + ")"; break;
+                case tok_mod: ret.num = "fmod(" + left.num + ", " + right.num + ")"; break;
+                case tok_eq: ret.cond = "(" + left.num + " == " + right.num + ")"; break;
+                case tok_lt: ret.cond = "(" + left.num + " < " + right.num + ")"; break;
+                case tok_gt: ret.cond = "(" + left.num + " > " + right.num + ")"; break;
+                case tok_lte: ret.cond = "(" + left.num + " <= " + right.num + ")"; break;
+                case tok_gte: ret.cond = "(" + left.num + " >= " + right.num + ")"; break;
+                default: break;
+            }
+            if (!ret.cond.empty())
+                ret.num = "(" + ret.cond + " ? 1.0 : 0.0)";
+            if (!ret.num.empty())
+                ret.typed = "Value(" + ret.num + ")";
+            break;
+        }
+        case toy_assign: {
+            const std::string &name = static_cast<const AssignExpr*>(expr)->lvalue();
+            const Fragment &rvalue = parts[0];
+            const std::string num = rvalue.num.empty() ? "(" + rvalue.typed + ").number()" : rvalue.num;
+            const bool param = def_ && std::find(def_->params().begin(), def_->params().end(), name) != def_->params().end();
+
+            ret.code = assign(name, rvalue.code);
+            if (!is_double(name)) {
+                ret.typed = assign(name, rvalue.typed);
+            } else if (param) {
+                ret.num = "(d_" + name + " = " + num + ")";
+                ret.typed = "Value(" + ret.num + ")";
+            } else {
+                ret.num = "(d_" + name + " = " + num + ", a_" + name + " = true, d_" + name + ")";
+                ret.typed = "Value(" + ret.num + ")";
+            }
+            assigned_.insert(name);
+            break;
+        }
+        case toy_function_call: {
+            const FuncCallExpr *node = static_cast<const FuncCallExpr*>(expr);
+            std::map<std::string, const DefStatement*>::const_iterator callee = functions_.find(node->funcname());
+
+            if (callee == functions_.end() && Runtime::calls_by_name(node->funcname())) {
+                ret.code = "toy_" + node->funcname() + "({" + join(code) + "}, " + line.str() + ")";
+                ret.typed = "toy_" + node->funcname() + "({" + join(typed) + "}, " + line.str() + ")";
+            } else if (callee == functions_.end()) {
+                ret.code = "Runtime::builtin(\"" + node->funcname() + "\", {" + join(code) + "}, *toy_out, " + line.str() + ")";
+                ret.typed = "Runtime::builtin(\"" + node->funcname() + "\", {" + join(typed) + "}, *toy_out, " + line.str() + ")";
+            } else if (callee->second->params().size() != parts.size()) {
+                std::ostringstream params;
+                params << callee->second->params().size();
+                ret.code = "toy_wrong_arity({" + join(code) + "}, \"" + node->funcname() + "\", " + params.str() + ", " + line.str() + ")";
+                ret.typed = "toy_wrong_arity({" + join(typed) + "}, \"" + node->funcname() + "\", " + params.str() + ", " + line.str() + ")";
+            } else {
+                std::ostringstream array;
+                array << "std::array<Value, " << parts.size() << ">";
+                ret.code = "f_" + node->funcname() + "(" + array.str() + "{{" + join(code) + "}})";
+                ret.typed = "f_" + node->funcname() + "(" + array.str() + "{{" + join(typed) + "}})";
+            }
+            break;
+        }
+        case toy_array:
+            ret.code = "Value::new_array({" + join(code) + "})";
+            ret.typed = "Value::new_array({" + join(typed) + "})";
+            break;
+        case toy_index: {
+            const Fragment &container = parts[0], &index = parts[1];
+            ret.pure = container.pure && index.pure;
+            if (ret.pure) {
+                ret.code = "Runtime::index(" + container.code + ", " + index.code + ", " + line.str() + ")";
+                ret.typed = "Runtime::index(" + container.typed + ", " + index.typed + ", " + line.str() + ")";
+            } else {
+                ret.code = "toy_index({{" + container.code + ", " + index.code + "}}, " + line.str() + ")";
+                ret.typed = "toy_index({{" + container.typed + ", " + index.typed + "}}, " + line.str() + ")";
+            }
+            break;
+        }
+        case toy_map:
+            ret.code = "Runtime::new_map({" + join(code) + "})";
+            ret.typed = "Runtime::new_map({" + join(typed) + "})";
+            break;
+        default:
+            break;
+    }
+
+    /* Anything inferred to be a number can be unboxed in a typed body */
+    if (def_types_ && ret.num.empty() && types_.type_of(expr) == type_number)
+        ret.num = "(" + ret.typed + ").number()";
+    return ret;
+}
+
+void CppEmitterVisitor::render_function(const DefStatement *def, const Fragment &block) {
+    const std::vector<std::string> &params = def->params();
+    std::ostringstream signature;
+    signature << "(const std::array<Value, " << params.size() << "> &args)";
+
+    std::string generic, typed, guard;
+    for (std::vector<std::string>::size_type i = 0; i < params.size(); ++i) {
+        std::ostringstream arg;
+        arg << "args[" << i << "]";
+        generic += "ToyVar l_" + params[i] + "(" + arg.str() + ");\n";
+        if (is_double(params[i]))
+            typed += "double d_" + params[i] + " = " + arg.str() + ".number();\n";
+        else
+            typed += "ToyVar l_" + params[i] + "(" + arg.str() + ");\n";
+        guard += (i ? " && " : "") + arg.str() + ".is_number()";
+    }
+
+    for (std::set<std::string>::const_iterator it = locals_.begin(), end = locals_.end(); it != end; ++it) {
+        if (std::find(params.begin(), params.end(), *it) != params.end())
+            continue;
+        generic += "ToyVar l_" + *it + ";\n";
+        typed += is_double(*it) ? "double d_" + *it + " = 0;\nbool a_" + *it + " = false;\n" : "ToyVar l_" + *it + ";\n";
+    }
+
+    generic += block.code + "return Value();\n";
+    typed += block.typed + "return Value();\n";
+
+    const std::string name = def->name();
+    prototypes_ += "static Value f_" + name + signature.str() + ";\n";
+
+    if (!def_types_) {
+        definitions_ += "static Value f_" + name + signature.str() + " {\n" + indent(generic) + "}\n\n";
+    } else if (params.empty()) {
+        definitions_ += "static Value f_" + name + signature.str() + " {\n" + indent(typed) + "}\n\n";
+    } else {
+        /* Every known call site passes numbers; anything else, e.g. a call
+         * from the host, takes the generic body */
+        prototypes_ += "static Value t_" + name + signature.str() + ";\n";
+        definitions_ += "static Value f_" + name + signature.str() + " {\n"
+                      + indent("if (" + guard + ")\n    return t_" + name + "(args);\n" + generic) + "}\n\n";
+        definitions_ += "static Value t_" + name + signature.str() + " {\n" + indent(typed) + "}\n\n";
+    }
+}
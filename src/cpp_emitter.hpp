@@ -0,0 +1,120 @@
+#ifndef _CPP_EMITTER_HPP
+#define _CPP_EMITTER_HPP
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include "ast.hpp"
+#include "ast_visitor.hpp"
+#include "toy.hpp"
+#include "type_inference.hpp"
+
+/* Translates a whole program to a standalone C++ translation unit, to be
+ * built as a shared object and loaded with NativeModule.
+ *
+ * Values are the runtime's Value type and every operator goes through
+ * Runtime, so the generated code behaves exactly like the Interpreter.
+ * That includes scoping, which the Interpreter decides as it runs: inside
+ * a function, assigning a name that is a global by then assigns the
+ * global, and reading a variable nobody has assigned throws. Those checks
+ * are left out where the variable is known to be assigned already.
+ * Functions whose call sites all pass numbers get a second, typed body
+ * behind a guard on entry: there, numeric locals are plain doubles and
+ * arithmetic and comparisons on them compile to machine instructions.
+ *
+ * Drive it with ASTVisitorDepthFirst, which hands over the nodes in
+ * pre-order; the C++ for each node is assembled once all of its children
+ * have been seen.
+ *
+ *     CppEmitterVisitor emitter(ast, types);
+ *     ASTVisitorDepthFirst df_strategy;
+ *     ast->accept(&df_strategy, &emitter);
+ *     std::cout << emitter.buffer();
+ */
+class CppEmitterVisitor : public ASTVisitor {
+  public:
+    CppEmitterVisitor(const AST *ast, const TypeInference &types);
+
+    virtual void visit(const AST*);
+    virtual void visit(const ValueExpr*);
+    virtual void visit(const BinaryOpExpr*);
+    virtual void visit(const VariableExpr*);
+    virtual void visit(const AssignExpr*);
+    virtual void visit(const FuncCallExpr*);
+    virtual void visit(const ArrayExpr*);
+    virtual void visit(const IndexExpr*);
+    virtual void visit(const MapExpr*);
+    virtual void visit(const ExpressionStatement*);
+    virtual void visit(const IfStatement*);
+    virtual void visit(const WhileStatement*);
+    virtual void visit(const ReturnStatement*);
+    virtual void visit(const DefStatement*);
+    virtual void visit(const ImportStatement*);
+
+    const std::string buffer() const;
+  private:
+    /* The C++ for one node. `typed` is the same code for the typed body of
+     * a function; `num` and `cond` are optional double and bool forms. */
+    struct Fragment {
+        Fragment()
+            : pure(false) {}
+        std::string code;
+        std::string typed;
+        std::string num;
+        std::string cond;
+        bool pure;
+    };
+
+    struct Pending {
+        Pending(const ASTNode *node, unsigned int children)
+            : node(node),
+              children(children),
+              scoped(false) {}
+        const ASTNode *node;
+        unsigned int children;
+        std::vector<Fragment> parts;
+        /* Assignments inside the node may not happen, so they are
+         * forgotten once it is rendered */
+        bool scoped;
+    };
+
+    void open(const ASTNode*, unsigned int);
+    Fragment render(const Pending&);
+    Fragment render_expression(const Expression*, const std::vector<Fragment>&);
+    void render_function(const DefStatement*, const Fragment&);
+
+    bool is_local(const std::string&) const;
+    bool is_global(const std::string&) const;
+    bool is_double(const std::string&) const;
+    const std::string global(const std::string&);
+    const std::string read(const std::string&, const std::string&, bool&);
+    const std::string assign(const std::string&, const std::string&);
+    const std::string constant(const std::string&);
+
+    const AST *ast_;
+    const TypeInference &types_;
+    std::map<std::string, const DefStatement*> functions_;
+    std::set<std::string> toplevel_writes_;
+    std::vector<Pending> pending_;
+
+    /* The top-level function being emitted, if any */
+    const DefStatement *def_;
+    std::set<std::string> locals_;
+    const FunctionTypes *def_types_;
+
+    /* Variables assigned on every path to the node being rendered, and
+     * what they were when each scoped node was opened */
+    std::set<std::string> assigned_;
+    std::vector<std::set<std::string> > scopes_;
+
+    std::set<std::string> globals_;
+    std::vector<std::string> constants_;
+    std::map<std::string, unsigned int> constant_ids_;
+    std::string prototypes_;
+    std::string definitions_;
+    std::string main_;
+    DISALLOW_COPY_AND_ASSIGN(CppEmitterVisitor);
+};
+
+#endif
@@ -0,0 +1,311 @@
+#include "dead_code_elimination.hpp"
+#include "ast_depth_first.hpp"
+#include "purity_analysis.hpp"
+#include "runtime.hpp"
+
+static void collect(const ASTNode*, std::vector<const ASTNode*>&);
+
+static void collect(const std::vector<const Expression*> &nodes, std::vector<const ASTNode*> &out) {
+    for (std::vector<const Expression*>::const_iterator it = nodes.begin(), end = nodes.end(); it != end; ++it)
+        collect(*it, out);
+}
+
+/* Every node of a subtree. Unlike a visitor, this doesn't parse a lazy
+ * function body to get at its nodes: there are none yet, and its text goes
+ * with the DefStatement. */
+static void collect(const ASTNode *node, std::vector<const ASTNode*> &out) {
+    if (!node)
+        return;
+    out.push_back(node);
+
+    switch (node->type()) {
+        case toy_ast: {
+            const std::vector<const Statement*> &nodes = dynamic_cast<const AST*>(node)->nodes();
+            for (std::vector<const Statement*>::const_iterator it = nodes.begin(), end = nodes.end(); it != end; ++it)
+                collect(*it, out);
+            break;
+        }
+        case toy_binary_op:
+            collect(dynamic_cast<const BinaryOpExpr*>(node)->left(), out);
+            collect(dynamic_cast<const BinaryOpExpr*>(node)->right(), out);
+            break;
+        case toy_assign:
+            collect(dynamic_cast<const AssignExpr*>(node)->rvalue(), out);
+            break;
+        case toy_function_call:
+            collect(dynamic_cast<const FuncCallExpr*>(node)->args(), out);
+            break;
+        case toy_array:
+            collect(dynamic_cast<const ArrayExpr*>(node)->elements(), out);
+            break;
+        case toy_index:
+            collect(dynamic_cast<const IndexExpr*>(node)->container(), out);
+            collect(dynamic_cast<const IndexExpr*>(node)->index(), out);
+            break;
+        case toy_map:
+            collect(dynamic_cast<const MapExpr*>(node)->keys(), out);
+            collect(dynamic_cast<const MapExpr*>(node)->values(), out);
+            break;
+        case toy_expression_statement:
+            collect(dynamic_cast<const ExpressionStatement*>(node)->expr(), out);
+            break;
+        case toy_if:
+            collect(dynamic_cast<const IfStatement*>(node)->cond(), out);
+            collect(dynamic_cast<const IfStatement*>(node)->true_block(), out);
+            collect(dynamic_cast<const IfStatement*>(node)->false_block(), out);
+            break;
+        case toy_while:
+            collect(dynamic_cast<const WhileStatement*>(node)->cond(), out);
+            collect(dynamic_cast<const WhileStatement*>(node)->block(), out);
+            break;
+        case toy_return:
+            collect(dynamic_cast<const ReturnStatement*>(node)->ret(), out);
+            break;
+        case toy_def:
+            if (dynamic_cast<const DefStatement*>(node)->parsed())
+                collect(dynamic_cast<const DefStatement*>(node)->block(), out);
+            break;
+        default:
+            break;
+    }
+}
+
+/* Sets `truthy` if the condition is a literal */
+static bool literal_condition(const Expression *cond, bool &truthy) {
+    if (cond->type() == toy_number) {
+        truthy = static_cast<const ValueExpr*>(cond)->number() != 0;
+        return true;
+    } else if (cond->type() == toy_string) {
+        truthy = !static_cast<const ValueExpr*>(cond)->string().empty();
+        return true;
+    }
+    return false;
+}
+
+static const std::set<std::string> callees(const ASTNode *node) {
+    EffectsVisitor effects;
+    ASTVisitorDepthFirst strategy;
+    node->accept(&strategy, &effects);
+    return effects.callees();
+}
+
+const AST *DeadCodeElimination::run() {
+    bool returns;
+    const AST *pruned = prune(ast_, true, returns);
+    const std::vector<const Statement*> &nodes = pruned->nodes();
+
+    /* Program binds the last definition of each name */
+    std::map<std::string, const DefStatement*> functions;
+    std::vector<std::string> worklist(keep_.begin(), keep_.end());
+    for (std::vector<const Statement*>::const_iterator it = nodes.begin(), end = nodes.end(); it != end; ++it) {
+        if ((*it)->type() == toy_def) {
+            const DefStatement *def = static_cast<const DefStatement*>(*it);
+            functions[def->name()] = def;
+        } else {
+            const std::set<std::string> called = callees(*it);
+            worklist.insert(worklist.end(), called.begin(), called.end());
+        }
+    }
+
+    std::set<std::string> reachable;
+    while (!worklist.empty()) {
+        const std::string name = worklist.back();
+        worklist.pop_back();
+
+        std::map<std::string, const DefStatement*>::const_iterator def = functions.find(name);
+        if (def == functions.end()) {
+            /* map(), pmap() and spawn() can call anything, by a computed name */
+            if (Runtime::calls_by_name(name)) {
+                for (def = functions.begin(); def != functions.end(); ++def)
+                    worklist.push_back(def->first);
+            }
+            continue;
+        }
+        if (!reachable.insert(name).second)
+            continue;
+
+        /* The pre-parser already knows what an unparsed body calls */
+        const std::set<std::string> called = def->second->parsed() ? callees(def->second->block()) : def->second->callees();
+        worklist.insert(worklist.end(), called.begin(), called.end());
+    }
+
+    std::vector<const Statement*> statements;
+    for (std::vector<const Statement*>::const_iterator it = nodes.begin(), end = nodes.end(); it != end; ++it) {
+        if ((*it)->type() == toy_def) {
+            const DefStatement *def = static_cast<const DefStatement*>(*it);
+            if (reachable.find(def->name()) == reachable.end() || functions[def->name()] != def) {
+                if (reachable.find(def->name()) == reachable.end())
+                    removed_functions_.insert(def->name());
+                drop(def);
+                continue;
+            }
+        }
+        statements.push_back(*it);
+    }
+
+    if (statements.size() == nodes.size())
+        return pruned;
+
+    if (pruned != ast_)
+        replaced_.push_back(pruned);
+    AST *ret = new AST(statements);
+    ret->set_line(ast_->line());
+    return ret;
+}
+
+/* Returns the block itself when nothing in it changed. At the top level,
+ * definitions are kept even after a return, since they are bound before
+ * anything runs. */
+const AST *DeadCodeElimination::prune(const AST *block, bool toplevel, bool &returns) {
+    std::vector<const Statement*> statements;
+    bool changed = false;
+    returns = false;
+
+    const std::vector<const Statement*> &nodes = block->nodes();
+    for (std::vector<const Statement*>::const_iterator it = nodes.begin(), end = nodes.end(); it != end; ++it) {
+        const Statement *statement = *it;
+
+        if (statement->type() == toy_def && !toplevel) {
+            drop(statement);
+            changed = true;
+            continue;
+        }
+        if (returns && statement->type() != toy_def) {
+            drop(statement);
+            changed = true;
+            continue;
+        }
+
+        bool truthy;
+        if (statement->type() == toy_if && literal_condition(static_cast<const IfStatement*>(statement)->cond(), truthy)) {
+            const IfStatement *node = static_cast<const IfStatement*>(statement);
+            const AST *taken = truthy ? node->true_block() : node->false_block();
+            const AST *skipped = truthy ? node->false_block() : node->true_block();
+
+            drop(node->cond());
+            if (skipped)
+                drop(skipped);
+            if (taken) {
+                /* Blocks don't introduce a scope, so the branch can be
+                 * spliced in as is */
+                bool taken_returns;
+                const AST *pruned = prune(taken, false, taken_returns);
+                statements.insert(statements.end(), pruned->nodes().begin(), pruned->nodes().end());
+                replaced_.push_back(pruned);
+                returns = taken_returns;
+            }
+            replaced_.push_back(node);
+            ++removed_statements_;
+            changed = true;
+            continue;
+        }
+
+        if (statement->type() == toy_while && literal_condition(static_cast<const WhileStatement*>(statement)->cond(), truthy) && !truthy) {
+            drop(statement);
+            changed = true;
+            continue;
+        }
+
+        bool statement_returns;
+        const Statement *pruned = prune(statement, statement_returns);
+        if (pruned != statement)
+            changed = true;
+        statements.push_back(pruned);
+        returns = statement_returns;
+    }
+
+    if (!changed)
+        return block;
+
+    if (block != ast_)
+        replaced_.push_back(block);
+    AST *ret = new AST(statements);
+    ret->set_line(block->line());
+    return ret;
+}
+
+/* Prunes the blocks of a statement. `returns` is set when it always ends
+ * in a return. */
+const Statement *DeadCodeElimination::prune(const Statement *statement, bool &returns) {
+    Statement *ret = 0;
+    returns = false;
+
+    switch (statement->type()) {
+        case toy_if: {
+            const IfStatement *node = static_cast<const IfStatement*>(statement);
+            bool true_returns, false_returns = false;
+            const AST *true_block = prune(node->true_block(), false, true_returns);
+            const AST *false_block = node->false_block() ? prune(node->false_block(), false, false_returns) : 0;
+
+            returns = true_returns && false_returns;
+            if (true_block != node->true_block() || false_block != node->false_block())
+                ret = new IfStatement(node->cond(), true_block, false_block);
+            break;
+        }
+        case toy_while: {
+            const WhileStatement *node = static_cast<const WhileStatement*>(statement);
+            bool block_returns;
+            const AST *block = prune(node->block(), false, block_returns);
+            if (block != node->block())
+                ret = new WhileStatement(node->cond(), block);
+            break;
+        }
+        case toy_def: {
+            const DefStatement *node = static_cast<const DefStatement*>(statement);
+            if (!node->parsed())
+                break;
+            bool block_returns;
+            const AST *block = prune(node->block(), false, block_returns);
+            if (block != node->block())
+                ret = new DefStatement(node->name(), node->params(), block);
+            break;
+        }
+        case toy_return:
+            returns = true;
+            break;
+        default:
+            break;
+    }
+
+    if (!ret)
+        return statement;
+
+    ret->set_line(statement->line());
+    replaced_.push_back(statement);
+    return ret;
+}
+
+void DeadCodeElimination::drop(const ASTNode *node) {
+    dropped_.push_back(node);
+    if (dynamic_cast<const Statement*>(node))
+        ++removed_statements_;
+}
+
+void DeadCodeElimination::release() {
+    for (std::vector<const ASTNode*>::const_iterator it = dropped_.begin(), end = dropped_.end(); it != end; ++it) {
+        std::vector<const ASTNode*> nodes;
+        collect(*it, nodes);
+        for (std::vector<const ASTNode*>::const_iterator node = nodes.begin(), nodes_end = nodes.end(); node != nodes_end; ++node)
+            delete *node;
+    }
+
+    for (std::vector<const ASTNode*>::const_iterator it = replaced_.begin(), end = replaced_.end(); it != end; ++it)
+        delete *it;
+
+    dropped_.clear();
+    replaced_.clear();
+}
+
+const Program *DeadCodeElimination::optimize(const Program *program, const std::set<std::string> &keep) {
+    DeadCodeElimination dce(program->ast());
+    dce.keep_ = keep;
+
+    const AST *ast = dce.run();
+    if (ast == program->ast())
+        return program;
+
+    const Program *ret = new Program(program->filename(), ast);
+    delete program;
+    dce.release();
+    return ret;
+}
@@ -0,0 +1,62 @@
+#ifndef _DEAD_CODE_ELIMINATION_HPP
+#define _DEAD_CODE_ELIMINATION_HPP
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include "ast.hpp"
+#include "program.hpp"
+#include "toy.hpp"
+
+/* Removes code that can never run from a whole program:
+ *
+ *  - functions that aren't reachable through calls from the top-level code,
+ *    or that are shadowed by a later definition of the same name; once
+ *    map(), pmap() or spawn() is reachable, every function is,
+ *  - statements after a return, and definitions nested in blocks, which
+ *    are never bound,
+ *  - if and while statements whose condition is a literal; a taken branch
+ *    is spliced into the enclosing block.
+ *
+ * The pruned AST shares every unchanged subtree with the original.
+ */
+class DeadCodeElimination {
+  public:
+    explicit DeadCodeElimination(const AST *ast)
+        : ast_(ast),
+          removed_statements_(0) {}
+
+    /* Functions to keep even if nothing calls them, e.g. entry points for
+     * Interpreter::call(). */
+    inline void keep(const std::string &funcname) { keep_.insert(funcname); }
+
+    /* Returns the original AST when there is nothing to remove */
+    const AST *run();
+
+    /* Frees the nodes dropped by run(). The original AST must not be used
+     * afterwards, except to delete its root. */
+    void release();
+
+    inline const std::set<std::string> &removed_functions() const { return removed_functions_; }
+    inline unsigned int removed_statements() const { return removed_statements_; }
+
+    /* Replaces a program by its pruned version, freeing the dropped code */
+    static const Program *optimize(const Program*, const std::set<std::string> &keep = std::set<std::string>());
+  private:
+    const AST *prune(const AST*, bool, bool&);
+    const Statement *prune(const Statement*, bool&);
+    void drop(const ASTNode*);
+
+    const AST *ast_;
+    std::set<std::string> keep_;
+    std::set<std::string> removed_functions_;
+    unsigned int removed_statements_;
+
+    /* Whole subtrees, and nodes whose children live on in the new AST */
+    std::vector<const ASTNode*> dropped_;
+    std::vector<const ASTNode*> replaced_;
+    DISALLOW_COPY_AND_ASSIGN(DeadCodeElimination);
+};
+
+#endif
@@ -14,3 +14,9 @@ UnexpectedToken::UnexpectedToken(const std::string &where, const Token *token) {
     ss << "Unexpected token in " << where << "(): '" << token->name() << "'";
     message_ = ss.str();
 }
+
+ExpectedToken::ExpectedToken(const std::string &expected, const Token *token) {
+    std::ostringstream ss;
+    ss << "I was expecting " << expected << " but got " << token->name();
+    message_ = ss.str();
+}
@@ -24,4 +24,37 @@ class UnexpectedToken : public SyntaxError {
         UnexpectedToken(const std::string&, const Token*);
 };
 
+class ExpectedToken : public SyntaxError {
+    public:
+        ExpectedToken(const std::string&, const Token*);
+};
+
+class SnapshotError {
+    public:
+        explicit SnapshotError(const std::string &message) : message_(message) {}
+        inline const std::string &message() const { return message_; }
+    protected:
+        std::string message_;
+};
+
+class RuntimeError {
+    public:
+        RuntimeError(const std::string &message, unsigned int line)
+            : message_(message),
+              line_(line) {}
+        inline const std::string &message() const { return message_; }
+        inline unsigned int line() const { return line_; }
+    protected:
+        std::string message_;
+        unsigned int line_;
+};
+
+/* A script ran out of one of the Interpreter's Limits. The interpreter is
+ * left in a consistent state and can be used again. */
+class LimitExceeded : public RuntimeError {
+    public:
+        LimitExceeded(const std::string &message, unsigned int line)
+            : RuntimeError(message, line) {}
+};
+
 #endif
@@ -0,0 +1,28 @@
+#include "frame_layout.hpp"
+#include <set>
+#include "ast_depth_first.hpp"
+#include "purity_analysis.hpp"
+
+FrameLayout::FrameLayout(const DefStatement *def)
+    : params_(def->params().size()) {
+    EffectsVisitor effects;
+    ASTVisitorDepthFirst strategy;
+    def->block()->accept(&strategy, &effects);
+
+    const std::vector<std::string> &params = def->params();
+    for (std::vector<std::string>::const_iterator it = params.begin(), end = params.end(); it != end; ++it) {
+        slots_[*it] = names_.size();
+        names_.push_back(*it);
+    }
+    for (std::set<std::string>::const_iterator it = effects.writes().begin(), end = effects.writes().end(); it != end; ++it) {
+        if (slots_.find(*it) == slots_.end()) {
+            slots_[*it] = names_.size();
+            names_.push_back(*it);
+        }
+    }
+}
+
+unsigned int FrameLayout::slot(const std::string &name) const {
+    std::map<std::string, unsigned int>::const_iterator it = slots_.find(name);
+    return it == slots_.end() ? no_slot : it->second;
+}
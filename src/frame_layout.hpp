@@ -0,0 +1,33 @@
+#ifndef _FRAME_LAYOUT_HPP
+#define _FRAME_LAYOUT_HPP
+
+#include <map>
+#include <string>
+#include <vector>
+#include "ast.hpp"
+#include "toy.hpp"
+
+/* The slots of a function's frame: its parameters, in order, then every
+ * other name the body assigns to. A call reserves that many Values on the
+ * Interpreter's stack. Read-only once built. */
+class FrameLayout {
+  public:
+    /* Throws SyntaxError from a lazily parsed body */
+    explicit FrameLayout(const DefStatement*);
+
+    static const unsigned int no_slot = ~0u;
+
+    /* no_slot if the name isn't local */
+    unsigned int slot(const std::string&) const;
+
+    inline const std::vector<std::string> &names() const { return names_; }
+    inline unsigned int size() const { return names_.size(); }
+    inline unsigned int params() const { return params_; }
+  private:
+    std::vector<std::string> names_;
+    std::map<std::string, unsigned int> slots_;
+    unsigned int params_;
+    DISALLOW_COPY_AND_ASSIGN(FrameLayout);
+};
+
+#endif
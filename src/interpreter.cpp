@@ -0,0 +1,1154 @@
+#include "interpreter.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <pthread.h>
+#include <set>
+#include <sstream>
+#include <utility>
+#include "exceptions.hpp"
+#include "purity_analysis.hpp"
+#include "runtime.hpp"
+#include "type_inference.hpp"
+
+/* Safepoints between looking at the clock and the memory estimate */
+static const unsigned long check_interval = 4096;
+
+/* Native stack kept free below the deepest call */
+static const ptrdiff_t native_reserve = 256 * 1024;
+
+/* What the calling thread may use of its native stack */
+static ptrdiff_t native_stack_size() {
+    size_t size = 0;
+    pthread_attr_t attr;
+    if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+        pthread_attr_getstacksize(&attr, &size);
+        pthread_attr_destroy(&attr);
+    }
+    if (size == 0)
+        size = 1024 * 1024;
+    return (ptrdiff_t)size > 2 * native_reserve ? size - native_reserve : size / 2;
+}
+
+/* The pool pmap() and spawn() run calls on, shared by every Interpreter */
+static ThreadPool &parallel_pool() {
+    static ThreadPool pool;
+    return pool;
+}
+
+/* A call started by spawn(), on a worker of its own */
+struct Interpreter::Task {
+    explicit Task(const Program &program)
+        : batch(1),
+          worker(program, out) {}
+    ThreadPool::Batch batch;
+    std::ostringstream out;
+    Interpreter worker;
+    Value result;
+};
+
+Interpreter::~Interpreter() {
+    /* Tasks nobody joined still use the program */
+    for (std::map<unsigned long, std::shared_ptr<Task> >::iterator it = tasks_.begin(), end = tasks_.end(); it != end; ++it) {
+        try {
+            parallel_pool().join(it->second->batch);
+        } catch (...) {
+        }
+    }
+
+    /* Lets queued compilations finish first */
+    delete compiler_;
+
+    for (std::unordered_map<const ASTNode*, TierState>::iterator it = tiers_.begin(), end = tiers_.end(); it != end; ++it) {
+        delete it->second.compiled.load();
+        delete it->second.layout;
+    }
+}
+
+void Interpreter::run() {
+    if (tiering_.eager && tiering_.threshold > 0)
+        precompile();
+
+    start();
+    Value ret;
+    try {
+        exec(program_.ast(), 0, ret);
+    } catch (...) {
+        finish();
+        throw;
+    }
+    finish();
+}
+
+Value Interpreter::call(const std::string &funcname, const std::vector<Value> &args) {
+    start();
+    const DefStatement *def = program_.function(funcname);
+    Value ret;
+    try {
+        if (def) {
+            stack_.assign(args.begin(), args.end());
+            ret = call(def, 0, def->line());
+        } else {
+            ret = builtin(funcname, args, 0);
+        }
+    } catch (...) {
+        finish();
+        throw;
+    }
+    finish();
+    return ret;
+}
+
+Value Interpreter::global(const std::string &name) const {
+    Scope::const_iterator it = globals_.find(name);
+    return it == globals_.end() ? Value() : it->second;
+}
+
+/* The returned reference is only good until the stack grows */
+const Value &Interpreter::lookup(const std::string &name, const Frame *frame, unsigned int line) const {
+    if (frame) {
+        unsigned int slot = frame->layout->slot(name);
+        if (slot != FrameLayout::no_slot && assigned_[frame->base + slot])
+            return stack_[frame->base + slot];
+    }
+
+    Scope::const_iterator it = globals_.find(name);
+    if (it != globals_.end())
+        return it->second;
+
+    throw RuntimeError("Undefined variable '" + name + "'", line);
+}
+
+void Interpreter::assign(const std::string &name, const Value &value, const Frame *frame) {
+    unsigned int slot = frame ? frame->layout->slot(name) : FrameLayout::no_slot;
+    if (slot != FrameLayout::no_slot && globals_.find(name) == globals_.end()) {
+        stack_[frame->base + slot] = value;
+        assigned_[frame->base + slot] = 1;
+    } else {
+        globals_[name] = value;
+    }
+}
+
+/* Statements; these return true when a return statement was executed */
+
+bool Interpreter::exec(const AST *block, const Frame *frame, Value &ret) {
+    const std::vector<const Statement*> &nodes = block->nodes();
+    for (std::vector<const Statement*>::const_iterator it = nodes.begin(), end = nodes.end(); it != end; ++it) {
+        if (exec(*it, frame, ret))
+            return true;
+    }
+    return false;
+}
+
+bool Interpreter::exec(const Statement *statement, const Frame *frame, Value &ret) {
+    sample_.line = statement->line();
+    switch (statement->type()) {
+        case toy_expression_statement:
+            eval(static_cast<const ExpressionStatement*>(statement)->expr(), frame);
+            return false;
+        case toy_if: {
+            const IfStatement *node = static_cast<const IfStatement*>(statement);
+            if (eval(node->cond(), frame).truthy())
+                return exec(node->true_block(), frame, ret);
+            if (node->false_block())
+                return exec(node->false_block(), frame, ret);
+            return false;
+        }
+        case toy_while: {
+            const WhileStatement *node = static_cast<const WhileStatement*>(statement);
+            const FrameLayout *layout = frame ? frame->layout : 0;
+            TierState &state = tiers_[node];
+            const CompiledCode *code = hot_code(node, state, layout);
+            if (code)
+                return execute_compiled(*code, frame, ret);
+
+            while (eval(node->cond(), frame).truthy()) {
+                if (exec(node->block(), frame, ret))
+                    return true;
+                safepoint(node->line());
+
+                /* On-stack replacement: the bytecode picks up at the
+                 * condition, on the same frame */
+                if ((code = hot_code(node, state, layout))) {
+                    ++tier_stats_.osr_entries;
+                    return execute_compiled(*code, frame, ret);
+                }
+            }
+            return false;
+        }
+        case toy_return:
+            ret = eval(static_cast<const ReturnStatement*>(statement)->ret(), frame);
+            return true;
+        case toy_def:
+        case toy_import:
+            /* Functions and modules are bound by Program at compile time */
+            return false;
+        default:
+            throw RuntimeError("Unknown statement", statement->line());
+    }
+}
+
+/* Expressions */
+
+Value Interpreter::eval(const Expression *expr, const Frame *frame) {
+    switch (expr->type()) {
+        case toy_number:
+            return Value(static_cast<const ValueExpr*>(expr)->number());
+        case toy_string:
+            return Value(static_cast<const ValueExpr*>(expr)->string());
+        case toy_variable:
+            return lookup(static_cast<const VariableExpr*>(expr)->varname(), frame, expr->line());
+        case toy_binary_op: {
+            const BinaryOpExpr *node = static_cast<const BinaryOpExpr*>(expr);
+            Value left = eval(node->left(), frame);
+            Value ret = Runtime::binary_op(node->op_type(), left, eval(node->right(), frame), node->line());
+
+            /* Concatenation can double a string per operator, which is too
+             * fast for the periodic estimate to catch */
+            if (limits_.memory > 0 && ret.string().size() > limits_.memory)
+                throw LimitExceeded("Memory limit exceeded", node->line());
+            return ret;
+        }
+        case toy_assign: {
+            const AssignExpr *node = static_cast<const AssignExpr*>(expr);
+            Value value = eval(node->rvalue(), frame);
+            assign(node->lvalue(), value, frame);
+            return value;
+        }
+        case toy_function_call:
+            return eval_call(static_cast<const FuncCallExpr*>(expr), frame);
+        case toy_array: {
+            const std::vector<const Expression*> &elements = static_cast<const ArrayExpr*>(expr)->elements();
+            Value::Array array;
+            array.reserve(elements.size());
+            for (std::vector<const Expression*>::const_iterator it = elements.begin(), end = elements.end(); it != end; ++it)
+                array.push_back(eval(*it, frame));
+            return Value::new_array(array);
+        }
+        case toy_index: {
+            const IndexExpr *node = static_cast<const IndexExpr*>(expr);
+            Value container = eval(node->container(), frame);
+            return Runtime::index(container, eval(node->index(), frame), node->line());
+        }
+        case toy_map: {
+            const MapExpr *node = static_cast<const MapExpr*>(expr);
+            Value map = Value::new_map();
+            for (std::vector<const Expression*>::size_type i = 0; i < node->keys().size(); ++i) {
+                Value key = eval(node->keys()[i], frame);
+                map.map()[key] = eval(node->values()[i], frame);
+            }
+            return map;
+        }
+        default:
+            throw RuntimeError("Unknown expression", expr->line());
+    }
+}
+
+Value Interpreter::eval_call(const FuncCallExpr *node, const Frame *frame) {
+    const std::vector<const Expression*> &arg_exprs = node->args();
+    const DefStatement *def = program_.function(node->funcname());
+
+    if (!def) {
+        std::vector<Value> args;
+        args.reserve(arg_exprs.size());
+        for (std::vector<const Expression*>::const_iterator it = arg_exprs.begin(), end = arg_exprs.end(); it != end; ++it)
+            args.push_back(eval(*it, frame));
+        return builtin(node->funcname(), args, node->line());
+    }
+
+    /* Straight into the callee's frame */
+    Stack::size_type base = stack_.size();
+    for (std::vector<const Expression*>::const_iterator it = arg_exprs.begin(), end = arg_exprs.end(); it != end; ++it) {
+        Value arg = eval(*it, frame);
+        stack_.push_back(std::move(arg));
+    }
+    return call(def, base, node->line());
+}
+
+/* Calls def with the arguments on the stack from base up. Its frame is
+ * the window from base, sized by its layout; the stack is back at base on
+ * return. */
+Value Interpreter::call(const DefStatement *def, Stack::size_type base, unsigned int line) {
+    const Stack::size_type argc = stack_.size() - base;
+    if (def->params().size() != argc) {
+        std::ostringstream ss;
+        ss << def->name() << "() takes " << def->params().size() << " arguments but got " << argc;
+        throw RuntimeError(ss.str(), line);
+    }
+
+    safepoint(def->line());
+
+    /* Taken before the call, which can assign its parameters */
+    MemoKey key;
+    key.def = !memoized_.empty() && memoized_.find(def) != memoized_.end() ? def : 0;
+    if (key.def) {
+        key.args.assign(stack_.begin() + base, stack_.end());
+        std::map<MemoKey, MemoEntry>::iterator memo = memo_.find(key);
+        if (memo != memo_.end()) {
+            ++memo_stats_.hits;
+            memo_order_.splice(memo_order_.begin(), memo_order_, memo->second.used);
+            stack_.resize(base);
+            return memo->second.result;
+        }
+        ++memo_stats_.misses;
+    }
+
+    TierState &state = tiers_[def];
+    if (!state.layout)
+        state.layout = new FrameLayout(def);
+    const Frame frame(state.layout, base);
+    const CompiledCode *code = hot_code(def, state, state.layout);
+    push_frame(frame, code ? code->temps() : 0, line);
+    enter(def);
+
+    Value ret;
+    if (code) {
+        execute_compiled(*code, &frame, ret);
+    } else {
+        const Tier previous = tier_;
+        switch_tier(tier_interpreted);
+        exec(def->block(), &frame, ret);
+        switch_tier(previous);
+    }
+
+    leave(line);
+    if (key.def)
+        memoize(key, ret);
+
+    stack_.resize(base);
+    return ret;
+}
+
+Value Interpreter::builtin(const std::string &funcname, const std::vector<Value> &args, unsigned int line) {
+    if (funcname == "map")
+        return map(args, line);
+    if (funcname == "pmap")
+        return pmap(args, line);
+    if (funcname == "spawn")
+        return spawn(args, line);
+    if (funcname == "join")
+        return join(args, line);
+    if (Io::is_builtin(funcname)) {
+        /* Waiting counts towards the time limit too */
+        IoWaiter::Clock::time_point deadline = IoWaiter::Clock::time_point::max();
+        if (limits_.seconds > 0 && limits_.seconds < 1e9)
+            deadline = started_ + std::chrono::duration_cast<IoWaiter::Clock::duration>(std::chrono::duration<double>(limits_.seconds));
+        return Io::builtin(funcname, args, *io_, line, deadline);
+    }
+    return Runtime::builtin(funcname, args, out_, line);
+}
+
+Value Interpreter::map(const std::vector<Value> &args, unsigned int line) {
+    if (args.size() != 2 || !args[0].is_string() || (!args[1].is_array() && !args[1].is_numbers()))
+        throw RuntimeError("map() takes a function name and an array or numbers", line);
+    const std::string &funcname = args[0].string();
+    const DefStatement *def = program_.function(funcname);
+    /* Like pmap(), builtins too */
+    auto apply = [this, def, &funcname, line](const Value &arg) {
+        if (!def)
+            return builtin(funcname, std::vector<Value>(1, arg), line);
+        stack_.push_back(arg);
+        return call(def, stack_.size() - 1, def->line());
+    };
+
+    if (args[1].is_array()) {
+        Value::Array ret;
+        const Value::Array &in = args[1].array();
+        ret.reserve(in.size());
+        for (Value::Array::const_iterator it = in.begin(), end = in.end(); it != end; ++it)
+            ret.push_back(apply(*it));
+        return Value::new_array(ret);
+    }
+
+    Value::Numbers ret;
+    const Value::Numbers &in = args[1].numbers();
+    ret.reserve(in.size());
+    for (Value::Numbers::const_iterator it = in.begin(), end = in.end(); it != end; ++it) {
+        Value result = apply(Value(*it));
+        if (!result.is_number())
+            throw RuntimeError("map() over numbers got a " + Value::value_type_name(result.type()) + " from " + funcname + "()", line);
+        ret.push_back(result.number());
+    }
+    return Value::new_numbers(ret);
+}
+
+/* Parallel builtins */
+
+void Interpreter::init_worker(Interpreter &worker) const {
+    worker.set_globals(globals_);
+
+    Limits limits = limits_;
+    if (limits.seconds > 0) {
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - started_;
+        limits.seconds = std::max(limits.seconds - elapsed.count(), 1e-9);
+    }
+    worker.set_limits(limits);
+
+    /* Workers are short-lived; they compile on their own thread, and only
+     * what gets hot */
+    Tiering tiering = tiering_;
+    tiering.background = false;
+    tiering.eager = false;
+    worker.set_tiering(tiering);
+
+    /* Same program and globals, same pure functions and types */
+    worker.numeric_params_ = numeric_params_;
+    worker.types_analyzed_ = types_analyzed_;
+    worker.memoization_ = memoization_;
+    worker.memoized_ = memoized_;
+    worker.memo_analyzed_ = memo_analyzed_;
+    worker.memo_globals_ = memo_globals_;
+}
+
+Value Interpreter::pmap(const std::vector<Value> &args, unsigned int line) {
+    if (args.size() != 2 || !args[0].is_string() || !args[1].is_array())
+        throw RuntimeError("pmap() takes a function name and an array", line);
+    const std::string &funcname = args[0].string();
+    const Value::Array &in = args[1].array();
+
+    /* A few runs of elements per thread, each on one worker, so the
+     * function can get hot within a run */
+    ThreadPool &pool = parallel_pool();
+    const size_t run_size = std::max<size_t>(1, in.size() / ((pool.size() + 1) * 4));
+    std::vector<std::pair<size_t, size_t> > runs;
+    for (size_t begin = 0; begin < in.size(); begin += run_size)
+        runs.push_back(std::make_pair(begin, std::min(begin + run_size, in.size())));
+
+    struct Run {
+        std::vector<Value> results;
+        std::string out;
+        std::exception_ptr error;
+    };
+    std::vector<Run> done;
+    pool.parallel_map(runs, done, [this, &in, &funcname](const std::pair<size_t, size_t> &run) {
+        Run ret;
+        std::ostringstream out;
+        try {
+            Interpreter worker(program_, out);
+            init_worker(worker);
+            for (size_t i = run.first; i < run.second; ++i) {
+                /* No call sees what another one assigned */
+                if (i > run.first)
+                    worker.set_globals(globals_);
+                ret.results.push_back(worker.call(funcname, std::vector<Value>(1, in[i])));
+            }
+        } catch (...) {
+            ret.error = std::current_exception();
+        }
+        ret.out = out.str();
+        return ret;
+    });
+
+    Value ret = Value::new_array(Value::Array());
+    for (std::vector<Run>::const_iterator it = done.begin(), end = done.end(); it != end; ++it) {
+        out_ << it->out;
+        if (it->error)
+            std::rethrow_exception(it->error);
+        ret.array().insert(ret.array().end(), it->results.begin(), it->results.end());
+    }
+    return ret;
+}
+
+Value Interpreter::spawn(const std::vector<Value> &args, unsigned int line) {
+    if (args.empty() || !args[0].is_string())
+        throw RuntimeError("spawn() takes a function name and its arguments", line);
+    const std::string funcname = args[0].string();
+    const std::vector<Value> call_args(args.begin() + 1, args.end());
+
+    std::shared_ptr<Task> task(new Task(program_));
+    init_worker(task->worker);
+    parallel_pool().submit([task, funcname, call_args]() {
+        std::exception_ptr error;
+        try {
+            task->result = task->worker.call(funcname, call_args);
+        } catch (...) {
+            error = std::current_exception();
+        }
+        task->batch.finish(error);
+    });
+
+    tasks_[++next_task_] = task;
+    return Value((double)next_task_);
+}
+
+Value Interpreter::join(const std::vector<Value> &args, unsigned int line) {
+    std::map<unsigned long, std::shared_ptr<Task> >::iterator it = tasks_.end();
+    if (args.size() == 1 && args[0].is_number() && args[0].number() >= 1)
+        it = tasks_.find((unsigned long)args[0].number());
+    if (it == tasks_.end())
+        throw RuntimeError("join() takes a task from spawn(), once", line);
+
+    std::shared_ptr<Task> task = it->second;
+    tasks_.erase(it);
+    try {
+        parallel_pool().join(task->batch);
+    } catch (...) {
+        out_ << task->out.str();
+        throw;
+    }
+    out_ << task->out.str();
+    return task->result;
+}
+
+/* Memoization */
+
+bool Interpreter::MemoKey::operator<(const MemoKey &other) const {
+    if (def != other.def)
+        return std::less<const DefStatement*>()(def, other.def);
+
+    /* Calls to one function have as many arguments */
+    for (std::vector<Value>::size_type i = 0; i < args.size(); ++i) {
+        const Value &a = args[i], &b = other.args[i];
+        if (a.is_number() && b.is_number()) {
+            /* Tells 0 from -0, and orders NaNs */
+            uint64_t a_bits, b_bits;
+            const double a_number = a.number(), b_number = b.number();
+            memcpy(&a_bits, &a_number, sizeof(a_bits));
+            memcpy(&b_bits, &b_number, sizeof(b_bits));
+            if (a_bits != b_bits)
+                return a_bits < b_bits;
+        } else if (a < b) {
+            return true;
+        } else if (b < a) {
+            return false;
+        }
+    }
+    return false;
+}
+
+void Interpreter::set_memoization(const Memoization &memoization) {
+    memoization_ = memoization;
+    memoized_.clear();
+    memo_analyzed_ = false;
+    memo_.clear();
+    memo_order_.clear();
+}
+
+/* Finds the functions to memoize. Purity depends on which names are
+ * globals, so this is redone once one appears that the last analysis
+ * didn't know, e.g. set by the host. */
+void Interpreter::analyze_purity() {
+    if (memoization_.capacity == 0)
+        return;
+    if (memo_analyzed_) {
+        bool known = true;
+        for (Scope::const_iterator it = globals_.begin(), end = globals_.end(); known && it != end; ++it)
+            known = memo_globals_.find(it->first) != memo_globals_.end();
+        if (known)
+            return;
+    }
+
+    memoized_.clear();
+    memo_.clear();
+    memo_order_.clear();
+    memo_analyzed_ = true;
+
+    PurityAnalysis purity(program_.ast());
+    for (std::set<std::string>::const_iterator it = memoization_.excluded.begin(), end = memoization_.excluded.end(); it != end; ++it)
+        purity.exclude(*it);
+    for (Scope::const_iterator it = globals_.begin(), end = globals_.end(); it != end; ++it)
+        purity.assume_global(it->first);
+    try {
+        purity.run();
+    } catch (SyntaxError&) {
+        /* A body that doesn't parse fails when it's called, not here;
+         * nothing is memoized until the globals change */
+        memo_globals_.clear();
+        for (Scope::const_iterator it = globals_.begin(), end = globals_.end(); it != end; ++it)
+            memo_globals_.insert(it->first);
+        return;
+    }
+
+    memo_globals_ = purity.globals();
+    for (std::set<std::string>::const_iterator it = purity.pure_functions().begin(), end = purity.pure_functions().end(); it != end; ++it)
+        memoized_.insert(program_.function(*it));
+}
+
+void Interpreter::memoize(const MemoKey &key, const Value &result) {
+    /* Every call makes a new array, map or numbers, which compare by
+     * identity; handing out the same one would show */
+    if (result.is_array() || result.is_map() || result.is_numbers())
+        return;
+
+    std::pair<std::map<MemoKey, MemoEntry>::iterator, bool> inserted = memo_.insert(std::make_pair(key, MemoEntry()));
+    if (!inserted.second)
+        return;
+    inserted.first->second.result = result;
+    memo_order_.push_front(&inserted.first->first);
+    inserted.first->second.used = memo_order_.begin();
+
+    if (memo_.size() > memoization_.capacity) {
+        memo_.erase(*memo_order_.back());
+        memo_order_.pop_back();
+        ++memo_stats_.evictions;
+    }
+}
+
+void Interpreter::push_frame(const Frame &frame, unsigned int temps, unsigned int line) {
+    const Stack::size_type top = frame.base + frame.layout->size() + temps;
+    if (limits_.stack > 0 && top > limits_.stack)
+        throw LimitExceeded("Stack overflow", line);
+
+    /* The interpreter itself recurses on the native stack */
+    const char *here = static_cast<const char*>(__builtin_frame_address(0));
+    if (native_base_ - here > native_size_)
+        throw LimitExceeded("Stack overflow", line);
+
+    const Stack::size_type argc = stack_.size() - frame.base;
+    stack_.resize(top);
+    assigned_.resize(top);
+    std::fill(assigned_.begin() + frame.base, assigned_.begin() + frame.base + argc, 1);
+    std::fill(assigned_.begin() + frame.base + argc, assigned_.end(), 0);
+}
+
+/* Tiering */
+
+/* Counts a call or an iteration, and returns the node's bytecode once it
+ * can be used */
+const CompiledCode *Interpreter::hot_code(const ASTNode *node, TierState &state, const FrameLayout *layout) {
+    if (tiering_.threshold == 0)
+        return 0;
+
+    if (state.code) {
+        if (globals_.size() == state.globals_seen)
+            return state.code;
+        if (installable(state.code)) {
+            state.globals_seen = globals_.size();
+            return state.code;
+        }
+
+        state.code = 0;
+        state.failed = true;
+        ++tier_stats_.deoptimizations;
+        return 0;
+    }
+
+    if (state.failed)
+        return 0;
+    if (!state.queued) {
+        if (++state.count < tiering_.threshold)
+            return 0;
+        queue_compile(node, state, layout);
+    }
+
+    CompiledCode *compiled = state.compiled.load(std::memory_order_acquire);
+    if (!compiled)
+        return 0;
+
+    ++tier_stats_.compilations;
+    tier_stats_.compile_seconds += compiled->compile_seconds();
+    if (!installable(compiled)) {
+        state.failed = true;
+        return 0;
+    }
+
+    state.code = compiled;
+    state.globals_seen = globals_.size();
+    return compiled;
+}
+
+static CompiledCode *compile_node(const ASTNode *node, const FrameLayout *layout, const Program &program, const std::vector<bool> &numbers) {
+    if (const DefStatement *def = dynamic_cast<const DefStatement*>(node))
+        return CompiledCode::compile(def, *layout, program, numbers);
+    return CompiledCode::compile(dynamic_cast<const WhileStatement*>(node), layout, program);
+}
+
+/* Finds the parameters to specialize functions for, once: those that
+ * TypeInference sees only numbers passed to. Calls from elsewhere, like
+ * the host or pmap(), are left to the guards. A body that doesn't parse
+ * leaves nothing specialized. */
+void Interpreter::analyze_types() {
+    if (types_analyzed_ || !tiering_.specialize)
+        return;
+    types_analyzed_ = true;
+
+    TypeInference types(program_.ast());
+    try {
+        types.run();
+    } catch (SyntaxError&) {
+        return;
+    }
+
+    const std::map<std::string, const DefStatement*> &functions = program_.functions();
+    for (std::map<std::string, const DefStatement*>::const_iterator it = functions.begin(), end = functions.end(); it != end; ++it) {
+        const FunctionTypes *function = types.function(it->first);
+        if (!function || function->def() != it->second)
+            continue;
+        const std::vector<TypeSet> &params = function->params();
+        std::vector<bool> numbers;
+        for (std::vector<TypeSet>::const_iterator param = params.begin(); param != params.end(); ++param)
+            numbers.push_back(*param == type_number);
+        if (std::find(numbers.begin(), numbers.end(), true) != numbers.end())
+            numeric_params_[it->second] = numbers;
+    }
+}
+
+const std::vector<bool> &Interpreter::numeric_params(const DefStatement *def) const {
+    static const std::vector<bool> none;
+    std::unordered_map<const DefStatement*, std::vector<bool> >::const_iterator it = numeric_params_.find(def);
+    return it != numeric_params_.end() ? it->second : none;
+}
+
+/* Functions don't depend on each other until they run, so each is laid out
+ * and compiled on its own task. The results are handed over in the order
+ * of the function names, as if compiled one after the other; one that
+ * doesn't parse is left for its first call to report. */
+void Interpreter::precompile() {
+    std::vector<const DefStatement*> defs;
+    const std::map<std::string, const DefStatement*> &functions = program_.functions();
+    for (std::map<std::string, const DefStatement*>::const_iterator it = functions.begin(), end = functions.end(); it != end; ++it) {
+        if (!tiers_[it->second].queued)
+            defs.push_back(it->second);
+    }
+
+    analyze_types();
+    const Program &program = program_;
+    std::vector<std::pair<FrameLayout*, CompiledCode*> > compiled;
+    ThreadPool pool;
+    pool.parallel_map(defs, compiled, [this, &program](const DefStatement *def) {
+        FrameLayout *layout = 0;
+        try {
+            layout = new FrameLayout(def);
+            return std::make_pair(layout, CompiledCode::compile(def, *layout, program, numeric_params(def)));
+        } catch (SyntaxError&) {
+            delete layout;
+            return std::make_pair(static_cast<FrameLayout*>(0), static_cast<CompiledCode*>(0));
+        }
+    });
+
+    for (std::vector<const DefStatement*>::size_type i = 0; i < defs.size(); ++i) {
+        if (!compiled[i].second)
+            continue;
+        TierState &state = tiers_[defs[i]];
+        state.layout = compiled[i].first;
+        state.compiled.store(compiled[i].second);
+        state.queued = true;
+    }
+}
+
+void Interpreter::queue_compile(const ASTNode *node, TierState &state, const FrameLayout *layout) {
+    state.queued = true;
+
+    const DefStatement *def = dynamic_cast<const DefStatement*>(node);
+    if (def)
+        analyze_types();
+    const std::vector<bool> numbers = def ? numeric_params(def) : std::vector<bool>();
+
+    if (!tiering_.background) {
+        state.compiled.store(compile_node(node, layout, program_, numbers));
+        return;
+    }
+
+    if (!compiler_)
+        compiler_ = new ThreadPool(1);
+
+    /* The Program and the layouts are immutable and a TierState never
+     * moves, so the task only shares the result slot with this thread */
+    std::atomic<CompiledCode*> *slot = &state.compiled;
+    const Program *program = &program_;
+    compiler_->submit([node, layout, slot, program, numbers]() {
+        try {
+            slot->store(compile_node(node, layout, *program, numbers), std::memory_order_release);
+        } catch (SyntaxError&) {
+            /* The AST walk reports it */
+        }
+    });
+}
+
+/* Slots stand in for locals, which only works while none of them is
+ * shadowed by a global */
+bool Interpreter::installable(const CompiledCode *code) const {
+    const std::vector<std::string> &writes = code->writes();
+    for (std::vector<std::string>::const_iterator it = writes.begin(), end = writes.end(); it != end; ++it) {
+        if (globals_.find(*it) != globals_.end())
+            return false;
+    }
+    return true;
+}
+
+/* Accounts the time since the last switch to the tier being left */
+void Interpreter::switch_tier(Tier tier) {
+    if (tier == tier_)
+        return;
+
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    std::chrono::duration<double> elapsed = now - tier_started_;
+    if (tier_ == tier_interpreted)
+        tier_stats_.interpreted_seconds += elapsed.count();
+    else
+        tier_stats_.compiled_seconds += elapsed.count();
+
+    tier_ = tier;
+    tier_started_ = now;
+}
+
+bool Interpreter::execute_compiled(const CompiledCode &code, const Frame *frame, Value &ret) {
+    const Tier previous = tier_;
+    switch_tier(tier_compiled);
+    bool returned = execute(code, frame, ret);
+    switch_tier(previous);
+    return returned;
+}
+
+/* Bytecode dispatch. Built with DISPATCH=threaded (the default, where the
+ * compiler has computed goto), each handler ends in a jump of its own
+ * through a table of label addresses straight to the next one, so the
+ * branch predictor sees as many indirect branches as there are opcodes;
+ * otherwise all of them go back through one switch. */
+#if defined(TOY_THREADED_DISPATCH) && defined(__GNUC__)
+#define THREADED_DISPATCH
+#define CASE(op) do_##op:
+#define NEXT() do { FETCH(); goto *labels[instruction->op]; } while (0)
+#else
+#define CASE(op) case op:
+#define NEXT() break
+#endif
+
+#ifdef TOY_PROFILE_OPCODES
+#define FETCH() (instruction = pc++, OpcodeProfile::count(previous, instruction->op), previous = instruction->op)
+#else
+#define FETCH() (instruction = pc++)
+#endif
+
+/* Label addresses are an extension */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+
+/* Runs bytecode; returns true when a return statement was executed. The
+ * operand stack starts above the frame. */
+bool Interpreter::execute(const CompiledCode &code, const Frame *frame, Value &ret) {
+    const std::vector<Instruction> &instructions = code.code();
+    const Instruction *pc = &instructions[0];
+    std::vector<Value> &stack = stack_;
+    const Stack::size_type base = stack.size();
+    const Stack::size_type slots = frame ? frame->base : 0;
+
+    const Instruction *instruction;
+#ifdef TOY_PROFILE_OPCODES
+    unsigned int previous = opcode_count;
+#endif
+#ifdef THREADED_DISPATCH
+    /* In the order of Opcode */
+    static const void *const labels[] = {
+        &&do_op_constant, &&do_op_pop, &&do_op_load_slot, &&do_op_store_slot,
+        &&do_op_load_name, &&do_op_store_name, &&do_op_binary, &&do_op_index,
+        &&do_op_array, &&do_op_map, &&do_op_call, &&do_op_builtin, &&do_op_jump,
+        &&do_op_jump_if_false, &&do_op_loop, &&do_op_return, &&do_op_end,
+        &&do_op_reserve, &&do_op_clear, &&do_op_load_cached, &&do_op_store_cached,
+        &&do_op_increment_loop, &&do_op_number_binary, &&do_op_guard_number,
+        &&do_op_store_pop, &&do_op_slot_constant_binary, &&do_op_slot_slot_binary,
+        &&do_op_binary_jump_if_false, &&do_op_number_binary_jump_if_false
+    };
+    static_assert(sizeof(labels) / sizeof(labels[0]) == opcode_count, "a label per opcode");
+    NEXT();
+#else
+    for (;;) {
+        FETCH();
+        switch (instruction->op) {
+#endif
+            CASE(op_constant)
+                stack.push_back(code.constants()[instruction->arg]);
+                NEXT();
+            CASE(op_pop)
+                stack.pop_back();
+                NEXT();
+            CASE(op_load_slot)
+                if (assigned_[slots + instruction->arg])
+                    stack.push_back(stack[slots + instruction->arg]);
+                else
+                    stack.push_back(lookup(code.layout()->names()[instruction->arg], 0, instruction->line));
+                NEXT();
+            CASE(op_store_slot)
+                stack[slots + instruction->arg] = stack.back();
+                assigned_[slots + instruction->arg] = 1;
+                NEXT();
+            CASE(op_load_name)
+                stack.push_back(lookup(code.names()[instruction->arg], frame, instruction->line));
+                NEXT();
+            CASE(op_store_name)
+                assign(code.names()[instruction->arg], stack.back(), frame);
+                NEXT();
+            CASE(op_binary) {
+                Value &left = stack[stack.size() - 2];
+                left = Runtime::binary_op((TokenType)instruction->arg, left, stack.back(), instruction->line);
+                stack.pop_back();
+                if (limits_.memory > 0 && stack.back().string().size() > limits_.memory)
+                    throw LimitExceeded("Memory limit exceeded", instruction->line);
+                NEXT();
+            }
+            CASE(op_index) {
+                Value &container = stack[stack.size() - 2];
+                container = Runtime::index(container, stack.back(), instruction->line);
+                stack.pop_back();
+                NEXT();
+            }
+            CASE(op_array) {
+                Value::Array array(stack.end() - instruction->arg, stack.end());
+                stack.resize(stack.size() - instruction->arg);
+                stack.push_back(Value::new_array(array));
+                NEXT();
+            }
+            CASE(op_map) {
+                std::vector<Value> keys_and_values(stack.end() - instruction->arg, stack.end());
+                stack.resize(stack.size() - instruction->arg);
+                stack.push_back(Runtime::new_map(keys_and_values));
+                NEXT();
+            }
+            CASE(op_call) {
+                /* The arguments on top become the callee's frame */
+                Value result = call(code.functions()[instruction->arg], stack.size() - instruction->arg2, instruction->line);
+                stack.push_back(std::move(result));
+                NEXT();
+            }
+            CASE(op_builtin) {
+                std::vector<Value> args(std::make_move_iterator(stack.end() - instruction->arg2), std::make_move_iterator(stack.end()));
+                stack.resize(stack.size() - instruction->arg2);
+                stack.push_back(builtin(code.names()[instruction->arg], args, instruction->line));
+                NEXT();
+            }
+            CASE(op_jump)
+                pc = &instructions[instruction->arg];
+                NEXT();
+            CASE(op_jump_if_false) {
+                bool truthy = stack.back().truthy();
+                stack.pop_back();
+                if (!truthy)
+                    pc = &instructions[instruction->arg];
+                NEXT();
+            }
+            CASE(op_loop)
+                safepoint(instruction->line);
+                pc = &instructions[instruction->arg];
+                NEXT();
+            CASE(op_return)
+                ret = std::move(stack.back());
+                stack.resize(base);
+                return true;
+            CASE(op_end)
+                stack.resize(base);
+                return false;
+            CASE(op_reserve)
+                stack.resize(stack.size() + instruction->arg);
+                NEXT();
+            CASE(op_clear)
+                std::fill(stack.begin() + base + instruction->arg, stack.begin() + base + instruction->arg + instruction->arg2, Value());
+                NEXT();
+            CASE(op_load_cached)
+                if (!stack[base + instruction->arg].is_none()) {
+                    stack.push_back(stack[base + instruction->arg]);
+                    pc = &instructions[instruction->arg2];
+                }
+                NEXT();
+            CASE(op_store_cached)
+                stack[base + instruction->arg] = stack.back();
+                NEXT();
+            CASE(op_increment_loop) {
+                const LoopStep &step = code.steps()[instruction->arg];
+                Value &variable = stack[slots + step.slot];
+                const Value &limit = stack[base + step.limit];
+                if (!assigned_[slots + step.slot] || !variable.is_number() || !limit.is_number()) {
+                    if (step_loop(code, step, slots, base, instruction->line))
+                        pc = &instructions[step.target];
+                    NEXT();
+                }
+
+                const double next = step.op == tok_add ? variable.number() + step.step : variable.number() - step.step;
+                variable = Value(next);
+                for (std::vector<std::pair<unsigned int, double> >::const_iterator it = step.products.begin(), end = step.products.end(); it != end; ++it)
+                    stack[base + it->first] = Value(next * it->second);
+                safepoint(instruction->line);
+
+                const double left = step.limit_left ? limit.number() : next;
+                const double right = step.limit_left ? next : limit.number();
+                bool taken;
+                switch (step.compare) {
+                    case tok_lt: taken = left < right; break;
+                    case tok_gt: taken = left > right; break;
+                    case tok_lte: taken = left <= right; break;
+                    case tok_gte: taken = left >= right; break;
+                    default: taken = left == right; break;
+                }
+                if (taken)
+                    pc = &instructions[step.target];
+                NEXT();
+            }
+            CASE(op_number_binary) {
+                Value &left = stack[stack.size() - 2];
+                left = Value(Runtime::number_op((TokenType)instruction->arg, left.number(), stack.back().number()));
+                stack.pop_back();
+                NEXT();
+            }
+            CASE(op_guard_number)
+                if (!stack[slots + instruction->arg].is_number()) {
+                    ++tier_stats_.guard_failures;
+                    pc = &instructions[instruction->arg2];
+                }
+                NEXT();
+            CASE(op_store_pop)
+                stack[slots + instruction->arg] = std::move(stack.back());
+                assigned_[slots + instruction->arg] = 1;
+                stack.pop_back();
+                ++pc;
+                NEXT();
+            CASE(op_slot_constant_binary) {
+                const Value &left = assigned_[slots + instruction->arg] ? stack[slots + instruction->arg]
+                    : lookup(code.layout()->names()[instruction->arg], 0, instruction->line);
+                const Instruction &binary = pc[1];
+                if (binary.op == op_number_binary) {
+                    stack.push_back(Value(Runtime::number_op((TokenType)binary.arg, left.number(), code.constants()[pc->arg].number())));
+                    pc += 2;
+                    NEXT();
+                }
+                stack.push_back(Runtime::binary_op((TokenType)binary.arg, left, code.constants()[pc->arg], binary.line));
+                if (limits_.memory > 0 && stack.back().string().size() > limits_.memory)
+                    throw LimitExceeded("Memory limit exceeded", binary.line);
+                pc += 2;
+                NEXT();
+            }
+            CASE(op_slot_slot_binary) {
+                const Value &left = assigned_[slots + instruction->arg] ? stack[slots + instruction->arg]
+                    : lookup(code.layout()->names()[instruction->arg], 0, instruction->line);
+                const Value &right = assigned_[slots + pc->arg] ? stack[slots + pc->arg]
+                    : lookup(code.layout()->names()[pc->arg], 0, pc->line);
+                const Instruction &binary = pc[1];
+                if (binary.op == op_number_binary) {
+                    stack.push_back(Value(Runtime::number_op((TokenType)binary.arg, left.number(), right.number())));
+                    pc += 2;
+                    NEXT();
+                }
+                stack.push_back(Runtime::binary_op((TokenType)binary.arg, left, right, binary.line));
+                if (limits_.memory > 0 && stack.back().string().size() > limits_.memory)
+                    throw LimitExceeded("Memory limit exceeded", binary.line);
+                pc += 2;
+                NEXT();
+            }
+            CASE(op_binary_jump_if_false) {
+                const Value result = Runtime::binary_op((TokenType)instruction->arg, stack[stack.size() - 2], stack.back(), instruction->line);
+                if (limits_.memory > 0 && result.string().size() > limits_.memory)
+                    throw LimitExceeded("Memory limit exceeded", instruction->line);
+                stack.resize(stack.size() - 2);
+                pc = result.truthy() ? pc + 1 : &instructions[pc->arg];
+                NEXT();
+            }
+            CASE(op_number_binary_jump_if_false) {
+                const bool truthy = Runtime::number_op((TokenType)instruction->arg, stack[stack.size() - 2].number(), stack.back().number()) != 0;
+                stack.resize(stack.size() - 2);
+                pc = truthy ? pc + 1 : &instructions[pc->arg];
+                NEXT();
+            }
+#ifndef THREADED_DISPATCH
+        }
+    }
+#endif
+}
+
+#pragma GCC diagnostic pop
+#undef CASE
+#undef NEXT
+#undef FETCH
+
+/* op_increment_loop when the variable or the limit isn't a number: the
+ * update and the condition it stands for, as they would have run */
+bool Interpreter::step_loop(const CompiledCode &code, const LoopStep &step, Stack::size_type slots, Stack::size_type base, unsigned int line) {
+    const Value current = assigned_[slots + step.slot] ? stack_[slots + step.slot] : lookup(code.layout()->names()[step.slot], 0, step.update_line);
+    const Value amount(step.step);
+    Value next = step.step_left ? Runtime::binary_op(step.op, amount, current, step.update_line) : Runtime::binary_op(step.op, current, amount, step.update_line);
+    if (limits_.memory > 0 && next.string().size() > limits_.memory)
+        throw LimitExceeded("Memory limit exceeded", step.update_line);
+    stack_[slots + step.slot] = next;
+    assigned_[slots + step.slot] = 1;
+
+    /* Emptied entries are computed again at their next use */
+    for (std::vector<std::pair<unsigned int, double> >::const_iterator it = step.products.begin(), end = step.products.end(); it != end; ++it)
+        stack_[base + it->first] = next.is_number() ? Value(next.number() * it->second) : Value();
+    safepoint(line);
+
+    const Value &limit = stack_[base + step.limit];
+    Value taken = step.limit_left ? Runtime::binary_op(step.compare, limit, next, step.compare_line) : Runtime::binary_op(step.compare, next, limit, step.compare_line);
+    return taken.truthy();
+}
+
+/* Limits */
+
+void Interpreter::start() {
+    analyze_purity();
+    stack_.clear();
+    assigned_.clear();
+    native_base_ = static_cast<const char*>(__builtin_frame_address(0));
+    native_size_ = native_limit_ ? native_limit_ : native_stack_size();
+    executed_ = 0;
+    started_ = std::chrono::steady_clock::now();
+    tier_ = tier_interpreted;
+    tier_started_ = started_;
+    refill();
+
+    /* Calls an error left unfinished */
+    sample_.depth = 0;
+    if (profiling_.interval > 0)
+        sampler_.start(&sample_, profiling_.interval);
+}
+
+void Interpreter::finish() {
+    sampler_.stop();
+    /* Books the time since the last switch */
+    switch_tier(tier_ == tier_interpreted ? tier_compiled : tier_interpreted);
+}
+
+/* Sets up the countdown to the next check. Without a clock or memory
+ * limit, that is the instruction limit itself. */
+void Interpreter::refill() {
+    chunk_ = ULONG_MAX;
+    if (limits_.seconds > 0 || limits_.memory > 0)
+        chunk_ = check_interval;
+    if (limits_.instructions > 0 && limits_.instructions - executed_ + 1 < chunk_)
+        chunk_ = limits_.instructions - executed_ + 1;
+    budget_ = chunk_;
+}
+
+void Interpreter::check_limits(unsigned int line) {
+    executed_ += chunk_;
+
+    if (limits_.instructions > 0 && executed_ > limits_.instructions)
+        throw LimitExceeded("Instruction limit exceeded", line);
+
+    if (limits_.seconds > 0) {
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - started_;
+        if (elapsed.count() > limits_.seconds)
+            throw LimitExceeded("Time limit exceeded", line);
+    }
+
+    if (limits_.memory > 0 && memory_used() > limits_.memory)
+        throw LimitExceeded("Memory limit exceeded", line);
+
+    refill();
+}
+
+static size_t footprint(const Value &value, std::set<const void*> &seen) {
+    size_t ret = sizeof(Value) + value.string().capacity();
+
+    if (value.is_array() && seen.insert(&value.array()).second) {
+        const Value::Array &array = value.array();
+        for (Value::Array::const_iterator it = array.begin(), end = array.end(); it != end; ++it)
+            ret += footprint(*it, seen);
+    } else if (value.is_map() && seen.insert(&value.map()).second) {
+        const Value::Map &map = value.map();
+        ret += map.overhead();
+        for (Value::Map::const_iterator it = map.begin(), end = map.end(); it != end; ++it)
+            ret += footprint(it->first, seen) + footprint(it->second, seen);
+    } else if (value.is_numbers() && seen.insert(&value.numbers()).second) {
+        ret += value.numbers().capacity() * sizeof(double);
+    }
+    return ret;
+}
+
+size_t Interpreter::memory_used() const {
+    std::set<const void*> seen;
+    size_t ret = 0;
+
+    for (Scope::const_iterator it = globals_.begin(), end = globals_.end(); it != end; ++it)
+        ret += it->first.capacity() + footprint(it->second, seen);
+    for (std::vector<Value>::const_iterator it = stack_.begin(), end = stack_.end(); it != end; ++it)
+        ret += footprint(*it, seen);
+    return ret;
+}
@@ -0,0 +1,365 @@
+#ifndef _INTERPRETER_HPP
+#define _INTERPRETER_HPP
+
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstddef>
+#include <iostream>
+#include <list>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "ast.hpp"
+#include "bytecode.hpp"
+#include "frame_layout.hpp"
+#include "io.hpp"
+#include "program.hpp"
+#include "sampler.hpp"
+#include "thread_pool.hpp"
+#include "toy.hpp"
+#include "toyobj.hpp"
+
+/* Executes a Program by walking its AST.
+ *
+ * An Interpreter holds all mutable state of a running script (globals and
+ * the call stack), and the Program it runs is only ever read. Interpreters
+ * are cheap to create; use one per thread. They are not thread-safe
+ * themselves.
+ *
+ * Inside a function, an assignment to a name that isn't already a global
+ * creates a local. Errors are reported by throwing RuntimeError.
+ *
+ * All calls share one value stack. A call's frame is a window on it, laid
+ * out by the function's FrameLayout: the caller evaluates the arguments
+ * onto the stack, where they become the callee's first slots, so calls
+ * don't allocate once the stack has grown. Running past the stack limit,
+ * or near the end of the native stack, throws LimitExceeded.
+ *
+ * Limits bound how long a single run() or call() may go on. They are
+ * checked at safepoints, i.e. every loop iteration and function call,
+ * which cost a decrement and a branch each; the clock and the memory
+ * estimate are only looked at every few thousand safepoints. A script
+ * running out throws LimitExceeded with the line it stopped at.
+ *
+ * Functions and loops start out walking the AST. Each counts its calls or
+ * iterations, and once that crosses the tiering threshold it is compiled
+ * to bytecode (see CompiledCode), by default on a background thread while
+ * the AST walk goes on. A loop that is already running switches to its
+ * bytecode at the next iteration.
+ *
+ * The builtins pmap(name, array) and spawn(name, args...) run calls to a
+ * function on a process-wide thread pool; join(task) waits for what
+ * spawn() started and returns its result. Each call runs on an Interpreter
+ * of its own, with its own stack, starting from a copy of the caller's
+ * globals: what it assigns to globals is dropped, what it prints is passed
+ * on in order once it is collected, and the first error in order is
+ * rethrown. Workers get the caller's limits, with the time left.
+ * map(name, xs) makes the same calls one after the other, right here; on
+ * numbers, each call must return a number.
+ *
+ * Calls to pure functions (see PurityAnalysis) are memoized: their results
+ * are kept by arguments, up to a number of entries, dropping the least
+ * recently used. Numbers match by their bits and arrays and maps by
+ * identity. Results that are arrays, maps or numbers are not kept, as a
+ * call makes a new one each time. A call answered from the table costs one
+ * safepoint, whatever the function would have run. Functions can be left
+ * out, or the table turned off.
+ *
+ * With profiling on, run() and call() sample what they run with a Sampler:
+ * every call keeps the stack of functions the Sampler reads up to date, and
+ * every statement the AST walk runs, and every safepoint, its line. Compiled
+ * code only passes a safepoint at loops and calls, so its samples go to the
+ * line of the last of those.
+ */
+class Interpreter {
+  public:
+    typedef std::map<std::string, Value> Scope;
+
+    /* Zero means unlimited */
+    struct Limits {
+        Limits()
+            : instructions(0),
+              seconds(0),
+              memory(0),
+              stack(0) {}
+        /* Safepoints passed */
+        unsigned long instructions;
+        double seconds;
+        /* Bytes held by values reachable from globals and locals; an
+         * estimate */
+        size_t memory;
+        /* Values on the stack: arguments, locals and temporaries of every
+         * active call */
+        size_t stack;
+    };
+
+    struct Tiering {
+        Tiering()
+            : threshold(1000),
+              background(true),
+              eager(false),
+              specialize(true) {}
+        /* Calls or iterations before compiling; 0 never compiles */
+        unsigned long threshold;
+        bool background;
+        /* Compile every function before running, on all cores, and use
+         * the code from the first call on. Loops still wait to get hot. */
+        bool eager;
+        /* Compile functions whose every call site passes numbers to some
+         * parameters for numbers as well, see CompiledCode */
+        bool specialize;
+    };
+
+    struct TierStats {
+        TierStats()
+            : interpreted_seconds(0),
+              compiled_seconds(0),
+              compile_seconds(0),
+              compilations(0),
+              osr_entries(0),
+              deoptimizations(0),
+              guard_failures(0) {}
+        double interpreted_seconds;
+        double compiled_seconds;
+        /* Mostly spent on the background thread */
+        double compile_seconds;
+        unsigned long compilations;
+        /* Loops that switched to bytecode while running */
+        unsigned long osr_entries;
+        /* Compiled functions dropped because a global now shadows one of
+         * their locals */
+        unsigned long deoptimizations;
+        /* Calls to code specialized for numeric parameters that passed
+         * something else, and ran the code as it was instead */
+        unsigned long guard_failures;
+    };
+
+    struct Memoization {
+        Memoization()
+            : capacity(4096) {}
+        /* Results kept; 0 turns memoization off */
+        size_t capacity;
+        /* Pure functions never memoized, by name */
+        std::set<std::string> excluded;
+    };
+
+    struct Profiling {
+        Profiling()
+            : interval(0) {}
+        /* Seconds of CPU time between samples; 0 doesn't sample */
+        double interval;
+    };
+
+    struct MemoStats {
+        MemoStats()
+            : hits(0),
+              misses(0),
+              evictions(0) {}
+        unsigned long hits;
+        unsigned long misses;
+        unsigned long evictions;
+    };
+
+    explicit Interpreter(const Program &program, std::ostream &out = std::cout)
+        : program_(program),
+          out_(out),
+          budget_(ULONG_MAX),
+          chunk_(ULONG_MAX),
+          executed_(0),
+          io_(&IoWaiter::blocking()),
+          native_base_(0),
+          native_size_(0),
+          native_limit_(0),
+          compiler_(0),
+          tier_(tier_interpreted),
+          types_analyzed_(false),
+          memo_analyzed_(false),
+          next_task_(0) {}
+    ~Interpreter();
+
+    inline void set_limits(const Limits &limits) { limits_ = limits; }
+    inline const Limits &limits() const { return limits_; }
+
+    inline void set_tiering(const Tiering &tiering) { tiering_ = tiering; }
+
+    /* Where sleep() and reads wait, see Io */
+    inline void set_io(IoWaiter *io) { io_ = io; }
+    /* Native stack run() and call() may use below where they are called,
+     * for callers that run the interpreter on a stack of their own; by
+     * default most of the thread's */
+    inline void set_native_stack(ptrdiff_t size) { native_limit_ = size; }
+    inline const TierStats &tier_stats() const { return tier_stats_; }
+
+    /* Clears the table */
+    void set_memoization(const Memoization&);
+    inline const MemoStats &memo_stats() const { return memo_stats_; }
+
+    inline void set_profiling(const Profiling &profiling) { profiling_ = profiling; }
+    /* What was sampled, over every run() and call() so far */
+    inline const Sampler &sampler() const { return sampler_; }
+
+    /* Runs the top-level statements of the program. */
+    void run();
+
+    /* Calls a function defined by the program, or a builtin. */
+    Value call(const std::string&, const std::vector<Value>&);
+
+    Value global(const std::string&) const;
+    inline void set_global(const std::string &name, const Value &value) { globals_[name] = value; }
+    inline const Scope &globals() const { return globals_; }
+    inline void set_globals(const Scope &globals) { globals_ = globals; }
+  private:
+    typedef std::vector<Value> Stack;
+
+    /* A call's window on the stack */
+    struct Frame {
+        Frame(const FrameLayout *layout, Stack::size_type base)
+            : layout(layout),
+              base(base) {}
+        const FrameLayout *layout;
+        Stack::size_type base;
+    };
+
+    bool exec(const AST*, const Frame*, Value&);
+    bool exec(const Statement*, const Frame*, Value&);
+
+    Value eval(const Expression*, const Frame*);
+    Value eval_call(const FuncCallExpr*, const Frame*);
+
+    Value call(const DefStatement*, Stack::size_type, unsigned int);
+    Value builtin(const std::string&, const std::vector<Value>&, unsigned int);
+    Value map(const std::vector<Value>&, unsigned int);
+    Value pmap(const std::vector<Value>&, unsigned int);
+    Value spawn(const std::vector<Value>&, unsigned int);
+    Value join(const std::vector<Value>&, unsigned int);
+    void init_worker(Interpreter&) const;
+    void push_frame(const Frame&, unsigned int, unsigned int);
+
+    const Value &lookup(const std::string&, const Frame*, unsigned int) const;
+    void assign(const std::string&, const Value&, const Frame*);
+
+    typedef enum {
+        tier_interpreted,
+        tier_compiled
+    } Tier;
+
+    /* Per function or loop */
+    struct TierState {
+        TierState()
+            : count(0),
+              queued(false),
+              failed(false),
+              compiled(0),
+              code(0),
+              globals_seen(0),
+              layout(0) {}
+        unsigned long count;
+        bool queued, failed;
+        /* Published by the compiler thread */
+        std::atomic<CompiledCode*> compiled;
+        const CompiledCode *code;
+        Scope::size_type globals_seen;
+        /* Functions only */
+        FrameLayout *layout;
+    };
+
+    const CompiledCode *hot_code(const ASTNode*, TierState&, const FrameLayout*);
+    void queue_compile(const ASTNode*, TierState&, const FrameLayout*);
+    void precompile();
+    void analyze_types();
+    const std::vector<bool> &numeric_params(const DefStatement*) const;
+    bool installable(const CompiledCode*) const;
+    void switch_tier(Tier);
+    bool execute_compiled(const CompiledCode&, const Frame*, Value&);
+    bool execute(const CompiledCode&, const Frame*, Value&);
+    bool step_loop(const CompiledCode&, const LoopStep&, Stack::size_type, Stack::size_type, unsigned int);
+
+    struct MemoKey;
+    void analyze_purity();
+    void memoize(const MemoKey&, const Value&);
+
+    void start();
+    void finish();
+    inline void safepoint(unsigned int line) {
+        sample_.line = line;
+        if (--budget_ == 0)
+            check_limits(line);
+    }
+    void check_limits(unsigned int);
+    inline void enter(const DefStatement *def) {
+        sample_.functions[sample_.depth & (Sampler::max_depth - 1)] = def;
+        sample_.depth = sample_.depth + 1;
+        sample_.line = def->line();
+    }
+    /* Back at the call */
+    inline void leave(unsigned int line) {
+        sample_.depth = sample_.depth - 1;
+        sample_.line = line;
+    }
+    void refill();
+    size_t memory_used() const;
+
+    const Program &program_;
+    std::ostream &out_;
+    Scope globals_;
+    Stack stack_;
+    /* Per slot of stack_, whether a local has been assigned yet */
+    std::vector<char> assigned_;
+
+    Limits limits_;
+    unsigned long budget_, chunk_, executed_;
+    std::chrono::steady_clock::time_point started_;
+    IoWaiter *io_;
+    const char *native_base_;
+    ptrdiff_t native_size_;
+    ptrdiff_t native_limit_;
+
+    Tiering tiering_;
+    TierStats tier_stats_;
+    std::unordered_map<const ASTNode*, TierState> tiers_;
+    ThreadPool *compiler_;
+    Tier tier_;
+    std::chrono::steady_clock::time_point tier_started_;
+    /* Per function, a flag per parameter that every call site passes a
+     * number to; only functions with one */
+    std::unordered_map<const DefStatement*, std::vector<bool> > numeric_params_;
+    bool types_analyzed_;
+
+    /* Arguments of a call to a pure function */
+    struct MemoKey {
+        const DefStatement *def;
+        std::vector<Value> args;
+        bool operator<(const MemoKey&) const;
+    };
+    /* Most recently used first */
+    typedef std::list<const MemoKey*> MemoOrder;
+    struct MemoEntry {
+        Value result;
+        MemoOrder::iterator used;
+    };
+    Memoization memoization_;
+    MemoStats memo_stats_;
+    std::unordered_set<const DefStatement*> memoized_;
+    bool memo_analyzed_;
+    /* Names purity was analyzed with as globals */
+    std::set<std::string> memo_globals_;
+    std::map<MemoKey, MemoEntry> memo_;
+    MemoOrder memo_order_;
+
+    /* Started by spawn() and not joined yet, by id */
+    struct Task;
+    std::map<unsigned long, std::shared_ptr<Task> > tasks_;
+    unsigned long next_task_;
+
+    Profiling profiling_;
+    Sampler sampler_;
+    Sampler::State sample_;
+    DISALLOW_COPY_AND_ASSIGN(Interpreter);
+};
+
+#endif
@@ -0,0 +1,162 @@
+#include "io.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include "exceptions.hpp"
+
+/* Waits on the calling thread */
+class BlockingWaiter : public IoWaiter {
+  public:
+    virtual bool wait_readable(int fd, Clock::time_point deadline) { return wait(fd, POLLIN, deadline); }
+    virtual bool wait_writable(int fd, Clock::time_point deadline) { return wait(fd, POLLOUT, deadline); }
+    virtual void sleep_until(Clock::time_point until) { std::this_thread::sleep_until(until); }
+  private:
+    static bool wait(int fd, short events, Clock::time_point deadline) {
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = events;
+        int ret;
+        while ((ret = poll(&pfd, 1, timeout(deadline))) < 0 && errno == EINTR) {}
+        return ret >= 0;
+    }
+
+    /* In milliseconds, rounded up, so as not to wake just before the
+     * deadline */
+    static int timeout(Clock::time_point deadline) {
+        if (deadline == Clock::time_point::max())
+            return -1;
+        Clock::duration left = deadline - Clock::now();
+        if (left <= Clock::duration::zero())
+            return 0;
+        long long ms = std::chrono::duration_cast<std::chrono::milliseconds>(left).count() + 1;
+        return (int)std::min<long long>(ms, INT_MAX);
+    }
+};
+
+IoWaiter &IoWaiter::blocking() {
+    static BlockingWaiter waiter;
+    return waiter;
+}
+
+static std::string error_message(const std::string &what, const std::string &path) {
+    return "Cannot " + what + " '" + path + "': " + strerror(errno);
+}
+
+/* Until end of file; closes fd either way */
+static std::string read_all(int fd, const std::string &path, IoWaiter &waiter, unsigned int line, IoWaiter::Clock::time_point deadline) {
+    /* Straight into the string: on a Scheduler's small stacks a buffer
+     * would stay resident */
+    static const size_t chunk = 16 * 1024;
+    std::string ret;
+    for (;;) {
+        const std::string::size_type size = ret.size();
+        ret.resize(size + chunk);
+        ssize_t count = read(fd, &ret[size], chunk);
+        ret.resize(size + (count > 0 ? count : 0));
+        if (count > 0) {
+            continue;
+        } else if (count == 0) {
+            break;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            if (IoWaiter::Clock::now() >= deadline) {
+                close(fd);
+                throw LimitExceeded("Time limit exceeded", line);
+            }
+            if (!waiter.wait_readable(fd, deadline)) {
+                close(fd);
+                throw RuntimeError("Cannot wait for '" + path + "'", line);
+            }
+        } else if (errno != EINTR) {
+            std::string message = error_message("read", path);
+            close(fd);
+            throw RuntimeError(message, line);
+        }
+    }
+    close(fd);
+    return ret;
+}
+
+static const std::string path_argument(const std::string &funcname, const std::vector<Value> &args, unsigned int line) {
+    if (args.size() != 1 || !args[0].is_string())
+        throw RuntimeError(funcname + "() takes a path", line);
+    return args[0].string();
+}
+
+static Value read_file(const std::vector<Value> &args, IoWaiter &waiter, unsigned int line, IoWaiter::Clock::time_point deadline) {
+    const std::string path = path_argument("read_file", args, line);
+    int fd = open(path.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0)
+        throw RuntimeError(error_message("open", path), line);
+    return Value(read_all(fd, path, waiter, line, deadline));
+}
+
+static Value read_socket(const std::vector<Value> &args, IoWaiter &waiter, unsigned int line, IoWaiter::Clock::time_point deadline) {
+    const std::string path = path_argument("read_socket", args, line);
+    struct sockaddr_un address;
+    if (path.size() >= sizeof(address.sun_path))
+        throw RuntimeError("Socket path too long: '" + path + "'", line);
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    memcpy(address.sun_path, path.c_str(), path.size());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        throw RuntimeError(error_message("open a socket for", path), line);
+
+    if (connect(fd, reinterpret_cast<struct sockaddr*>(&address), sizeof(address)) < 0) {
+        /* A full backlog; the connection completes once it is writable */
+        int error = errno;
+        if (error == EAGAIN || error == EINPROGRESS) {
+            socklen_t size = sizeof(error);
+            if (!waiter.wait_writable(fd, deadline) || getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &size) < 0)
+                error = errno ? errno : EIO;
+            else if (error == 0 && IoWaiter::Clock::now() >= deadline) {
+                close(fd);
+                throw LimitExceeded("Time limit exceeded", line);
+            }
+        }
+        if (error != 0) {
+            errno = error;
+            std::string message = error_message("connect to", path);
+            close(fd);
+            throw RuntimeError(message, line);
+        }
+    }
+    return Value(read_all(fd, path, waiter, line, deadline));
+}
+
+/* Sleeping past the deadline only sleeps until it */
+static Value sleep_seconds(const std::vector<Value> &args, IoWaiter &waiter, unsigned int line, IoWaiter::Clock::time_point deadline) {
+    if (args.size() != 1 || !args[0].is_number() || !(args[0].number() >= 0))
+        throw RuntimeError("sleep() takes a number of seconds", line);
+    /* About 30 years, well inside the clock's range */
+    std::chrono::duration<double> seconds(std::min(args[0].number(), 1e9));
+    IoWaiter::Clock::time_point until = IoWaiter::Clock::now() + std::chrono::duration_cast<IoWaiter::Clock::duration>(seconds);
+    if (until > deadline) {
+        waiter.sleep_until(deadline);
+        throw LimitExceeded("Time limit exceeded", line);
+    }
+    waiter.sleep_until(until);
+    return Value();
+}
+
+bool Io::is_builtin(const std::string &funcname) {
+    return funcname == "sleep" || funcname == "read_file" || funcname == "read_socket";
+}
+
+Value Io::builtin(const std::string &funcname, const std::vector<Value> &args, IoWaiter &waiter, unsigned int line, IoWaiter::Clock::time_point deadline) {
+    if (funcname == "sleep")
+        return sleep_seconds(args, waiter, line, deadline);
+    if (funcname == "read_file")
+        return read_file(args, waiter, line, deadline);
+    if (funcname == "read_socket")
+        return read_socket(args, waiter, line, deadline);
+    throw RuntimeError("Undefined function '" + funcname + "'", line);
+}
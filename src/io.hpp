@@ -0,0 +1,45 @@
+#ifndef _IO_HPP
+#define _IO_HPP
+
+#include <chrono>
+#include <string>
+#include <vector>
+#include "toy.hpp"
+#include "toyobj.hpp"
+
+/* Where a script waits for I/O. blocking() waits on the calling thread; a
+ * Scheduler suspends the script instead and runs others meanwhile. The
+ * wait functions return once the descriptor is ready or the deadline has
+ * passed, and false if the descriptor can't be waited on. */
+class IoWaiter {
+  public:
+    typedef std::chrono::steady_clock Clock;
+
+    IoWaiter() {}
+    virtual ~IoWaiter() {}
+
+    virtual bool wait_readable(int, Clock::time_point deadline) = 0;
+    virtual bool wait_writable(int, Clock::time_point deadline) = 0;
+    virtual void sleep_until(Clock::time_point) = 0;
+
+    static IoWaiter &blocking();
+  private:
+    DISALLOW_COPY_AND_ASSIGN(IoWaiter);
+};
+
+/* The builtins that wait: sleep(seconds), read_file(path) and
+ * read_socket(path), which reads a Unix domain stream socket until the
+ * other end closes it. Descriptors are non-blocking, so waiting is left to
+ * the IoWaiter. Errors are thrown as RuntimeError carrying the given line.
+ *
+ * No wait goes past the deadline, e.g. where the script's time limit runs
+ * out; reaching it throws LimitExceeded.
+ */
+class Io {
+  public:
+    static bool is_builtin(const std::string&);
+    static Value builtin(const std::string&, const std::vector<Value>&, IoWaiter&, unsigned int,
+                         IoWaiter::Clock::time_point deadline = IoWaiter::Clock::time_point::max());
+};
+
+#endif
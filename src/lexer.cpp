@@ -1,16 +1,144 @@
 #include "lexer.hpp"
 #include <cstdlib>
+#include <string>
 #include <iostream>
 #include <queue>
 #include <sstream>
+#include <utility>
 #include <cassert>
 #include "exceptions.hpp"
 
-#define toy_isnumeric(c) (isdigit((c)) || (c) == '.')
-#define toy_isalphanumeric(c) (isalpha((c)) || isdigit((c)) || (c) == '_')
-
 #define MAX_SYNTAX_CHARS ((int)sizeof("return"))
 
+/* Tables */
+
+/* What a byte can start or continue, independent of the locale */
+typedef enum {
+    char_other, char_space, char_newline,
+    char_alpha, char_digit, char_dot, char_underscore,
+    char_quote, char_hash, char_symbol,
+    num_char_classes
+} CharClass;
+
+/* Where the lexer is within a token. state_start picks the kind of token
+ * from its first byte; the others go on until state_done. */
+typedef enum {
+    state_start, state_word, state_number, state_space, state_string, state_symbol,
+    state_done,
+    num_lex_states
+} LexState;
+
+struct CharClasses {
+    constexpr CharClasses()
+        : table() {
+        for (int c = 0; c < 256; ++c) {
+            CharClass cls = char_other;
+            if (c == ' ' || c == '\t' || c == '\v' || c == '\f' || c == '\r') cls = char_space;
+            else if (c == '\n') cls = char_newline;
+            else if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')) cls = char_alpha;
+            else if (c >= '0' && c <= '9') cls = char_digit;
+            else if (c == '.') cls = char_dot;
+            else if (c == '_') cls = char_underscore;
+            else if (c == '"') cls = char_quote;
+            else if (c == '#') cls = char_hash;
+            else if (c != 0 && std::char_traits<char>::find("=<>(){}[]+-*/%;,:", 17, (char)c)) cls = char_symbol;
+            table[c] = cls;
+        }
+    }
+    CharClass table[256];
+};
+
+struct Transitions {
+    constexpr Transitions()
+        : table() {
+        for (int state = 0; state < num_lex_states; ++state) {
+            for (int cls = 0; cls < num_char_classes; ++cls)
+                table[state][cls] = state_done;
+        }
+
+        table[state_start][char_space] = table[state_start][char_newline] = table[state_start][char_hash] = state_space;
+        table[state_start][char_alpha] = state_word;
+        table[state_start][char_digit] = table[state_start][char_dot] = state_number;
+        table[state_start][char_quote] = state_string;
+        table[state_start][char_symbol] = state_symbol;
+
+        table[state_word][char_alpha] = table[state_word][char_digit] = table[state_word][char_underscore] = state_word;
+        table[state_number][char_digit] = table[state_number][char_dot] = state_number;
+    }
+    LexState table[num_lex_states][num_char_classes];
+};
+
+static constexpr CharClasses char_classes;
+static constexpr Transitions transitions;
+
+static inline CharClass char_class(char c) {
+    return char_classes.table[(unsigned char)c];
+}
+
+static inline LexState transition(LexState state, char c) {
+    return transitions.table[state][char_class(c)];
+}
+
+/* Keywords, by a perfect hash of their length and first and last bytes.
+ * The multiplier is searched for at compile time. */
+struct Keyword {
+    const char *word;
+    size_t size;
+    TokenType type;
+};
+
+static constexpr Keyword keywords[] = {
+    {"def", 3, tok_def}, {"if", 2, tok_if}, {"else", 4, tok_else},
+    {"while", 5, tok_while}, {"return", 6, tok_return}, {"import", 6, tok_import}
+};
+static constexpr size_t num_keywords = sizeof(keywords) / sizeof(keywords[0]);
+static constexpr unsigned int keyword_slots = 8;
+
+static constexpr unsigned int keyword_hash(unsigned int multiplier, const char *word, size_t size) {
+    return ((unsigned char)word[0] + (unsigned char)word[size - 1] * multiplier + size) % keyword_slots;
+}
+
+static constexpr unsigned int keyword_multiplier() {
+    for (unsigned int multiplier = 1; multiplier < 256; ++multiplier) {
+        bool used[keyword_slots] = {};
+        bool collides = false;
+        for (size_t i = 0; i < num_keywords && !collides; ++i) {
+            unsigned int slot = keyword_hash(multiplier, keywords[i].word, keywords[i].size);
+            collides = used[slot];
+            used[slot] = true;
+        }
+        if (!collides)
+            return multiplier;
+    }
+    return 0;
+}
+
+static constexpr unsigned int multiplier = keyword_multiplier();
+static_assert(multiplier != 0, "No perfect hash for the keywords");
+
+/* Slot to index into keywords, or -1 */
+struct KeywordSlots {
+    constexpr KeywordSlots()
+        : table() {
+        for (unsigned int slot = 0; slot < keyword_slots; ++slot)
+            table[slot] = -1;
+        for (size_t i = 0; i < num_keywords; ++i)
+            table[keyword_hash(multiplier, keywords[i].word, keywords[i].size)] = i;
+    }
+    int table[keyword_slots];
+};
+
+static constexpr KeywordSlots keyword_slots_table;
+
+/* tok_word if word isn't a keyword */
+static TokenType keyword_type(const std::string &word) {
+    int index = keyword_slots_table.table[keyword_hash(multiplier, word.data(), word.size())];
+    if (index < 0 || keywords[index].size != word.size()
+            || std::char_traits<char>::compare(keywords[index].word, word.data(), word.size()) != 0)
+        return tok_word;
+    return keywords[index].type;
+}
+
 const std::string Token::token_type_name(TokenType type) {
     static std::string tok_name_table[] = {
         "word", "number", "string",
@@ -22,10 +150,13 @@ const std::string Token::token_type_name(TokenType type) {
 
         "paren_start", "paren_end",
         "block_start", "block_end",
+        "bracket_start", "bracket_end",
         "semicolon", "comma",
+        "colon",
 
         "while",  "return", "def",
-        "assign", "if",     "else"
+        "assign", "if",     "else",
+        "import"
     };
 
     return tok_name_table[(int)type];
@@ -44,9 +175,179 @@ const std::string Token::name() const {
     return ss.str();
 }
 
+/* Parallel lexing */
+
+typedef enum {
+    scan_code,
+    scan_string,
+    scan_comment
+} ScanState;
+
+/* How a piece of source moves the scanner along, for a given state at its
+ * start */
+struct Scan {
+    Scan()
+        : end_state(scan_code),
+          resync(std::string::npos) {}
+    ScanState end_state;
+    /* Just past the first newline that leaves the scanner outside strings
+     * and comments, i.e. where a chunk can start */
+    size_t resync;
+};
+
+static Scan scan(const std::string &source, size_t begin, size_t end, ScanState state) {
+    Scan ret;
+    for (size_t i = begin; i < end; ++i) {
+        char c = source[i];
+        switch (state) {
+            case scan_code:
+                if (c == '"')
+                    state = scan_string;
+                else if (c == '#')
+                    state = scan_comment;
+                break;
+            case scan_string:
+                if (c == '"')
+                    state = scan_code;
+                break;
+            case scan_comment:
+                if (c == '\n')
+                    state = scan_code;
+                break;
+        }
+        if (c == '\n' && state == scan_code && ret.resync == std::string::npos)
+            ret.resync = i + 1;
+    }
+    ret.end_state = state;
+    return ret;
+}
+
+/* Reads a range of a string in place */
+class RangeBuf : public std::streambuf {
+  public:
+    RangeBuf(const std::string &source, size_t begin, size_t end) {
+        char *data = const_cast<char*>(source.data());
+        setg(data + begin, data + begin, data + end);
+    }
+};
+
+LexerContext::LexerContext(const std::string &source, const std::string &filename, ThreadPool &pool, size_t chunk_size)
+    : input_(0),
+      line_(1),
+      filename_(filename),
+      curtok_(0),
+      capturing_(false),
+      consumed_(0),
+      source_(&source),
+      chunk_(0),
+      next_(0),
+      end_(0),
+      capture_begin_(0),
+      eos_(false),
+      end_line_(1) {
+    /* Pieces of about chunk_size, each ending with a newline */
+    std::vector<std::pair<size_t, size_t> > pieces;
+    for (size_t begin = 0; begin < source.size(); ) {
+        size_t end = begin + chunk_size < source.size() ? source.find('\n', begin + chunk_size) : std::string::npos;
+        end = end == std::string::npos ? source.size() : end + 1;
+        pieces.push_back(std::make_pair(begin, end));
+        begin = end;
+    }
+
+    std::vector<Scan> scans;
+    pool.parallel_map(pieces, scans, [&source](const std::pair<size_t, size_t> &piece) {
+        return scan(source, piece.first, piece.second, scan_code);
+    });
+
+    /* Chain the scans to find where chunks can really start. A piece that
+     * begins inside a string an earlier one opened is scanned again. */
+    std::vector<std::pair<size_t, size_t> > ranges;
+    ScanState state = scan_code;
+    for (size_t i = 0; i < pieces.size(); ++i) {
+        Scan piece = scans[i];
+        if (state == scan_code) {
+            ranges.push_back(pieces[i]);
+        } else {
+            piece = scan(source, pieces[i].first, pieces[i].second, state);
+            if (piece.resync != std::string::npos)
+                ranges.push_back(std::make_pair(piece.resync, pieces[i].second));
+        }
+        state = piece.end_state == scan_string ? scan_string : scan_code;
+    }
+    for (size_t i = 0; i < ranges.size(); ++i)
+        ranges[i].second = i + 1 < ranges.size() ? ranges[i + 1].first : source.size();
+
+    pool.parallel_map(ranges, chunks_, [&source, &filename](const std::pair<size_t, size_t> &range) {
+        return lex_chunk(source, range.first, range.second, filename);
+    });
+
+    for (std::vector<Chunk>::iterator chunk = chunks_.begin(), end = chunks_.end(); chunk != end; ++chunk) {
+        chunk->first_line = end_line_;
+        end_line_ += chunk->end_line - 1;
+    }
+}
+
+LexerContext::Chunk LexerContext::lex_chunk(const std::string &source, size_t begin, size_t end, const std::string &filename) {
+    Chunk ret;
+    RangeBuf buf(source, begin, end);
+    std::istream input(&buf);
+    LexerContext lexer(input, filename);
+
+    try {
+        while (lexer.fetchtok()) {
+            ret.tokens.push_back(Lexed(lexer.curtok_, lexer.line_, begin + lexer.consumed_ - lexer.charbuf_.size(), lexer.eos()));
+            lexer.curtok_ = 0;
+        }
+        ret.end_line = lexer.line_;
+    } catch (SyntaxError &error) {
+        ret.failed = true;
+        ret.error = error.message();
+        ret.error_line = lexer.line_;
+    }
+    return ret;
+}
+
+/* Hands out the chunks' tokens in order, as if lexed from one stream */
+bool LexerContext::fetch_lexed() {
+    while (chunk_ < chunks_.size()) {
+        Chunk &chunk = chunks_[chunk_];
+        if (next_ < chunk.tokens.size()) {
+            Lexed &lexed = chunk.tokens[next_++];
+            set_curtok(lexed.token);
+            lexed.token = 0;
+            line_ = chunk.first_line + lexed.line - 1;
+            end_ = lexed.end;
+            eos_ = lexed.eos && chunk_ + 1 == chunks_.size();
+            return true;
+        }
+
+        if (chunk.failed) {
+            line_ = chunk.first_line + chunk.error_line - 1;
+            throw SyntaxError(chunk.error);
+        }
+        ++chunk_;
+        next_ = 0;
+    }
+
+    line_ = end_line_;
+    eos_ = true;
+    return false;
+}
+
 LexerContext::~LexerContext() {
     if (curtok_)
         delete curtok_;
+    for (std::vector<Chunk>::iterator chunk = chunks_.begin(), chunks_end = chunks_.end(); chunk != chunks_end; ++chunk) {
+        for (std::vector<Lexed>::iterator it = chunk->tokens.begin(), end = chunk->tokens.end(); it != end; ++it)
+            delete it->token;
+    }
+}
+
+const std::string LexerContext::stop_capture() {
+    capturing_ = false;
+    if (source_)
+        return source_->substr(capture_begin_, end_ - capture_begin_);
+    return capture_;
 }
 
 /* Getting input */
@@ -59,7 +360,12 @@ char LexerContext::next_char() {
         return c;
     }
 
-    return input_.get();
+    char c = input_->get();
+    ++consumed_;
+    if (capturing_ && input_->good())
+        capture_.push_back(c);
+
+    return c;
 }
 
 bool LexerContext::next_char_equals(char eq) {
@@ -76,7 +382,7 @@ bool LexerContext::next_char_equals(char eq) {
 void LexerContext::strip_whitespace_and_comments() {
     char c = next_char();
 
-    while (isspace(c) || c == '#') {
+    while (transition(state_start, c) == state_space) {
         if (c == '\n')
             ++line_;
 
@@ -120,10 +426,10 @@ bool LexerContext::lex_string() {
 bool LexerContext::lex_number() {
     char c = next_char();
 
-    if (toy_isnumeric(c)) {
+    if (transition(state_start, c) == state_number) {
         std::string number;
 
-        while (toy_isnumeric(c)) {
+        while (transition(state_number, c) == state_number) {
             number.push_back(c);
             c = next_char();
         }
@@ -143,22 +449,19 @@ bool LexerContext::lex_number() {
 bool LexerContext::lex_word_or_keyword() {
     char c = next_char();
 
-    if (isalpha(c)) {
+    if (transition(state_start, c) == state_word) {
         std::string word;
 
-        while (toy_isalphanumeric(c)) {
+        while (transition(state_word, c) == state_word) {
             word.push_back(c);
             c = next_char();
         }
 
         charbuf_.push(c);
 
-        if (word == "def") set_curtok(new Token(tok_def));
-        else if (word == "if") set_curtok(new Token(tok_if));
-        else if (word == "else") set_curtok(new Token(tok_else));
-        else if (word == "while") set_curtok(new Token(tok_while));
-        else if (word == "return") set_curtok(new Token(tok_return));
-        else set_curtok(new Token(tok_word, word));
+        TokenType type = keyword_type(word);
+        if (type == tok_word) set_curtok(new Token(tok_word, word));
+        else set_curtok(new Token(type));
 
         return true;
     }
@@ -190,6 +493,8 @@ bool LexerContext::lex_symbol() {
         case ')': set_curtok(new Token(tok_paren_end)); break;
         case '{': set_curtok(new Token(tok_block_start)); break;
         case '}': set_curtok(new Token(tok_block_end)); break;
+        case '[': set_curtok(new Token(tok_bracket_start)); break;
+        case ']': set_curtok(new Token(tok_bracket_end)); break;
         case '+': set_curtok(new Token(tok_add)); break;
         case '-': set_curtok(new Token(tok_sub)); break;
         case '*': set_curtok(new Token(tok_mul)); break;
@@ -197,6 +502,7 @@ bool LexerContext::lex_symbol() {
         case '%': set_curtok(new Token(tok_mod)); break;
         case ';': set_curtok(new Token(tok_semicolon)); break;
         case ',': set_curtok(new Token(tok_comma)); break;
+        case ':': set_curtok(new Token(tok_colon)); break;
 
         default: {
             charbuf_.push(c);
@@ -208,22 +514,22 @@ bool LexerContext::lex_symbol() {
 }
 
 bool LexerContext::fetchtok() {
+    if (source_)
+        return fetch_lexed();
+
     strip_whitespace_and_comments();
 
     if (eos())
         return false;
 
-    if (lex_string())
-        return true;
-
-    if (lex_number())
-        return true;
-
-    if (lex_word_or_keyword())
-        return true;
-
-    if (lex_symbol())
-        return true;
+    /* Straight to the one kind of token the next byte can start */
+    switch (transition(state_start, charbuf_.front())) {
+        case state_string: if (lex_string()) return true; break;
+        case state_number: if (lex_number()) return true; break;
+        case state_word: if (lex_word_or_keyword()) return true; break;
+        case state_symbol: if (lex_symbol()) return true; break;
+        default: break;
+    }
 
     throw UnexpectedCharacter(next_char());
 }
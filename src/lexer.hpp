@@ -1,9 +1,12 @@
 #ifndef _LEXER_HPP
 #define _LEXER_HPP
 
+#include <cstddef>
 #include <queue>
 #include <string>
 #include <iostream>
+#include <vector>
+#include "thread_pool.hpp"
 #include "toy.hpp"
 
 typedef enum {
@@ -19,11 +22,14 @@ typedef enum {
     /* Grammar */
     tok_paren_start, tok_paren_end,
     tok_block_start, tok_block_end,
+    tok_bracket_start, tok_bracket_end,
     tok_semicolon, tok_comma,
+    tok_colon,
 
     /* Statements */
     tok_while, tok_return, tok_def,
-    tok_assign, tok_if, tok_else
+    tok_assign, tok_if, tok_else,
+    tok_import
 } TokenType;
 
 class Token {
@@ -56,11 +62,26 @@ class Token {
 
 class LexerContext {
   public:
-    explicit LexerContext(std::istream &input)
-        : input_(input),
-          line_(1),
-          filename_("<stdin>"),
-          curtok_(0) {}
+    explicit LexerContext(std::istream &input, const std::string &filename = "<stdin>", unsigned int line = 1)
+        : input_(&input),
+          line_(line),
+          filename_(filename),
+          curtok_(0),
+          capturing_(false),
+          consumed_(0),
+          source_(0),
+          chunk_(0),
+          next_(0),
+          end_(0),
+          capture_begin_(0),
+          eos_(false),
+          end_line_(0) {}
+
+    /* Lexes all of source up front. It is cut into chunks of about
+     * chunk_size bytes at newlines outside of strings, which are lexed in
+     * parallel on the pool and handed out in order; a lexing error is only
+     * thrown once fetchtok() gets to it. source must outlive the lexer. */
+    LexerContext(const std::string &source, const std::string &filename, ThreadPool&, size_t chunk_size = 1 << 20);
     ~LexerContext();
 
     bool fetchtok();
@@ -68,8 +89,49 @@ class LexerContext {
     inline const Token *curtok() const { return curtok_; }
     inline const std::string &filename() const { return filename_; }
     inline unsigned int line() const { return line_; }
-    inline bool eos() const { return !input_.good(); }
+    inline bool eos() const { return input_ ? !input_->good() : eos_; }
+
+    /* Records the source text read from now on, e.g. to parse it again
+     * later. */
+    inline void start_capture() {
+        capture_.clear();
+        capturing_ = true;
+        capture_begin_ = end_;
+    }
+    const std::string stop_capture();
   private:
+    /* A token lexed ahead, with the lexer's state right after it */
+    struct Lexed {
+        Lexed(Token *token, unsigned int line, size_t end, bool eos)
+            : token(token),
+              line(line),
+              end(end),
+              eos(eos) {}
+        Token *token;
+        unsigned int line;
+        size_t end;
+        bool eos;
+    };
+
+    /* The tokens of one chunk, with lines counted from 1; first_line is
+     * filled in afterwards */
+    struct Chunk {
+        Chunk()
+            : first_line(1),
+              end_line(1),
+              failed(false),
+              error_line(0) {}
+        std::vector<Lexed> tokens;
+        unsigned int first_line;
+        unsigned int end_line;
+        bool failed;
+        std::string error;
+        unsigned int error_line;
+    };
+
+    static Chunk lex_chunk(const std::string&, size_t, size_t, const std::string&);
+    bool fetch_lexed();
+
     char next_char();
     bool next_char_equals(char);
 
@@ -87,10 +149,23 @@ class LexerContext {
 
     /* Data */
     std::queue<char> charbuf_;
-    std::istream &input_;
+    std::istream *input_;
     unsigned int line_;
     std::string filename_;
     Token *curtok_;
+    std::string capture_;
+    bool capturing_;
+    size_t consumed_;
+
+    /* Lexed up front */
+    const std::string *source_;
+    std::vector<Chunk> chunks_;
+    size_t chunk_;
+    size_t next_;
+    size_t end_;
+    size_t capture_begin_;
+    bool eos_;
+    unsigned int end_line_;
     DISALLOW_COPY_AND_ASSIGN(LexerContext);
 };
 
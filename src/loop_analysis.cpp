@@ -0,0 +1,369 @@
+#include "loop_analysis.hpp"
+#include <map>
+#include "ast_depth_first.hpp"
+#include "ast_visitor.hpp"
+#include "purity_analysis.hpp"
+
+/* Collects every WhileStatement in a block, including nested ones. */
+class LoopCollector : public ASTVisitor {
+  public:
+    LoopCollector() {}
+
+    virtual void visit(const AST*) {}
+    virtual void visit(const ValueExpr*) {}
+    virtual void visit(const BinaryOpExpr*) {}
+    virtual void visit(const VariableExpr*) {}
+    virtual void visit(const AssignExpr*) {}
+    virtual void visit(const FuncCallExpr*) {}
+    virtual void visit(const ArrayExpr*) {}
+    virtual void visit(const IndexExpr*) {}
+    virtual void visit(const MapExpr*) {}
+    virtual void visit(const ExpressionStatement*) {}
+    virtual void visit(const IfStatement*) {}
+    virtual void visit(const WhileStatement *node) { loops_.push_back(node); }
+    virtual void visit(const ReturnStatement*) {}
+    virtual void visit(const DefStatement*) {}
+    virtual void visit(const ImportStatement*) {}
+
+    inline const std::vector<const WhileStatement*> &loops() const { return loops_; }
+  private:
+    std::vector<const WhileStatement*> loops_;
+    DISALLOW_COPY_AND_ASSIGN(LoopCollector);
+};
+
+/* Collects every BinaryOpExpr in a block, including nested ones. */
+class BinaryOpCollector : public ASTVisitor {
+  public:
+    BinaryOpCollector() {}
+
+    virtual void visit(const AST*) {}
+    virtual void visit(const ValueExpr*) {}
+    virtual void visit(const BinaryOpExpr *node) { binops_.push_back(node); }
+    virtual void visit(const VariableExpr*) {}
+    virtual void visit(const AssignExpr*) {}
+    virtual void visit(const FuncCallExpr*) {}
+    virtual void visit(const ArrayExpr*) {}
+    virtual void visit(const IndexExpr*) {}
+    virtual void visit(const MapExpr*) {}
+    virtual void visit(const ExpressionStatement*) {}
+    virtual void visit(const IfStatement*) {}
+    virtual void visit(const WhileStatement*) {}
+    virtual void visit(const ReturnStatement*) {}
+    virtual void visit(const DefStatement*) {}
+    virtual void visit(const ImportStatement*) {}
+
+    inline const std::vector<const BinaryOpExpr*> &binops() const { return binops_; }
+  private:
+    std::vector<const BinaryOpExpr*> binops_;
+    DISALLOW_COPY_AND_ASSIGN(BinaryOpCollector);
+};
+
+/* What a loop is allowed to assume about the variables it reads. */
+class LoopContext {
+  public:
+    LoopContext(const EffectsVisitor &effects, const std::set<std::string> *locals)
+        : effects_(effects),
+          locals_(locals) {}
+
+    bool is_invariant(const Expression*) const;
+  private:
+    const EffectsVisitor &effects_;
+    const std::set<std::string> *locals_;
+    DISALLOW_COPY_AND_ASSIGN(LoopContext);
+};
+
+bool LoopContext::is_invariant(const Expression *expr) const {
+    switch (expr->type()) {
+        case toy_number:
+        case toy_string:
+            return true;
+        case toy_variable: {
+            const std::string name = static_cast<const VariableExpr*>(expr)->varname();
+            if (effects_.writes().find(name) != effects_.writes().end())
+                return false;
+            if (!effects_.callees().empty() && (!locals_ || locals_->find(name) == locals_->end()))
+                return false;
+            return true;
+        }
+        case toy_binary_op: {
+            const BinaryOpExpr *binop = static_cast<const BinaryOpExpr*>(expr);
+            return is_invariant(binop->left()) && is_invariant(binop->right());
+        }
+        case toy_array: {
+            const std::vector<const Expression*> elements = static_cast<const ArrayExpr*>(expr)->elements();
+            for (std::vector<const Expression*>::const_iterator it = elements.begin(), end = elements.end(); it != end; ++it) {
+                if (!is_invariant(*it))
+                    return false;
+            }
+            return true;
+        }
+        case toy_index: {
+            const IndexExpr *node = static_cast<const IndexExpr*>(expr);
+            return is_invariant(node->container()) && is_invariant(node->index());
+        }
+        case toy_map: {
+            const MapExpr *node = static_cast<const MapExpr*>(expr);
+            const std::vector<const Expression*> keys = node->keys(), values = node->values();
+            for (std::vector<const Expression*>::size_type i = 0; i < keys.size(); ++i) {
+                if (!is_invariant(keys[i]) || !is_invariant(values[i]))
+                    return false;
+            }
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+static void collect_invariants(const LoopContext&, const AST*, std::vector<const BinaryOpExpr*>&);
+
+static void collect_invariants(const LoopContext &ctx, const Expression *expr, std::vector<const BinaryOpExpr*> &out) {
+    switch (expr->type()) {
+        case toy_binary_op: {
+            const BinaryOpExpr *binop = static_cast<const BinaryOpExpr*>(expr);
+            if (ctx.is_invariant(binop)) {
+                out.push_back(binop);
+            } else {
+                collect_invariants(ctx, binop->left(), out);
+                collect_invariants(ctx, binop->right(), out);
+            }
+            break;
+        }
+        case toy_assign:
+            collect_invariants(ctx, static_cast<const AssignExpr*>(expr)->rvalue(), out);
+            break;
+        case toy_function_call: {
+            const std::vector<const Expression*> args = static_cast<const FuncCallExpr*>(expr)->args();
+            for (std::vector<const Expression*>::const_iterator it = args.begin(), end = args.end(); it != end; ++it)
+                collect_invariants(ctx, *it, out);
+            break;
+        }
+        case toy_array: {
+            const std::vector<const Expression*> elements = static_cast<const ArrayExpr*>(expr)->elements();
+            for (std::vector<const Expression*>::const_iterator it = elements.begin(), end = elements.end(); it != end; ++it)
+                collect_invariants(ctx, *it, out);
+            break;
+        }
+        case toy_index: {
+            const IndexExpr *node = static_cast<const IndexExpr*>(expr);
+            collect_invariants(ctx, node->container(), out);
+            collect_invariants(ctx, node->index(), out);
+            break;
+        }
+        case toy_map: {
+            const MapExpr *node = static_cast<const MapExpr*>(expr);
+            const std::vector<const Expression*> keys = node->keys(), values = node->values();
+            for (std::vector<const Expression*>::size_type i = 0; i < keys.size(); ++i) {
+                collect_invariants(ctx, keys[i], out);
+                collect_invariants(ctx, values[i], out);
+            }
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+static void collect_invariants(const LoopContext &ctx, const Statement *statement, std::vector<const BinaryOpExpr*> &out) {
+    switch (statement->type()) {
+        case toy_expression_statement:
+            collect_invariants(ctx, static_cast<const ExpressionStatement*>(statement)->expr(), out);
+            break;
+        case toy_if: {
+            const IfStatement *node = static_cast<const IfStatement*>(statement);
+            collect_invariants(ctx, node->cond(), out);
+            collect_invariants(ctx, node->true_block(), out);
+            if (node->false_block())
+                collect_invariants(ctx, node->false_block(), out);
+            break;
+        }
+        case toy_while: {
+            const WhileStatement *node = static_cast<const WhileStatement*>(statement);
+            collect_invariants(ctx, node->cond(), out);
+            collect_invariants(ctx, node->block(), out);
+            break;
+        }
+        case toy_return:
+            collect_invariants(ctx, static_cast<const ReturnStatement*>(statement)->ret(), out);
+            break;
+        default:
+            break;
+    }
+}
+
+static void collect_invariants(const LoopContext &ctx, const AST *block, std::vector<const BinaryOpExpr*> &out) {
+    const std::vector<const Statement*> nodes = block->nodes();
+    for (std::vector<const Statement*>::const_iterator it = nodes.begin(), end = nodes.end(); it != end; ++it)
+        collect_invariants(ctx, *it, out);
+}
+
+/* Counts the assignments to each variable within a loop. */
+class AssignCounter : public ASTVisitor {
+  public:
+    AssignCounter() {}
+
+    virtual void visit(const AST*) {}
+    virtual void visit(const ValueExpr*) {}
+    virtual void visit(const BinaryOpExpr*) {}
+    virtual void visit(const VariableExpr*) {}
+    virtual void visit(const AssignExpr *node) { ++counts_[node->lvalue()]; }
+    virtual void visit(const FuncCallExpr*) {}
+    virtual void visit(const ArrayExpr*) {}
+    virtual void visit(const IndexExpr*) {}
+    virtual void visit(const MapExpr*) {}
+    virtual void visit(const ExpressionStatement*) {}
+    virtual void visit(const IfStatement*) {}
+    virtual void visit(const WhileStatement*) {}
+    virtual void visit(const ReturnStatement*) {}
+    virtual void visit(const DefStatement*) {}
+    virtual void visit(const ImportStatement*) {}
+
+    inline int count(const std::string &name) const {
+        std::map<std::string, int>::const_iterator it = counts_.find(name);
+        return it == counts_.end() ? 0 : it->second;
+    }
+  private:
+    std::map<std::string, int> counts_;
+    DISALLOW_COPY_AND_ASSIGN(AssignCounter);
+};
+
+static bool is_compare(TokenType op) {
+    return op == tok_lt || op == tok_gt || op == tok_lte || op == tok_gte || op == tok_eq;
+}
+
+const InductionVariable *LoopInfo::induction_var(const std::string &name) const {
+    for (std::vector<InductionVariable>::const_iterator it = induction_vars_.begin(), end = induction_vars_.end(); it != end; ++it) {
+        if (it->name() == name)
+            return &*it;
+    }
+    return 0;
+}
+
+LoopAnalysis::~LoopAnalysis() {
+    for (std::vector<LoopInfo*>::iterator it = loops_.begin(), end = loops_.end(); it != end; ++it)
+        delete *it;
+}
+
+/* Whether expr reads an induction variable of the loop */
+static bool is_induction_var(const LoopInfo *info, const Expression *expr) {
+    return expr->type() == toy_variable && info->induction_var(static_cast<const VariableExpr*>(expr)->varname());
+}
+
+void LoopAnalysis::analyze(LoopInfo *info, const std::set<std::string> *locals) {
+    ASTVisitorDepthFirst strategy;
+    const WhileStatement *loop = info->loop();
+
+    EffectsVisitor effects;
+    AssignCounter assigns;
+    loop->cond()->accept(&strategy, &effects);
+    loop->block()->accept(&strategy, &effects);
+    loop->cond()->accept(&strategy, &assigns);
+    loop->block()->accept(&strategy, &assigns);
+
+    LoopContext ctx(effects, locals);
+
+    /* Only unconditional updates in the loop body itself count; anything
+     * nested in an if or an inner loop may run any number of times. */
+    const std::vector<const Statement*> nodes = loop->block()->nodes();
+    for (std::vector<const Statement*>::const_iterator it = nodes.begin(), end = nodes.end(); it != end; ++it) {
+        if ((*it)->type() != toy_expression_statement)
+            continue;
+
+        const Expression *expr = static_cast<const ExpressionStatement*>(*it)->expr();
+        if (expr->type() != toy_assign)
+            continue;
+
+        const AssignExpr *assign = static_cast<const AssignExpr*>(expr);
+        if (assign->rvalue()->type() != toy_binary_op || assigns.count(assign->lvalue()) != 1)
+            continue;
+
+        const BinaryOpExpr *update = static_cast<const BinaryOpExpr*>(assign->rvalue());
+        if (update->op_type() != tok_add && update->op_type() != tok_sub)
+            continue;
+
+        const Expression *self = update->left(), *step = update->right();
+        if (update->op_type() == tok_add && step->type() == toy_variable
+                && static_cast<const VariableExpr*>(step)->varname() == assign->lvalue()) {
+            self = update->right();
+            step = update->left();
+        }
+
+        if (self->type() != toy_variable || static_cast<const VariableExpr*>(self)->varname() != assign->lvalue())
+            continue;
+        if (!ctx.is_invariant(step))
+            continue;
+
+        info->induction_vars_.push_back(InductionVariable(assign->lvalue(), update->op_type(), step));
+    }
+
+    collect_invariants(ctx, loop->cond(), info->invariants_);
+    collect_invariants(ctx, loop->block(), info->invariants_);
+
+    if (loop->cond()->type() == toy_binary_op) {
+        const BinaryOpExpr *cond = static_cast<const BinaryOpExpr*>(loop->cond());
+        if (is_compare(cond->op_type())) {
+            const Expression *left = cond->left(), *right = cond->right();
+            if ((left->type() == toy_variable && info->induction_var(static_cast<const VariableExpr*>(left)->varname()) && ctx.is_invariant(right))
+                    || (right->type() == toy_variable && info->induction_var(static_cast<const VariableExpr*>(right)->varname()) && ctx.is_invariant(left)))
+                info->exit_compare_ = cond;
+        }
+    }
+
+    BinaryOpCollector binops;
+    loop->cond()->accept(&strategy, &binops);
+    loop->block()->accept(&strategy, &binops);
+    for (std::vector<const BinaryOpExpr*>::const_iterator it = binops.binops().begin(), end = binops.binops().end(); it != end; ++it) {
+        const Expression *left = (*it)->left(), *right = (*it)->right();
+        if ((*it)->op_type() == tok_mul && ((is_induction_var(info, left) && right->type() == toy_number)
+                || (is_induction_var(info, right) && left->type() == toy_number)))
+            info->products_.push_back(*it);
+    }
+}
+
+void LoopAnalysis::analyze_block(const AST *block, const std::set<std::string> *locals) {
+    ASTVisitorDepthFirst strategy;
+    LoopCollector collector;
+    block->accept(&strategy, &collector);
+
+    for (std::vector<const WhileStatement*>::const_iterator it = collector.loops().begin(), end = collector.loops().end(); it != end; ++it) {
+        LoopInfo *info = new LoopInfo(*it);
+        analyze(info, locals);
+        loops_.push_back(info);
+    }
+}
+
+void LoopAnalysis::run() {
+    ASTVisitorDepthFirst strategy;
+    std::vector<const DefStatement*> defs;
+    std::vector<const Statement*> top_level;
+    std::set<std::string> globals;
+
+    const std::vector<const Statement*> nodes = ast_->nodes();
+    for (std::vector<const Statement*>::const_iterator it = nodes.begin(), end = nodes.end(); it != end; ++it) {
+        if ((*it)->type() == toy_def) {
+            defs.push_back(static_cast<const DefStatement*>(*it));
+        } else {
+            EffectsVisitor effects;
+            (*it)->accept(&strategy, &effects);
+            globals.insert(effects.writes().begin(), effects.writes().end());
+            top_level.push_back(*it);
+        }
+    }
+
+    AST top_level_block(top_level);
+    analyze_block(&top_level_block, 0);
+
+    for (std::vector<const DefStatement*>::const_iterator it = defs.begin(), end = defs.end(); it != end; ++it) {
+        EffectsVisitor effects;
+        (*it)->block()->accept(&strategy, &effects);
+
+        const std::vector<std::string> params = (*it)->params();
+        std::set<std::string> locals(params.begin(), params.end());
+        for (std::set<std::string>::const_iterator name = effects.writes().begin(), nend = effects.writes().end(); name != nend; ++name) {
+            if (globals.find(*name) == globals.end())
+                locals.insert(*name);
+        }
+
+        analyze_block((*it)->block(), &locals);
+    }
+}
@@ -0,0 +1,92 @@
+#ifndef _LOOP_ANALYSIS_HPP
+#define _LOOP_ANALYSIS_HPP
+
+#include <set>
+#include <string>
+#include <vector>
+#include "ast.hpp"
+#include "lexer.hpp"
+#include "toy.hpp"
+
+/* A variable that changes by the same loop invariant amount once per
+ * iteration, i.e. the loop body contains exactly one unconditional
+ * `i = i + step;` (or `-`) and no other assignment to i. */
+class InductionVariable {
+  public:
+    InductionVariable(const std::string &name, TokenType op, const Expression *step)
+        : name_(name),
+          op_(op),
+          step_(step) {}
+    inline const std::string &name() const { return name_; }
+    inline TokenType op() const { return op_; }
+    inline const Expression *step() const { return step_; }
+  private:
+    std::string name_;
+    TokenType op_;
+    const Expression *step_;
+};
+
+class LoopInfo {
+  public:
+    explicit LoopInfo(const WhileStatement *loop)
+        : loop_(loop),
+          exit_compare_(0) {}
+
+    inline const WhileStatement *loop() const { return loop_; }
+    inline const std::vector<InductionVariable> &induction_vars() const { return induction_vars_; }
+
+    /* Maximal loop invariant BinaryOpExpr subtrees, in source order. These
+     * can be evaluated once before the loop instead of on every iteration. */
+    inline const std::vector<const BinaryOpExpr*> &invariants() const { return invariants_; }
+
+    /* Set when the loop condition compares an induction variable with a
+     * loop invariant value, e.g. `while (i <= n)`, so the update and the
+     * compare can be fused into a single increment-and-branch. */
+    inline const BinaryOpExpr *exit_compare() const { return exit_compare_; }
+
+    /* Products of an induction variable and a number literal, e.g.
+     * `i * 8`, in source order. They only change when the variable does,
+     * so they can be updated along with it instead of at every use. */
+    inline const std::vector<const BinaryOpExpr*> &products() const { return products_; }
+
+    const InductionVariable *induction_var(const std::string&) const;
+  private:
+    friend class LoopAnalysis;
+
+    const WhileStatement *loop_;
+    std::vector<InductionVariable> induction_vars_;
+    std::vector<const BinaryOpExpr*> invariants_;
+    const BinaryOpExpr *exit_compare_;
+    std::vector<const BinaryOpExpr*> products_;
+    DISALLOW_COPY_AND_ASSIGN(LoopInfo);
+};
+
+/* Finds induction variables, invariant expressions and induction compares
+ * for every WhileStatement in a program.
+ *
+ * Function calls inside a loop are assumed to be able to change any
+ * top-level variable, but not the parameters and locals of the function
+ * the loop lives in.
+ */
+class LoopAnalysis {
+  public:
+    explicit LoopAnalysis(const AST *ast)
+        : ast_(ast) {}
+    ~LoopAnalysis();
+
+    void run();
+
+    inline const std::vector<LoopInfo*> &loops() const { return loops_; }
+
+    /* Analyzes one loop on its own. locals are the names calls can't
+     * change, or null at the top level. */
+    static void analyze(LoopInfo*, const std::set<std::string> *locals);
+  private:
+    void analyze_block(const AST*, const std::set<std::string>*);
+
+    const AST *ast_;
+    std::vector<LoopInfo*> loops_;
+    DISALLOW_COPY_AND_ASSIGN(LoopAnalysis);
+};
+
+#endif
@@ -1,30 +1,463 @@
+#include <cstdlib>
+#include <fstream>
 #include <iostream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "ast_depth_first.hpp"
+#include "cpp_emitter.hpp"
+#include "dead_code_elimination.hpp"
 #include "exceptions.hpp"
+#include "frame_layout.hpp"
+#include "interpreter.hpp"
 #include "lexer.hpp"
+#include "module_loader.hpp"
+#include "native_module.hpp"
 #include "parser.hpp"
-#include "toy.hpp"
 #include "pprinter_visitor.hpp"
-#include "ast_depth_first.hpp"
+#include "program.hpp"
+#include "scheduler.hpp"
+#include "snapshot.hpp"
+#include "ssa.hpp"
+#include "ssa_passes.hpp"
+#include "thread_pool.hpp"
+#include "toy.hpp"
+#include "type_inference.hpp"
 
-int main() {
-    LexerContext lexer(std::cin);
-    ParserContext parse(lexer);
+/* Directories in $TOY_PATH, separated by ':' */
+static std::vector<std::string> search_path() {
+    std::vector<std::string> ret;
+    const char *env = getenv("TOY_PATH");
+    if (!env)
+        return ret;
 
-    AST *ast = 0;
+    std::string path(env);
+    std::string::size_type start = 0, colon;
+    while ((colon = path.find(':', start)) != std::string::npos) {
+        if (colon > start)
+            ret.push_back(path.substr(start, colon - start));
+        start = colon + 1;
+    }
+    if (start < path.size())
+        ret.push_back(path.substr(start));
+    return ret;
+}
+
+/* $TOY_MAX_INSTRUCTIONS, $TOY_MAX_SECONDS, $TOY_MAX_MEMORY (bytes) and
+ * $TOY_STACK_SIZE (values) */
+static Interpreter::Limits limits() {
+    Interpreter::Limits ret;
+    if (getenv("TOY_MAX_INSTRUCTIONS"))
+        ret.instructions = strtoul(getenv("TOY_MAX_INSTRUCTIONS"), 0, 10);
+    if (getenv("TOY_MAX_SECONDS"))
+        ret.seconds = strtod(getenv("TOY_MAX_SECONDS"), 0);
+    if (getenv("TOY_MAX_MEMORY"))
+        ret.memory = strtoul(getenv("TOY_MAX_MEMORY"), 0, 10);
+    if (getenv("TOY_STACK_SIZE"))
+        ret.stack = strtoul(getenv("TOY_STACK_SIZE"), 0, 10);
+    return ret;
+}
+
+/* $TOY_TIER_THRESHOLD, 0 to stay on the AST walk, $TOY_TIER_BACKGROUND, 0
+ * to compile on the interpreter's thread, $TOY_TIER_EAGER, 1 to compile
+ * every function up front, and $TOY_TIER_SPECIALIZE, 0 not to specialize
+ * functions for numeric parameters */
+static Interpreter::Tiering tiering() {
+    Interpreter::Tiering ret;
+    if (getenv("TOY_TIER_THRESHOLD"))
+        ret.threshold = strtoul(getenv("TOY_TIER_THRESHOLD"), 0, 10);
+    if (getenv("TOY_TIER_BACKGROUND"))
+        ret.background = strtoul(getenv("TOY_TIER_BACKGROUND"), 0, 10) != 0;
+    if (getenv("TOY_TIER_EAGER"))
+        ret.eager = strtoul(getenv("TOY_TIER_EAGER"), 0, 10) != 0;
+    if (getenv("TOY_TIER_SPECIALIZE"))
+        ret.specialize = strtoul(getenv("TOY_TIER_SPECIALIZE"), 0, 10) != 0;
+    return ret;
+}
+
+/* $TOY_MEMO_SIZE, results kept, 0 to turn memoization off, and
+ * $TOY_MEMO_EXCLUDE, functions never to memoize, separated by ',' */
+static Interpreter::Memoization memoization() {
+    Interpreter::Memoization ret;
+    if (getenv("TOY_MEMO_SIZE"))
+        ret.capacity = strtoul(getenv("TOY_MEMO_SIZE"), 0, 10);
+    if (getenv("TOY_MEMO_EXCLUDE")) {
+        std::istringstream names(getenv("TOY_MEMO_EXCLUDE"));
+        std::string name;
+        while (std::getline(names, name, ','))
+            ret.excluded.insert(name);
+    }
+    return ret;
+}
+
+/* $TOY_PROFILE, a file to write folded stacks to, or $TOY_PROFILE_STATS,
+ * to print the histograms, sample every $TOY_PROFILE_INTERVAL seconds of
+ * CPU time, by default every millisecond */
+static Interpreter::Profiling profiling() {
+    Interpreter::Profiling ret;
+    if (getenv("TOY_PROFILE") || getenv("TOY_PROFILE_STATS"))
+        ret.interval = getenv("TOY_PROFILE_INTERVAL") ? strtod(getenv("TOY_PROFILE_INTERVAL"), 0) : 0.001;
+    return ret;
+}
+
+static void print_memo_stats(const Interpreter::MemoStats &stats) {
+    const unsigned long calls = stats.hits + stats.misses;
+    std::cerr << "memo hits: " << stats.hits << ", misses: " << stats.misses << ", evictions: " << stats.evictions
+              << ", hit rate: " << (calls ? 100.0 * stats.hits / calls : 0) << "%" << std::endl;
+}
+
+static void print_tier_stats(const Interpreter::TierStats &stats) {
+    std::cerr << "interpreted: " << stats.interpreted_seconds << "s, compiled: " << stats.compiled_seconds
+              << "s, compiling: " << stats.compile_seconds << "s" << std::endl
+              << "compilations: " << stats.compilations << ", osr entries: " << stats.osr_entries
+              << ", deoptimizations: " << stats.deoptimizations << ", guard failures: " << stats.guard_failures << std::endl;
+}
+
+/* Loads a program to run, with dead code removed: functions are only kept
+ * if the top-level code can call them */
+static const Program *load(const std::string &filename) {
+    ModuleLoader loader(search_path());
+    if (getenv("TOY_CACHE"))
+        loader.set_cache_dir(getenv("TOY_CACHE"));
+    return DeadCodeElimination::optimize(loader.load(filename));
+}
+
+/* Loads a program whose every function may be called from outside, unless
+ * the entry points are given */
+static const Program *load_library(const std::string &filename, const std::set<std::string> &entry_points) {
+    ModuleLoader loader(search_path());
+    if (getenv("TOY_CACHE"))
+        loader.set_cache_dir(getenv("TOY_CACHE"));
+    const Program *program = loader.load(filename);
+
+    std::set<std::string> keep = entry_points;
+    if (keep.empty()) {
+        for (std::map<std::string, const DefStatement*>::const_iterator it = program->functions().begin(), end = program->functions().end(); it != end; ++it)
+            keep.insert(it->first);
+    }
+    return DeadCodeElimination::optimize(program, keep);
+}
+
+static bool has_suffix(const std::string &string, const std::string &suffix) {
+    return string.size() >= suffix.size() && string.compare(string.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+/* toy --print-ast [script.toy]: parse the script, or stdin, without
+ * running it, and print the AST with PrettyPrinterVisitor, as toy did
+ * before it ran scripts. Function bodies are parsed up front, so any
+ * syntax error shows. */
+static int print_ast(const std::string &filename) {
+    std::ifstream file;
+    if (!filename.empty()) {
+        file.open(filename.c_str());
+        if (!file) {
+            std::cout << "Cannot open " << filename << std::endl;
+            return 1;
+        }
+    }
+    LexerContext lexer(filename.empty() ? std::cin : file, filename.empty() ? "<stdin>" : filename);
 
+    AST *ast = 0;
     try {
-        ast = parse.parse_ast(false);
+        ParserContext parser(lexer);
+        ast = parser.parse_ast(false);
     } catch (SyntaxError &error) {
-        std::cout << error.message() << std::endl;
+        std::cout << lexer.filename() << ":" << lexer.line() << ": " << error.message() << std::endl;
         return 1;
     }
 
     PrettyPrinterVisitor ppv;
     ASTVisitorDepthFirst df_strategy;
     ast->accept(&df_strategy, &ppv);
-
     std::cout << ppv.buffer();
 
     delete ast;
     return 0;
 }
+
+/* toy --emit-cpp script.toy [function...]: print the program as C++, see
+ * CppEmitterVisitor. The module can call every function, or just the ones
+ * listed and what they call. */
+static int emit_cpp(const std::string &filename, const std::set<std::string> &entry_points) {
+    const Program *program = 0;
+    try {
+        program = load_library(filename, entry_points);
+    } catch (SyntaxError &error) {
+        std::cerr << error.message() << std::endl;
+        return 1;
+    }
+
+    int ret = 0;
+    try {
+        /* Parses every function body that is still lazy */
+        TypeInference types(program->ast());
+        types.run();
+
+        CppEmitterVisitor emitter(program->ast(), types);
+        ASTVisitorDepthFirst df_strategy;
+        program->ast()->accept(&df_strategy, &emitter);
+        std::cout << emitter.buffer();
+    } catch (SyntaxError &error) {
+        std::cerr << error.message() << std::endl;
+        ret = 1;
+    }
+
+    delete program;
+    return ret;
+}
+
+/* toy --emit-ssa script.toy [function...]: print each top-level function,
+ * or the ones listed and what they call, as optimized SSA, see
+ * SsaPassManager */
+static int emit_ssa(const std::string &filename, const std::set<std::string> &entry_points) {
+    const Program *program = 0;
+    try {
+        program = load_library(filename, entry_points);
+    } catch (SyntaxError &error) {
+        std::cerr << error.message() << std::endl;
+        return 1;
+    }
+
+    std::vector<const DefStatement*> defs;
+    const std::vector<const Statement*> &nodes = program->ast()->nodes();
+    for (std::vector<const Statement*>::const_iterator it = nodes.begin(), end = nodes.end(); it != end; ++it) {
+        if ((*it)->type() == toy_def)
+            defs.push_back(static_cast<const DefStatement*>(*it));
+    }
+
+    /* One task per function, each with its output or its error, printed in
+     * source order up to the first error */
+    std::vector<std::pair<std::string, std::string> > dumps;
+    ThreadPool pool;
+    pool.parallel_map(defs, dumps, [program](const DefStatement *def) {
+        std::ostringstream ss;
+        try {
+            SsaPassManager passes;
+            passes.add_defaults();
+            FrameLayout layout(def);
+            SsaFunction *function = SsaFunction::build(def, layout, *program);
+            passes.run(*function);
+            function->dump(ss);
+            delete function;
+        } catch (SyntaxError &error) {
+            return std::make_pair(ss.str(), error.message());
+        }
+        return std::make_pair(ss.str(), std::string());
+    });
+
+    int ret = 0;
+    for (std::vector<std::pair<std::string, std::string> >::const_iterator it = dumps.begin(), end = dumps.end(); it != end; ++it) {
+        if (!it->second.empty()) {
+            std::cerr << it->second << std::endl;
+            ret = 1;
+            break;
+        }
+        std::cout << it->first;
+    }
+
+    delete program;
+    return ret;
+}
+
+/* toy --concurrent a.toy b.toy ...: run the scripts interleaved on one
+ * thread, see Scheduler */
+static int run_concurrent(const std::vector<std::string> &filenames) {
+    std::vector<const Program*> programs;
+    for (std::vector<std::string>::const_iterator it = filenames.begin(), end = filenames.end(); it != end; ++it) {
+        try {
+            programs.push_back(load(*it));
+        } catch (SyntaxError &error) {
+            std::cout << error.message() << std::endl;
+            for (std::vector<const Program*>::const_iterator program = programs.begin(); program != programs.end(); ++program)
+                delete *program;
+            return 1;
+        }
+    }
+
+    unsigned int failed;
+    {
+        Scheduler scheduler;
+        scheduler.set_limits(limits());
+        scheduler.set_tiering(tiering());
+        scheduler.set_memoization(memoization());
+        for (std::vector<const Program*>::const_iterator it = programs.begin(), end = programs.end(); it != end; ++it)
+            scheduler.spawn(**it);
+        failed = scheduler.run();
+    }
+
+    for (std::vector<const Program*>::const_iterator it = programs.begin(), end = programs.end(); it != end; ++it)
+        delete *it;
+    return failed > 0 ? 1 : 0;
+}
+
+/* Runs a program's top-level code on an interpreter set up from the
+ * environment, reporting errors like the default mode */
+static int run(const Program &program, Interpreter &interpreter) {
+    interpreter.set_limits(limits());
+    interpreter.set_tiering(tiering());
+    interpreter.set_memoization(memoization());
+    interpreter.set_profiling(profiling());
+
+    int ret = 0;
+    try {
+        interpreter.run();
+    } catch (RuntimeError &error) {
+        std::cout << program.filename() << ":" << error.line() << ": " << error.message() << std::endl;
+        ret = 1;
+    } catch (SyntaxError &error) {
+        /* From a function body parsed on first call */
+        std::cout << error.message() << std::endl;
+        ret = 1;
+    }
+
+    if (getenv("TOY_TIER_STATS"))
+        print_tier_stats(interpreter.tier_stats());
+    if (getenv("TOY_MEMO_STATS"))
+        print_memo_stats(interpreter.memo_stats());
+    if (getenv("TOY_PROFILE")) {
+        std::ofstream out(getenv("TOY_PROFILE"));
+        interpreter.sampler().write_folded(out, program.filename());
+    }
+    if (getenv("TOY_PROFILE_STATS"))
+        interpreter.sampler().write_histograms(std::cerr, program.filename());
+#ifdef TOY_PROFILE_OPCODES
+    /* Appended to, so runs can share a file */
+    if (getenv("TOY_OPCODE_PROFILE")) {
+        std::ofstream out(getenv("TOY_OPCODE_PROFILE"), std::ios::app);
+        OpcodeProfile::write(out);
+    }
+#endif
+    return ret;
+}
+
+/* toy --save-snapshot image prelude.toy: run the prelude and save the
+ * interpreter as it is after, see Snapshot. Nothing is left out as dead
+ * code, as the functions are meant to be called later. */
+static int save_snapshot(const std::string &image, const std::string &filename) {
+    const Program *program = 0;
+    try {
+        ModuleLoader loader(search_path());
+        program = loader.load(filename);
+    } catch (SyntaxError &error) {
+        std::cout << error.message() << std::endl;
+        return 1;
+    }
+
+    int ret;
+    {
+        Interpreter interpreter(*program);
+        ret = run(*program, interpreter);
+        if (ret == 0) {
+            std::ofstream out(image.c_str(), std::ios::binary);
+            Snapshot::save(out, *program, interpreter);
+            if (!out) {
+                std::cout << "Cannot write " << image << std::endl;
+                ret = 1;
+            }
+        }
+    }
+
+    delete program;
+    return ret;
+}
+
+/* toy --snapshot image script.toy: run the script with the functions and
+ * globals of a saved prelude */
+static int run_snapshot(const std::string &image, const std::string &filename) {
+    Interpreter::Scope globals;
+    const Program *base = 0, *script = 0;
+    try {
+        std::ifstream in(image.c_str(), std::ios::binary);
+        if (!in)
+            throw SnapshotError("Cannot open " + image);
+        base = Snapshot::load(in, globals);
+
+        ModuleLoader loader(search_path());
+        script = loader.load(filename);
+    } catch (SnapshotError &error) {
+        std::cout << image << ": " << error.message() << std::endl;
+        delete base;
+        return 1;
+    } catch (SyntaxError &error) {
+        std::cout << error.message() << std::endl;
+        delete base;
+        return 1;
+    }
+
+    const Program *program = Program::extend(*base, *script);
+    int ret;
+    {
+        Interpreter interpreter(*program);
+        interpreter.set_globals(globals);
+        ret = run(*program, interpreter);
+    }
+
+    delete program;
+    delete script;
+    delete base;
+    return ret;
+}
+
+/* toy script.so: run a program compiled with --emit-cpp */
+static int run_native(const std::string &filename) {
+    NativeModule *module = 0;
+    try {
+        module = NativeModule::load(filename);
+    } catch (SyntaxError &error) {
+        std::cout << error.message() << std::endl;
+        return 1;
+    }
+
+    int ret = 0;
+    try {
+        module->run();
+    } catch (RuntimeError &error) {
+        std::cout << module->filename() << ":" << error.line() << ": " << error.message() << std::endl;
+        ret = 1;
+    }
+
+    delete module;
+    return ret;
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1 && std::string(argv[1]) == "--print-ast")
+        return print_ast(argc > 2 ? argv[2] : "");
+    if (argc > 2 && std::string(argv[1]) == "--emit-cpp")
+        return emit_cpp(argv[2], std::set<std::string>(argv + 3, argv + argc));
+    if (argc > 2 && std::string(argv[1]) == "--emit-ssa")
+        return emit_ssa(argv[2], std::set<std::string>(argv + 3, argv + argc));
+    if (argc > 2 && std::string(argv[1]) == "--concurrent")
+        return run_concurrent(std::vector<std::string>(argv + 2, argv + argc));
+    if (argc > 3 && std::string(argv[1]) == "--save-snapshot")
+        return save_snapshot(argv[2], argv[3]);
+    if (argc > 3 && std::string(argv[1]) == "--snapshot")
+        return run_snapshot(argv[2], argv[3]);
+    if (argc > 1 && has_suffix(argv[1], ".so"))
+        return run_native(argv[1]);
+
+    const Program *program = 0;
+
+    try {
+        if (argc > 1)
+            program = load(argv[1]);
+        else
+            program = DeadCodeElimination::optimize(Program::compile(std::cin, "<stdin>"));
+    } catch (SyntaxError &error) {
+        std::cout << error.message() << std::endl;
+        return 1;
+    }
+
+    int ret;
+
+    /* The interpreter may still be compiling, so it goes first */
+    {
+        Interpreter interpreter(*program);
+        ret = run(*program, interpreter);
+    }
+
+    delete program;
+    return ret;
+}
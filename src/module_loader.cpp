@@ -0,0 +1,196 @@
+#include "module_loader.hpp"
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <sstream>
+#include <sys/stat.h>
+#include "exceptions.hpp"
+#include "snapshot.hpp"
+
+/* Canonical path of an existing regular file, or "" */
+static const std::string real_file(const std::string &path) {
+    char buffer[PATH_MAX];
+    struct stat st;
+
+    if (!realpath(path.c_str(), buffer) || stat(buffer, &st) != 0 || !S_ISREG(st.st_mode))
+        return "";
+    return buffer;
+}
+
+static const std::string dirname_of(const std::string &path) {
+    std::string::size_type slash = path.rfind('/');
+    return slash == std::string::npos ? "." : path.substr(0, slash);
+}
+
+const Program *ModuleLoader::load(const std::string &filename) {
+    const std::string root = real_file(filename);
+    if (root.empty())
+        throw SyntaxError("Cannot open " + filename);
+
+    modules_.clear();
+    definitions_.clear();
+    cache_hits_ = 0;
+
+    std::vector<std::string> wave(1, root);
+    modules_[root];
+
+    while (!wave.empty()) {
+        std::vector<AST*> asts;
+        pool_.parallel_map(wave, asts, [this](const std::string &path) { return parse(path); });
+
+        std::vector<std::string> next;
+        for (std::vector<std::string>::size_type i = 0; i < wave.size(); ++i) {
+            Module &module = modules_[wave[i]];
+            module.ast = asts[i];
+
+            const std::vector<const Statement*> &nodes = module.ast->nodes();
+            for (std::vector<const Statement*>::const_iterator it = nodes.begin(), end = nodes.end(); it != end; ++it) {
+                if ((*it)->type() != toy_import)
+                    continue;
+
+                const ImportStatement *import = static_cast<const ImportStatement*>(*it);
+                const std::string path = resolve(import->module(), wave[i], import->line());
+                module.deps.push_back(path);
+
+                if (modules_.find(path) == modules_.end()) {
+                    modules_[path];
+                    next.push_back(path);
+                }
+            }
+        }
+
+        wave = next;
+    }
+
+    std::set<std::string> visiting, done;
+    std::vector<const Statement*> statements;
+    link(root, visiting, done, statements);
+
+    return new Program(filename, new AST(statements));
+}
+
+const std::string ModuleLoader::resolve(const std::string &module, const std::string &importer, unsigned int line) const {
+    std::string name = module;
+    if (name.size() < 4 || name.compare(name.size() - 4, 4, ".toy") != 0)
+        name += ".toy";
+
+    std::string found;
+    if (name[0] == '/') {
+        found = real_file(name);
+    } else {
+        found = real_file(dirname_of(importer) + "/" + name);
+        for (std::vector<std::string>::const_iterator it = search_path_.begin(), end = search_path_.end(); found.empty() && it != end; ++it)
+            found = real_file(*it + "/" + name);
+    }
+
+    if (found.empty()) {
+        std::ostringstream ss;
+        ss << importer << ":" << line << ": Cannot find module '" << module << "'";
+        throw SyntaxError(ss.str());
+    }
+    return found;
+}
+
+void ModuleLoader::link(const std::string &path, std::set<std::string> &visiting, std::set<std::string> &done, std::vector<const Statement*> &out) {
+    if (done.find(path) != done.end())
+        return;
+    if (visiting.find(path) != visiting.end())
+        throw SyntaxError("Import cycle through " + path);
+
+    visiting.insert(path);
+    const Module &module = modules_[path];
+    for (std::vector<std::string>::const_iterator it = module.deps.begin(), end = module.deps.end(); it != end; ++it)
+        link(*it, visiting, done, out);
+    visiting.erase(path);
+    done.insert(path);
+
+    /* A file may redefine its own functions, but two modules defining the
+     * same name would silently depend on the import order */
+    const std::vector<const Statement*> &nodes = module.ast->nodes();
+    for (std::vector<const Statement*>::const_iterator it = nodes.begin(), end = nodes.end(); it != end; ++it) {
+        if ((*it)->type() != toy_def)
+            continue;
+
+        const std::string &name = static_cast<const DefStatement*>(*it)->name();
+        std::map<std::string, std::string>::const_iterator defined = definitions_.find(name);
+        if (defined != definitions_.end() && defined->second != path) {
+            std::ostringstream ss;
+            ss << path << ":" << (*it)->line() << ": Function '" << name << "' is already defined in " << defined->second;
+            throw SyntaxError(ss.str());
+        }
+        definitions_[name] = path;
+    }
+
+    out.insert(out.end(), nodes.begin(), nodes.end());
+}
+
+/* Parsing and caching; these run on the pool */
+
+AST *ModuleLoader::parse(const std::string &path) {
+    std::string source_stamp;
+    if (!cache_dir_.empty()) {
+        source_stamp = stamp(path);
+        AST *cached = load_cached(path, source_stamp);
+        if (cached) {
+            ++cache_hits_;
+            return cached;
+        }
+    }
+
+    std::ifstream input(path.c_str());
+    if (!input)
+        throw SyntaxError("Cannot open " + path);
+
+    AST *ast = Program::parse(input, path);
+
+    if (!cache_dir_.empty())
+        store_cached(path, source_stamp, ast);
+    return ast;
+}
+
+const std::string ModuleLoader::stamp(const std::string &path) const {
+    struct stat st;
+    std::ostringstream ss;
+
+    if (stat(path.c_str(), &st) == 0)
+        ss << path << " " << st.st_size << " " << st.st_mtim.tv_sec << "." << st.st_mtim.tv_nsec;
+    return ss.str();
+}
+
+const std::string ModuleLoader::cache_path(const std::string &path) const {
+    std::ostringstream ss;
+    ss << cache_dir_ << "/" << std::hex << std::hash<std::string>()(path) << ".ast";
+    return ss.str();
+}
+
+AST *ModuleLoader::load_cached(const std::string &path, const std::string &source_stamp) const {
+    std::ifstream input(cache_path(path).c_str(), std::ios::binary);
+    std::string cached_stamp;
+
+    if (!input || !std::getline(input, cached_stamp) || cached_stamp != source_stamp)
+        return 0;
+
+    try {
+        return Snapshot::load_ast(input);
+    } catch (SnapshotError&) {
+        return 0;
+    }
+}
+
+void ModuleLoader::store_cached(const std::string &path, const std::string &source_stamp, const AST *ast) const {
+    const std::string cached = cache_path(path);
+    const std::string tmp = cached + ".tmp";
+
+    {
+        std::ofstream output(tmp.c_str(), std::ios::binary);
+        if (!output)
+            return;
+        output << source_stamp << "\n";
+        Snapshot::save_ast(output, ast);
+    }
+
+    /* Readers only ever see complete files */
+    rename(tmp.c_str(), cached.c_str());
+}
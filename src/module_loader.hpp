@@ -0,0 +1,66 @@
+#ifndef _MODULE_LOADER_HPP
+#define _MODULE_LOADER_HPP
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include "ast.hpp"
+#include "program.hpp"
+#include "thread_pool.hpp"
+#include "toy.hpp"
+
+/* Loads a script together with every module it imports, directly or not.
+ *
+ * `import "name";` at the top level of a file pulls in name.toy, looked up
+ * first next to the importing file and then in each directory of the
+ * search path. The modules form a DAG. Each wave of newly discovered
+ * modules is parsed in parallel on a thread pool, and the modules are
+ * linked into one Program in dependency order, so a module's top-level
+ * code runs before that of anything importing it. Import cycles, and two
+ * modules defining the same function, are errors.
+ *
+ * With a cache directory set, parsed modules are stored there and reused
+ * as long as the source file's size and modification time are unchanged.
+ */
+class ModuleLoader {
+  public:
+    explicit ModuleLoader(const std::vector<std::string> &search_path)
+        : search_path_(search_path),
+          cache_hits_(0) {}
+
+    inline void set_cache_dir(const std::string &dir) { cache_dir_ = dir; }
+
+    /* Throws SyntaxError for parse errors and unresolvable or cyclic
+     * imports. */
+    const Program *load(const std::string &filename);
+
+    /* Number of modules taken from the cache by the last load() */
+    inline unsigned int cache_hits() const { return cache_hits_; }
+  private:
+    struct Module {
+        Module()
+            : ast(0) {}
+        const AST *ast;
+        std::vector<std::string> deps;
+    };
+
+    const std::string resolve(const std::string&, const std::string&, unsigned int) const;
+    const std::string stamp(const std::string&) const;
+    AST *parse(const std::string&);
+    const std::string cache_path(const std::string&) const;
+    AST *load_cached(const std::string&, const std::string&) const;
+    void store_cached(const std::string&, const std::string&, const AST*) const;
+    void link(const std::string&, std::set<std::string>&, std::set<std::string>&, std::vector<const Statement*>&);
+
+    std::vector<std::string> search_path_;
+    std::string cache_dir_;
+    std::map<std::string, Module> modules_;
+    /* The module each function linked so far comes from */
+    std::map<std::string, std::string> definitions_;
+    ThreadPool pool_;
+    std::atomic<unsigned int> cache_hits_;
+    DISALLOW_COPY_AND_ASSIGN(ModuleLoader);
+};
+
+#endif
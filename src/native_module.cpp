@@ -0,0 +1,38 @@
+#include "native_module.hpp"
+#include <dlfcn.h>
+#include "exceptions.hpp"
+#include "runtime.hpp"
+
+NativeModule *NativeModule::load(const std::string &path) {
+    /* dlopen() only searches the library path for bare names */
+    const std::string filename = path.find('/') == std::string::npos ? "./" + path : path;
+
+    void *handle = dlopen(filename.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (!handle)
+        throw SyntaxError(std::string("Cannot load ") + dlerror());
+
+    MainFunction main = (MainFunction)dlsym(handle, "toy_main");
+    CallFunction call = (CallFunction)dlsym(handle, "toy_call");
+    if (!main || !call) {
+        dlclose(handle);
+        throw SyntaxError(path + " is not a compiled Toy program");
+    }
+
+    return new NativeModule(path, handle, main, call);
+}
+
+NativeModule::~NativeModule() {
+    dlclose(handle_);
+}
+
+void NativeModule::run(std::ostream &out) const {
+    main_(out);
+}
+
+Value NativeModule::call(const std::string &funcname, const std::vector<Value> &args, std::ostream &out) const {
+    Value ret;
+    if (call_(funcname.c_str(), args, out, ret))
+        return ret;
+
+    return Runtime::builtin(funcname, args, out, 0);
+}
@@ -0,0 +1,47 @@
+#ifndef _NATIVE_MODULE_HPP
+#define _NATIVE_MODULE_HPP
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include "toy.hpp"
+#include "toyobj.hpp"
+
+/* A Toy program compiled ahead of time to a shared object, see
+ * CppEmitterVisitor. It runs like an Interpreter over the same program.
+ *
+ * The object resolves Value, Runtime and RuntimeError against the
+ * executable loading it, which must be linked with -rdynamic. Its globals
+ * live in the object itself, so a given object is loaded once per process.
+ *
+ *     $ make script.so
+ *     $ ./toy script.so
+ */
+class NativeModule {
+  public:
+    /* Throws SyntaxError if the object can't be loaded */
+    static NativeModule *load(const std::string &path);
+    ~NativeModule();
+
+    inline const std::string &filename() const { return filename_; }
+
+    void run(std::ostream &out = std::cout) const;
+    Value call(const std::string&, const std::vector<Value>&, std::ostream &out = std::cout) const;
+  private:
+    typedef void (*MainFunction)(std::ostream&);
+    typedef bool (*CallFunction)(const char*, const std::vector<Value>&, std::ostream&, Value&);
+
+    NativeModule(const std::string &filename, void *handle, MainFunction main, CallFunction call)
+        : filename_(filename),
+          handle_(handle),
+          main_(main),
+          call_(call) {}
+
+    std::string filename_;
+    void *handle_;
+    MainFunction main_;
+    CallFunction call_;
+    DISALLOW_COPY_AND_ASSIGN(NativeModule);
+};
+
+#endif
@@ -28,13 +28,16 @@ AST *ParserContext::parse_ast(bool in_block) {
     std::vector<const Statement*> statements;
 
     while (!lexer_.eos() && !(in_block && curtok()->type() == tok_block_end)) {
-        statements.push_back(parse_statement());
+        statements.push_back(parse_statement(!in_block));
     }
 
     return new AST(statements);
 }
 
-Statement *ParserContext::parse_statement() {
+/* Imports are linked in before anything runs, so they can't be inside a
+ * block or function */
+Statement *ParserContext::parse_statement(bool toplevel) {
+    unsigned int line = lexer_.line();
     Statement *statement = 0;
     switch (curtok()->type()) {
         case tok_while: {
@@ -54,6 +57,13 @@ Statement *ParserContext::parse_statement() {
             statement = parse_def();
             break;
         }
+        case tok_import: {
+            if (!toplevel)
+                throw SyntaxError("Imports are only allowed at the top level");
+            statement = parse_import();
+            eat_token(tok_semicolon);
+            break;
+        }
         default: {
             Expression *expression = parse_expression();
             if (expression) {
@@ -65,6 +75,8 @@ Statement *ParserContext::parse_statement() {
             break;
         }
     }
+
+    statement->set_line(line);
     return statement;
 }
 
@@ -78,6 +90,7 @@ Expression *ParserContext::parse_expression() {
 }
 
 AST *ParserContext::parse_block() {
+    unsigned int line = lexer_.line();
     AST *ret = 0;
 
     if (curtok()->type() == tok_block_start) {
@@ -94,6 +107,7 @@ AST *ParserContext::parse_block() {
         ret = new AST(statements);
     }
 
+    ret->set_line(line);
     return ret;
 }
 
@@ -150,19 +164,95 @@ Statement *ParserContext::parse_def() {
     }
     eat_token(tok_paren_end);
 
+    if (lazy_ && curtok()->type() == tok_block_start)
+        return preparse_def(funcname, params);
+
     return new DefStatement(funcname, params, parse_block());
 }
 
+/* Skips over a function body, only checking that its braces balance */
+Statement *ParserContext::preparse_def(const std::string &funcname, const std::vector<std::string> &params) {
+    unsigned int line = lexer_.line();
+    std::set<std::string> callees;
+    std::string word;
+
+    lexer_.start_capture();
+    for (unsigned int depth = 1; depth > 0; ) {
+        if (!lexer_.fetchtok())
+            throw ExpectedToken(Token::token_type_name(tok_block_end), curtok());
+
+        switch (curtok()->type()) {
+            case tok_block_start: ++depth; break;
+            case tok_block_end: --depth; break;
+            case tok_import: throw SyntaxError("Imports are only allowed at the top level");
+            case tok_paren_start:
+                if (!word.empty())
+                    callees.insert(word);
+                break;
+            default: break;
+        }
+        word = curtok()->type() == tok_word ? curtok()->string() : "";
+    }
+    const std::string body = "{" + lexer_.stop_capture();
+    eat_token(tok_block_end);
+
+    return new DefStatement(funcname, params, body, lexer_.filename(), line, callees);
+}
+
+AST *ParserContext::parse_body() {
+    AST *ret = parse_block();
+    if (!lexer_.eos())
+        throw UnexpectedToken("parse_body", curtok());
+    return ret;
+}
+
+Statement *ParserContext::parse_import() {
+    eat_token(tok_import);
+
+    if (curtok()->type() != tok_string)
+        throw SyntaxError("Expected module name string in import");
+
+    std::string module = curtok()->string();
+    eat_token(tok_string);
+
+    return new ImportStatement(module);
+}
+
 /* Expressions */
 
 Expression *ParserContext::parse_primary() {
+    unsigned int line = lexer_.line();
+    Expression *ret = 0;
+
     switch (curtok()->type()) {
-        case tok_word: return parse_word_expression();
-        case tok_number: return parse_number();
-        case tok_string: return parse_string();
-        case tok_paren_start: return parse_paren_expression();
+        case tok_word: ret = parse_word_expression(); break;
+        case tok_number: ret = parse_number(); break;
+        case tok_string: ret = parse_string(); break;
+        case tok_paren_start: ret = parse_paren_expression(); break;
+        case tok_bracket_start: ret = parse_array(); break;
+        case tok_block_start: ret = parse_map(); break;
         default: throw UnexpectedToken("parse_primary", curtok());
     }
+
+    ret->set_line(line);
+    if (ret->type() == toy_assign)
+        return ret;
+
+    return parse_index_expression(ret);
+}
+
+Expression *ParserContext::parse_index_expression(Expression *container) {
+    while (curtok()->type() == tok_bracket_start) {
+        eat_token(tok_bracket_start);
+        Expression *index = parse_expression();
+        eat_token(tok_bracket_end);
+
+        IndexExpr *node = new IndexExpr(container, index);
+        node->set_line(container->line());
+        container = node;
+    }
+
+    return container;
 }
 
 Expression *ParserContext::parse_binary_op_expression(Expression *LHS, int min_prec) {
@@ -180,7 +270,9 @@ Expression *ParserContext::parse_binary_op_expression(Expression *LHS, int min_p
             next_prec = get_prec(curtok()->type());
         }
 
-        LHS = new BinaryOpExpr(LHS, RHS, op);
+        BinaryOpExpr *node = new BinaryOpExpr(LHS, RHS, op);
+        node->set_line(LHS->line());
+        LHS = node;
 
         op_prec = get_prec(curtok()->type());
     }
@@ -233,3 +325,37 @@ Expression *ParserContext::parse_word_expression() {
 
     return new VariableExpr(word);
 }
+
+Expression *ParserContext::parse_array() {
+    eat_token(tok_bracket_start);
+
+    std::vector<const Expression*> elements;
+    while (curtok()->type() != tok_bracket_end) {
+        elements.push_back(parse_expression());
+
+        /* One may follow the last element too */
+        if (curtok()->type() != tok_bracket_end)
+            eat_token(tok_comma);
+    }
+    eat_token(tok_bracket_end);
+
+    return new ArrayExpr(elements);
+}
+
+Expression *ParserContext::parse_map() {
+    eat_token(tok_block_start);
+
+    std::vector<const Expression*> keys, values;
+    while (curtok()->type() != tok_block_end) {
+        keys.push_back(parse_expression());
+        eat_token(tok_colon);
+        values.push_back(parse_expression());
+
+        /* Like arrays, one may follow the last entry too */
+        if (curtok()->type() != tok_block_end)
+            eat_token(tok_comma);
+    }
+    eat_token(tok_block_end);
+
+    return new MapExpr(keys, values);
+}
@@ -6,45 +6,58 @@
 #include <vector>
 #include <string>
 #include <cstdlib>
+#include <set>
 #include "toyobj.hpp"
 #include "lexer.hpp"
 #include "toy.hpp"
 #include "ast.hpp"
+#include "exceptions.hpp"
 
 class ParserContext {
   public:
     explicit ParserContext(LexerContext &lexer)
-        : lexer_(lexer) { lexer_.fetchtok(); }
+        : lexer_(lexer),
+          lazy_(false) { lexer_.fetchtok(); }
+
+    /* Only pre-parse function bodies, see DefStatement */
+    inline void set_lazy(bool lazy) { lazy_ = lazy; }
 
     AST *parse_ast(bool);
+
+    /* A function body kept by a lazy parse */
+    AST *parse_body();
  private:
-    Statement *parse_statement();
+    Statement *parse_statement(bool toplevel = false);
     Statement *parse_while();
     Statement *parse_if();
     Statement *parse_return();
     Statement *parse_def();
+    Statement *preparse_def(const std::string&, const std::vector<std::string>&);
+    Statement *parse_import();
 
     Expression *parse_expression();
     Expression *parse_primary();
+    Expression *parse_index_expression(Expression*);
     Expression *parse_binary_op_expression(Expression*, int);
     Expression *parse_paren_expression();
     Expression *parse_number();
     Expression *parse_string();
     Expression *parse_word_expression();
+    Expression *parse_array();
+    Expression *parse_map();
 
     AST *parse_block();
 
     int get_prec(TokenType) const;
     inline const Token *curtok() { return lexer_.curtok(); }
     inline void eat_token(TokenType type) {
-        if (type != curtok()->type()) {
-            std::cout << "I was expecting " << Token::token_type_name(type) << " but got " << curtok()->name() << std::endl;
-            exit(1);
-        }
+        if (type != curtok()->type())
+            throw ExpectedToken(Token::token_type_name(type), curtok());
         lexer_.fetchtok();
     }
 
     LexerContext &lexer_;
+    bool lazy_;
     DISALLOW_COPY_AND_ASSIGN(ParserContext);
 };
 
@@ -21,6 +21,15 @@ void PrettyPrinterVisitor::visit(const AssignExpr*) {
 void PrettyPrinterVisitor::visit(const FuncCallExpr*) {
 }
 
+void PrettyPrinterVisitor::visit(const ArrayExpr*) {
+}
+
+void PrettyPrinterVisitor::visit(const IndexExpr*) {
+}
+
+void PrettyPrinterVisitor::visit(const MapExpr*) {
+}
+
 void PrettyPrinterVisitor::visit(const ExpressionStatement*) {
 }
 
@@ -35,3 +44,6 @@ void PrettyPrinterVisitor::visit(const ReturnStatement*) {
 
 void PrettyPrinterVisitor::visit(const DefStatement*) {
 }
+
+void PrettyPrinterVisitor::visit(const ImportStatement*) {
+}
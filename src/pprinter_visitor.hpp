@@ -17,11 +17,15 @@ class PrettyPrinterVisitor : public ASTVisitor {
     virtual void visit(const VariableExpr*);
     virtual void visit(const AssignExpr*);
     virtual void visit(const FuncCallExpr*);
+    virtual void visit(const ArrayExpr*);
+    virtual void visit(const IndexExpr*);
+    virtual void visit(const MapExpr*);
     virtual void visit(const ExpressionStatement*);
     virtual void visit(const IfStatement*);
     virtual void visit(const WhileStatement*);
     virtual void visit(const ReturnStatement*);
     virtual void visit(const DefStatement*);
+    virtual void visit(const ImportStatement*);
 
     inline std::string buffer() { return buffer_; }
   private:
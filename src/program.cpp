@@ -0,0 +1,86 @@
+#include "program.hpp"
+#include <sstream>
+#include <thread>
+#include <vector>
+#include "exceptions.hpp"
+#include "lexer.hpp"
+#include "parser.hpp"
+#include "thread_pool.hpp"
+
+Program::Program(const std::string &filename, const AST *ast)
+    : filename_(filename),
+      ast_(ast) {
+    const std::vector<const Statement*> &nodes = ast_->nodes();
+    for (std::vector<const Statement*>::const_iterator it = nodes.begin(), end = nodes.end(); it != end; ++it) {
+        if ((*it)->type() == toy_def) {
+            const DefStatement *def = static_cast<const DefStatement*>(*it);
+            functions_[def->name()] = def;
+        }
+    }
+}
+
+Program::~Program() {
+    delete ast_;
+}
+
+const Program *Program::compile(std::istream &input, const std::string &filename) {
+    return new Program(filename, parse(input, filename));
+}
+
+const Program *Program::extend(const Program &base, const Program &script) {
+    std::vector<const Statement*> nodes;
+    for (std::map<std::string, const DefStatement*>::const_iterator it = base.functions_.begin(), end = base.functions_.end(); it != end; ++it)
+        nodes.push_back(it->second);
+    nodes.insert(nodes.end(), script.ast_->nodes().begin(), script.ast_->nodes().end());
+    return new Program(script.filename_, new AST(nodes));
+}
+
+/* Sources at least this big are lexed in parallel, given enough cores to
+ * make up for holding all tokens at once */
+static const std::streamoff parallel_lex_size = 8 << 20;
+static const unsigned int parallel_lex_cores = 4;
+
+/* The bytes left in a seekable stream, or -1 */
+static std::streamoff remaining(std::istream &input) {
+    std::streampos start = input.tellg();
+    if (start == std::streampos(-1))
+        return -1;
+
+    input.seekg(0, std::ios::end);
+    std::streampos end = input.tellg();
+    input.seekg(start);
+    return end == std::streampos(-1) ? -1 : std::streamoff(end - start);
+}
+
+static AST *parse(LexerContext &lexer) {
+    try {
+        ParserContext parser(lexer);
+        parser.set_lazy(true);
+        return parser.parse_ast(false);
+    } catch (SyntaxError &error) {
+        std::ostringstream ss;
+        ss << lexer.filename() << ":" << lexer.line() << ": " << error.message();
+        throw SyntaxError(ss.str());
+    }
+}
+
+AST *Program::parse(std::istream &input, const std::string &filename) {
+    std::streamoff size = remaining(input);
+    if (size < parallel_lex_size || std::thread::hardware_concurrency() < parallel_lex_cores) {
+        LexerContext lexer(input, filename);
+        return ::parse(lexer);
+    }
+
+    std::string source(size, '\0');
+    input.read(&source[0], size);
+    source.resize(input.gcount());
+
+    ThreadPool pool;
+    LexerContext lexer(source, filename, pool);
+    return ::parse(lexer);
+}
+
+const DefStatement *Program::function(const std::string &funcname) const {
+    std::map<std::string, const DefStatement*>::const_iterator it = functions_.find(funcname);
+    return it == functions_.end() ? 0 : it->second;
+}
@@ -0,0 +1,47 @@
+#ifndef _PROGRAM_HPP
+#define _PROGRAM_HPP
+
+#include <iostream>
+#include <map>
+#include <string>
+#include "ast.hpp"
+#include "toy.hpp"
+
+/* A parsed script. A Program never changes after compile(), so one
+ * instance can be shared by any number of Interpreters on any number of
+ * threads without locking. Function bodies are only parsed when first
+ * called, which DefStatement synchronizes itself. */
+class Program {
+  public:
+    /* Throws SyntaxError, with the message prefixed by filename:line. */
+    static const Program *compile(std::istream&, const std::string &filename);
+
+    /* Only parses; throws like compile(). Big seekable inputs are lexed in
+     * parallel. */
+    static AST *parse(std::istream&, const std::string &filename);
+
+    /* Runs script with the functions of base defined too, e.g. those of a
+     * restored snapshot; script's own definitions win. Shares the nodes of
+     * both, which have to outlive it. */
+    static const Program *extend(const Program &base, const Program &script);
+    ~Program();
+
+    inline const AST *ast() const { return ast_; }
+    inline const std::string &filename() const { return filename_; }
+
+    const DefStatement *function(const std::string&) const;
+    /* Every function a call can reach, by name */
+    inline const std::map<std::string, const DefStatement*> &functions() const { return functions_; }
+  private:
+    friend class Snapshot;
+    friend class ModuleLoader;
+    friend class DeadCodeElimination;
+    Program(const std::string&, const AST*);
+
+    const std::string filename_;
+    const AST *ast_;
+    std::map<std::string, const DefStatement*> functions_;
+    DISALLOW_COPY_AND_ASSIGN(Program);
+};
+
+#endif
@@ -0,0 +1,98 @@
+#include "purity_analysis.hpp"
+#include <vector>
+#include "ast_depth_first.hpp"
+#include "io.hpp"
+
+void EffectsVisitor::visit(const VariableExpr *node) {
+    reads_.insert(node->varname());
+}
+
+void EffectsVisitor::visit(const AssignExpr *node) {
+    writes_.insert(node->lvalue());
+}
+
+void EffectsVisitor::visit(const FuncCallExpr *node) {
+    /* Output and I/O alike: neither may be memoized away */
+    if (node->funcname() == "print" || Io::is_builtin(node->funcname()))
+        prints_ = true;
+    callees_.insert(node->funcname());
+}
+
+bool PurityAnalysis::is_pure(const std::string &funcname) const {
+    return pure_.find(funcname) != pure_.end();
+}
+
+bool PurityAnalysis::locally_pure(const DefStatement *def, const EffectsVisitor &effects) const {
+    if (effects.prints() || excluded_.find(def->name()) != excluded_.end())
+        return false;
+
+    const std::vector<std::string> params = def->params();
+    std::set<std::string> locals(params.begin(), params.end());
+
+    for (std::set<std::string>::const_iterator it = effects.writes().begin(), end = effects.writes().end(); it != end; ++it) {
+        if (globals_.find(*it) != globals_.end())
+            return false;
+        locals.insert(*it);
+    }
+
+    for (std::set<std::string>::const_iterator it = effects.reads().begin(), end = effects.reads().end(); it != end; ++it) {
+        if (locals.find(*it) == locals.end())
+            return false;
+    }
+
+    return true;
+}
+
+void PurityAnalysis::run() {
+    ASTVisitorDepthFirst strategy;
+    std::vector<const DefStatement*> defs;
+
+    globals_ = assumed_;
+    pure_.clear();
+
+    const std::vector<const Statement*> nodes = ast_->nodes();
+    for (std::vector<const Statement*>::const_iterator it = nodes.begin(), end = nodes.end(); it != end; ++it) {
+        if ((*it)->type() == toy_def) {
+            defs.push_back(static_cast<const DefStatement*>(*it));
+        } else {
+            EffectsVisitor top_level;
+            (*it)->accept(&strategy, &top_level);
+            globals_.insert(top_level.writes().begin(), top_level.writes().end());
+        }
+    }
+
+    /* Start from every function that is pure on its own, then drop the ones
+     * calling something outside the set until nothing changes. Starting from
+     * the optimistic side lets (mutually) recursive functions stay pure. */
+    std::map<std::string, std::set<std::string> > callees;
+    for (std::vector<const DefStatement*>::const_iterator it = defs.begin(), end = defs.end(); it != end; ++it) {
+        EffectsVisitor effects;
+        (*it)->block()->accept(&strategy, &effects);
+
+        if (locally_pure(*it, effects)) {
+            pure_.insert((*it)->name());
+            callees[(*it)->name()] = effects.callees();
+        } else {
+            /* The last definition of a name is the one called */
+            pure_.erase((*it)->name());
+            callees.erase((*it)->name());
+        }
+    }
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (std::map<std::string, std::set<std::string> >::const_iterator it = callees.begin(), end = callees.end(); it != end; ++it) {
+            if (!is_pure(it->first))
+                continue;
+
+            for (std::set<std::string>::const_iterator callee = it->second.begin(), cend = it->second.end(); callee != cend; ++callee) {
+                if (!is_pure(*callee)) {
+                    pure_.erase(it->first);
+                    changed = true;
+                    break;
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,83 @@
+#ifndef _PURITY_ANALYSIS_HPP
+#define _PURITY_ANALYSIS_HPP
+
+#include <map>
+#include <set>
+#include <string>
+#include "ast.hpp"
+#include "ast_visitor.hpp"
+#include "toy.hpp"
+
+/* Collects the side effects and dependencies of a block of code. */
+class EffectsVisitor : public ASTVisitor {
+  public:
+    EffectsVisitor()
+        : prints_(false) {}
+
+    virtual void visit(const AST*) {}
+    virtual void visit(const ValueExpr*) {}
+    virtual void visit(const BinaryOpExpr*) {}
+    virtual void visit(const VariableExpr*);
+    virtual void visit(const AssignExpr*);
+    virtual void visit(const FuncCallExpr*);
+    virtual void visit(const ArrayExpr*) {}
+    virtual void visit(const IndexExpr*) {}
+    virtual void visit(const MapExpr*) {}
+    virtual void visit(const ExpressionStatement*) {}
+    virtual void visit(const IfStatement*) {}
+    virtual void visit(const WhileStatement*) {}
+    virtual void visit(const ReturnStatement*) {}
+    virtual void visit(const DefStatement*) {}
+    virtual void visit(const ImportStatement*) {}
+
+    inline const std::set<std::string> &reads() const { return reads_; }
+    inline const std::set<std::string> &writes() const { return writes_; }
+    inline const std::set<std::string> &callees() const { return callees_; }
+    inline bool prints() const { return prints_; }
+  private:
+    std::set<std::string> reads_;
+    std::set<std::string> writes_;
+    std::set<std::string> callees_;
+    bool prints_;
+    DISALLOW_COPY_AND_ASSIGN(EffectsVisitor);
+};
+
+/* Finds the top-level functions whose result depends only on their
+ * arguments: they don't print, don't read or write globals, and only call
+ * other pure functions. Such functions can safely be memoized.
+ *
+ * Assignments inside a function are taken to be local unless the name is
+ * also assigned at the top level. Calls to anything that isn't defined in
+ * the program (builtins) are treated as impure.
+ */
+class PurityAnalysis {
+  public:
+    explicit PurityAnalysis(const AST *ast)
+        : ast_(ast) {}
+
+    /* Functions that must never be reported as pure, e.g. because the user
+     * has opted them out of memoization. */
+    inline void exclude(const std::string &funcname) { excluded_.insert(funcname); }
+
+    /* Names that are globals besides those the top-level code assigns,
+     * e.g. set by the host before running */
+    inline void assume_global(const std::string &name) { assumed_.insert(name); }
+
+    void run();
+
+    bool is_pure(const std::string&) const;
+    inline const std::set<std::string> &pure_functions() const { return pure_; }
+    /* Assigned at the top level, or assumed */
+    inline const std::set<std::string> &globals() const { return globals_; }
+  private:
+    bool locally_pure(const DefStatement*, const EffectsVisitor&) const;
+
+    const AST *ast_;
+    std::set<std::string> excluded_;
+    std::set<std::string> assumed_;
+    std::set<std::string> globals_;
+    std::set<std::string> pure_;
+    DISALLOW_COPY_AND_ASSIGN(PurityAnalysis);
+};
+
+#endif
@@ -0,0 +1,154 @@
+#include "runtime.hpp"
+#include <cmath>
+#include <sstream>
+#include "exceptions.hpp"
+#include "io.hpp"
+#include "simd.hpp"
+
+Value Runtime::binary_op(TokenType op, const Value &left, const Value &right, unsigned int line) {
+    if (left.is_number() && right.is_number()) {
+        /* The binary operators are contiguous in TokenType */
+        if (op >= tok_add && op <= tok_gte)
+            return Value(number_op(op, left.number(), right.number()));
+    } else if (op == tok_add && (left.is_string() || right.is_string())) {
+        return Value(left.str() + right.str());
+    } else if (op == tok_eq) {
+        return Value(left == right ? 1.0 : 0.0);
+    } else if (left.is_string() && right.is_string()) {
+        switch (op) {
+            case tok_lt: return Value(left.string() < right.string() ? 1.0 : 0.0);
+            case tok_gt: return Value(left.string() > right.string() ? 1.0 : 0.0);
+            case tok_lte: return Value(left.string() <= right.string() ? 1.0 : 0.0);
+            case tok_gte: return Value(left.string() >= right.string() ? 1.0 : 0.0);
+            default: break;
+        }
+    }
+
+    std::ostringstream ss;
+    ss << "Unsupported operand types for " << Token::token_type_name(op) << ": "
+       << Value::value_type_name(left.type()) << " and " << Value::value_type_name(right.type());
+    throw RuntimeError(ss.str(), line);
+}
+
+Value Runtime::index(const Value &container, const Value &index, unsigned int line) {
+    if (container.is_map()) {
+        Value::Map::const_iterator it = container.map().find(index);
+        return it == container.map().end() ? Value() : it->second;
+    }
+
+    if (!index.is_number())
+        throw RuntimeError("Index must be a number", line);
+
+    /* NaN fails every range check below, and casting it is undefined */
+    double i = index.number();
+    if (i != std::floor(i))
+        throw RuntimeError("Index must be a whole number", line);
+    if (container.is_array()) {
+        if (i < 0 || i >= container.array().size())
+            throw RuntimeError("Array index out of range", line);
+        return container.array()[(size_t)i];
+    } else if (container.is_numbers()) {
+        if (i < 0 || i >= container.numbers().size())
+            throw RuntimeError("Numbers index out of range", line);
+        return Value(container.numbers()[(size_t)i]);
+    } else if (container.is_string()) {
+        if (i < 0 || i >= container.string().size())
+            throw RuntimeError("String index out of range", line);
+        return Value(container.string().substr((size_t)i, 1));
+    }
+
+    throw RuntimeError("Cannot index a " + Value::value_type_name(container.type()), line);
+}
+
+Value Runtime::new_map(const std::vector<Value> &keys_and_values) {
+    Value ret = Value::new_map();
+    for (std::vector<Value>::size_type i = 0; i + 1 < keys_and_values.size(); i += 2)
+        ret.map()[keys_and_values[i]] = keys_and_values[i + 1];
+    return ret;
+}
+
+bool Runtime::calls_by_name(const std::string &funcname) {
+    return funcname == "map" || funcname == "pmap" || funcname == "spawn" || funcname == "join";
+}
+
+/* Builtins on numbers */
+
+static TokenType comparison(const std::string &op) {
+    if (op == "==") return tok_eq;
+    if (op == "<") return tok_lt;
+    if (op == ">") return tok_gt;
+    if (op == "<=") return tok_lte;
+    if (op == ">=") return tok_gte;
+    return tok_word;
+}
+
+static Value numbers_builtin(const std::string &funcname, const std::vector<Value> &args, unsigned int line) {
+    if (funcname == "numbers") {
+        if (args.size() == 1 && args[0].is_numbers())
+            return args[0];
+        if (args.size() == 1 && args[0].is_array()) {
+            Value::Numbers ret;
+            ret.reserve(args[0].array().size());
+            for (Value::Array::const_iterator it = args[0].array().begin(), end = args[0].array().end(); it != end; ++it) {
+                if (!it->is_number())
+                    throw RuntimeError("numbers() of an array holding a " + Value::value_type_name(it->type()), line);
+                ret.push_back(it->number());
+            }
+            return Value::new_numbers(ret);
+        }
+        throw RuntimeError("numbers() takes an array of numbers", line);
+    } else if (funcname == "sum") {
+        if (args.size() != 1 || !args[0].is_numbers())
+            throw RuntimeError("sum() takes numbers", line);
+        return Value(Simd::sum(args[0].numbers().data(), args[0].numbers().size()));
+    } else if (funcname == "dot") {
+        if (args.size() != 2 || !args[0].is_numbers() || !args[1].is_numbers())
+            throw RuntimeError("dot() takes two numbers", line);
+        const Value::Numbers &x = args[0].numbers(), &y = args[1].numbers();
+        if (x.size() != y.size())
+            throw RuntimeError("dot() of numbers of different lengths", line);
+        return Value(Simd::dot(x.data(), y.data(), x.size()));
+    } else if (funcname == "axpy") {
+        if (args.size() != 3 || !args[0].is_number() || !args[1].is_numbers() || !args[2].is_numbers())
+            throw RuntimeError("axpy() takes a number and two numbers", line);
+        const Value::Numbers &x = args[1].numbers(), &y = args[2].numbers();
+        if (x.size() != y.size())
+            throw RuntimeError("axpy() of numbers of different lengths", line);
+        Value::Numbers ret(x.size());
+        Simd::axpy(args[0].number(), x.data(), y.data(), ret.data(), x.size());
+        return Value::new_numbers(ret);
+    } else {
+        /* compare(op, x, y), y numbers or a number */
+        TokenType op = args.size() == 3 && args[0].is_string() ? comparison(args[0].string()) : tok_word;
+        if (op == tok_word || !args[1].is_numbers() || (!args[2].is_numbers() && !args[2].is_number()))
+            throw RuntimeError("compare() takes one of ==, <, >, <= and >=, numbers and numbers or a number", line);
+        const Value::Numbers &x = args[1].numbers();
+        const Value::Numbers y = args[2].is_number() ? Value::Numbers(x.size(), args[2].number()) : args[2].numbers();
+        if (x.size() != y.size())
+            throw RuntimeError("compare() of numbers of different lengths", line);
+        Value::Numbers ret(x.size());
+        Simd::compare(op, x.data(), y.data(), ret.data(), x.size());
+        return Value::new_numbers(ret);
+    }
+}
+
+Value Runtime::builtin(const std::string &funcname, const std::vector<Value> &args, std::ostream &out, unsigned int line) {
+    if (funcname == "print") {
+        for (std::vector<Value>::const_iterator it = args.begin(), end = args.end(); it != end; ++it)
+            out << it->str();
+        return Value();
+    } else if (funcname == "len" && args.size() == 1) {
+        if (args[0].is_array()) return Value((double)args[0].array().size());
+        if (args[0].is_map()) return Value((double)args[0].map().size());
+        if (args[0].is_numbers()) return Value((double)args[0].numbers().size());
+        if (args[0].is_string()) return Value((double)args[0].string().size());
+        throw RuntimeError("len() of a " + Value::value_type_name(args[0].type()), line);
+    } else if (funcname == "numbers" || funcname == "sum" || funcname == "dot" || funcname == "axpy" || funcname == "compare") {
+        return numbers_builtin(funcname, args, line);
+    } else if (Io::is_builtin(funcname)) {
+        /* Compiled scripts have no Scheduler to yield to */
+        return Io::builtin(funcname, args, IoWaiter::blocking(), line);
+    }
+
+    throw RuntimeError("Undefined function '" + funcname + "'", line);
+}
@@ -0,0 +1,41 @@
+#ifndef _RUNTIME_HPP
+#define _RUNTIME_HPP
+
+#include <cmath>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "lexer.hpp"
+#include "toyobj.hpp"
+
+/* The semantics of Toy operators, indexing and builtins. Shared by the
+ * Interpreter and by C++ code generated from Toy scripts, so both behave
+ * the same. Errors are thrown as RuntimeError carrying the given line. */
+class Runtime {
+  public:
+    static Value binary_op(TokenType, const Value&, const Value&, unsigned int);
+    /* Any binary operator on two numbers, which can't fail */
+    static inline double number_op(TokenType op, double l, double r) {
+        switch (op) {
+            case tok_add: return l + r;
+            case tok_sub: return l - r;
+            case tok_mul: return l * r;
+            case tok_div: return l / r;
+            case tok_mod: return fmod(l, r);
+            case tok_eq: return l == r ? 1.0 : 0.0;
+            case tok_lt: return l < r ? 1.0 : 0.0;
+            case tok_gt: return l > r ? 1.0 : 0.0;
+            case tok_lte: return l <= r ? 1.0 : 0.0;
+            default: return l >= r ? 1.0 : 0.0;
+        }
+    }
+    static Value index(const Value&, const Value&, unsigned int);
+    static Value new_map(const std::vector<Value>&);
+    static Value builtin(const std::string&, const std::vector<Value>&, std::ostream&, unsigned int);
+
+    /* map(), pmap(), spawn() and join(), which run functions named at
+     * runtime and are left to the Interpreter and the generated code */
+    static bool calls_by_name(const std::string&);
+};
+
+#endif
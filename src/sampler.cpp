@@ -0,0 +1,223 @@
+#include "sampler.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <functional>
+#include <iomanip>
+#include <map>
+#include <set>
+#include <sstream>
+#include <unistd.h>
+#include "ast.hpp"
+
+/* Older glibc has the field under its own name only */
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+/* The Sampler the handler records for, if any */
+static std::atomic<Sampler*> active(0);
+
+const unsigned int Sampler::max_depth;
+const size_t Sampler::bucket_count;
+const size_t Sampler::frame_count;
+
+Sampler::~Sampler() {
+    stop();
+}
+
+bool Sampler::start(const State *state, double interval) {
+    if (running_ || interval <= 0)
+        return false;
+    Sampler *none = 0;
+    if (!active.compare_exchange_strong(none, this))
+        return false;
+
+    if (buckets_.empty()) {
+        buckets_.resize(bucket_count);
+        frames_.resize(frame_count);
+    }
+    state_ = state;
+    interval_ = interval;
+    thread_ = gettid();
+
+    static bool installed = false;
+    if (!installed) {
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = handler;
+        action.sa_flags = SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        installed = sigaction(SIGPROF, &action, 0) == 0;
+    }
+
+    /* On this thread's clock, delivered to this thread: the compiler and
+     * the pool's threads neither count nor get sampled */
+    struct sigevent event;
+    memset(&event, 0, sizeof(event));
+    event.sigev_notify = SIGEV_THREAD_ID;
+    event.sigev_signo = SIGPROF;
+    event.sigev_notify_thread_id = thread_;
+    if (!installed || timer_create(CLOCK_THREAD_CPUTIME_ID, &event, &timer_) != 0) {
+        active.store(0);
+        return false;
+    }
+
+    struct itimerspec spec;
+    spec.it_interval.tv_sec = (time_t)interval;
+    spec.it_interval.tv_nsec = (long)((interval - (double)spec.it_interval.tv_sec) * 1e9);
+    if (spec.it_interval.tv_sec == 0 && spec.it_interval.tv_nsec == 0)
+        spec.it_interval.tv_nsec = 1;
+    spec.it_value = spec.it_interval;
+    timer_settime(timer_, 0, &spec, 0);
+    running_ = true;
+    return true;
+}
+
+void Sampler::stop() {
+    if (!running_)
+        return;
+    timer_delete(timer_);
+    /* A signal still pending finds nothing to record for */
+    active.store(0);
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    running_ = false;
+}
+
+void Sampler::handler(int) {
+    const int saved = errno;
+    Sampler *sampler = active.load(std::memory_order_relaxed);
+    /* Sent to the thread that started sampling, unless that was another
+     * run's, on another thread */
+    if (sampler && sampler->thread_ == gettid())
+        sampler->record();
+    errno = saved;
+}
+
+void Sampler::record() {
+    const unsigned int depth = state_->depth > 0 ? state_->depth : 0;
+    const unsigned int line = state_->line;
+    const unsigned int kept = depth < max_depth ? depth : max_depth;
+    const DefStatement *stack[max_depth];
+    uint64_t hash = 0xcbf29ce484222325ULL ^ line;
+    for (unsigned int i = 0; i < kept; ++i) {
+        stack[i] = state_->functions[(depth - kept + i) & (max_depth - 1)];
+        hash = (hash ^ (uintptr_t)stack[i]) * 0x100000001b3ULL;
+    }
+    hash ^= hash >> 29;
+    ++taken_;
+
+    /* Linear probing, kept under 3/4 full */
+    for (size_t i = hash & (bucket_count - 1);; i = (i + 1) & (bucket_count - 1)) {
+        Bucket &bucket = buckets_[i];
+        if (bucket.count == 0) {
+            if (used_ >= bucket_count / 4 * 3 || frames_used_ + kept > frame_count) {
+                ++dropped_;
+                return;
+            }
+            bucket.hash = hash;
+            bucket.count = 1;
+            bucket.frames = frames_used_;
+            bucket.depth = kept;
+            bucket.truncated = depth > kept;
+            bucket.line = line;
+            std::copy(stack, stack + kept, frames_.begin() + frames_used_);
+            frames_used_ += kept;
+            ++used_;
+            return;
+        }
+        if (bucket.hash == hash && bucket.line == line && bucket.depth == kept && bucket.truncated == (depth > kept)
+            && std::equal(stack, stack + kept, frames_.begin() + bucket.frames)) {
+            ++bucket.count;
+            return;
+        }
+    }
+}
+
+std::vector<Sampler::Sample> Sampler::samples() const {
+    std::vector<Sample> ret;
+    for (std::vector<Bucket>::const_iterator it = buckets_.begin(), end = buckets_.end(); it != end; ++it) {
+        if (it->count == 0)
+            continue;
+        Sample sample;
+        sample.stack.assign(frames_.begin() + it->frames, frames_.begin() + it->frames + it->depth);
+        sample.truncated = it->truncated;
+        sample.line = it->line;
+        sample.count = it->count;
+        ret.push_back(sample);
+    }
+    return ret;
+}
+
+/* Innermost function, or the root for top-level code */
+static const std::string &leaf(const Sampler::Sample &sample, const std::string &root) {
+    return sample.stack.empty() ? root : sample.stack.back()->name();
+}
+
+void Sampler::write_folded(std::ostream &out, const std::string &root) const {
+    /* Sorted, so that runs compare */
+    std::map<std::string, unsigned long> stacks;
+    const std::vector<Sample> all = samples();
+    for (std::vector<Sample>::const_iterator it = all.begin(), end = all.end(); it != end; ++it) {
+        std::ostringstream stack;
+        stack << root;
+        if (it->truncated)
+            stack << ";...";
+        for (std::vector<const DefStatement*>::const_iterator def = it->stack.begin(); def != it->stack.end(); ++def)
+            stack << ";" << (*def)->name();
+        stack << ":" << it->line;
+        stacks[stack.str()] += it->count;
+    }
+
+    for (std::map<std::string, unsigned long>::const_iterator it = stacks.begin(), end = stacks.end(); it != end; ++it)
+        out << it->first << " " << it->second << std::endl;
+}
+
+typedef std::pair<unsigned long, std::string> Ranked;
+
+static void write_ranked(std::ostream &out, const std::map<std::string, unsigned long> &counts, unsigned long taken) {
+    std::vector<Ranked> ranked;
+    for (std::map<std::string, unsigned long>::const_iterator it = counts.begin(), end = counts.end(); it != end; ++it)
+        ranked.push_back(Ranked(it->second, it->first));
+    std::stable_sort(ranked.begin(), ranked.end(), std::greater<Ranked>());
+
+    for (std::vector<Ranked>::const_iterator it = ranked.begin(), end = ranked.end(); it != end; ++it)
+        out << "  " << std::setw(8) << it->first << " " << std::setw(5) << std::fixed << std::setprecision(1)
+            << 100.0 * it->first / taken << "%  " << it->second << std::endl;
+}
+
+void Sampler::write_histograms(std::ostream &out, const std::string &root) const {
+    std::map<std::string, unsigned long> self, total, lines;
+    const std::vector<Sample> all = samples();
+    for (std::vector<Sample>::const_iterator it = all.begin(), end = all.end(); it != end; ++it) {
+        const std::string &name = leaf(*it, root);
+        self[name] += it->count;
+
+        std::ostringstream line;
+        line << name << ":" << it->line;
+        lines[line.str()] += it->count;
+
+        /* Once per sample, however often it recurses */
+        std::set<std::string> seen;
+        seen.insert(root);
+        for (std::vector<const DefStatement*>::const_iterator def = it->stack.begin(); def != it->stack.end(); ++def)
+            seen.insert((*def)->name());
+        for (std::set<std::string>::const_iterator name = seen.begin(); name != seen.end(); ++name)
+            total[*name] += it->count;
+    }
+
+    const std::ios::fmtflags flags = out.flags();
+    const std::streamsize precision = out.precision();
+    out << "samples: " << taken_ << " every " << interval_ * 1000 << "ms of CPU time, dropped: " << dropped_ << std::endl;
+    if (taken_ > 0) {
+        out << "functions, by samples in them:" << std::endl;
+        write_ranked(out, self, taken_);
+        out << "functions, by samples with them on the stack:" << std::endl;
+        write_ranked(out, total, taken_);
+        out << "lines:" << std::endl;
+        write_ranked(out, lines, taken_);
+    }
+    out.flags(flags);
+    out.precision(precision);
+}
@@ -0,0 +1,117 @@
+#ifndef _SAMPLER_HPP
+#define _SAMPLER_HPP
+
+#include <csignal>
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <ostream>
+#include <string>
+#include <sys/types.h>
+#include <vector>
+#include "toy.hpp"
+
+class DefStatement;
+
+/* A sampling profiler for Toy code.
+ *
+ * The thread being profiled keeps a State up to date as it runs: the
+ * functions it is in and the line it last passed a safepoint on (see
+ * Interpreter). A timer on the thread's CPU clock sends it SIGPROF every
+ * interval, and the handler adds the State as it is to a table of
+ * distinct stacks with a count each. The table is allocated when sampling
+ * starts, so the handler never allocates or locks; a stack that no longer
+ * fits is only counted as dropped. Reading the table back, into
+ * per-function and per-line histograms or folded stacks (the input of
+ * flamegraph.pl and most flame graph viewers), is done once sampling has
+ * stopped.
+ *
+ * One Sampler runs at a time in a process. The handler stays installed
+ * once sampling has started, and does nothing while none runs.
+ */
+class Sampler {
+  public:
+    /* Calls kept per stack; a power of two */
+    static const unsigned int max_depth = 64;
+
+    /* Written by the thread itself, read by the signal handler that
+     * interrupts it. Functions go in at depth modulo max_depth, so the
+     * innermost are always there. */
+    struct State {
+        State()
+            : line(0),
+              depth(0) {}
+        volatile sig_atomic_t line;
+        volatile sig_atomic_t depth;
+        const DefStatement *volatile functions[max_depth];
+    };
+
+    /* Samples with the same stack and line */
+    struct Sample {
+        /* Outermost first; only the innermost max_depth calls of a
+         * deeper stack */
+        std::vector<const DefStatement*> stack;
+        bool truncated;
+        unsigned int line;
+        unsigned long count;
+    };
+
+    Sampler()
+        : state_(0),
+          running_(false),
+          interval_(0),
+          thread_(0),
+          used_(0),
+          frames_used_(0),
+          taken_(0),
+          dropped_(0) {}
+    ~Sampler();
+
+    /* Samples the calling thread's state every interval seconds of its CPU
+     * time, adding to what was sampled before. False if another Sampler is
+     * running, or there is no timer to be had. */
+    bool start(const State*, double interval);
+    void stop();
+    inline bool running() const { return running_; }
+
+    std::vector<Sample> samples() const;
+    inline unsigned long taken() const { return taken_; }
+    inline unsigned long dropped() const { return dropped_; }
+
+    /* A line per stack and line, "root;f;g:12 count"; top-level code is
+     * the root */
+    void write_folded(std::ostream&, const std::string &root) const;
+    /* Samples per function (in it, and anywhere on the stack) and per
+     * line, most first */
+    void write_histograms(std::ostream&, const std::string &root) const;
+  private:
+    static const size_t bucket_count = 4096;
+    static const size_t frame_count = 65536;
+
+    struct Bucket {
+        uint64_t hash;
+        unsigned long count;
+        size_t frames;
+        unsigned int depth;
+        bool truncated;
+        unsigned int line;
+    };
+
+    static void handler(int);
+    void record();
+
+    const State *state_;
+    bool running_;
+    double interval_;
+    timer_t timer_;
+    pid_t thread_;
+
+    /* Only touched by the handler while running */
+    std::vector<Bucket> buckets_;
+    std::vector<const DefStatement*> frames_;
+    size_t used_, frames_used_;
+    unsigned long taken_, dropped_;
+    DISALLOW_COPY_AND_ASSIGN(Sampler);
+};
+
+#endif
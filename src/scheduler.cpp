@@ -0,0 +1,258 @@
+#include "scheduler.hpp"
+#include <cstdint>
+#include <exception>
+#include <new>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "exceptions.hpp"
+#include "io.hpp"
+
+/* AddressSanitizer has to be told when the stack changes under it */
+#if defined(__SANITIZE_ADDRESS__)
+#include <sanitizer/common_interface_defs.h>
+#define START_SWITCH(save, bottom, size) __sanitizer_start_switch_fiber(save, bottom, size)
+#define FINISH_SWITCH(save, bottom, size) __sanitizer_finish_switch_fiber(save, bottom, size)
+#else
+#define START_SWITCH(save, bottom, size) ((void)(save), (void)(bottom), (void)(size))
+#define FINISH_SWITCH(save, bottom, size) ((void)(save), (void)(bottom), (void)(size))
+#endif
+
+/* Native stack kept free below a script's deepest call */
+static const size_t stack_reserve = 64 * 1024;
+
+/* One script: its Interpreter, and the coroutine it runs on. While it waits
+ * it is either in the epoll set or among the sleepers. */
+class Scheduler::Script : public IoWaiter {
+  public:
+    Script(Scheduler*, const Program&, std::ostream&, size_t);
+    ~Script();
+
+    virtual bool wait_readable(int fd, Clock::time_point deadline) { return scheduler_->wait(this, fd, EPOLLIN, deadline); }
+    virtual bool wait_writable(int fd, Clock::time_point deadline) { return scheduler_->wait(this, fd, EPOLLOUT, deadline); }
+    virtual void sleep_until(Clock::time_point until) { scheduler_->sleep_until(this, until); }
+
+    inline Interpreter &interpreter() { return interpreter_; }
+    inline ucontext_t *context() { return &context_; }
+    inline const char *stack() const { return stack_; }
+    inline size_t stack_size() const { return stack_size_; }
+    inline bool finished() const { return finished_; }
+    inline bool failed() const { return failed_; }
+
+    void release_stack();
+  private:
+    static void start(unsigned int, unsigned int);
+    void main();
+
+    Scheduler *scheduler_;
+    const Program &program_;
+    std::ostream &out_;
+    Interpreter interpreter_;
+    char *stack_;
+    size_t stack_size_;
+    ucontext_t context_;
+    bool finished_, failed_;
+};
+
+Scheduler::Script::Script(Scheduler *scheduler, const Program &program, std::ostream &out, size_t stack_size)
+    : scheduler_(scheduler),
+      program_(program),
+      out_(out),
+      interpreter_(program, out),
+      stack_size_(stack_size),
+      finished_(false),
+      failed_(false) {
+    /* The lowest page is left unmapped to catch overflows */
+    void *stack = mmap(0, stack_size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+    if (stack == MAP_FAILED)
+        throw std::bad_alloc();
+    stack_ = static_cast<char*>(stack);
+    mprotect(stack_, sysconf(_SC_PAGESIZE), PROT_NONE);
+
+    size_t usable = stack_size_ > 4 * stack_reserve ? stack_size_ - stack_reserve : stack_size_ / 2;
+    interpreter_.set_native_stack(usable);
+    interpreter_.set_io(this);
+
+    getcontext(&context_);
+    context_.uc_stack.ss_sp = stack_;
+    context_.uc_stack.ss_size = stack_size_;
+    context_.uc_link = &scheduler->context_;
+    /* makecontext() only passes ints */
+    uintptr_t self = reinterpret_cast<uintptr_t>(this);
+    makecontext(&context_, reinterpret_cast<void (*)()>(start), 2,
+                static_cast<unsigned int>(self >> 32), static_cast<unsigned int>(self & 0xffffffff));
+}
+
+Scheduler::Script::~Script() {
+    munmap(stack_, stack_size_);
+}
+
+/* Hands back the pages below the current frame, which a deep call may have
+ * touched, so a suspended script only holds the stack it is using */
+void Scheduler::Script::release_stack() {
+    const uintptr_t page = sysconf(_SC_PAGESIZE);
+    char marker;
+    /* A page of margin for the frames switching contexts */
+    uintptr_t top = (reinterpret_cast<uintptr_t>(&marker) & ~(page - 1)) - page;
+    uintptr_t bottom = reinterpret_cast<uintptr_t>(stack_) + page;
+    if (top > bottom)
+        madvise(reinterpret_cast<void*>(bottom), top - bottom, MADV_DONTNEED);
+}
+
+void Scheduler::Script::start(unsigned int high, unsigned int low) {
+    uintptr_t self = (static_cast<uintptr_t>(high) << 32) | low;
+    Script *script = reinterpret_cast<Script*>(self);
+    Scheduler *scheduler = script->scheduler_;
+    FINISH_SWITCH(0, &scheduler->stack_bottom_, &scheduler->stack_used_);
+    script->main();
+    /* Back to the scheduler through uc_link, for good */
+    START_SWITCH(0, scheduler->stack_bottom_, scheduler->stack_used_);
+}
+
+/* Nothing may be thrown past the coroutine's first frame */
+void Scheduler::Script::main() {
+    try {
+        interpreter_.run();
+    } catch (RuntimeError &error) {
+        out_ << program_.filename() << ":" << error.line() << ": " << error.message() << std::endl;
+        failed_ = true;
+    } catch (SyntaxError &error) {
+        /* From a function body parsed on first call */
+        out_ << error.message() << std::endl;
+        failed_ = true;
+    } catch (std::exception &error) {
+        out_ << program_.filename() << ": " << error.what() << std::endl;
+        failed_ = true;
+    }
+    finished_ = true;
+}
+
+/* Scheduler */
+
+Scheduler::Scheduler(size_t stack_size)
+    : stack_size_(stack_size),
+      epoll_(epoll_create1(EPOLL_CLOEXEC)),
+      stack_bottom_(0),
+      stack_used_(0),
+      live_(0),
+      failed_(0) {
+    if (epoll_ < 0)
+        throw std::bad_alloc();
+}
+
+Scheduler::~Scheduler() {
+    /* Only scripts that never got to run can be left */
+    for (std::deque<Script*>::const_iterator it = ready_.begin(), end = ready_.end(); it != end; ++it)
+        delete *it;
+    close(epoll_);
+}
+
+void Scheduler::spawn(const Program &program, std::ostream &out) {
+    Script *script = new Script(this, program, out, stack_size_);
+    script->interpreter().set_limits(limits_);
+    Interpreter::Tiering tiering = tiering_;
+    tiering.background = false;
+    script->interpreter().set_tiering(tiering);
+    script->interpreter().set_memoization(memoization_);
+
+    ready_.push_back(script);
+    ++live_;
+}
+
+unsigned int Scheduler::run() {
+    while (live_ > 0) {
+        while (!ready_.empty()) {
+            Script *script = ready_.front();
+            ready_.pop_front();
+            resume(script);
+            if (script->finished()) {
+                if (script->failed())
+                    ++failed_;
+                --live_;
+                delete script;
+            }
+        }
+        if (live_ > 0)
+            poll();
+    }
+    return failed_;
+}
+
+void Scheduler::resume(Script *script) {
+    void *save;
+    START_SWITCH(&save, script->stack(), script->stack_size());
+    swapcontext(&context_, script->context());
+    FINISH_SWITCH(save, 0, 0);
+}
+
+void Scheduler::suspend(Script *script) {
+    script->release_stack();
+    void *save;
+    START_SWITCH(&save, stack_bottom_, stack_used_);
+    swapcontext(script->context(), &context_);
+    FINISH_SWITCH(save, 0, 0);
+}
+
+/* Whichever comes first, the descriptor or the deadline, wakes the script
+ * and cancels the other */
+bool Scheduler::wait(Script *script, int fd, unsigned int events, Clock::time_point deadline) {
+    struct epoll_event event;
+    event.events = events | EPOLLONESHOT;
+    event.data.ptr = script;
+    /* Fails for regular files, which are always ready anyway */
+    if (epoll_ctl(epoll_, EPOLL_CTL_ADD, fd, &event) < 0)
+        return false;
+
+    Wait &wait = waiting_[script];
+    wait.fd = fd;
+    wait.timer = deadline == Clock::time_point::max() ? sleeping_.end() : sleeping_.insert(std::make_pair(deadline, script));
+    suspend(script);
+    return true;
+}
+
+void Scheduler::sleep_until(Script *script, Clock::time_point until) {
+    sleeping_.insert(std::make_pair(until, script));
+    suspend(script);
+}
+
+void Scheduler::wake_sleepers() {
+    const Clock::time_point now = Clock::now();
+    while (!sleeping_.empty() && sleeping_.begin()->first <= now) {
+        Script *script = sleeping_.begin()->second;
+        sleeping_.erase(sleeping_.begin());
+
+        std::map<Script*, Wait>::iterator wait = waiting_.find(script);
+        if (wait != waiting_.end()) {
+            epoll_ctl(epoll_, EPOLL_CTL_DEL, wait->second.fd, 0);
+            waiting_.erase(wait);
+        }
+        ready_.push_back(script);
+    }
+}
+
+/* Waits until a script is ready */
+void Scheduler::poll() {
+    wake_sleepers();
+    if (!ready_.empty() || (waiting_.empty() && sleeping_.empty()))
+        return;
+
+    int timeout = -1;
+    if (!sleeping_.empty()) {
+        Clock::duration left = sleeping_.begin()->first - Clock::now();
+        /* Rounded up, so as not to wake just before the deadline */
+        timeout = std::chrono::duration_cast<std::chrono::milliseconds>(left).count() + 1;
+    }
+
+    struct epoll_event events[64];
+    int count = epoll_wait(epoll_, events, 64, timeout);
+    for (int i = 0; i < count; ++i) {
+        Script *script = static_cast<Script*>(events[i].data.ptr);
+        std::map<Script*, Wait>::iterator wait = waiting_.find(script);
+        epoll_ctl(epoll_, EPOLL_CTL_DEL, wait->second.fd, 0);
+        if (wait->second.timer != sleeping_.end())
+            sleeping_.erase(wait->second.timer);
+        waiting_.erase(wait);
+        ready_.push_back(script);
+    }
+    wake_sleepers();
+}
@@ -0,0 +1,87 @@
+#ifndef _SCHEDULER_HPP
+#define _SCHEDULER_HPP
+
+#include <chrono>
+#include <cstddef>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <ucontext.h>
+#include "interpreter.hpp"
+#include "program.hpp"
+#include "toy.hpp"
+
+/* Runs many scripts on one thread, interleaving them whenever one waits
+ * for I/O.
+ *
+ * Each script is an Interpreter on a coroutine with a native stack of its
+ * own, so its whole call stack can be suspended inside sleep() or a read
+ * (see Io) and resumed later where it left off. Stacks are reserved, not
+ * committed: a suspended script only holds the pages it has touched,
+ * besides its Interpreter. Switching is a swapcontext(), and only happens
+ * at those waits, so scripts that don't wait simply run one after the
+ * other.
+ *
+ * Waits on descriptors go through one epoll instance, and sleeps and the
+ * deadlines of waits through a timer queue; both are only looked at once
+ * no script is ready to run.
+ *
+ *     Scheduler scheduler;
+ *     scheduler.spawn(*program1);
+ *     scheduler.spawn(*program2);
+ *     unsigned int failed = scheduler.run();
+ */
+class Scheduler {
+  public:
+    /* stack_size is the address space reserved for each script's stack */
+    explicit Scheduler(size_t stack_size = 1024 * 1024);
+    ~Scheduler();
+
+    /* Applied to scripts spawned afterwards. Compiling always happens on
+     * the scheduler's thread. */
+    inline void set_limits(const Interpreter::Limits &limits) { limits_ = limits; }
+    inline void set_tiering(const Interpreter::Tiering &tiering) { tiering_ = tiering; }
+    inline void set_memoization(const Interpreter::Memoization &memoization) { memoization_ = memoization; }
+
+    /* The program must outlive run(). Errors are printed to out, like
+     * "filename:line: message". */
+    void spawn(const Program&, std::ostream &out = std::cout);
+
+    /* Until every script has finished. Returns how many failed. */
+    unsigned int run();
+  private:
+    class Script;
+    typedef std::chrono::steady_clock Clock;
+
+    bool wait(Script*, int, unsigned int, Clock::time_point);
+    void sleep_until(Script*, Clock::time_point);
+    void suspend(Script*);
+    void resume(Script*);
+    void wake_sleepers();
+    void poll();
+
+    size_t stack_size_;
+    int epoll_;
+    ucontext_t context_;
+    /* The scheduler's own stack, for AddressSanitizer */
+    const void *stack_bottom_;
+    size_t stack_used_;
+    Interpreter::Limits limits_;
+    Interpreter::Tiering tiering_;
+    Interpreter::Memoization memoization_;
+    std::deque<Script*> ready_;
+    /* Sleeps, and deadlines of waits on descriptors */
+    std::multimap<Clock::time_point, Script*> sleeping_;
+
+    /* A script waiting on a descriptor */
+    struct Wait {
+        int fd;
+        std::multimap<Clock::time_point, Script*>::iterator timer;
+    };
+    std::map<Script*, Wait> waiting_;
+    unsigned int live_;
+    unsigned int failed_;
+    DISALLOW_COPY_AND_ASSIGN(Scheduler);
+};
+
+#endif
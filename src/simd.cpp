@@ -0,0 +1,181 @@
+#include "simd.hpp"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TOY_SIMD_AVX2
+#include <immintrin.h>
+#endif
+
+/* Eight partial sums: lanes j and j + 4, then pairs of those */
+static inline double reduce(const double *partial) {
+    double lanes[4];
+    for (int j = 0; j < 4; ++j)
+        lanes[j] = partial[j] + partial[j + 4];
+    return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+}
+
+static double scalar_sum(const double *x, size_t n) {
+    double partial[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        for (int j = 0; j < 8; ++j)
+            partial[j] += x[i + j];
+    }
+    double ret = reduce(partial);
+    for (; i < n; ++i)
+        ret += x[i];
+    return ret;
+}
+
+static double scalar_dot(const double *x, const double *y, size_t n) {
+    double partial[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        for (int j = 0; j < 8; ++j)
+            partial[j] += x[i + j] * y[i + j];
+    }
+    double ret = reduce(partial);
+    for (; i < n; ++i)
+        ret += x[i] * y[i];
+    return ret;
+}
+
+static void scalar_axpy(double a, const double *x, const double *y, double *out, size_t n) {
+    for (size_t i = 0; i < n; ++i)
+        out[i] = a * x[i] + y[i];
+}
+
+static void scalar_compare(TokenType op, const double *x, const double *y, double *out, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        bool result;
+        switch (op) {
+            case tok_eq: result = x[i] == y[i]; break;
+            case tok_lt: result = x[i] < y[i]; break;
+            case tok_gt: result = x[i] > y[i]; break;
+            case tok_lte: result = x[i] <= y[i]; break;
+            case tok_gte: result = x[i] >= y[i]; break;
+            default: result = false; break;
+        }
+        out[i] = result ? 1.0 : 0.0;
+    }
+}
+
+#ifdef TOY_SIMD_AVX2
+__attribute__((target("avx2")))
+static double avx2_sum(const double *x, size_t n) {
+    __m256d low = _mm256_setzero_pd(), high = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        low = _mm256_add_pd(low, _mm256_loadu_pd(x + i));
+        high = _mm256_add_pd(high, _mm256_loadu_pd(x + i + 4));
+    }
+    double partial[8];
+    _mm256_storeu_pd(partial, low);
+    _mm256_storeu_pd(partial + 4, high);
+    double ret = reduce(partial);
+    for (; i < n; ++i)
+        ret += x[i];
+    return ret;
+}
+
+__attribute__((target("avx2")))
+static double avx2_dot(const double *x, const double *y, size_t n) {
+    __m256d low = _mm256_setzero_pd(), high = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        low = _mm256_add_pd(low, _mm256_mul_pd(_mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i)));
+        high = _mm256_add_pd(high, _mm256_mul_pd(_mm256_loadu_pd(x + i + 4), _mm256_loadu_pd(y + i + 4)));
+    }
+    double partial[8];
+    _mm256_storeu_pd(partial, low);
+    _mm256_storeu_pd(partial + 4, high);
+    double ret = reduce(partial);
+    for (; i < n; ++i)
+        ret += x[i] * y[i];
+    return ret;
+}
+
+__attribute__((target("avx2")))
+static void avx2_axpy(double a, const double *x, const double *y, double *out, size_t n) {
+    const __m256d factor = _mm256_set1_pd(a);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+        _mm256_storeu_pd(out + i, _mm256_add_pd(_mm256_mul_pd(factor, _mm256_loadu_pd(x + i)), _mm256_loadu_pd(y + i)));
+    scalar_axpy(a, x + i, y + i, out + i, n - i);
+}
+
+/* The predicate must be a constant */
+template <int predicate>
+__attribute__((target("avx2")))
+static void avx2_compare(const double *x, const double *y, double *out, size_t n) {
+    const __m256d one = _mm256_set1_pd(1.0);
+    for (size_t i = 0; i + 4 <= n; i += 4) {
+        __m256d mask = _mm256_cmp_pd(_mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i), predicate);
+        _mm256_storeu_pd(out + i, _mm256_and_pd(mask, one));
+    }
+}
+#endif
+
+bool Simd::avx2_ =
+#ifdef TOY_SIMD_AVX2
+    __builtin_cpu_supports("avx2");
+#else
+    false;
+#endif
+
+bool Simd::avx2() {
+    return avx2_;
+}
+
+void Simd::set_avx2(bool on) {
+#ifdef TOY_SIMD_AVX2
+    avx2_ = on && __builtin_cpu_supports("avx2");
+#else
+    (void)on;
+#endif
+}
+
+double Simd::sum(const double *x, size_t n) {
+#ifdef TOY_SIMD_AVX2
+    if (avx2_)
+        return avx2_sum(x, n);
+#endif
+    return scalar_sum(x, n);
+}
+
+double Simd::dot(const double *x, const double *y, size_t n) {
+#ifdef TOY_SIMD_AVX2
+    if (avx2_)
+        return avx2_dot(x, y, n);
+#endif
+    return scalar_dot(x, y, n);
+}
+
+void Simd::axpy(double a, const double *x, const double *y, double *out, size_t n) {
+#ifdef TOY_SIMD_AVX2
+    if (avx2_) {
+        avx2_axpy(a, x, y, out, n);
+        return;
+    }
+#endif
+    scalar_axpy(a, x, y, out, n);
+}
+
+void Simd::compare(TokenType op, const double *x, const double *y, double *out, size_t n) {
+#ifdef TOY_SIMD_AVX2
+    if (avx2_) {
+        switch (op) {
+            case tok_eq: avx2_compare<_CMP_EQ_OQ>(x, y, out, n); break;
+            case tok_lt: avx2_compare<_CMP_LT_OQ>(x, y, out, n); break;
+            case tok_gt: avx2_compare<_CMP_GT_OQ>(x, y, out, n); break;
+            case tok_lte: avx2_compare<_CMP_LE_OQ>(x, y, out, n); break;
+            case tok_gte: avx2_compare<_CMP_GE_OQ>(x, y, out, n); break;
+            default: break;
+        }
+        /* The rest of a group of four */
+        const size_t done = n / 4 * 4;
+        scalar_compare(op, x + done, y + done, out + done, n - done);
+        return;
+    }
+#endif
+    scalar_compare(op, x, y, out, n);
+}
@@ -0,0 +1,32 @@
+#ifndef _SIMD_HPP
+#define _SIMD_HPP
+
+#include <cstddef>
+#include "lexer.hpp"
+
+/* The loops behind the builtins on numbers, on doubles in memory.
+ *
+ * Where the CPU has AVX2 they run four lanes at a time; elsewhere the same
+ * loops run one element at a time. Both give bit-identical results: the
+ * reductions keep eight partial sums, add them up in the same order and
+ * the remaining elements after them, and nothing is fused into an FMA.
+ */
+class Simd {
+  public:
+    static double sum(const double*, size_t);
+    static double dot(const double*, const double*, size_t);
+    /* out[i] = a * x[i] + y[i] */
+    static void axpy(double, const double*, const double*, double*, size_t);
+    /* out[i] = 1 where x[i] op y[i], else 0, for op one of ==, <, >, <=
+     * and >=. Comparisons with NaN are false. */
+    static void compare(TokenType, const double*, const double*, double*, size_t);
+
+    /* Whether the AVX2 loops run. Turning them on does nothing where the
+     * CPU doesn't have it; for tests. */
+    static bool avx2();
+    static void set_avx2(bool);
+  private:
+    static bool avx2_;
+};
+
+#endif
@@ -0,0 +1,505 @@
+#include "snapshot.hpp"
+#include <algorithm>
+#include <cstring>
+#include <set>
+#include <stdint.h>
+#include "exceptions.hpp"
+#include "lexer.hpp"
+
+#define SNAPSHOT_MAGIC "TOYIMG"
+#define SNAPSHOT_VERSION 2
+
+typedef enum {
+    image_program = 'P',
+    image_ast = 'A'
+} ImageKind;
+
+static void write_header(std::ostream &out, ImageKind kind) {
+    out.write(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC) - 1);
+    out.put((char)SNAPSHOT_VERSION);
+    out.put((char)kind);
+}
+
+static void read_header(std::istream &in, ImageKind kind) {
+    char magic[sizeof(SNAPSHOT_MAGIC) - 1];
+    in.read(magic, sizeof(magic));
+
+    if (!in.good() || memcmp(magic, SNAPSHOT_MAGIC, sizeof(magic)) != 0)
+        throw SnapshotError("Not a Toy image");
+    if (in.get() != SNAPSHOT_VERSION)
+        throw SnapshotError("Unsupported Toy image version");
+    if (in.get() != kind)
+        throw SnapshotError("Wrong kind of Toy image");
+}
+
+Snapshot::Snapshot(std::istream *in)
+    : out_(0),
+      in_(in),
+      in_end_(-1) {
+    std::streampos start = in->tellg();
+    if (start == std::streampos(-1))
+        return;
+
+    in->seekg(0, std::ios::end);
+    in_end_ = in->tellg();
+    in->seekg(start);
+}
+
+void Snapshot::save(std::ostream &out, const Program &program, const Interpreter &interpreter) {
+    Snapshot writer(&out);
+    write_header(out, image_program);
+
+    writer.write_string(program.filename());
+    writer.write_block(program.ast());
+
+    const Interpreter::Scope &globals = interpreter.globals();
+    writer.write_u32(globals.size());
+    for (Interpreter::Scope::const_iterator it = globals.begin(), end = globals.end(); it != end; ++it) {
+        writer.write_string(it->first);
+        writer.write_value(it->second);
+    }
+}
+
+const Program *Snapshot::load(std::istream &in, Interpreter::Scope &globals) {
+    Snapshot reader(&in);
+    read_header(in, image_program);
+
+    const std::string filename = reader.read_string();
+    AST *ast = reader.read_block();
+
+    for (unsigned int i = 0, count = reader.read_u32(); i < count; ++i) {
+        const std::string name = reader.read_string();
+        globals[name] = reader.read_value();
+    }
+
+    return new Program(filename, ast);
+}
+
+void Snapshot::save_ast(std::ostream &out, const AST *ast) {
+    Snapshot writer(&out);
+    write_header(out, image_ast);
+    writer.write_block(ast);
+}
+
+AST *Snapshot::load_ast(std::istream &in) {
+    Snapshot reader(&in);
+    read_header(in, image_ast);
+    return reader.read_block();
+}
+
+/* Primitives; everything is little endian */
+
+void Snapshot::write_u8(unsigned char c) {
+    out_->put((char)c);
+}
+
+void Snapshot::write_u32(unsigned int n) {
+    for (int i = 0; i < 4; ++i)
+        write_u8((n >> (i * 8)) & 0xff);
+}
+
+void Snapshot::write_number(double number) {
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(bits));
+    for (int i = 0; i < 8; ++i)
+        write_u8((bits >> (i * 8)) & 0xff);
+}
+
+void Snapshot::write_string(const std::string &string) {
+    write_u32(string.size());
+    out_->write(string.data(), string.size());
+}
+
+unsigned char Snapshot::read_u8() {
+    int c = in_->get();
+    if (c == EOF)
+        throw SnapshotError("Truncated Toy image");
+    return (unsigned char)c;
+}
+
+unsigned int Snapshot::read_u32() {
+    unsigned int n = 0;
+    for (int i = 0; i < 4; ++i)
+        n |= (unsigned int)read_u8() << (i * 8);
+    return n;
+}
+
+double Snapshot::read_number() {
+    uint64_t bits = 0;
+    for (int i = 0; i < 8; ++i)
+        bits |= (uint64_t)read_u8() << (i * 8);
+
+    double number;
+    memcpy(&number, &bits, sizeof(number));
+    return number;
+}
+
+/* A corrupt size must not allocate more than the image holds. Where the
+ * stream can't tell how much that is, the string is read in pieces. */
+const std::string Snapshot::read_string() {
+    static const unsigned int piece = 64 << 10;
+
+    unsigned int size = read_u32();
+    if (in_end_ != std::streampos(-1) && std::streamoff(size) > in_end_ - in_->tellg())
+        throw SnapshotError("Truncated Toy image");
+
+    std::string string;
+    while (string.size() < size) {
+        std::string::size_type offset = string.size();
+        string.resize(std::min<std::string::size_type>(size, offset + piece));
+        if (!in_->read(&string[offset], string.size() - offset))
+            throw SnapshotError("Truncated Toy image");
+    }
+    return string;
+}
+
+/* AST nodes, written in pre-order as type, line and payload */
+
+void Snapshot::write_block(const AST *block) {
+    write_u8(block->type());
+    write_u32(block->line());
+
+    const std::vector<const Statement*> &nodes = block->nodes();
+    write_u32(nodes.size());
+    for (std::vector<const Statement*>::const_iterator it = nodes.begin(), end = nodes.end(); it != end; ++it)
+        write_statement(*it);
+}
+
+void Snapshot::write_statement(const Statement *node) {
+    write_u8(node->type());
+    write_u32(node->line());
+
+    switch (node->type()) {
+        case toy_expression_statement:
+            write_expression(static_cast<const ExpressionStatement*>(node)->expr());
+            break;
+        case toy_if: {
+            const IfStatement *ifs = static_cast<const IfStatement*>(node);
+            write_expression(ifs->cond());
+            write_block(ifs->true_block());
+            write_u8(ifs->false_block() != 0);
+            if (ifs->false_block())
+                write_block(ifs->false_block());
+            break;
+        }
+        case toy_while:
+            write_expression(static_cast<const WhileStatement*>(node)->cond());
+            write_block(static_cast<const WhileStatement*>(node)->block());
+            break;
+        case toy_return:
+            write_expression(static_cast<const ReturnStatement*>(node)->ret());
+            break;
+        case toy_def: {
+            const DefStatement *def = static_cast<const DefStatement*>(node);
+            write_string(def->name());
+            write_u32(def->params().size());
+            for (std::vector<std::string>::const_iterator it = def->params().begin(), end = def->params().end(); it != end; ++it)
+                write_string(*it);
+
+            /* Unparsed bodies stay unparsed */
+            write_u8(def->parsed());
+            if (def->parsed()) {
+                write_block(def->block());
+            } else {
+                write_string(def->body());
+                write_string(def->filename());
+                write_u32(def->body_line());
+                write_u32(def->callees().size());
+                for (std::set<std::string>::const_iterator it = def->callees().begin(), end = def->callees().end(); it != end; ++it)
+                    write_string(*it);
+            }
+            break;
+        }
+        case toy_import:
+            write_string(static_cast<const ImportStatement*>(node)->module());
+            break;
+        default:
+            throw SnapshotError("Cannot save unknown statement");
+    }
+}
+
+void Snapshot::write_expression(const Expression *node) {
+    write_u8(node->type());
+    write_u32(node->line());
+
+    switch (node->type()) {
+        case toy_number:
+            write_number(static_cast<const ValueExpr*>(node)->number());
+            break;
+        case toy_string:
+            write_string(static_cast<const ValueExpr*>(node)->string());
+            break;
+        case toy_binary_op: {
+            const BinaryOpExpr *binop = static_cast<const BinaryOpExpr*>(node);
+            write_u8(binop->op_type());
+            write_expression(binop->left());
+            write_expression(binop->right());
+            break;
+        }
+        case toy_variable:
+            write_string(static_cast<const VariableExpr*>(node)->varname());
+            break;
+        case toy_array: {
+            const std::vector<const Expression*> &elements = static_cast<const ArrayExpr*>(node)->elements();
+            write_u32(elements.size());
+            for (std::vector<const Expression*>::const_iterator it = elements.begin(), end = elements.end(); it != end; ++it)
+                write_expression(*it);
+            break;
+        }
+        case toy_index:
+            write_expression(static_cast<const IndexExpr*>(node)->container());
+            write_expression(static_cast<const IndexExpr*>(node)->index());
+            break;
+        case toy_map: {
+            const MapExpr *map = static_cast<const MapExpr*>(node);
+            write_u32(map->keys().size());
+            for (std::vector<const Expression*>::size_type i = 0; i < map->keys().size(); ++i) {
+                write_expression(map->keys()[i]);
+                write_expression(map->values()[i]);
+            }
+            break;
+        }
+        case toy_assign:
+            write_string(static_cast<const AssignExpr*>(node)->lvalue());
+            write_expression(static_cast<const AssignExpr*>(node)->rvalue());
+            break;
+        case toy_function_call: {
+            const FuncCallExpr *call = static_cast<const FuncCallExpr*>(node);
+            write_string(call->funcname());
+            write_u32(call->args().size());
+            for (std::vector<const Expression*>::const_iterator it = call->args().begin(), end = call->args().end(); it != end; ++it)
+                write_expression(*it);
+            break;
+        }
+        default:
+            throw SnapshotError("Cannot save unknown expression");
+    }
+}
+
+AST *Snapshot::read_block() {
+    AST *ret = dynamic_cast<AST*>(read_node());
+    if (!ret)
+        throw SnapshotError("Corrupt Toy image: expected a block");
+    return ret;
+}
+
+Statement *Snapshot::read_statement() {
+    Statement *ret = dynamic_cast<Statement*>(read_node());
+    if (!ret)
+        throw SnapshotError("Corrupt Toy image: expected a statement");
+    return ret;
+}
+
+Expression *Snapshot::read_expression() {
+    Expression *ret = dynamic_cast<Expression*>(read_node());
+    if (!ret)
+        throw SnapshotError("Corrupt Toy image: expected an expression");
+    return ret;
+}
+
+ASTNode *Snapshot::read_node() {
+    NodeType type = (NodeType)read_u8();
+    unsigned int line = read_u32();
+    ASTNode *ret = 0;
+
+    switch (type) {
+        case toy_ast: {
+            std::vector<const Statement*> nodes;
+            for (unsigned int i = 0, count = read_u32(); i < count; ++i)
+                nodes.push_back(read_statement());
+            ret = new AST(nodes);
+            break;
+        }
+        case toy_number:
+            ret = new ValueExpr(read_number());
+            break;
+        case toy_string:
+            ret = new ValueExpr(read_string());
+            break;
+        case toy_binary_op: {
+            TokenType op = (TokenType)read_u8();
+            const Expression *left = read_expression();
+            const Expression *right = read_expression();
+            ret = new BinaryOpExpr(left, right, op);
+            break;
+        }
+        case toy_variable:
+            ret = new VariableExpr(read_string());
+            break;
+        case toy_array: {
+            std::vector<const Expression*> elements;
+            for (unsigned int i = 0, count = read_u32(); i < count; ++i)
+                elements.push_back(read_expression());
+            ret = new ArrayExpr(elements);
+            break;
+        }
+        case toy_index: {
+            const Expression *container = read_expression();
+            const Expression *index = read_expression();
+            ret = new IndexExpr(container, index);
+            break;
+        }
+        case toy_map: {
+            std::vector<const Expression*> keys, values;
+            for (unsigned int i = 0, count = read_u32(); i < count; ++i) {
+                keys.push_back(read_expression());
+                values.push_back(read_expression());
+            }
+            ret = new MapExpr(keys, values);
+            break;
+        }
+        case toy_assign: {
+            const std::string lvalue = read_string();
+            ret = new AssignExpr(lvalue, read_expression());
+            break;
+        }
+        case toy_function_call: {
+            const std::string funcname = read_string();
+            std::vector<const Expression*> args;
+            for (unsigned int i = 0, count = read_u32(); i < count; ++i)
+                args.push_back(read_expression());
+            ret = new FuncCallExpr(funcname, args);
+            break;
+        }
+        case toy_expression_statement:
+            ret = new ExpressionStatement(read_expression());
+            break;
+        case toy_if: {
+            const Expression *cond = read_expression();
+            const AST *true_block = read_block();
+            if (read_u8())
+                ret = new IfStatement(cond, true_block, read_block());
+            else
+                ret = new IfStatement(cond, true_block);
+            break;
+        }
+        case toy_while: {
+            const Expression *cond = read_expression();
+            ret = new WhileStatement(cond, read_block());
+            break;
+        }
+        case toy_return:
+            ret = new ReturnStatement(read_expression());
+            break;
+        case toy_def: {
+            const std::string name = read_string();
+            std::vector<std::string> params;
+            for (unsigned int i = 0, count = read_u32(); i < count; ++i)
+                params.push_back(read_string());
+
+            if (read_u8()) {
+                ret = new DefStatement(name, params, read_block());
+            } else {
+                const std::string body = read_string();
+                const std::string filename = read_string();
+                const unsigned int body_line = read_u32();
+                std::set<std::string> callees;
+                for (unsigned int i = 0, count = read_u32(); i < count; ++i)
+                    callees.insert(read_string());
+                ret = new DefStatement(name, params, body, filename, body_line, callees);
+            }
+            break;
+        }
+        case toy_import:
+            ret = new ImportStatement(read_string());
+            break;
+        default:
+            throw SnapshotError("Corrupt Toy image: unknown node type");
+    }
+
+    ret->set_line(line);
+    return ret;
+}
+
+/* Values; arrays, maps and numbers get an id the first time they are written, and
+ * later references only write the id */
+
+void Snapshot::write_value(const Value &value) {
+    write_u8(value.type());
+
+    switch (value.type()) {
+        case value_number:
+            write_number(value.number());
+            break;
+        case value_string:
+            write_string(value.string());
+            break;
+        case value_array:
+        case value_map:
+        case value_numbers: {
+            const void *object = value.is_array() ? (const void*)&value.array()
+                               : value.is_map() ? (const void*)&value.map()
+                               : (const void*)&value.numbers();
+            std::map<const void*, unsigned int>::const_iterator it = written_.find(object);
+            if (it != written_.end()) {
+                write_u32(it->second);
+                break;
+            }
+
+            unsigned int id = written_.size();
+            written_[object] = id;
+            write_u32(id);
+
+            if (value.is_array()) {
+                write_u32(value.array().size());
+                for (Value::Array::const_iterator el = value.array().begin(), end = value.array().end(); el != end; ++el)
+                    write_value(*el);
+            } else if (value.is_numbers()) {
+                write_u32(value.numbers().size());
+                for (Value::Numbers::const_iterator el = value.numbers().begin(), end = value.numbers().end(); el != end; ++el)
+                    write_number(*el);
+            } else {
+                write_u32(value.map().size());
+                for (Value::Map::const_iterator el = value.map().begin(), end = value.map().end(); el != end; ++el) {
+                    write_value(el->first);
+                    write_value(el->second);
+                }
+            }
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+Value Snapshot::read_value() {
+    ValueType type = (ValueType)read_u8();
+
+    switch (type) {
+        case value_none:
+            return Value();
+        case value_number:
+            return Value(read_number());
+        case value_string:
+            return Value(read_string());
+        case value_array:
+        case value_map:
+        case value_numbers: {
+            unsigned int id = read_u32();
+            if (id < read_.size())
+                return read_[id];
+            if (id != read_.size())
+                throw SnapshotError("Corrupt Toy image: bad object id");
+
+            Value ret = type == value_array ? Value::new_array(Value::Array())
+                      : type == value_map ? Value::new_map()
+                      : Value::new_numbers(Value::Numbers());
+            read_.push_back(ret);
+
+            unsigned int count = read_u32();
+            for (unsigned int i = 0; i < count; ++i) {
+                if (type == value_numbers) {
+                    ret.numbers().push_back(read_number());
+                } else if (type == value_array) {
+                    ret.array().push_back(read_value());
+                } else {
+                    Value key = read_value();
+                    ret.map()[key] = read_value();
+                }
+            }
+            return ret;
+        }
+        default:
+            throw SnapshotError("Corrupt Toy image: unknown value type");
+    }
+}
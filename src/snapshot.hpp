@@ -0,0 +1,76 @@
+#ifndef _SNAPSHOT_HPP
+#define _SNAPSHOT_HPP
+
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+#include "ast.hpp"
+#include "interpreter.hpp"
+#include "program.hpp"
+#include "toy.hpp"
+#include "toyobj.hpp"
+
+/* Saves an initialized interpreter, i.e. the program's functions and
+ * top-level code plus every global value, as a binary image, and restores
+ * it in another process without parsing or running the prelude again.
+ *
+ * The image is read, not mapped: a restore still builds every node and
+ * value it holds, so it takes time in proportion to the image. It only
+ * pays off where the prelude computes more than it leaves behind.
+ *
+ * The image holds no pointers, so it can be loaded at any address. Arrays
+ * and maps shared between globals stay shared after a restore. Loading
+ * throws SnapshotError on a truncated, corrupt or foreign image.
+ *
+ *     Snapshot::save(out, *program, interpreter);
+ *     ...
+ *     Interpreter::Scope globals;
+ *     const Program *program = Snapshot::load(in, globals);
+ *     Interpreter interpreter(*program);
+ *     interpreter.set_globals(globals);
+ */
+class Snapshot {
+  public:
+    static void save(std::ostream&, const Program&, const Interpreter&);
+    static const Program *load(std::istream&, Interpreter::Scope&);
+
+    /* Only the AST part of an image, e.g. to cache a parsed module */
+    static void save_ast(std::ostream&, const AST*);
+    static AST *load_ast(std::istream&);
+  private:
+    explicit Snapshot(std::ostream *out)
+        : out_(out),
+          in_(0),
+          in_end_(-1) {}
+    explicit Snapshot(std::istream*);
+
+    void write_u8(unsigned char);
+    void write_u32(unsigned int);
+    void write_number(double);
+    void write_string(const std::string&);
+    void write_block(const AST*);
+    void write_statement(const Statement*);
+    void write_expression(const Expression*);
+    void write_value(const Value&);
+
+    unsigned char read_u8();
+    unsigned int read_u32();
+    double read_number();
+    const std::string read_string();
+    AST *read_block();
+    Statement *read_statement();
+    Expression *read_expression();
+    ASTNode *read_node();
+    Value read_value();
+
+    std::ostream *out_;
+    std::istream *in_;
+    /* Where the image ends, or -1 if the stream can't tell */
+    std::streampos in_end_;
+    std::map<const void*, unsigned int> written_;
+    std::vector<Value> read_;
+    DISALLOW_COPY_AND_ASSIGN(Snapshot);
+};
+
+#endif
@@ -0,0 +1,627 @@
+#include "ssa.hpp"
+#include <algorithm>
+#include "lexer.hpp"
+
+/* Builds SSA straight from the AST, following Braun et al., "Simple and
+ * Efficient Construction of Static Single Assignment Form": a variable's
+ * value is looked up through the predecessors of the block reading it, and
+ * a phi is only placed where that finds more than one definition. A block
+ * is sealed once all of its predecessors are known; reads in a loop header
+ * before that get incomplete phis, filled in when the back edge is added.
+ *
+ * Phis left with a single distinct operand are removed afterwards by
+ * CopyPropagation rather than here.
+ */
+class SsaFunction::Builder {
+  public:
+    Builder(SsaFunction *function, const Program &program)
+        : function_(function),
+          program_(program),
+          current_(0) {}
+
+    void build();
+  private:
+    SsaBlock *new_block();
+    void seal(SsaBlock*);
+    void jump(SsaBlock*, SsaBlock*, SsaTerminator, unsigned int);
+
+    void write(const std::string&, SsaBlock*, SsaValue*);
+    SsaValue *read(const std::string&, SsaBlock*);
+    SsaValue *read_recursive(const std::string&, SsaBlock*);
+    SsaValue *new_phi(const std::string&, SsaBlock*);
+    void add_phi_operands(const std::string&, SsaValue*);
+
+    void build(const AST*);
+    void build(const Statement*);
+    SsaValue *build(const Expression*);
+    SsaValue *emit(SsaOp, unsigned int);
+
+    typedef std::map<std::string, SsaValue*> Definitions;
+
+    SsaFunction *function_;
+    const Program &program_;
+    /* 0 after a return, until the next join */
+    SsaBlock *current_;
+    /* By block id */
+    std::vector<Definitions> definitions_;
+    std::vector<Definitions> incomplete_;
+    std::vector<bool> sealed_;
+    Definitions undefined_;
+    DISALLOW_COPY_AND_ASSIGN(Builder);
+};
+
+SsaFunction *SsaFunction::build(const DefStatement *def, const FrameLayout &layout, const Program &program) {
+    SsaFunction *ret = new SsaFunction(def, layout);
+    try {
+        Builder builder(ret, program);
+        builder.build();
+    } catch (...) {
+        delete ret;
+        throw;
+    }
+    return ret;
+}
+
+void SsaFunction::Builder::build() {
+    const DefStatement *def = function_->def();
+    const FrameLayout &layout = function_->layout();
+
+    SsaBlock *entry = new_block();
+    seal(entry);
+    for (unsigned int i = 0; i < layout.params(); ++i) {
+        SsaValue *param = function_->new_value(ssa_param, entry, def->line());
+        param->arg = i;
+        param->name = layout.names()[i];
+        function_->params_.push_back(param);
+        write(param->name, entry, param);
+    }
+
+    current_ = entry;
+    build(def->block());
+    if (current_) {
+        current_->terminator = term_end;
+        current_->line = def->line();
+    }
+}
+
+SsaBlock *SsaFunction::Builder::new_block() {
+    SsaBlock *ret = function_->new_block();
+    definitions_.resize(function_->blocks_.size());
+    incomplete_.resize(function_->blocks_.size());
+    sealed_.resize(function_->blocks_.size(), false);
+    return ret;
+}
+
+void SsaFunction::Builder::seal(SsaBlock *block) {
+    Definitions &incomplete = incomplete_[block->id];
+    for (Definitions::const_iterator it = incomplete.begin(), end = incomplete.end(); it != end; ++it)
+        add_phi_operands(it->first, it->second);
+    incomplete.clear();
+    sealed_[block->id] = true;
+}
+
+void SsaFunction::Builder::jump(SsaBlock *from, SsaBlock *to, SsaTerminator terminator, unsigned int line) {
+    from->terminator = terminator;
+    from->targets[0] = to;
+    from->line = line;
+    to->preds.push_back(from);
+}
+
+/* Variables */
+
+void SsaFunction::Builder::write(const std::string &varname, SsaBlock *block, SsaValue *value) {
+    definitions_[block->id][varname] = value;
+}
+
+SsaValue *SsaFunction::Builder::read(const std::string &varname, SsaBlock *block) {
+    Definitions::const_iterator it = definitions_[block->id].find(varname);
+    if (it != definitions_[block->id].end())
+        return it->second;
+    return read_recursive(varname, block);
+}
+
+SsaValue *SsaFunction::Builder::read_recursive(const std::string &varname, SsaBlock *block) {
+    SsaValue *ret;
+    if (!sealed_[block->id]) {
+        ret = new_phi(varname, block);
+        incomplete_[block->id][varname] = ret;
+    } else if (block->preds.empty()) {
+        /* Only the entry block: read before any assignment */
+        Definitions::const_iterator it = undefined_.find(varname);
+        if (it != undefined_.end()) {
+            ret = it->second;
+        } else {
+            ret = function_->new_value(ssa_undef, function_->entry(), 0);
+            ret->name = varname;
+            undefined_[varname] = ret;
+        }
+    } else if (block->preds.size() == 1) {
+        ret = read(varname, block->preds[0]);
+    } else {
+        /* Written first to break cycles through loops */
+        ret = new_phi(varname, block);
+        write(varname, block, ret);
+        add_phi_operands(varname, ret);
+    }
+    write(varname, block, ret);
+    return ret;
+}
+
+SsaValue *SsaFunction::Builder::new_phi(const std::string &varname, SsaBlock *block) {
+    SsaValue *ret = function_->new_value(ssa_phi, block, 0);
+    ret->name = varname;
+    block->phis.push_back(ret);
+    return ret;
+}
+
+void SsaFunction::Builder::add_phi_operands(const std::string &varname, SsaValue *phi) {
+    const std::vector<SsaBlock*> &preds = phi->block->preds;
+    for (std::vector<SsaBlock*>::const_iterator it = preds.begin(), end = preds.end(); it != end; ++it)
+        phi->operands.push_back(read(varname, *it));
+}
+
+/* Statements */
+
+void SsaFunction::Builder::build(const AST *block) {
+    const std::vector<const Statement*> &nodes = block->nodes();
+    for (std::vector<const Statement*>::const_iterator it = nodes.begin(), end = nodes.end(); it != end; ++it)
+        build(*it);
+}
+
+void SsaFunction::Builder::build(const Statement *statement) {
+    /* Unreachable after a return */
+    if (!current_)
+        return;
+
+    switch (statement->type()) {
+        case toy_expression_statement:
+            build(static_cast<const ExpressionStatement*>(statement)->expr());
+            break;
+        case toy_if: {
+            const IfStatement *node = static_cast<const IfStatement*>(statement);
+            SsaValue *cond = build(node->cond());
+
+            /* An else block even when there is none, so that no edge goes
+             * from a branch straight to a join */
+            SsaBlock *true_block = new_block(), *false_block = new_block();
+            current_->terminator = term_branch;
+            current_->result = cond;
+            current_->targets[0] = true_block;
+            current_->targets[1] = false_block;
+            current_->line = node->line();
+            true_block->preds.push_back(current_);
+            false_block->preds.push_back(current_);
+            seal(true_block);
+            seal(false_block);
+
+            current_ = true_block;
+            build(node->true_block());
+            SsaBlock *true_end = current_;
+
+            current_ = false_block;
+            if (node->false_block())
+                build(node->false_block());
+            SsaBlock *false_end = current_;
+
+            if (!true_end && !false_end) {
+                current_ = 0;
+                break;
+            }
+            SsaBlock *join = new_block();
+            if (true_end)
+                jump(true_end, join, term_jump, node->line());
+            if (false_end)
+                jump(false_end, join, term_jump, node->line());
+            seal(join);
+            current_ = join;
+            break;
+        }
+        case toy_while: {
+            const WhileStatement *node = static_cast<const WhileStatement*>(statement);
+            SsaBlock *header = new_block();
+            jump(current_, header, term_jump, node->line());
+
+            current_ = header;
+            SsaValue *cond = build(node->cond());
+            SsaBlock *body = new_block(), *exit = new_block();
+            header->terminator = term_branch;
+            header->result = cond;
+            header->targets[0] = body;
+            header->targets[1] = exit;
+            header->line = node->line();
+            body->preds.push_back(header);
+            exit->preds.push_back(header);
+            seal(body);
+            seal(exit);
+
+            current_ = body;
+            build(node->block());
+            if (current_)
+                jump(current_, header, term_loop, node->line());
+            seal(header);
+            current_ = exit;
+            break;
+        }
+        case toy_return: {
+            SsaValue *ret = build(static_cast<const ReturnStatement*>(statement)->ret());
+            current_->terminator = term_return;
+            current_->result = ret;
+            current_->line = statement->line();
+            current_ = 0;
+            break;
+        }
+        default:
+            /* Nested definitions are never bound, and imports are resolved
+             * when loading */
+            break;
+    }
+}
+
+/* Expressions */
+
+SsaValue *SsaFunction::Builder::emit(SsaOp op, unsigned int line) {
+    SsaValue *ret = function_->new_value(op, current_, line);
+    current_->values.push_back(ret);
+    return ret;
+}
+
+SsaValue *SsaFunction::Builder::build(const Expression *expr) {
+    SsaValue *ret = 0;
+    switch (expr->type()) {
+        case toy_number:
+            return function_->constant(Value(static_cast<const ValueExpr*>(expr)->number()), expr->line());
+        case toy_string:
+            return function_->constant(Value(static_cast<const ValueExpr*>(expr)->string()), expr->line());
+        case toy_variable: {
+            const std::string &varname = static_cast<const VariableExpr*>(expr)->varname();
+            if (function_->layout().slot(varname) == FrameLayout::no_slot) {
+                ret = emit(ssa_global, expr->line());
+            } else {
+                /* Stays a read until CopyPropagation shows it is assigned */
+                SsaValue *value = read(varname, current_);
+                ret = emit(ssa_local, expr->line());
+                ret->operands.push_back(value);
+            }
+            ret->name = varname;
+            break;
+        }
+        case toy_binary_op: {
+            const BinaryOpExpr *node = static_cast<const BinaryOpExpr*>(expr);
+            SsaValue *left = build(node->left());
+            SsaValue *right = build(node->right());
+            ret = emit(ssa_binary, node->line());
+            ret->arg = node->op_type();
+            ret->operands.push_back(left);
+            ret->operands.push_back(right);
+            break;
+        }
+        case toy_assign: {
+            const AssignExpr *node = static_cast<const AssignExpr*>(expr);
+            ret = build(node->rvalue());
+            write(node->lvalue(), current_, ret);
+            break;
+        }
+        case toy_function_call: {
+            const FuncCallExpr *node = static_cast<const FuncCallExpr*>(expr);
+            std::vector<SsaValue*> args;
+            const std::vector<const Expression*> &nodes = node->args();
+            for (std::vector<const Expression*>::const_iterator it = nodes.begin(), end = nodes.end(); it != end; ++it)
+                args.push_back(build(*it));
+
+            const DefStatement *def = program_.function(node->funcname());
+            ret = emit(def ? ssa_call : ssa_builtin, node->line());
+            ret->function = def;
+            ret->name = node->funcname();
+            ret->operands = args;
+            break;
+        }
+        case toy_array: {
+            std::vector<SsaValue*> elements;
+            const std::vector<const Expression*> &nodes = static_cast<const ArrayExpr*>(expr)->elements();
+            for (std::vector<const Expression*>::const_iterator it = nodes.begin(), end = nodes.end(); it != end; ++it)
+                elements.push_back(build(*it));
+            ret = emit(ssa_array, expr->line());
+            ret->operands = elements;
+            break;
+        }
+        case toy_index: {
+            const IndexExpr *node = static_cast<const IndexExpr*>(expr);
+            SsaValue *container = build(node->container());
+            SsaValue *index = build(node->index());
+            ret = emit(ssa_index, node->line());
+            ret->operands.push_back(container);
+            ret->operands.push_back(index);
+            break;
+        }
+        case toy_map: {
+            const MapExpr *node = static_cast<const MapExpr*>(expr);
+            std::vector<SsaValue*> keys_and_values;
+            for (std::vector<const Expression*>::size_type i = 0; i < node->keys().size(); ++i) {
+                keys_and_values.push_back(build(node->keys()[i]));
+                keys_and_values.push_back(build(node->values()[i]));
+            }
+            ret = emit(ssa_map, node->line());
+            ret->operands = keys_and_values;
+            break;
+        }
+        default:
+            ret = function_->constant(Value(), expr->line());
+            break;
+    }
+    return ret;
+}
+
+/* SsaFunction */
+
+SsaFunction::~SsaFunction() {
+    for (std::vector<SsaValue*>::const_iterator it = values_.begin(), end = values_.end(); it != end; ++it)
+        delete *it;
+    for (std::vector<SsaBlock*>::const_iterator it = blocks_.begin(), end = blocks_.end(); it != end; ++it)
+        delete *it;
+}
+
+SsaBlock *SsaFunction::new_block() {
+    blocks_.push_back(new SsaBlock(blocks_.size()));
+    return blocks_.back();
+}
+
+SsaValue *SsaFunction::new_value(SsaOp op, SsaBlock *block, unsigned int line) {
+    values_.push_back(new SsaValue(op, values_.size(), block, line));
+    return values_.back();
+}
+
+SsaValue *SsaFunction::constant(const Value &value, unsigned int line) {
+    SsaValue *ret = new_value(ssa_constant, entry(), line);
+    ret->constant = value;
+    return ret;
+}
+
+SsaValue *SsaFunction::resolve(SsaValue *value) {
+    while (value->replacement)
+        value = value->replacement;
+    return value;
+}
+
+static unsigned int successors(const SsaBlock *block) {
+    switch (block->terminator) {
+        case term_jump:
+        case term_loop:
+            return 1;
+        case term_branch:
+            return 2;
+        default:
+            return 0;
+    }
+}
+
+std::vector<SsaBlock*> SsaFunction::reverse_postorder() const {
+    std::vector<SsaBlock*> ret;
+    std::vector<bool> visited(blocks_.size(), false);
+    /* Blocks with the number of successors already pushed */
+    std::vector<std::pair<SsaBlock*, unsigned int> > stack;
+    stack.push_back(std::make_pair(entry(), 0u));
+    visited[entry()->id] = true;
+
+    while (!stack.empty()) {
+        std::pair<SsaBlock*, unsigned int> &top = stack.back();
+        if (top.second < successors(top.first)) {
+            SsaBlock *next = top.first->targets[top.second++];
+            if (!visited[next->id]) {
+                visited[next->id] = true;
+                stack.push_back(std::make_pair(next, 0u));
+            }
+        } else {
+            ret.push_back(top.first);
+            stack.pop_back();
+        }
+    }
+
+    std::reverse(ret.begin(), ret.end());
+    return ret;
+}
+
+/* Cooper, Harvey and Kennedy, "A Simple, Fast Dominance Algorithm" */
+void SsaFunction::compute_dominators() {
+    std::vector<SsaBlock*> order = reverse_postorder();
+    std::vector<unsigned int> position(blocks_.size(), ~0u);
+    for (std::vector<SsaBlock*>::size_type i = 0; i < order.size(); ++i) {
+        position[order[i]->id] = i;
+        order[i]->idom = 0;
+    }
+
+    SsaBlock *start = entry();
+    start->idom = start;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (std::vector<SsaBlock*>::const_iterator it = order.begin() + 1, end = order.end(); it != end; ++it) {
+            SsaBlock *idom = 0;
+            const std::vector<SsaBlock*> &preds = (*it)->preds;
+            for (std::vector<SsaBlock*>::const_iterator pred = preds.begin(); pred != preds.end(); ++pred) {
+                if (position[(*pred)->id] == ~0u || !(*pred)->idom)
+                    continue;
+                if (!idom) {
+                    idom = *pred;
+                    continue;
+                }
+                SsaBlock *a = *pred, *b = idom;
+                while (a != b) {
+                    while (position[a->id] > position[b->id])
+                        a = a->idom;
+                    while (position[b->id] > position[a->id])
+                        b = b->idom;
+                }
+                idom = a;
+            }
+            if ((*it)->idom != idom) {
+                (*it)->idom = idom;
+                changed = true;
+            }
+        }
+    }
+    start->idom = 0;
+}
+
+static bool resolve_operands(SsaValue *value) {
+    bool ret = false;
+    for (std::vector<SsaValue*>::iterator it = value->operands.begin(), end = value->operands.end(); it != end; ++it) {
+        SsaValue *resolved = SsaFunction::resolve(*it);
+        if (resolved != *it) {
+            *it = resolved;
+            ret = true;
+        }
+    }
+    return ret;
+}
+
+static bool compact_values(std::vector<SsaValue*> &values) {
+    bool ret = false;
+    std::vector<SsaValue*>::iterator out = values.begin();
+    for (std::vector<SsaValue*>::iterator it = values.begin(), end = values.end(); it != end; ++it) {
+        if ((*it)->replacement || (*it)->removed) {
+            ret = true;
+            continue;
+        }
+        ret = resolve_operands(*it) || ret;
+        *out++ = *it;
+    }
+    values.erase(out, values.end());
+    return ret;
+}
+
+bool SsaFunction::compact() {
+    bool ret = false;
+    for (std::vector<SsaBlock*>::const_iterator it = blocks_.begin(), end = blocks_.end(); it != end; ++it) {
+        SsaBlock *block = *it;
+        ret = compact_values(block->phis) || ret;
+        ret = compact_values(block->values) || ret;
+        if (block->result && block->result != resolve(block->result)) {
+            block->result = resolve(block->result);
+            ret = true;
+        }
+    }
+    return ret;
+}
+
+std::set<const SsaValue*> SsaFunction::undefined_phis() const {
+    std::set<const SsaValue*> undefined;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (std::vector<SsaBlock*>::const_iterator it = blocks_.begin(), end = blocks_.end(); it != end; ++it) {
+            const std::vector<SsaValue*> &phis = (*it)->phis;
+            for (std::vector<SsaValue*>::const_iterator phi = phis.begin(); phi != phis.end(); ++phi) {
+                if (undefined.count(*phi))
+                    continue;
+                const std::vector<SsaValue*> &operands = (*phi)->operands;
+                for (std::vector<SsaValue*>::const_iterator op = operands.begin(); op != operands.end(); ++op) {
+                    if ((*op)->op == ssa_undef || undefined.count(*op)) {
+                        undefined.insert(*phi);
+                        changed = true;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+    return undefined;
+}
+
+/* Dumping */
+
+static const char *op_name(SsaOp op) {
+    switch (op) {
+        case ssa_param: return "param";
+        case ssa_undef: return "undef";
+        case ssa_constant: return "constant";
+        case ssa_local: return "local";
+        case ssa_global: return "global";
+        case ssa_binary: return "binary";
+        case ssa_index: return "index";
+        case ssa_array: return "array";
+        case ssa_map: return "map";
+        case ssa_call: return "call";
+        case ssa_builtin: return "builtin";
+        case ssa_phi: return "phi";
+    }
+    return "?";
+}
+
+static void dump_operand(std::ostream &out, const SsaValue *value) {
+    switch (value->op) {
+        case ssa_constant:
+            if (value->constant.is_string())
+                out << '"' << value->constant.string() << '"';
+            else
+                out << value->constant.str();
+            break;
+        case ssa_param:
+        case ssa_undef:
+            out << value->name;
+            break;
+        default:
+            out << "v" << value->id;
+            break;
+    }
+}
+
+static void dump_value(std::ostream &out, const SsaValue *value) {
+    out << "    v" << value->id << " = " << op_name(value->op);
+    if (value->op == ssa_binary)
+        out << " " << Token::token_type_name((TokenType)value->arg);
+    else if (!value->name.empty())
+        out << " " << value->name;
+
+    const char *separator = " ";
+    for (std::vector<SsaValue*>::const_iterator it = value->operands.begin(), end = value->operands.end(); it != end; ++it) {
+        out << separator;
+        dump_operand(out, *it);
+        separator = ", ";
+    }
+    out << std::endl;
+}
+
+void SsaFunction::dump(std::ostream &out) const {
+    out << "def " << def_->name() << ":" << std::endl;
+    for (std::vector<SsaValue*>::const_iterator it = params_.begin(), end = params_.end(); it != end; ++it) {
+        if (assumed_number(*it))
+            out << "  assumes " << (*it)->name << " is a number" << std::endl;
+    }
+    std::vector<SsaBlock*> order = reverse_postorder();
+    for (std::vector<SsaBlock*>::const_iterator it = order.begin(), end = order.end(); it != end; ++it) {
+        const SsaBlock *block = *it;
+        out << "  b" << block->id << ":";
+        if (!block->preds.empty()) {
+            out << " <-";
+            for (std::vector<SsaBlock*>::const_iterator pred = block->preds.begin(); pred != block->preds.end(); ++pred)
+                out << " b" << (*pred)->id;
+        }
+        out << std::endl;
+
+        for (std::vector<SsaValue*>::const_iterator phi = block->phis.begin(); phi != block->phis.end(); ++phi)
+            dump_value(out, *phi);
+        for (std::vector<SsaValue*>::const_iterator value = block->values.begin(); value != block->values.end(); ++value)
+            dump_value(out, *value);
+
+        out << "    ";
+        switch (block->terminator) {
+            case term_jump:
+            case term_loop:
+                out << (block->terminator == term_loop ? "loop" : "jump") << " b" << block->targets[0]->id;
+                break;
+            case term_branch:
+                out << "branch ";
+                dump_operand(out, block->result);
+                out << ", b" << block->targets[0]->id << ", b" << block->targets[1]->id;
+                break;
+            case term_return:
+                out << "return ";
+                dump_operand(out, block->result);
+                break;
+            default:
+                out << "end";
+                break;
+        }
+        out << std::endl;
+    }
+}
@@ -0,0 +1,149 @@
+#ifndef _SSA_HPP
+#define _SSA_HPP
+
+#include <iostream>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include "ast.hpp"
+#include "frame_layout.hpp"
+#include "program.hpp"
+#include "toy.hpp"
+#include "toyobj.hpp"
+
+/* A mid-level IR for one function, in SSA form: every value is defined
+ * once, and locals are replaced by the values assigned to them, merged by
+ * phis where control flow joins. It sits between the AST and bytecode so
+ * that SsaPasses can remove redundant work before it reaches the
+ * Interpreter. */
+typedef enum {
+    ssa_param,          /* arg is the parameter's index */
+    ssa_undef,          /* a local before its first assignment */
+    ssa_constant,
+    ssa_local,          /* reads a local that may be unassigned; operand 0 */
+    ssa_global,         /* reads name, which is not a local */
+    ssa_binary,         /* arg is the operator's TokenType */
+    ssa_index,
+    ssa_array,
+    ssa_map,            /* keys and values, alternating */
+    ssa_call,           /* function with the operands */
+    ssa_builtin,        /* name with the operands */
+    ssa_phi             /* one operand per predecessor, in order */
+} SsaOp;
+
+typedef enum {
+    term_none,          /* not built yet */
+    term_jump,
+    term_loop,          /* a jump back to a loop header */
+    term_branch,        /* to targets[0] if result is truthy, else targets[1] */
+    term_return,        /* result */
+    term_end            /* falls off the end of the function */
+} SsaTerminator;
+
+struct SsaBlock;
+
+struct SsaValue {
+    SsaValue(SsaOp op, unsigned int id, SsaBlock *block, unsigned int line)
+        : op(op),
+          id(id),
+          block(block),
+          line(line),
+          arg(0),
+          function(0),
+          replacement(0),
+          removed(false) {}
+    SsaOp op;
+    unsigned int id;
+    SsaBlock *block;
+    unsigned int line;
+    std::vector<SsaValue*> operands;
+    unsigned int arg;
+    /* The variable or builtin */
+    std::string name;
+    Value constant;
+    const DefStatement *function;
+    /* Set by a pass that found an equivalent value */
+    SsaValue *replacement;
+    bool removed;
+};
+
+struct SsaBlock {
+    explicit SsaBlock(unsigned int id)
+        : id(id),
+          terminator(term_none),
+          result(0),
+          line(0),
+          idom(0) {}
+    unsigned int id;
+    std::vector<SsaValue*> phis;
+    std::vector<SsaValue*> values;
+    std::vector<SsaBlock*> preds;
+    SsaTerminator terminator;
+    SsaValue *result;
+    SsaBlock *targets[2];
+    unsigned int line;
+    /* Immediate dominator, see SsaFunction::compute_dominators() */
+    SsaBlock *idom;
+};
+
+class SsaFunction {
+  public:
+    /* Throws SyntaxError from a lazily parsed body. The layout must outlive
+     * the function. */
+    static SsaFunction *build(const DefStatement*, const FrameLayout&, const Program&);
+    ~SsaFunction();
+
+    inline const DefStatement *def() const { return def_; }
+    inline const FrameLayout &layout() const { return layout_; }
+    inline SsaBlock *entry() const { return blocks_[0]; }
+    inline const std::vector<SsaValue*> &params() const { return params_; }
+
+    /* Lets the passes and lowering take the parameter for a number. The
+     * code built from the function is only right when it is one, which
+     * the caller checks on entry. */
+    inline void assume_number(unsigned int param) { numbers_.insert(params_[param]); }
+    inline bool assumed_number(const SsaValue *param) const { return numbers_.count(param) > 0; }
+    inline bool assumes_numbers() const { return !numbers_.empty(); }
+
+    /* Reachable blocks, each after all of its predecessors except along
+     * back edges */
+    std::vector<SsaBlock*> reverse_postorder() const;
+    void compute_dominators();
+
+    /* Points every operand at the end of its replacement chain, and drops
+     * replaced and removed values from their blocks. Returns whether
+     * anything changed. */
+    bool compact();
+
+    /* Phis that could merge a local that is unassigned on some path. Those
+     * can't be lowered to bytecode. */
+    std::set<const SsaValue*> undefined_phis() const;
+
+    void dump(std::ostream&) const;
+
+    /* A new constant, which like parameters and undefined locals belongs
+     * to no block: it is materialized wherever it is used */
+    SsaValue *constant(const Value&, unsigned int);
+
+    static SsaValue *resolve(SsaValue*);
+  private:
+    class Builder;
+
+    SsaFunction(const DefStatement *def, const FrameLayout &layout)
+        : def_(def),
+          layout_(layout) {}
+
+    SsaBlock *new_block();
+    SsaValue *new_value(SsaOp, SsaBlock*, unsigned int);
+
+    const DefStatement *def_;
+    const FrameLayout &layout_;
+    std::vector<SsaBlock*> blocks_;
+    std::vector<SsaValue*> values_;
+    std::vector<SsaValue*> params_;
+    std::set<const SsaValue*> numbers_;
+    DISALLOW_COPY_AND_ASSIGN(SsaFunction);
+};
+
+#endif
@@ -0,0 +1,439 @@
+#include "ssa_passes.hpp"
+#include <cstring>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include "exceptions.hpp"
+#include "lexer.hpp"
+#include "runtime.hpp"
+
+/* CopyPropagation */
+
+bool CopyPropagation::run(SsaFunction &function) {
+    bool ret = false, changed = true;
+    while (changed) {
+        std::vector<SsaBlock*> order = function.reverse_postorder();
+
+        for (std::vector<SsaBlock*>::const_iterator it = order.begin(), end = order.end(); it != end; ++it) {
+            const std::vector<SsaValue*> &phis = (*it)->phis;
+            for (std::vector<SsaValue*>::const_iterator phi = phis.begin(); phi != phis.end(); ++phi) {
+                SsaValue *same = 0;
+                bool trivial = true;
+                const std::vector<SsaValue*> &operands = (*phi)->operands;
+                for (std::vector<SsaValue*>::const_iterator op = operands.begin(); op != operands.end(); ++op) {
+                    SsaValue *value = SsaFunction::resolve(*op);
+                    if (value == *phi || value == same)
+                        continue;
+                    if (same) {
+                        trivial = false;
+                        break;
+                    }
+                    same = value;
+                }
+                if (trivial && same)
+                    (*phi)->replacement = same;
+            }
+        }
+
+        std::set<const SsaValue*> undefined = function.undefined_phis();
+        for (std::vector<SsaBlock*>::const_iterator it = order.begin(), end = order.end(); it != end; ++it) {
+            const std::vector<SsaValue*> &values = (*it)->values;
+            for (std::vector<SsaValue*>::const_iterator value = values.begin(); value != values.end(); ++value) {
+                if ((*value)->op != ssa_local)
+                    continue;
+                SsaValue *assigned = SsaFunction::resolve((*value)->operands[0]);
+                if (assigned->op != ssa_undef && !undefined.count(assigned))
+                    (*value)->replacement = assigned;
+            }
+        }
+
+        changed = function.compact();
+        ret = ret || changed;
+    }
+    return ret;
+}
+
+/* GlobalValueNumbering */
+
+static void operand_key(std::ostream &out, const SsaValue *value) {
+    if (value->op != ssa_constant) {
+        out << "v" << value->id;
+    } else if (value->constant.is_number()) {
+        /* Exact, so that 0.1 + 0.2 and 0.3 stay apart */
+        double number = value->constant.number();
+        unsigned long long bits;
+        memcpy(&bits, &number, sizeof(bits));
+        out << "n" << bits;
+    } else if (value->constant.is_string()) {
+        out << "s" << value->constant.string().size() << ":" << value->constant.string();
+    } else {
+        out << "none";
+    }
+}
+
+/* Empty if the value must not be merged with any other */
+static std::string value_key(const SsaValue *value) {
+    switch (value->op) {
+        case ssa_binary:
+        case ssa_index:
+            break;
+        case ssa_builtin:
+            if (value->name == "len")
+                break;
+            return std::string();
+        default:
+            return std::string();
+    }
+
+    std::ostringstream ss;
+    ss << value->op << ":" << value->arg << ":" << value->name;
+    for (std::vector<SsaValue*>::const_iterator it = value->operands.begin(), end = value->operands.end(); it != end; ++it) {
+        ss << ",";
+        operand_key(ss, *it);
+    }
+    return ss.str();
+}
+
+static bool fold(SsaFunction &function, SsaValue *value) {
+    if (value->op != ssa_binary || value->operands[0]->op != ssa_constant || value->operands[1]->op != ssa_constant)
+        return false;
+
+    try {
+        Value folded = Runtime::binary_op((TokenType)value->arg, value->operands[0]->constant,
+                                          value->operands[1]->constant, value->line);
+        value->replacement = function.constant(folded, value->line);
+        return true;
+    } catch (RuntimeError&) {
+        /* Left to throw when it runs */
+        return false;
+    }
+}
+
+bool GlobalValueNumbering::run(SsaFunction &function) {
+    function.compute_dominators();
+    std::vector<SsaBlock*> order = function.reverse_postorder();
+    std::map<const SsaBlock*, std::vector<SsaBlock*> > children;
+    for (std::vector<SsaBlock*>::const_iterator it = order.begin(), end = order.end(); it != end; ++it) {
+        if ((*it)->idom)
+            children[(*it)->idom].push_back(*it);
+    }
+
+    /* Depth first over the dominator tree, with the values available in
+     * each block: those of its dominators */
+    std::map<std::string, SsaValue*> available;
+    std::vector<std::vector<std::string> > scopes;
+    std::vector<std::pair<SsaBlock*, bool> > walk(1, std::make_pair(function.entry(), false));
+    bool changed = false;
+
+    while (!walk.empty()) {
+        std::pair<SsaBlock*, bool> top = walk.back();
+        walk.pop_back();
+
+        if (top.second) {
+            /* Leaving the block: forget what it made available */
+            const std::vector<std::string> &keys = scopes.back();
+            for (std::vector<std::string>::const_iterator it = keys.begin(), end = keys.end(); it != end; ++it)
+                available.erase(*it);
+            scopes.pop_back();
+            continue;
+        }
+
+        SsaBlock *block = top.first;
+        scopes.push_back(std::vector<std::string>());
+        const std::vector<SsaValue*> &values = block->values;
+        for (std::vector<SsaValue*>::const_iterator it = values.begin(), end = values.end(); it != end; ++it) {
+            SsaValue *value = *it;
+            for (std::vector<SsaValue*>::iterator op = value->operands.begin(); op != value->operands.end(); ++op)
+                *op = SsaFunction::resolve(*op);
+            if (fold(function, value)) {
+                changed = true;
+                continue;
+            }
+
+            std::string key = value_key(value);
+            if (key.empty())
+                continue;
+            std::map<std::string, SsaValue*>::const_iterator found = available.find(key);
+            if (found != available.end()) {
+                value->replacement = found->second;
+                changed = true;
+            } else {
+                available[key] = value;
+                scopes.back().push_back(key);
+            }
+        }
+
+        walk.push_back(std::make_pair(block, true));
+        const std::vector<SsaBlock*> &dominated = children[block];
+        for (std::vector<SsaBlock*>::const_reverse_iterator it = dominated.rbegin(); it != dominated.rend(); ++it)
+            walk.push_back(std::make_pair(*it, false));
+    }
+
+    function.compact();
+    return changed;
+}
+
+/* DeadStoreElimination */
+
+/* What a value is, if computing it doesn't throw */
+static SsaKind join(SsaKind a, SsaKind b) {
+    if (a == kind_unknown)
+        return b;
+    if (b == kind_unknown || a == b)
+        return a;
+    return kind_any;
+}
+
+static SsaKind infer(const SsaValue*, const std::map<const SsaValue*, SsaKind>&);
+
+static SsaKind kind_of(const SsaValue *value, const std::map<const SsaValue*, SsaKind> &kinds) {
+    if (value->op == ssa_constant)
+        return infer(value, kinds);
+    std::map<const SsaValue*, SsaKind>::const_iterator it = kinds.find(value);
+    if (it != kinds.end())
+        return it->second;
+    return value->op == ssa_param || value->op == ssa_undef ? kind_any : kind_unknown;
+}
+
+static SsaKind infer(const SsaValue *value, const std::map<const SsaValue*, SsaKind> &kinds) {
+    switch (value->op) {
+        case ssa_constant:
+            if (value->constant.is_number()) return kind_number;
+            if (value->constant.is_string()) return kind_string;
+            return kind_none;
+        case ssa_binary: {
+            if (value->arg != tok_add)
+                return kind_number;
+            SsaKind left = kind_of(value->operands[0], kinds), right = kind_of(value->operands[1], kinds);
+            if (left == kind_string || right == kind_string)
+                return kind_string;
+            if (left == kind_number && right == kind_number)
+                return kind_number;
+            return kind_any;
+        }
+        case ssa_array:
+            return kind_array;
+        case ssa_map:
+            return kind_map;
+        case ssa_builtin:
+            return value->name == "len" ? kind_number : kind_any;
+        case ssa_phi: {
+            SsaKind ret = kind_unknown;
+            for (std::vector<SsaValue*>::const_iterator it = value->operands.begin(); it != value->operands.end(); ++it)
+                ret = join(ret, kind_of(*it, kinds));
+            return ret;
+        }
+        default:
+            return kind_any;
+    }
+}
+
+static bool can_throw(const SsaValue *value, const std::map<const SsaValue*, SsaKind> &kinds) {
+    switch (value->op) {
+        case ssa_phi:
+        case ssa_array:
+        case ssa_map:
+            return false;
+        case ssa_binary: {
+            SsaKind left = kind_of(value->operands[0], kinds), right = kind_of(value->operands[1], kinds);
+            if (value->arg == tok_eq)
+                return false;
+            if (value->arg == tok_add && (left == kind_string || right == kind_string))
+                return false;
+            return left != kind_number || right != kind_number;
+        }
+        case ssa_builtin: {
+            if (value->name != "len" || value->operands.size() != 1)
+                return true;
+            SsaKind arg = kind_of(value->operands[0], kinds);
+            return arg != kind_array && arg != kind_map && arg != kind_string;
+        }
+        default:
+            return true;
+    }
+}
+
+/* Optimistically, until the phis of loops settle */
+static void infer_kinds(const SsaFunction &function, std::map<const SsaValue*, SsaKind> &kinds) {
+    const std::vector<SsaBlock*> order = function.reverse_postorder();
+    const std::vector<SsaValue*> &params = function.params();
+    for (std::vector<SsaValue*>::const_iterator it = params.begin(), end = params.end(); it != end; ++it) {
+        if (function.assumed_number(*it))
+            kinds[*it] = kind_number;
+    }
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (std::vector<SsaBlock*>::const_iterator it = order.begin(), end = order.end(); it != end; ++it) {
+            for (int list = 0; list < 2; ++list) {
+                const std::vector<SsaValue*> &values = list ? (*it)->values : (*it)->phis;
+                for (std::vector<SsaValue*>::const_iterator value = values.begin(); value != values.end(); ++value) {
+                    SsaKind kind = infer(*value, kinds);
+                    std::map<const SsaValue*, SsaKind>::iterator known = kinds.find(*value);
+                    if (known == kinds.end()) {
+                        kinds[*value] = kind;
+                        changed = true;
+                    } else if (known->second != kind) {
+                        known->second = kind;
+                        changed = true;
+                    }
+                }
+            }
+        }
+    }
+}
+
+SsaKinds::SsaKinds(const SsaFunction &function) {
+    infer_kinds(function, kinds_);
+}
+
+SsaKind SsaKinds::of(const SsaValue *value) const {
+    return kind_of(value, kinds_);
+}
+
+bool SsaKinds::can_throw(const SsaValue *value) const {
+    return ::can_throw(value, kinds_);
+}
+
+bool DeadStoreElimination::run(SsaFunction &function) {
+    std::vector<SsaBlock*> order = function.reverse_postorder();
+    SsaKinds kinds(function);
+
+    bool ret = false, changed = true;
+    while (changed) {
+        std::map<const SsaValue*, unsigned int> uses;
+        for (std::vector<SsaBlock*>::const_iterator it = order.begin(), end = order.end(); it != end; ++it) {
+            for (int list = 0; list < 2; ++list) {
+                const std::vector<SsaValue*> &values = list ? (*it)->values : (*it)->phis;
+                for (std::vector<SsaValue*>::const_iterator value = values.begin(); value != values.end(); ++value) {
+                    const std::vector<SsaValue*> &operands = (*value)->operands;
+                    for (std::vector<SsaValue*>::const_iterator op = operands.begin(); op != operands.end(); ++op) {
+                        if (*op != *value)
+                            ++uses[*op];
+                    }
+                }
+            }
+            if ((*it)->result)
+                ++uses[(*it)->result];
+        }
+
+        for (std::vector<SsaBlock*>::const_iterator it = order.begin(), end = order.end(); it != end; ++it) {
+            for (int list = 0; list < 2; ++list) {
+                const std::vector<SsaValue*> &values = list ? (*it)->values : (*it)->phis;
+                for (std::vector<SsaValue*>::const_iterator value = values.begin(); value != values.end(); ++value) {
+                    if (!uses.count(*value) && !kinds.can_throw(*value))
+                        (*value)->removed = true;
+                }
+            }
+        }
+
+        changed = function.compact();
+        ret = ret || changed;
+    }
+    return ret;
+}
+
+/* LoopInvariantCodeMotion */
+
+/* The header and every block that reaches the latch without passing it */
+static std::set<const SsaBlock*> loop_blocks(SsaBlock *latch) {
+    SsaBlock *header = latch->targets[0];
+    std::set<const SsaBlock*> ret;
+    ret.insert(header);
+    std::vector<SsaBlock*> work(1, latch);
+    while (!work.empty()) {
+        SsaBlock *block = work.back();
+        work.pop_back();
+        if (!ret.insert(block).second)
+            continue;
+        work.insert(work.end(), block->preds.begin(), block->preds.end());
+    }
+    return ret;
+}
+
+/* first_effect: nothing that can throw comes before the value in a block
+ * that runs whenever the loop is entered, so it may throw before the loop
+ * just the same */
+static bool hoistable(const SsaValue *value, const std::set<const SsaBlock*> &loop, const SsaKinds &kinds, bool first_effect) {
+    if (value->op != ssa_binary && value->op != ssa_index && (value->op != ssa_builtin || value->name != "len"))
+        return false;
+    for (std::vector<SsaValue*>::const_iterator op = value->operands.begin(); op != value->operands.end(); ++op) {
+        if (loop.count((*op)->block))
+            return false;
+    }
+    if (first_effect)
+        return true;
+    /* A string could be over the memory limit */
+    return !kinds.can_throw(value) && kinds.of(value) == kind_number;
+}
+
+bool LoopInvariantCodeMotion::run(SsaFunction &function) {
+    std::vector<SsaBlock*> order = function.reverse_postorder();
+    SsaKinds kinds(function);
+
+    /* Inner loops come first, so what they hoist can move on out */
+    bool ret = false;
+    for (std::vector<SsaBlock*>::const_iterator it = order.begin(), end = order.end(); it != end; ++it) {
+        if ((*it)->terminator != term_loop)
+            continue;
+
+        const std::set<const SsaBlock*> loop = loop_blocks(*it);
+        SsaBlock *header = (*it)->targets[0], *preheader = 0;
+        unsigned int entries = 0;
+        for (std::vector<SsaBlock*>::const_iterator pred = header->preds.begin(); pred != header->preds.end(); ++pred) {
+            if (!loop.count(*pred)) {
+                preheader = *pred;
+                ++entries;
+            }
+        }
+        if (entries != 1 || preheader->terminator != term_jump)
+            continue;
+
+        /* Definitions come before their uses in this order */
+        for (std::vector<SsaBlock*>::const_iterator block = order.begin(); block != end; ++block) {
+            if (!loop.count(*block))
+                continue;
+            /* The header runs at least once */
+            bool first_effect = *block == header;
+            std::vector<SsaValue*> &values = (*block)->values;
+            for (std::vector<SsaValue*>::iterator value = values.begin(); value != values.end();) {
+                if (!hoistable(*value, loop, kinds, first_effect)) {
+                    first_effect = first_effect && !kinds.can_throw(*value);
+                    ++value;
+                    continue;
+                }
+                (*value)->block = preheader;
+                preheader->values.push_back(*value);
+                value = values.erase(value);
+                ret = true;
+            }
+        }
+    }
+    return ret;
+}
+
+/* SsaPassManager */
+
+SsaPassManager::~SsaPassManager() {
+    for (std::vector<SsaPass*>::const_iterator it = passes_.begin(), end = passes_.end(); it != end; ++it)
+        delete *it;
+}
+
+void SsaPassManager::add_defaults() {
+    add(new CopyPropagation());
+    add(new GlobalValueNumbering());
+    add(new DeadStoreElimination());
+    add(new LoopInvariantCodeMotion());
+}
+
+void SsaPassManager::run(SsaFunction &function, unsigned int max_rounds) const {
+    for (unsigned int round = 0; round < max_rounds; ++round) {
+        bool changed = false;
+        for (std::vector<SsaPass*>::const_iterator it = passes_.begin(), end = passes_.end(); it != end; ++it)
+            changed = (*it)->run(function) || changed;
+        if (!changed)
+            break;
+    }
+}
@@ -0,0 +1,106 @@
+#ifndef _SSA_PASSES_HPP
+#define _SSA_PASSES_HPP
+
+#include <map>
+#include <vector>
+#include "ssa.hpp"
+#include "toy.hpp"
+
+/* What a value can be at runtime */
+typedef enum {
+    kind_unknown,       /* not inferred yet */
+    kind_none,
+    kind_number,
+    kind_string,
+    kind_array,
+    kind_map,
+    kind_any
+} SsaKind;
+
+/* The kinds of a function's values, inferred from constants, operators,
+ * len() and the parameters the function assumes are numbers; optimistic
+ * around loops until their phis settle. Passes use them to tell what
+ * can't throw, lowering what needs no checks. */
+class SsaKinds {
+  public:
+    explicit SsaKinds(const SsaFunction&);
+
+    SsaKind of(const SsaValue*) const;
+    bool can_throw(const SsaValue*) const;
+  private:
+    std::map<const SsaValue*, SsaKind> kinds_;
+    DISALLOW_COPY_AND_ASSIGN(SsaKinds);
+};
+
+/* A transformation of an SsaFunction. Values that become redundant are
+ * given a replacement or marked removed, then the pass compacts the
+ * function. Nothing that can throw or print is dropped or moved past
+ * anything else that can. */
+class SsaPass {
+  public:
+    SsaPass() {}
+    virtual ~SsaPass() {}
+
+    virtual const char *name() const = 0;
+    /* Whether the function changed */
+    virtual bool run(SsaFunction&) = 0;
+  private:
+    DISALLOW_COPY_AND_ASSIGN(SsaPass);
+};
+
+/* Folds each read of a local into the value last assigned to it, unless
+ * the local may be unassigned there (so the read may throw), and removes
+ * phis whose operands are all the same value. */
+class CopyPropagation : public SsaPass {
+  public:
+    virtual const char *name() const { return "copy-propagation"; }
+    virtual bool run(SsaFunction&);
+};
+
+/* Gives each pure computation an equivalent dominating one, if any:
+ * operators, indexing and len() of the same operands (arrays and maps are
+ * immutable). Operators on two constants are folded. */
+class GlobalValueNumbering : public SsaPass {
+  public:
+    virtual const char *name() const { return "gvn"; }
+    virtual bool run(SsaFunction&);
+};
+
+/* Removes values that are never used, such as assignments to locals that
+ * are never read, when computing them can't throw: what the operands can
+ * be is inferred from constants and operators. */
+class DeadStoreElimination : public SsaPass {
+  public:
+    virtual const char *name() const { return "dead-store-elimination"; }
+    virtual bool run(SsaFunction&);
+};
+
+/* Moves numeric computations whose operands are all defined outside a loop
+ * to the block that enters it, so they run once instead of per iteration.
+ * Only what can't throw and yields a number is moved, since it then runs
+ * even when the loop doesn't. */
+class LoopInvariantCodeMotion : public SsaPass {
+  public:
+    virtual const char *name() const { return "licm"; }
+    virtual bool run(SsaFunction&);
+};
+
+class SsaPassManager {
+  public:
+    SsaPassManager() {}
+    ~SsaPassManager();
+
+    /* Takes ownership */
+    inline void add(SsaPass *pass) { passes_.push_back(pass); }
+    /* The passes above, in the order they help each other */
+    void add_defaults();
+
+    /* Runs every pass in turn, again while any of them made a change, at
+     * most max_rounds times */
+    void run(SsaFunction&, unsigned int max_rounds = 4) const;
+  private:
+    std::vector<SsaPass*> passes_;
+    DISALLOW_COPY_AND_ASSIGN(SsaPassManager);
+};
+
+#endif
@@ -0,0 +1,114 @@
+#include "thread_pool.hpp"
+
+/* Which pool (if any) the current thread works for, and its slot in it. */
+static thread_local ThreadPool *current_pool = 0;
+static thread_local unsigned int current_worker = 0;
+
+ThreadPool::ThreadPool(unsigned int num_workers)
+    : queued_(0),
+      next_worker_(0),
+      stopping_(false) {
+    if (num_workers == 0)
+        num_workers = std::thread::hardware_concurrency();
+    if (num_workers == 0)
+        num_workers = 1;
+
+    for (unsigned int i = 0; i < num_workers; ++i)
+        workers_.push_back(new Worker());
+    for (unsigned int i = 0; i < num_workers; ++i)
+        threads_.push_back(std::thread(&ThreadPool::worker_loop, this, i));
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> guard(idle_lock_);
+        stopping_ = true;
+    }
+    idle_cond_.notify_all();
+
+    for (std::vector<std::thread>::iterator it = threads_.begin(), end = threads_.end(); it != end; ++it)
+        it->join();
+    for (std::vector<Worker*>::iterator it = workers_.begin(), end = workers_.end(); it != end; ++it)
+        delete *it;
+}
+
+void ThreadPool::submit(const Task &task) {
+    unsigned int target;
+    if (current_pool == this)
+        target = current_worker;
+    else
+        target = next_worker_++ % workers_.size();
+
+    /* Counted before it can be taken, so the count never drops below the
+     * tasks still queued */
+    {
+        std::lock_guard<std::mutex> guard(idle_lock_);
+        ++queued_;
+    }
+    {
+        std::lock_guard<std::mutex> guard(workers_[target]->lock);
+        workers_[target]->tasks.push_back(task);
+    }
+    idle_cond_.notify_one();
+}
+
+bool ThreadPool::pop_task(unsigned int index, Task &task) {
+    Worker *worker = workers_[index];
+    std::lock_guard<std::mutex> guard(worker->lock);
+    if (worker->tasks.empty())
+        return false;
+
+    task = worker->tasks.back();
+    worker->tasks.pop_back();
+    return true;
+}
+
+bool ThreadPool::steal_task(unsigned int thief, Task &task) {
+    for (unsigned int i = 1; i <= workers_.size(); ++i) {
+        Worker *victim = workers_[(thief + i) % workers_.size()];
+        std::lock_guard<std::mutex> guard(victim->lock);
+        if (!victim->tasks.empty()) {
+            task = victim->tasks.front();
+            victim->tasks.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+bool ThreadPool::run_one() {
+    Task task;
+    unsigned int self = current_pool == this ? current_worker : 0;
+
+    if ((current_pool == this && pop_task(self, task)) || steal_task(self, task)) {
+        --queued_;
+        task();
+        return true;
+    }
+    return false;
+}
+
+void ThreadPool::worker_loop(unsigned int index) {
+    current_pool = this;
+    current_worker = index;
+
+    for (;;) {
+        if (run_one())
+            continue;
+
+        std::unique_lock<std::mutex> guard(idle_lock_);
+        idle_cond_.wait(guard, [this]() { return stopping_ || queued_ > 0; });
+        if (stopping_ && queued_ == 0)
+            return;
+    }
+}
+
+void ThreadPool::join(Batch &batch) {
+    while (!batch.done()) {
+        if (!run_one())
+            batch.wait_briefly();
+    }
+
+    if (batch.error())
+        std::rethrow_exception(batch.error());
+}
@@ -0,0 +1,124 @@
+#ifndef _THREAD_POOL_HPP
+#define _THREAD_POOL_HPP
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "toy.hpp"
+
+/* A work-stealing pool of worker threads.
+ *
+ * Each worker owns a deque of tasks. Tasks submitted from a worker go to the
+ * back of its own deque and are popped from there (LIFO, cache friendly);
+ * idle workers steal from the front of the other deques. Tasks submitted from
+ * outside the pool are spread round-robin over the workers.
+ */
+class ThreadPool {
+  public:
+    typedef std::function<void()> Task;
+
+    /* 0 workers means one per hardware thread. */
+    explicit ThreadPool(unsigned int num_workers = 0);
+    ~ThreadPool();
+
+    void submit(const Task&);
+
+    /* Counts down the tasks of a batch; each calls finish() when done */
+    class Batch;
+
+    /* Helps run tasks until the whole batch is done, then rethrows the
+     * first exception one of its tasks reported */
+    void join(Batch&);
+
+    /* Runs fn(in[i]) for every element on the pool and stores the results in
+     * order in out. The calling thread helps out until the whole batch is
+     * done, so it is safe to call from inside a task. The first exception
+     * thrown by fn is rethrown here. */
+    template <typename In, typename Out, typename Fn>
+    void parallel_map(const std::vector<In> &in, std::vector<Out> &out, Fn fn);
+
+    inline unsigned int size() const { return workers_.size(); }
+  private:
+    struct Worker {
+        std::deque<Task> tasks;
+        std::mutex lock;
+    };
+
+    bool pop_task(unsigned int, Task&);
+    bool steal_task(unsigned int, Task&);
+    bool run_one();
+    void worker_loop(unsigned int);
+
+    std::vector<Worker*> workers_;
+    std::vector<std::thread> threads_;
+    std::mutex idle_lock_;
+    std::condition_variable idle_cond_;
+    std::atomic<unsigned int> queued_;
+    std::atomic<unsigned int> next_worker_;
+    bool stopping_;
+    DISALLOW_COPY_AND_ASSIGN(ThreadPool);
+};
+
+/* Completion counter for one parallel_map call. */
+class ThreadPool::Batch {
+  public:
+    explicit Batch(unsigned int count)
+        : remaining_(count) {}
+
+    void finish(std::exception_ptr error) {
+        std::lock_guard<std::mutex> guard(lock_);
+        if (error && !error_)
+            error_ = error;
+        if (--remaining_ == 0)
+            cond_.notify_all();
+    }
+
+    inline bool done() {
+        std::lock_guard<std::mutex> guard(lock_);
+        return remaining_ == 0;
+    }
+
+    inline void wait_briefly() {
+        std::unique_lock<std::mutex> guard(lock_);
+        cond_.wait_for(guard, std::chrono::milliseconds(1));
+    }
+
+    inline std::exception_ptr error() const { return error_; }
+  private:
+    unsigned int remaining_;
+    std::exception_ptr error_;
+    std::mutex lock_;
+    std::condition_variable cond_;
+    DISALLOW_COPY_AND_ASSIGN(Batch);
+};
+
+template <typename In, typename Out, typename Fn>
+void ThreadPool::parallel_map(const std::vector<In> &in, std::vector<Out> &out, Fn fn) {
+    out.clear();
+    out.resize(in.size());
+    if (in.empty())
+        return;
+
+    Batch batch(in.size());
+    for (size_t i = 0; i < in.size(); ++i) {
+        submit([&in, &out, &fn, &batch, i]() {
+            std::exception_ptr error;
+            try {
+                out[i] = fn(in[i]);
+            } catch (...) {
+                error = std::current_exception();
+            }
+            batch.finish(error);
+        });
+    }
+
+    join(batch);
+}
+
+#endif
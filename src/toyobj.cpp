@@ -0,0 +1,257 @@
+#include "toyobj.hpp"
+#include <cstring>
+#include <sstream>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+Value Value::new_array(const Array &elements) {
+    Value ret;
+    ret.type_ = value_array;
+    ret.array_.reset(new Array(elements));
+    return ret;
+}
+
+Value Value::new_map() {
+    Value ret;
+    ret.type_ = value_map;
+    ret.map_.reset(new Map());
+    return ret;
+}
+
+Value Value::new_numbers(const Numbers &numbers) {
+    Value ret;
+    ret.type_ = value_numbers;
+    ret.numbers_.reset(new Numbers(numbers));
+    return ret;
+}
+
+const std::string Value::value_type_name(ValueType type) {
+    static const char *value_name_table[] = {
+        "none", "number", "string", "array", "map", "numbers"
+    };
+
+    return value_name_table[(int)type];
+}
+
+bool Value::truthy() const {
+    switch (type_) {
+        case value_number: return number_ != 0;
+        case value_string: return !string_.empty();
+        case value_array: return !array_->empty();
+        case value_map: return !map_->empty();
+        case value_numbers: return !numbers_->empty();
+        default: return false;
+    }
+}
+
+const std::string Value::str() const {
+    std::ostringstream ss;
+    ss.precision(15);
+
+    switch (type_) {
+        case value_number: ss << number_; break;
+        case value_string: ss << string_; break;
+        case value_array: {
+            ss << "[";
+            for (Array::const_iterator it = array_->begin(), end = array_->end(); it != end; ++it) {
+                if (it != array_->begin())
+                    ss << ", ";
+                ss << it->str();
+            }
+            ss << "]";
+            break;
+        }
+        case value_map: {
+            ss << "{";
+            for (Map::const_iterator it = map_->begin(), end = map_->end(); it != end; ++it) {
+                if (it != map_->begin())
+                    ss << ", ";
+                ss << it->first.str() << ": " << it->second.str();
+            }
+            ss << "}";
+            break;
+        }
+        case value_numbers: {
+            ss << "[";
+            for (Numbers::const_iterator it = numbers_->begin(), end = numbers_->end(); it != end; ++it) {
+                if (it != numbers_->begin())
+                    ss << ", ";
+                ss << *it;
+            }
+            ss << "]";
+            break;
+        }
+        default: ss << "none"; break;
+    }
+
+    return ss.str();
+}
+
+bool Value::operator<(const Value &other) const {
+    if (type_ != other.type_)
+        return type_ < other.type_;
+
+    switch (type_) {
+        case value_number: return number_ < other.number_;
+        case value_string: return string_ < other.string_;
+        case value_array: return array_.get() < other.array_.get();
+        case value_map: return map_.get() < other.map_.get();
+        case value_numbers: return numbers_.get() < other.numbers_.get();
+        default: return false;
+    }
+}
+
+bool Value::operator==(const Value &other) const {
+    return !(*this < other) && !(other < *this);
+}
+
+static inline uint64_t mix(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+uint64_t Value::hash() const {
+    switch (type_) {
+        case value_number: {
+            /* -0 and 0 are the same key */
+            double number = number_ == 0 ? 0.0 : number_;
+            uint64_t bits;
+            memcpy(&bits, &number, sizeof(bits));
+            return mix(bits ^ value_number);
+        }
+        case value_string: {
+            /* Eight bytes at a time; most keys are a word or two */
+            const char *data = string_.data();
+            size_t size = string_.size();
+            uint64_t h = 0x9e3779b97f4a7c15ULL ^ size;
+            for (; size >= 8; data += 8, size -= 8) {
+                uint64_t word;
+                memcpy(&word, data, 8);
+                h = (h ^ word) * 0x100000001b3ULL;
+                h ^= h >> 29;
+            }
+            uint64_t tail = 0;
+            memcpy(&tail, data, size);
+            return mix(h ^ tail);
+        }
+        case value_array: return mix((uint64_t)(uintptr_t)array_.get());
+        case value_map: return mix((uint64_t)(uintptr_t)map_.get());
+        case value_numbers: return mix((uint64_t)(uintptr_t)numbers_.get());
+        default: return 0;
+    }
+}
+
+static bool same_key(const Value &a, const Value &b) {
+    if (a.type() != b.type())
+        return false;
+    switch (a.type()) {
+        case value_number: return a.number() == b.number();
+        case value_string: return a.string() == b.string();
+        case value_array: return &a.array() == &b.array();
+        case value_map: return &a.map() == &b.map();
+        case value_numbers: return &a.numbers() == &b.numbers();
+        default: return true;
+    }
+}
+
+/* ValueMap. The low 7 bits of a hash go in the control bytes, the rest
+ * picks the first group to probe. */
+
+const unsigned int ValueMap::group_size;
+const uint8_t ValueMap::empty_slot;
+
+static inline uint8_t control_bits(uint64_t hash) {
+    return hash & 0x7f;
+}
+
+/* A bit per slot in the group whose control byte is the given one; empty
+ * slots have the high bit set, so that is what matching 0x80 finds */
+static inline unsigned int match(const uint8_t *group, uint8_t control) {
+#ifdef __SSE2__
+    const __m128i bytes = _mm_loadu_si128((const __m128i*)group);
+    if (control & 0x80)
+        return _mm_movemask_epi8(bytes);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(control)));
+#else
+    unsigned int ret = 0;
+    for (unsigned int i = 0; i < 16; ++i) {
+        if (group[i] == control)
+            ret |= 1u << i;
+    }
+    return ret;
+#endif
+}
+
+uint32_t ValueMap::lookup(const Value &key, uint64_t hash) const {
+    if (groups_ == 0)
+        return entries_.size();
+
+    const uint8_t control = control_bits(hash);
+    /* Triangular steps visit every group when there are a power of two */
+    size_t group = (hash >> 7) & (groups_ - 1);
+    for (size_t step = 1; ; ++step) {
+        const uint8_t *controls = &controls_[group * group_size];
+        for (unsigned int bits = match(controls, control); bits; bits &= bits - 1) {
+            uint32_t entry = slots_[group * group_size + __builtin_ctz(bits)];
+            if (hashes_[entry] == hash && same_key(entries_[entry].first, key))
+                return entry;
+        }
+        if (match(controls, empty_slot))
+            return entries_.size();
+        group = (group + step) & (groups_ - 1);
+    }
+}
+
+ValueMap::const_iterator ValueMap::find(const Value &key) const {
+    return entries_.begin() + lookup(key, key.hash());
+}
+
+Value &ValueMap::operator[](const Value &key) {
+    const uint64_t hash = key.hash();
+    uint32_t entry = lookup(key, hash);
+    if (entry < entries_.size())
+        return entries_[entry].second;
+
+    entries_.push_back(Entry(key, Value()));
+    hashes_.push_back(hash);
+    if (entries_.size() > groups_ * group_size / 8 * 7)
+        grow();
+    else
+        index(entry);
+    return entries_.back().second;
+}
+
+/* Puts an entry in the first empty slot along its probe sequence */
+void ValueMap::index(uint32_t entry) {
+    const uint64_t hash = hashes_[entry];
+    size_t group = (hash >> 7) & (groups_ - 1);
+    for (size_t step = 1; ; ++step) {
+        unsigned int empty = match(&controls_[group * group_size], empty_slot);
+        if (empty) {
+            size_t slot = group * group_size + __builtin_ctz(empty);
+            controls_[slot] = control_bits(hash);
+            slots_[slot] = entry;
+            return;
+        }
+        group = (group + step) & (groups_ - 1);
+    }
+}
+
+void ValueMap::grow() {
+    groups_ = groups_ ? groups_ * 2 : 1;
+    controls_.assign(groups_ * group_size, empty_slot);
+    slots_.assign(groups_ * group_size, 0);
+    for (uint32_t entry = 0; entry < entries_.size(); ++entry)
+        index(entry);
+}
+
+size_t ValueMap::overhead() const {
+    return hashes_.capacity() * sizeof(uint64_t) + controls_.capacity() + slots_.capacity() * sizeof(uint32_t)
+        + (entries_.capacity() - entries_.size()) * sizeof(Entry);
+}
@@ -1,7 +1,135 @@
 #ifndef _TOYOBJ_HPP
 #define _TOYOBJ_HPP
 
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+typedef enum {
+    value_none,
+    value_number,
+    value_string,
+    value_array,
+    value_map,
+    value_numbers
+} ValueType;
+
+class ValueMap;
+
+/* A runtime value. Numbers and strings are copied; arrays and maps are
+ * shared by reference, like in most scripting languages.
+ *
+ * Numbers (the type) are arrays that only hold numbers, stored
+ * contiguously as doubles for the vectorized builtins, see Simd. Like
+ * arrays, they are never changed once made. */
 class Value {
+  public:
+    typedef std::vector<Value> Array;
+    typedef ValueMap Map;
+    typedef std::vector<double> Numbers;
+
+    Value()
+        : type_(value_none),
+          number_(0) {}
+    Value(double number)
+        : type_(value_number),
+          number_(number) {}
+    Value(const std::string &string)
+        : type_(value_string),
+          number_(0),
+          string_(string) {}
+
+    static Value new_array(const Array&);
+    static Value new_map();
+    static Value new_numbers(const Numbers&);
+
+    inline ValueType type() const { return type_; }
+    inline bool is_none() const { return type_ == value_none; }
+    inline bool is_number() const { return type_ == value_number; }
+    inline bool is_string() const { return type_ == value_string; }
+    inline bool is_array() const { return type_ == value_array; }
+    inline bool is_map() const { return type_ == value_map; }
+    inline bool is_numbers() const { return type_ == value_numbers; }
+
+    inline double number() const { return number_; }
+    inline const std::string &string() const { return string_; }
+    inline Array &array() const { return *array_; }
+    inline Map &map() const { return *map_; }
+    inline Numbers &numbers() const { return *numbers_; }
+
+    bool truthy() const;
+    const std::string str() const;
+
+    static const std::string value_type_name(ValueType);
+
+    /* Numbers order before strings; arrays, maps and numbers by identity.
+     * For std::map keys, like the memoized calls'. */
+    bool operator<(const Value&) const;
+    bool operator==(const Value&) const;
+
+    /* Consistent with Map's key equality: numbers by value, with NaN equal
+     * to nothing, strings by content, the rest by identity */
+    uint64_t hash() const;
+  private:
+    ValueType type_;
+    double number_;
+    std::string string_;
+    std::shared_ptr<Array> array_;
+    std::shared_ptr<Map> map_;
+    std::shared_ptr<Numbers> numbers_;
+};
+
+/* The table behind Toy's maps: open addressing, probed a group of slots at
+ * a time in the manner of a Swiss table.
+ *
+ * Entries are kept in a vector in the order their keys were first
+ * assigned, which is also the order maps print in. The index over them is
+ * an array of slots in groups of 16, each with a control byte that is
+ * either empty or holds 7 bits of the key's hash. A lookup hashes the key
+ * once, takes a group from the other bits and compares its 16 control
+ * bytes at once (with SSE2 where there is one); only the slots that match
+ * look at an entry, first at its full hash, then at its key. String keys
+ * short enough for std::string's own buffer (15 bytes with libstdc++) sit
+ * inline in the entry, so a hit touches the control bytes, one slot and
+ * one entry, and allocates nothing. Toy has no way to remove a key, so
+ * there are no tombstones; the index doubles once it is 7/8 full.
+ */
+class ValueMap {
+  public:
+    typedef std::pair<Value, Value> Entry;
+    typedef std::vector<Entry>::const_iterator const_iterator;
+
+    ValueMap()
+        : groups_(0) {}
+
+    inline size_t size() const { return entries_.size(); }
+    inline bool empty() const { return entries_.empty(); }
+    inline const_iterator begin() const { return entries_.begin(); }
+    inline const_iterator end() const { return entries_.end(); }
+
+    const_iterator find(const Value&) const;
+    /* Adds the key with a none value if it is not there yet */
+    Value &operator[](const Value&);
+
+    /* Bytes taken beyond the entries themselves */
+    size_t overhead() const;
+  private:
+    static const unsigned int group_size = 16;
+    static const uint8_t empty_slot = 0x80;
+
+    /* The entry holding the key, or size() */
+    uint32_t lookup(const Value&, uint64_t) const;
+    void grow();
+    void index(uint32_t);
+
+    std::vector<Entry> entries_;
+    std::vector<uint64_t> hashes_;
+    /* Both groups_ * group_size long */
+    std::vector<uint8_t> controls_;
+    std::vector<uint32_t> slots_;
+    size_t groups_;
 };
 
 #endif
@@ -0,0 +1,253 @@
+#include "type_inference.hpp"
+#include "lexer.hpp"
+#include "runtime.hpp"
+
+TypeSet FunctionTypes::var(const std::string &name) const {
+    std::map<std::string, TypeSet>::const_iterator it = vars_.find(name);
+    return it == vars_.end() ? type_none : it->second;
+}
+
+bool FunctionTypes::numeric_params() const {
+    for (std::vector<TypeSet>::const_iterator it = params_.begin(), end = params_.end(); it != end; ++it) {
+        if (*it != type_number)
+            return false;
+    }
+    return true;
+}
+
+TypeInference::~TypeInference() {
+    for (std::map<std::string, FunctionTypes*>::iterator it = functions_.begin(), end = functions_.end(); it != end; ++it)
+        delete it->second;
+}
+
+const std::string TypeInference::type_set_name(TypeSet types) {
+    static const char *names[] = { "number", "string", "array", "map" };
+
+    if (types == type_none)
+        return "none";
+    if (types == type_any)
+        return "any";
+
+    std::string ret;
+    for (unsigned int i = 0; i < sizeof(names) / sizeof(*names); ++i) {
+        if (types & (1 << i)) {
+            if (!ret.empty())
+                ret += "|";
+            ret += names[i];
+        }
+    }
+    return ret;
+}
+
+TypeSet TypeInference::type_of(const Expression *expr) const {
+    std::map<const Expression*, TypeSet>::const_iterator it = types_.find(expr);
+    return it == types_.end() ? type_none : it->second;
+}
+
+const FunctionTypes *TypeInference::function(const std::string &name) const {
+    std::map<std::string, FunctionTypes*>::const_iterator it = functions_.find(name);
+    return it == functions_.end() ? 0 : it->second;
+}
+
+bool TypeInference::is_numeric(const BinaryOpExpr *node) const {
+    return type_of(node->left()) == type_number && type_of(node->right()) == type_number;
+}
+
+void TypeInference::join(TypeSet &into, TypeSet types) {
+    if ((into | types) != into) {
+        into |= types;
+        changed_ = true;
+    }
+}
+
+TypeSet TypeInference::lookup(const std::string &name, const Scope *scope) const {
+    Scope::const_iterator local = scope ? scope->find(name) : globals_.end();
+    Scope::const_iterator global = globals_.find(name);
+
+    /* Inside a function, a name that is a global as well reads whichever
+     * was assigned */
+    if (scope && local != scope->end())
+        return global != globals_.end() ? local->second | global->second : local->second;
+    if (global != globals_.end())
+        return global->second;
+
+    /* Never assigned anywhere we can see */
+    return type_any;
+}
+
+void TypeInference::assign(const std::string &name, TypeSet types, Scope *scope) {
+    /* Inside a function, assignments go to the local unless the
+     * top-level variable exists by then, which depends on the order
+     * things run in; so a top-level variable gets both. Top-level
+     * statements go first, so globals_ knows them all by now. */
+    Scope::iterator global = globals_.find(name);
+    if (scope)
+        join((*scope)[name], types);
+    if (!scope || global != globals_.end())
+        join(globals_[name], types);
+}
+
+void TypeInference::run() {
+    const std::vector<const Statement*> nodes = ast_->nodes();
+    for (std::vector<const Statement*>::const_iterator it = nodes.begin(), end = nodes.end(); it != end; ++it) {
+        if ((*it)->type() == toy_def) {
+            const DefStatement *def = static_cast<const DefStatement*>(*it);
+            if (functions_.find(def->name()) == functions_.end())
+                functions_[def->name()] = new FunctionTypes(def);
+        }
+    }
+
+    /* Everything only ever grows, and the lattice is finite */
+    do {
+        changed_ = false;
+
+        for (std::vector<const Statement*>::const_iterator it = nodes.begin(), end = nodes.end(); it != end; ++it) {
+            if ((*it)->type() != toy_def)
+                infer(*it, 0, 0);
+        }
+
+        for (std::map<std::string, FunctionTypes*>::iterator it = functions_.begin(), end = functions_.end(); it != end; ++it) {
+            FunctionTypes *fn = it->second;
+            const std::vector<std::string> params = fn->def()->params();
+            for (std::vector<std::string>::size_type i = 0; i < params.size(); ++i)
+                join(fn->vars_[params[i]], fn->params_[i]);
+
+            infer(fn->def()->block(), &fn->vars_, fn);
+        }
+    } while (changed_);
+}
+
+void TypeInference::infer(const AST *block, Scope *scope, FunctionTypes *fn) {
+    const std::vector<const Statement*> nodes = block->nodes();
+    for (std::vector<const Statement*>::const_iterator it = nodes.begin(), end = nodes.end(); it != end; ++it)
+        infer(*it, scope, fn);
+}
+
+void TypeInference::infer(const Statement *statement, Scope *scope, FunctionTypes *fn) {
+    switch (statement->type()) {
+        case toy_expression_statement:
+            infer(static_cast<const ExpressionStatement*>(statement)->expr(), scope);
+            break;
+        case toy_if: {
+            const IfStatement *node = static_cast<const IfStatement*>(statement);
+            infer(node->cond(), scope);
+            infer(node->true_block(), scope, fn);
+            if (node->false_block())
+                infer(node->false_block(), scope, fn);
+            break;
+        }
+        case toy_while: {
+            const WhileStatement *node = static_cast<const WhileStatement*>(statement);
+            infer(node->cond(), scope);
+            infer(node->block(), scope, fn);
+            break;
+        }
+        case toy_return: {
+            TypeSet ret = infer(static_cast<const ReturnStatement*>(statement)->ret(), scope);
+            if (fn)
+                join(fn->ret_, ret);
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+TypeSet TypeInference::infer(const Expression *expr, Scope *scope) {
+    TypeSet ret = type_none;
+
+    switch (expr->type()) {
+        case toy_number:
+            ret = type_number;
+            break;
+        case toy_string:
+            ret = type_string;
+            break;
+        case toy_variable:
+            ret = lookup(static_cast<const VariableExpr*>(expr)->varname(), scope);
+            break;
+        case toy_binary_op: {
+            const BinaryOpExpr *node = static_cast<const BinaryOpExpr*>(expr);
+            TypeSet left = infer(node->left(), scope);
+            TypeSet right = infer(node->right(), scope);
+
+            if (left == type_none || right == type_none)
+                break;
+
+            if (node->op_type() != tok_add) {
+                /* Arithmetic and comparisons */
+                ret = type_number;
+            } else {
+                if ((left & type_number) && (right & type_number))
+                    ret |= type_number;
+                if ((left & type_string) || (right & type_string))
+                    ret |= type_string;
+                if ((left | right) & (type_array | type_map))
+                    ret = type_any;
+            }
+            break;
+        }
+        case toy_assign: {
+            const AssignExpr *node = static_cast<const AssignExpr*>(expr);
+            ret = infer(node->rvalue(), scope);
+            assign(node->lvalue(), ret, scope);
+            break;
+        }
+        case toy_function_call: {
+            const FuncCallExpr *node = static_cast<const FuncCallExpr*>(expr);
+            const std::vector<const Expression*> args = node->args();
+            std::map<std::string, FunctionTypes*>::iterator callee = functions_.find(node->funcname());
+
+            for (std::vector<const Expression*>::size_type i = 0; i < args.size(); ++i) {
+                TypeSet arg = infer(args[i], scope);
+                if (callee != functions_.end() && i < callee->second->params_.size())
+                    join(callee->second->params_[i], arg);
+            }
+
+            /* What map(), pmap() and spawn() call, and with what, is only known
+             * at runtime */
+            if (callee == functions_.end() && Runtime::calls_by_name(node->funcname())) {
+                for (callee = functions_.begin(); callee != functions_.end(); ++callee) {
+                    for (std::vector<TypeSet>::iterator param = callee->second->params_.begin(); param != callee->second->params_.end(); ++param)
+                        join(*param, type_any);
+                }
+            }
+
+            /* Builtins can return anything */
+            ret = callee != functions_.end() ? callee->second->ret_ : type_any;
+            break;
+        }
+        case toy_array: {
+            const std::vector<const Expression*> elements = static_cast<const ArrayExpr*>(expr)->elements();
+            for (std::vector<const Expression*>::const_iterator it = elements.begin(), end = elements.end(); it != end; ++it)
+                infer(*it, scope);
+            ret = type_array;
+            break;
+        }
+        case toy_index: {
+            const IndexExpr *node = static_cast<const IndexExpr*>(expr);
+            TypeSet container = infer(node->container(), scope);
+            infer(node->index(), scope);
+
+            /* Element types aren't tracked */
+            if (container != type_none)
+                ret = type_any;
+            break;
+        }
+        case toy_map: {
+            const MapExpr *node = static_cast<const MapExpr*>(expr);
+            const std::vector<const Expression*> keys = node->keys(), values = node->values();
+            for (std::vector<const Expression*>::size_type i = 0; i < keys.size(); ++i) {
+                infer(keys[i], scope);
+                infer(values[i], scope);
+            }
+            ret = type_map;
+            break;
+        }
+        default:
+            break;
+    }
+
+    join(types_[expr], ret);
+    return types_[expr];
+}
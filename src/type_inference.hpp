@@ -0,0 +1,92 @@
+#ifndef _TYPE_INFERENCE_HPP
+#define _TYPE_INFERENCE_HPP
+
+#include <map>
+#include <string>
+#include <vector>
+#include "ast.hpp"
+#include "toy.hpp"
+
+/* The set of runtime types a value may have. type_none means no value has
+ * been seen (yet), e.g. the parameters of a function nobody calls. */
+typedef unsigned int TypeSet;
+const TypeSet type_none   = 0;
+const TypeSet type_number = 1 << 0;
+const TypeSet type_string = 1 << 1;
+const TypeSet type_array  = 1 << 2;
+const TypeSet type_map    = 1 << 3;
+const TypeSet type_any    = type_number | type_string | type_array | type_map;
+
+class FunctionTypes {
+  public:
+    explicit FunctionTypes(const DefStatement *def)
+        : def_(def),
+          params_(def->params().size(), type_none),
+          ret_(type_none) {}
+
+    inline const DefStatement *def() const { return def_; }
+
+    /* Joined over every call site in the program. */
+    inline const std::vector<TypeSet> &params() const { return params_; }
+    inline TypeSet ret() const { return ret_; }
+    TypeSet var(const std::string&) const;
+
+    /* True when every call site passes numbers only, so the body can run
+     * on a check-free numeric path behind a single guard on entry. */
+    bool numeric_params() const;
+  private:
+    friend class TypeInference;
+
+    const DefStatement *def_;
+    std::vector<TypeSet> params_;
+    std::map<std::string, TypeSet> vars_;
+    TypeSet ret_;
+    DISALLOW_COPY_AND_ASSIGN(FunctionTypes);
+};
+
+/* Interprocedural type inference over a whole program.
+ *
+ * Types flow from literals, through operators (arithmetic yields numbers,
+ * `+` on two strings yields a string) and assignments, from arguments at
+ * every call site into parameters, and from return statements back to the
+ * callers. The analysis is flow-insensitive within a function: a variable
+ * has the join of everything assigned to it. It iterates to a fixed point,
+ * so recursive functions like nfac are handled.
+ */
+class TypeInference {
+  public:
+    explicit TypeInference(const AST *ast)
+        : ast_(ast),
+          changed_(false) {}
+    ~TypeInference();
+
+    void run();
+
+    TypeSet type_of(const Expression*) const;
+    const FunctionTypes *function(const std::string&) const;
+
+    /* Both operands are known to be numbers, so no runtime type check is
+     * needed to evaluate the operator. */
+    bool is_numeric(const BinaryOpExpr*) const;
+
+    static const std::string type_set_name(TypeSet);
+  private:
+    typedef std::map<std::string, TypeSet> Scope;
+
+    void join(TypeSet&, TypeSet);
+    TypeSet lookup(const std::string&, const Scope*) const;
+    void assign(const std::string&, TypeSet, Scope*);
+
+    void infer(const AST*, Scope*, FunctionTypes*);
+    void infer(const Statement*, Scope*, FunctionTypes*);
+    TypeSet infer(const Expression*, Scope*);
+
+    const AST *ast_;
+    std::map<std::string, FunctionTypes*> functions_;
+    std::map<const Expression*, TypeSet> types_;
+    Scope globals_;
+    bool changed_;
+    DISALLOW_COPY_AND_ASSIGN(TypeInference);
+};
+
+#endif
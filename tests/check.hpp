@@ -0,0 +1,28 @@
+#ifndef _CHECK_HPP
+#define _CHECK_HPP
+
+#include <iostream>
+#include <string>
+
+/* What the unit tests share: check() reports an expectation that doesn't
+ * hold and goes on, and main() ends with `return checked();`, which fails
+ * if any didn't. */
+
+static int failures = 0;
+
+static inline void check(bool ok, const std::string &what) {
+    if (!ok) {
+        std::cerr << "FAIL " << what << std::endl;
+        ++failures;
+    }
+}
+
+static inline int checked() {
+    if (failures) {
+        std::cerr << failures << " failures" << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+#endif
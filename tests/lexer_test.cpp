@@ -0,0 +1,103 @@
+/* Lexes the same sources from a stream and in chunks of several sizes, and
+ * checks both give the same tokens, lines, captured text and errors. */
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "check.hpp"
+#include "exceptions.hpp"
+#include "lexer.hpp"
+#include "thread_pool.hpp"
+
+/* Every token as "line: name", the text of each outermost block as the
+ * parser captures it for lazy bodies, and the error lexing stopped at */
+static std::vector<std::string> lex(LexerContext &lexer) {
+    std::vector<std::string> ret;
+    unsigned int depth = 0;
+    try {
+        while (lexer.fetchtok()) {
+            std::ostringstream ss;
+            ss << lexer.line() << ": " << lexer.curtok()->name();
+            ret.push_back(ss.str());
+
+            if (lexer.curtok()->type() == tok_block_start && depth++ == 0)
+                lexer.start_capture();
+            if (lexer.curtok()->type() == tok_block_end && --depth == 0)
+                ret.push_back("block: {" + lexer.stop_capture());
+        }
+    } catch (SyntaxError &error) {
+        std::ostringstream ss;
+        ss << lexer.line() << ": error " << error.message();
+        ret.push_back(ss.str());
+    }
+    return ret;
+}
+
+static void compare(const std::string &name, const std::string &source, ThreadPool &pool) {
+    std::istringstream input(source);
+    LexerContext streamed(input, name);
+    const std::vector<std::string> expected = lex(streamed);
+
+    static const size_t chunk_sizes[] = { 1, 2, 7, 30, 1 << 20 };
+    for (unsigned int i = 0; i < sizeof(chunk_sizes) / sizeof(*chunk_sizes); ++i) {
+        LexerContext chunked(source, name, pool, chunk_sizes[i]);
+        const std::vector<std::string> actual = lex(chunked);
+
+        std::ostringstream what;
+        what << name << " in chunks of " << chunk_sizes[i];
+        check(actual.size() == expected.size(), what.str() + ": token count");
+        for (size_t t = 0; t < actual.size() && t < expected.size(); ++t)
+            check(actual[t] == expected[t], what.str() + ": got '" + actual[t] + "', expected '" + expected[t] + "'");
+    }
+}
+
+int main() {
+    ThreadPool pool(4);
+
+    compare("program",
+            "def f(a, b) {\n"
+            "    return a * 2 + b;\n"
+            "}\n"
+            "x = f(1, 2.5);\n"
+            "while (x <= 10) { x = x + 1; }\n"
+            "if (x == 11) { print(x); } else { print(\"no\"); }\n",
+            pool);
+
+    /* Chunk boundaries must not fall inside strings or comments */
+    compare("strings and comments",
+            "s = \"a string\n"
+            "over # three\n"
+            "lines\";\n"
+            "# a comment with a \" quote\n"
+            "t = \"#not a comment\";\n"
+            "# \"\n"
+            "u = [1, 2, {\"k\": s}];\n",
+            pool);
+
+    compare("blank lines",
+            "\n\n\n"
+            "a = 1;\n"
+            "\n\n"
+            "b = a;\n"
+            "\n",
+            pool);
+
+    compare("empty", "", pool);
+
+    /* Errors are reported where the stream lexer reports them */
+    compare("error",
+            "a = 1;\n"
+            "b = 2;\n"
+            "c = $;\n"
+            "d = 4;\n",
+            pool);
+
+    compare("unterminated string",
+            "a = 1;\n"
+            "b = \"open\n"
+            "c = 3;\n",
+            pool);
+
+    return checked();
+}
@@ -0,0 +1,51 @@
+#!/bin/sh
+# Runs every script under tests/ in each of the ways toy can run one: the
+# AST walk only, compiling to bytecode at once, compiling everything up
+# front, compiled to C++, and with memoization off. Each has to print the
+# same and exit the same as the AST walk. Error messages name the file they
+# came from, which differs between modes, so the name is left out of the
+# comparison.
+#
+# Usage: tests/run.sh [toy executable]
+
+TOY=${1:-./toy}
+DIR=$(dirname "$0")
+OUT=$(mktemp -d)
+trap 'rm -rf "$OUT"' EXIT
+
+failed=0
+
+# run <mode> <script> <output file>
+run() {
+    case $1 in
+        interpreted)
+            TOY_TIER_THRESHOLD=0 "$TOY" "$2" > "$3" 2>&1 ;;
+        threshold-1)
+            TOY_TIER_THRESHOLD=1 TOY_TIER_BACKGROUND=0 "$TOY" "$2" > "$3" 2>&1 ;;
+        eager)
+            TOY_TIER_EAGER=1 "$TOY" "$2" > "$3" 2>&1 ;;
+        aot)
+            "$TOY" --emit-cpp "$2" > "$OUT/aot.cpp" 2> "$3" &&
+            ${CXX:-g++} -shared -fPIC -O1 -I"$DIR/../src" -o "$OUT/aot.so" "$OUT/aot.cpp" &&
+            "$TOY" "$OUT/aot.so" > "$3" 2>&1 ;;
+        unmemoized)
+            TOY_TIER_THRESHOLD=0 TOY_MEMO_SIZE=0 "$TOY" "$2" > "$3" 2>&1 ;;
+    esac
+    echo "exit $?" >> "$3"
+    sed -i -e "s|$2:|SCRIPT:|" -e "s|$OUT/aot.so:|SCRIPT:|" "$3"
+}
+
+for script in "$DIR"/*.toy; do
+    run interpreted "$script" "$OUT/expected"
+    for mode in threshold-1 eager aot unmemoized; do
+        run $mode "$script" "$OUT/actual"
+        if ! diff -u "$OUT/expected" "$OUT/actual" > "$OUT/diff"; then
+            echo "FAIL $script ($mode)"
+            cat "$OUT/diff"
+            failed=1
+        fi
+    done
+done
+
+[ $failed = 0 ] && echo "All tests passed"
+exit $failed
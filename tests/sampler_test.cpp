@@ -0,0 +1,82 @@
+/* Profiles a script that spends nearly all its time in one loop, on the AST
+ * walk and in bytecode, and checks that the samples land on that loop and
+ * come out as folded stacks. */
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "check.hpp"
+#include "interpreter.hpp"
+#include "program.hpp"
+#include "sampler.hpp"
+
+static const char *source =
+    "def spin(n) {\n"
+    "    i = 0;\n"
+    "    while (i < n) {\n"
+    "        i = i + 1;\n"
+    "    }\n"
+    "    return i;\n"
+    "}\n"
+    "def outer(n) {\n"
+    "    return spin(n);\n"
+    "}\n"
+    "result = outer(3000000);\n";
+
+static void profile(const Program &program, unsigned long threshold, const std::string &name) {
+    std::ostringstream out;
+    Interpreter interpreter(program, out);
+    Interpreter::Tiering tiering;
+    tiering.threshold = threshold;
+    tiering.background = false;
+    interpreter.set_tiering(tiering);
+    Interpreter::Profiling profiling;
+    profiling.interval = 0.0005;
+    interpreter.set_profiling(profiling);
+    interpreter.run();
+
+    const Sampler &sampler = interpreter.sampler();
+    check(!sampler.running(), name + ": stopped after run()");
+    check(sampler.taken() >= 20, name + ": samples taken");
+    check(sampler.dropped() == 0, name + ": nothing dropped");
+
+    /* Everything but the odd sample at the start or the end is in the loop */
+    unsigned long in_loop = 0;
+    const std::vector<Sampler::Sample> samples = sampler.samples();
+    for (std::vector<Sampler::Sample>::const_iterator it = samples.begin(), end = samples.end(); it != end; ++it) {
+        if (it->stack.size() == 2 && it->stack[0]->name() == "outer" && it->stack[1]->name() == "spin" && it->line >= 3 && it->line <= 4)
+            in_loop += it->count;
+    }
+    check(in_loop * 10 >= sampler.taken() * 9, name + ": samples in spin()'s loop");
+
+    std::ostringstream folded;
+    sampler.write_folded(folded, "sampler.toy");
+    check(folded.str().find("sampler.toy;outer;spin:3 ") != std::string::npos, name + ": folded stacks");
+
+    /* More runs add to the samples */
+    const unsigned long taken = sampler.taken();
+    interpreter.call("spin", std::vector<Value>(1, Value(300000.0)));
+    check(sampler.taken() > taken, name + ": samples added by call()");
+}
+
+int main() {
+    std::istringstream input(source);
+    const Program *program = Program::compile(input, "sampler.toy");
+
+    profile(*program, 0, "ast");
+    profile(*program, 1, "bytecode");
+
+    {
+        /* One at a time */
+        Sampler::State state;
+        Sampler first, second;
+        check(first.start(&state, 0.01), "starts");
+        check(!second.start(&state, 0.01), "only one runs");
+        first.stop();
+        check(second.start(&state, 0.01), "starts once the other stopped");
+    }
+
+    delete program;
+    return checked();
+}
@@ -0,0 +1,87 @@
+/* Runs the builtins' loops with AVX2 and without, on lengths around the
+ * vector widths and on awkward values, and checks both give the same bits. */
+
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "check.hpp"
+#include "simd.hpp"
+
+static bool same(double a, double b) {
+    return memcmp(&a, &b, sizeof(a)) == 0;
+}
+
+static bool same(const std::vector<double> &a, const std::vector<double> &b) {
+    return a.size() == b.size() && (a.empty() || memcmp(a.data(), b.data(), a.size() * sizeof(double)) == 0);
+}
+
+/* Far apart in magnitude, so that the order of the additions shows */
+static std::vector<double> values(size_t n, unsigned int seed) {
+    std::vector<double> ret;
+    for (size_t i = 0; i < n; ++i) {
+        seed = seed * 1103515245 + 12345;
+        ret.push_back((double)(seed % 2001) / 7.0 * pow(10.0, (double)(seed % 13) - 6));
+    }
+    return ret;
+}
+
+static void compare(const std::string &name, const std::vector<double> &x, const std::vector<double> &y) {
+    static const TokenType ops[] = { tok_eq, tok_lt, tok_gt, tok_lte, tok_gte };
+    const size_t n = x.size();
+    double sums[2], dots[2];
+    std::vector<double> axpys[2], compares[2][5];
+
+    for (int avx2 = 0; avx2 < 2; ++avx2) {
+        Simd::set_avx2(avx2);
+        sums[avx2] = Simd::sum(x.data(), n);
+        dots[avx2] = Simd::dot(x.data(), y.data(), n);
+        axpys[avx2].resize(n);
+        Simd::axpy(0.3, x.data(), y.data(), axpys[avx2].data(), n);
+        for (int op = 0; op < 5; ++op) {
+            compares[avx2][op].resize(n);
+            Simd::compare(ops[op], x.data(), y.data(), compares[avx2][op].data(), n);
+        }
+    }
+
+    check(same(sums[0], sums[1]), name + ": sum");
+    check(same(dots[0], dots[1]), name + ": dot");
+    check(same(axpys[0], axpys[1]), name + ": axpy");
+    for (int op = 0; op < 5; ++op)
+        check(same(compares[0][op], compares[1][op]), name + ": compare " + Token::token_type_name(ops[op]));
+}
+
+int main() {
+    Simd::set_avx2(true);
+    if (!Simd::avx2())
+        std::cerr << "No AVX2 here; comparing the scalar loops with themselves" << std::endl;
+
+    for (size_t n = 0; n <= 35; ++n) {
+        std::ostringstream name;
+        name << "length " << n;
+        compare(name.str(), values(n, n), values(n, n + 100));
+    }
+    compare("long", values(10007, 1), values(10007, 2));
+
+    /* Equal elements, NaNs, infinities and signed zeros */
+    const double nan = std::numeric_limits<double>::quiet_NaN(), inf = std::numeric_limits<double>::infinity();
+    std::vector<double> x, y;
+    for (int i = 0; i < 3; ++i) {
+        const double left[] = { 1, 2, nan, 4, inf, -0.0, 7, 8, 9 };
+        const double right[] = { 1, 3, 3, nan, inf, 0.0, -inf, 8, 1 };
+        x.insert(x.end(), left, left + 9);
+        y.insert(y.end(), right, right + 9);
+    }
+    compare("special", x, y);
+
+    std::vector<double> ones(11, 1.0), less(11);
+    Simd::compare(tok_lt, ones.data(), values(11, 5).data(), less.data(), 11);
+    for (size_t i = 0; i < less.size(); ++i)
+        check(less[i] == 0.0 || less[i] == 1.0, "compare gives 0 or 1");
+    check(Simd::sum(ones.data(), ones.size()) == 11, "sum of ones");
+
+    return checked();
+}
@@ -0,0 +1,98 @@
+/* Saves an interpreter that has run a prelude, restores it and checks the
+ * globals and functions come back the same; then checks that damaged
+ * images throw SnapshotError. */
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "check.hpp"
+#include "exceptions.hpp"
+#include "interpreter.hpp"
+#include "program.hpp"
+#include "snapshot.hpp"
+
+static const char *prelude =
+    "def square(x) {\n"
+    "    return x * x;\n"
+    "}\n"
+    "def describe(m) {\n"
+    "    return m[\"name\"] + \" has \" + m[\"count\"];\n"
+    "}\n"
+    "table = [square(1), square(2), square(3), \"four\"];\n"
+    "info = {\"name\": \"table\", \"count\": 4, \"rows\": table, 7: [1, 2]};\n"
+    "weights = numbers([0.5, 1, 2.25]);\n"
+    "pair = [weights, weights];\n"
+    "pi = 3.25;\n"
+    "empty = \"\";\n";
+
+/* Whether loading the image throws SnapshotError, and nothing else */
+static bool rejected(const std::string &image) {
+    std::istringstream in(image);
+    Interpreter::Scope globals;
+    try {
+        delete Snapshot::load(in, globals);
+    } catch (SnapshotError&) {
+        return true;
+    } catch (...) {
+        return false;
+    }
+    return false;
+}
+
+int main() {
+    std::istringstream source(prelude);
+    const Program *program = Program::compile(source, "prelude.toy");
+    std::ostringstream image;
+    Interpreter::Scope saved;
+    {
+        Interpreter interpreter(*program);
+        interpreter.run();
+        Snapshot::save(image, *program, interpreter);
+        saved = interpreter.globals();
+    }
+
+    Interpreter::Scope globals;
+    std::istringstream in(image.str());
+    const Program *restored = Snapshot::load(in, globals);
+
+    check(restored->filename() == "prelude.toy", "filename");
+    check(globals.size() == saved.size(), "number of globals");
+    for (Interpreter::Scope::const_iterator it = saved.begin(), end = saved.end(); it != end; ++it) {
+        Interpreter::Scope::const_iterator found = globals.find(it->first);
+        check(found != globals.end() && found->second.str() == it->second.str(), "global " + it->first);
+    }
+
+    /* The array in info is the same object as table */
+    check(&globals["info"].map()[Value("rows")].array() == &globals["table"].array(), "shared array");
+    check(&globals["pair"].array()[1].numbers() == &globals["weights"].numbers(), "shared numbers");
+
+    {
+        Interpreter interpreter(*restored);
+        interpreter.set_globals(globals);
+        check(interpreter.call("square", std::vector<Value>(1, Value(12.0))).number() == 144, "call restored function");
+        check(interpreter.call("describe", std::vector<Value>(1, globals["info"])).string() == "table has 4", "call with restored global");
+    }
+
+    /* Every truncation is caught */
+    const std::string bytes = image.str();
+    for (std::string::size_type size = 0; size < bytes.size(); ++size) {
+        std::ostringstream what;
+        what << "truncated to " << size << " bytes";
+        check(rejected(bytes.substr(0, size)), what.str());
+    }
+
+    /* A string size far beyond the image; the first string is the filename,
+     * right after the header */
+    std::string corrupt = bytes;
+    corrupt.replace(8, 4, "\xff\xff\xff\x7f", 4);
+    check(rejected(corrupt), "huge string size");
+
+    check(rejected("TOYIMX"), "bad magic");
+    check(rejected(std::string("TOYIMG\x63P", 8)), "bad version");
+
+    delete restored;
+    delete program;
+
+    return checked();
+}
@@ -0,0 +1,80 @@
+/* Checks that a function only ever called with numbers is compiled for
+ * numbers behind guards, and that a call passing something else, here
+ * from the host, runs the code as it was. */
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "bytecode.hpp"
+#include "check.hpp"
+#include "exceptions.hpp"
+#include "frame_layout.hpp"
+#include "interpreter.hpp"
+#include "program.hpp"
+
+static const char *source =
+    "def poly(x, y) {\n"
+    "    return x * x + 2 * x * y - y;\n"
+    "}\n"
+    "result = poly(3, 4);\n";
+
+static unsigned int count(const CompiledCode &code, Opcode op) {
+    unsigned int ret = 0;
+    for (std::vector<Instruction>::const_iterator it = code.code().begin(), end = code.code().end(); it != end; ++it)
+        ret += it->op == op;
+    return ret;
+}
+
+static std::vector<Value> args(const Value &x, const Value &y) {
+    std::vector<Value> ret;
+    ret.push_back(x);
+    ret.push_back(y);
+    return ret;
+}
+
+int main() {
+    std::istringstream input(source);
+    const Program *program = Program::compile(input, "specialize.toy");
+    const DefStatement *poly = program->function("poly");
+
+    {
+        FrameLayout layout(poly);
+        /* Operators on what other operators than + yield need no checks
+         * either way */
+        CompiledCode *plain = CompiledCode::compile(poly, layout, *program);
+        check(count(*plain, op_guard_number) == 0, "no guards without numbers");
+
+        CompiledCode *special = CompiledCode::compile(poly, layout, *program, std::vector<bool>(2, true));
+        check(count(*special, op_guard_number) == 2, "a guard per parameter");
+        check(count(*special, op_number_binary) == count(*plain, op_number_binary) + 5, "every operator unchecked");
+        check(count(*special, op_binary) == count(*plain, op_binary), "the code as it was after the guards");
+        delete special;
+        delete plain;
+    }
+
+    Interpreter interpreter(*program);
+    Interpreter::Tiering tiering;
+    tiering.threshold = 1;
+    tiering.background = false;
+    interpreter.set_tiering(tiering);
+    interpreter.run();
+    check(interpreter.global("result").number() == 29, "run");
+
+    check(interpreter.call("poly", args(Value(5.0), Value(0.5))).number() == 29.5, "numbers");
+    check(interpreter.tier_stats().guard_failures == 0, "guards pass on numbers");
+
+    std::string error;
+    try {
+        interpreter.call("poly", args(Value("a"), Value(1.0)));
+    } catch (RuntimeError &e) {
+        error = e.message();
+    }
+    check(error.find("Unsupported operand types") == 0, "string: " + error);
+    check(interpreter.tier_stats().guard_failures == 1, "guard fails on a string");
+    check(interpreter.call("poly", args(Value(1.0), Value(1.0))).number() == 2, "numbers again");
+
+    delete program;
+
+    return checked();
+}
@@ -0,0 +1,37 @@
+#!/bin/sh
+# Counts which bytecode instruction runs right after which over a corpus
+# of scripts, most frequent first, to find sequences worth fusing into a
+# superinstruction. Scripts run with every function and loop compiled at
+# once. The executable has to count pairs, and is best left without the
+# superinstructions it already has:
+#
+#     make clean && make PROFILE_OPCODES=1 SUPERINSTRUCTIONS=0
+#     tools/opcode_pairs.sh ./toy benchmarks/*.toy
+#
+# Usage: tools/opcode_pairs.sh [toy executable] [script...]
+# By default the scripts are those under tests/. Prints the top $TOP
+# pairs (20 by default) with their share of all instructions run.
+
+TOY=${1:-./toy}
+[ $# -gt 0 ] && shift
+[ $# -eq 0 ] && set -- "$(dirname "$0")"/../tests/*.toy
+
+PROFILE=$(mktemp)
+trap 'rm -f "$PROFILE"' EXIT
+
+for script in "$@"; do
+    TOY_OPCODE_PROFILE="$PROFILE" TOY_TIER_THRESHOLD=1 TOY_TIER_BACKGROUND=0 \
+        "$TOY" "$script" > /dev/null 2>&1
+done
+
+if [ ! -s "$PROFILE" ]; then
+    echo "No pairs counted; is $TOY built with PROFILE_OPCODES=1?" >&2
+    exit 1
+fi
+
+awk '
+    { count[$1 " " $2] += $3; total += $3 }
+    END {
+        for (pair in count)
+            printf "%12d %5.1f%%  %s\n", count[pair], 100 * count[pair] / total, pair
+    }' "$PROFILE" | sort -rn | head -n "${TOP:-20}"